@@ -0,0 +1,621 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Check every copy kernel in blt.c against a simple reference, for each
+ * variant the cpu can run, and optionally (-b) time them.
+ *
+ * The timings are printed one per line as tab separated fields,
+ *	kernel isa swizzle bpp width height align GB/s
+ * so that runs can be compared with the usual text tools. Use -f to
+ * restrict the kernels to those whose name contains the given string.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "sna.h"
+
+enum type {
+	LINEAR,
+	TO_TILED,
+	FROM_TILED,
+	BETWEEN_TILED,
+	MOVE,
+	AFFINE,
+};
+
+struct kernel {
+	const char *name;
+	const char *isa;
+	enum type type;
+	int tiling;
+	int swizzle;
+	memcpy_box_func func;
+	memcpy_xor_func xor;
+	uint32_t and;
+	unsigned cpu; /* features to choose the affine rows by */
+};
+
+#define MAX_KERNELS 256
+static struct kernel kernels[MAX_KERNELS];
+static int num_kernels;
+
+static const char *swizzle_names[] = {
+	[I915_BIT_6_SWIZZLE_NONE] = "none",
+	[I915_BIT_6_SWIZZLE_9] = "9",
+	[I915_BIT_6_SWIZZLE_9_10] = "9_10",
+	[I915_BIT_6_SWIZZLE_9_11] = "9_11",
+	[I915_BIT_6_SWIZZLE_9_10_11] = "9_10_11",
+};
+
+static const struct isa {
+	const char *name;
+	unsigned features;
+} isas[] = {
+	{ "scalar", 0 },
+	{ "sse2", SSE2 },
+	{ "sse4.1", SSE2 | SSE4_1 },
+	{ "avx2", SSE2 | SSE4_1 | AVX2 },
+	{ "avx512", SSE2 | SSE4_1 | AVX2 | AVX512F },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void __add_kernel(const char *name, const char *isa, enum type type,
+			 int tiling, int swizzle, memcpy_box_func func,
+			 memcpy_xor_func xor, uint32_t and)
+{
+	int n;
+
+	if (func == NULL && xor == NULL)
+		return;
+
+	/* Only list each implementation once, under the first isa to use it */
+	for (n = 0; n < num_kernels; n++)
+		if (kernels[n].func == func &&
+		    kernels[n].xor == xor &&
+		    kernels[n].and == and &&
+		    kernels[n].type == type &&
+		    strcmp(kernels[n].name, name) == 0)
+			return;
+
+	assert(num_kernels < MAX_KERNELS);
+	kernels[num_kernels].name = name;
+	kernels[num_kernels].isa = isa;
+	kernels[num_kernels].type = type;
+	kernels[num_kernels].tiling = tiling;
+	kernels[num_kernels].swizzle = swizzle;
+	kernels[num_kernels].func = func;
+	kernels[num_kernels].xor = xor;
+	kernels[num_kernels].and = and;
+	num_kernels++;
+}
+
+static void add_kernel(const char *name, const char *isa, enum type type,
+		       int tiling, int swizzle, memcpy_box_func func)
+{
+	__add_kernel(name, isa, type, tiling, swizzle, func, NULL, 0);
+}
+
+/* Each xor kernel is checked both for filling in alpha alone, and with
+ * a mask that also clears some of the source bits.
+ */
+static void add_xor_kernel(const char *name, const char *and_name,
+			   const char *isa, enum type type,
+			   int tiling, int swizzle, memcpy_xor_func xor)
+{
+	__add_kernel(name, isa, type, tiling, swizzle, NULL, xor, 0xffffffff);
+	__add_kernel(and_name, isa, type, tiling, swizzle, NULL, xor, 0x5a5a5a5a);
+}
+
+static void add_affine_kernel(const struct isa *isa)
+{
+	assert(num_kernels < MAX_KERNELS);
+	memset(&kernels[num_kernels], 0, sizeof(kernels[num_kernels]));
+	kernels[num_kernels].name = "affine_blt";
+	kernels[num_kernels].isa = isa->name;
+	kernels[num_kernels].type = AFFINE;
+	kernels[num_kernels].cpu = isa->features;
+	num_kernels++;
+}
+
+static uint32_t or_mask(int bpp)
+{
+	return 0x80u << (bpp - 8);
+}
+
+static void collect_kernels(unsigned cpu)
+{
+	unsigned n;
+	int swizzle;
+
+	for (n = 0; n < ARRAY_SIZE(isas); n++) {
+		const struct isa *isa = &isas[n];
+		struct kgem kgem;
+
+		if ((isa->features & cpu) != isa->features)
+			continue;
+
+		memset(&kgem, 0, sizeof(kgem));
+		kgem.gen = 0100;
+
+		choose_memcpy_nt(&kgem, isa->features);
+		choose_memcpy_from_wc(&kgem, isa->features);
+		add_kernel("memcpy_blt", "scalar", LINEAR, 0, 0, memcpy_blt);
+		add_kernel("memcpy_nt", isa->name, LINEAR, 0, 0, kgem.memcpy_nt);
+		add_kernel("memcpy_from_wc", isa->name, LINEAR, 0, 0, kgem.memcpy_from_wc);
+
+		for (swizzle = I915_BIT_6_SWIZZLE_NONE;
+		     swizzle <= I915_BIT_6_SWIZZLE_9_10_11;
+		     swizzle++) {
+			memset(&kgem, 0, sizeof(kgem));
+			kgem.gen = 0100;
+
+			choose_memcpy_tiled_x(&kgem, swizzle, isa->features);
+			add_kernel("memcpy_to_tiled_x", isa->name, TO_TILED,
+				   I915_TILING_X, swizzle, kgem.memcpy_to_tiled_x);
+			add_kernel("memcpy_from_tiled_x", isa->name, FROM_TILED,
+				   I915_TILING_X, swizzle, kgem.memcpy_from_tiled_x);
+			add_kernel("memcpy_between_tiled_x", isa->name, BETWEEN_TILED,
+				   I915_TILING_X, swizzle, kgem.memcpy_between_tiled_x);
+			add_kernel("memcpy_to_tiled_x__nt", isa->name, TO_TILED,
+				   I915_TILING_X, swizzle, kgem.memcpy_to_tiled_x__nt);
+			add_kernel("memcpy_from_tiled_x__wc", isa->name, FROM_TILED,
+				   I915_TILING_X, swizzle, kgem.memcpy_from_tiled_x__wc);
+			add_xor_kernel("memcpy_to_tiled_x__xor",
+				       "memcpy_to_tiled_x__xor_and",
+				       isa->name, TO_TILED,
+				       I915_TILING_X, swizzle, kgem.memcpy_to_tiled_x__xor);
+
+			choose_memcpy_tiled_y(&kgem, swizzle, isa->features);
+			add_kernel("memcpy_to_tiled_y", isa->name, TO_TILED,
+				   I915_TILING_Y, swizzle, kgem.memcpy_to_tiled_y);
+			add_kernel("memcpy_from_tiled_y", isa->name, FROM_TILED,
+				   I915_TILING_Y, swizzle, kgem.memcpy_from_tiled_y);
+		}
+
+		/* affine_blt() only has sse2 and avx2 variants of its rows */
+		if (isa->features == 0 || isa->features == SSE2 ||
+		    (isa->features & AVX2 && !(isa->features & AVX512F)))
+			add_affine_kernel(isa);
+	}
+
+	/* memcpy_xor() picks its own kernel for this cpu */
+	add_xor_kernel("memcpy_xor", "memcpy_xor_and",
+		       "native", LINEAR, 0, 0, memcpy_xor);
+	add_kernel("memmove_box", "scalar", MOVE, 0, 0, memcpy_blt);
+}
+
+/* The reference detiler: the address of byte x in row y of a surface */
+static uint32_t swizzle_address(uint32_t offset, int swizzle)
+{
+	uint32_t bit = 0;
+
+	switch (swizzle) {
+	case I915_BIT_6_SWIZZLE_9:
+		bit = offset >> 9;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10:
+		bit = offset >> 9 ^ offset >> 10;
+		break;
+	case I915_BIT_6_SWIZZLE_9_11:
+		bit = offset >> 9 ^ offset >> 11;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10_11:
+		bit = offset >> 9 ^ offset >> 10 ^ offset >> 11;
+		break;
+	}
+
+	return offset ^ (bit & 1) << 6;
+}
+
+static uint32_t address(int tiling, int swizzle, int pitch, int x, int y)
+{
+	uint32_t offset;
+
+	switch (tiling) {
+	case I915_TILING_X:
+		offset = y / 8 * pitch * 8 + x / 512 * 4096;
+		offset += y % 8 * 512 + x % 512;
+		break;
+	case I915_TILING_Y:
+		offset = y / 32 * pitch * 32 + x / 128 * 4096;
+		offset += x % 128 / 16 * 512 + y % 32 * 16 + x % 16;
+		break;
+	default:
+		return y * pitch + x;
+	}
+
+	return swizzle_address(offset, swizzle);
+}
+
+struct surface {
+	uint8_t *data;
+	int tiling;
+	int pitch;
+	int height;
+	size_t size;
+};
+
+static void surface_init(struct surface *s, int tiling,
+			 int width_bytes, int height, int misalign)
+{
+	switch (tiling) {
+	case I915_TILING_X:
+		s->pitch = ALIGN(width_bytes, 512);
+		s->height = ALIGN(height, 8);
+		break;
+	case I915_TILING_Y:
+		s->pitch = ALIGN(width_bytes, 128);
+		s->height = ALIGN(height, 32);
+		break;
+	default:
+		s->pitch = ALIGN(width_bytes, 64);
+		s->height = height;
+		break;
+	}
+	s->tiling = tiling;
+	s->size = (size_t)s->pitch * s->height;
+
+	if (posix_memalign((void **)&s->data, 4096, s->size + 4096))
+		abort();
+
+	/* The linear side need not start on a cacheline */
+	if (tiling == I915_TILING_NONE)
+		s->data += misalign;
+}
+
+static void surface_fini(struct surface *s, int misalign)
+{
+	if (s->tiling == I915_TILING_NONE)
+		s->data -= misalign;
+	free(s->data);
+}
+
+static void fill(uint8_t *data, size_t size, unsigned seed)
+{
+	while (size--) {
+		seed = seed * 1103515245 + 12345;
+		*data++ = seed >> 16;
+	}
+}
+
+struct test {
+	const struct kernel *k;
+	int bpp, width, height, align;
+	int transform; /* for affine_blt */
+};
+
+/* The identity samples exactly at the texels, and so is checked against
+ * a plain copy. The others exercise the fractional weights, and are
+ * checked against the scalar rows.
+ */
+static const struct pixman_f_transform affine_transforms[] = {
+	{{ { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } }},
+	/* sub-pixel translation */
+	{{ { 1, 0, 0.3125 }, { 0, 1, -0.6 }, { 0, 0, 1 } }},
+	/* upscale and downscale */
+	{{ { 0.75, 0, 0 }, { 0, 1.37, 0.25 }, { 0, 0, 1 } }},
+	/* rotation by 30 degrees */
+	{{ { 0.8660254, -0.5, 8.5 }, { 0.5, 0.8660254, -3.25 }, { 0, 0, 1 } }},
+};
+
+/* Apply the kernel to src -> dst, and the reference to src -> ref */
+static void run(const struct test *t,
+		struct surface *src, struct surface *dst, struct surface *ref,
+		bool reference)
+{
+	const struct kernel *k = t->k;
+	const int cpp = t->bpp / 8;
+	const int sx = t->align, sy = t->align & 7;
+	const int dy = t->align & 3;
+	int dx = 3 * t->align & 63;
+	int x, y;
+
+	/* Copying between tiles is only supported with matching columns */
+	if (k->type == BETWEEN_TILED)
+		dx = sx;
+
+	switch (k->type) {
+	case LINEAR:
+	case TO_TILED:
+	case FROM_TILED:
+	case BETWEEN_TILED:
+		if (!reference) {
+			if (k->xor)
+				k->xor(src->data, dst->data, t->bpp,
+				       src->pitch, dst->pitch,
+				       sx, sy, dx, dy, t->width, t->height,
+				       k->and, or_mask(t->bpp));
+			else
+				k->func(src->data, dst->data, t->bpp,
+					src->pitch, dst->pitch,
+					sx, sy, dx, dy, t->width, t->height);
+			break;
+		}
+
+		for (y = 0; y < t->height; y++) {
+			for (x = 0; x < t->width * cpp; x++) {
+				uint32_t s = address(src->tiling, k->swizzle,
+						     src->pitch,
+						     sx * cpp + x, sy + y);
+				uint32_t d = address(ref->tiling, k->swizzle,
+						     ref->pitch,
+						     dx * cpp + x, dy + y);
+				uint8_t v = src->data[s];
+
+				if (k->xor) {
+					v &= k->and >> (8 * (x % cpp));
+					v |= or_mask(t->bpp) >> (8 * (x % cpp));
+				}
+				ref->data[d] = v;
+			}
+		}
+		break;
+
+	case MOVE:
+		{
+			/* Scroll the box up and left within the surface */
+			BoxRec box;
+			int ox = t->align % 5 + 1, oy = t->align % 3 + 1;
+
+			box.x1 = 0;
+			box.y1 = 0;
+			box.x2 = t->width - ox;
+			box.y2 = t->height - oy;
+			if (box.x2 <= 0 || box.y2 <= 0)
+				break;
+
+			if (!reference) {
+				memmove_box(dst->data + oy * dst->pitch + ox * cpp,
+					    dst->data, t->bpp, dst->pitch,
+					    &box, ox, oy);
+				break;
+			}
+
+			for (y = 0; y < box.y2; y++)
+				memmove(ref->data + y * ref->pitch,
+					ref->data + (y + oy) * ref->pitch + ox * cpp,
+					box.x2 * cpp);
+		}
+		break;
+
+	case AFFINE:
+		{
+			const struct pixman_f_transform *m =
+				&affine_transforms[t->transform];
+
+			if (t->bpp != 32)
+				break;
+
+			if (!reference || t->transform) {
+				affine_blt__cpu(reference ? 0 : k->cpu,
+						src->data,
+						reference ? ref->data : dst->data,
+						t->bpp,
+						sx, sy, t->width + sx, t->height + sy,
+						src->pitch,
+						dx, dy, t->width, t->height,
+						reference ? ref->pitch : dst->pitch,
+						m);
+				break;
+			}
+
+			for (y = 0; y < t->height; y++)
+				memcpy(ref->data + (dy + y) * ref->pitch + dx * cpp,
+				       src->data + (sy + y) * src->pitch + sx * cpp,
+				       t->width * cpp);
+		}
+		break;
+	}
+}
+
+static int src_tiling(const struct kernel *k)
+{
+	return k->type == FROM_TILED || k->type == BETWEEN_TILED ? k->tiling : I915_TILING_NONE;
+}
+
+static int dst_tiling(const struct kernel *k)
+{
+	return k->type == TO_TILED || k->type == BETWEEN_TILED ? k->tiling : I915_TILING_NONE;
+}
+
+static void setup(const struct test *t,
+		  struct surface *src, struct surface *dst, struct surface *ref)
+{
+	const int cpp = t->bpp / 8;
+	const int margin = 64 + 3 * t->align;
+
+	surface_init(src, src_tiling(t->k),
+		     (t->width + margin) * cpp, t->height + 8, t->align);
+	surface_init(dst, dst_tiling(t->k),
+		     (t->width + margin) * cpp, t->height + 8, 2 * t->align);
+	fill(src->data, src->size, 1);
+	fill(dst->data, dst->size, 2);
+
+	if (ref) {
+		surface_init(ref, dst_tiling(t->k),
+			     (t->width + margin) * cpp, t->height + 8, 0);
+		memcpy(ref->data, dst->data, dst->size);
+	}
+}
+
+static bool check(const struct test *t)
+{
+	struct surface src, dst, ref;
+	bool ok;
+
+	setup(t, &src, &dst, &ref);
+
+	run(t, &src, &dst, &ref, false);
+	run(t, &src, &dst, &ref, true);
+
+	ok = memcmp(dst.data, ref.data, dst.size) == 0;
+	if (!ok)
+		fprintf(stderr, "FAIL: %s (%s), swizzle=%s, bpp=%d, size=%dx%d, align=%d, transform=%d\n",
+			t->k->name, t->k->isa, swizzle_names[t->k->swizzle],
+			t->bpp, t->width, t->height, t->align, t->transform);
+
+	surface_fini(&src, t->align);
+	surface_fini(&dst, 2 * t->align);
+	surface_fini(&ref, 0);
+	return ok;
+}
+
+static double bench(const struct test *t)
+{
+	struct surface src, dst;
+	uint64_t start, elapsed;
+	int loops, n;
+
+	setup(t, &src, &dst, NULL);
+
+	run(t, &src, &dst, NULL, false);
+
+	loops = 1;
+	do {
+		start = now_ns();
+		for (n = 0; n < loops; n++)
+			run(t, &src, &dst, NULL, false);
+		elapsed = now_ns() - start;
+		loops *= 2;
+	} while (elapsed < 10000000);
+
+	surface_fini(&src, t->align);
+	surface_fini(&dst, 2 * t->align);
+
+	return (double)(loops / 2) * t->width * t->height * (t->bpp / 8) / elapsed;
+}
+
+static bool wanted(const struct kernel *k, const char *filter)
+{
+	return filter == NULL || strstr(k->name, filter);
+}
+
+int main(int argc, char **argv)
+{
+	static const int check_widths[] = { 1, 3, 16, 33, 129, 300, 1030 };
+	static const int check_heights[] = { 1, 2, 9, 40 };
+	static const int check_aligns[] = { 0, 1, 7, 17 };
+	static const int bench_widths[] = { 64, 512, 2048 };
+	static const int bench_heights[] = { 16, 256 };
+	static const int bench_aligns[] = { 0, 1 };
+	const char *filter = NULL;
+	bool do_bench = false;
+	int failed = 0, passed = 0;
+	int c, k, b;
+	unsigned w, h, a, m;
+
+	while ((c = getopt(argc, argv, "bf:")) != -1) {
+		switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b] [-f kernel]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	collect_kernels(sna_cpu_detect());
+
+	for (k = 0; k < num_kernels; k++) {
+		unsigned num_transforms = 1;
+
+		if (!wanted(&kernels[k], filter))
+			continue;
+
+		if (kernels[k].type == AFFINE)
+			num_transforms = ARRAY_SIZE(affine_transforms);
+
+		for (b = 8; b <= 32; b <<= 1)
+			for (w = 0; w < ARRAY_SIZE(check_widths); w++)
+				for (h = 0; h < ARRAY_SIZE(check_heights); h++)
+					for (a = 0; a < ARRAY_SIZE(check_aligns); a++)
+						for (m = 0; m < num_transforms; m++) {
+							struct test t = {
+								&kernels[k], b,
+								check_widths[w],
+								check_heights[h],
+								check_aligns[a],
+								m,
+							};
+
+							if (check(&t))
+								passed++;
+							else
+								failed++;
+						}
+	}
+	fprintf(stderr, "%d kernels, %d checks passed, %d failed\n",
+		num_kernels, passed, failed);
+
+	if (do_bench) {
+		printf("kernel\tisa\tswizzle\tbpp\twidth\theight\talign\tGB/s\n");
+		for (k = 0; k < num_kernels; k++) {
+			if (!wanted(&kernels[k], filter))
+				continue;
+
+			for (b = 8; b <= 32; b <<= 1)
+				for (w = 0; w < ARRAY_SIZE(bench_widths); w++)
+					for (h = 0; h < ARRAY_SIZE(bench_heights); h++)
+						for (a = 0; a < ARRAY_SIZE(bench_aligns); a++) {
+							struct test t = {
+								&kernels[k], b,
+								bench_widths[w],
+								bench_heights[h],
+								bench_aligns[a],
+							};
+
+							if (kernels[k].type == AFFINE && b != 32)
+								continue;
+
+							printf("%s\t%s\t%s\t%d\t%d\t%d\t%d\t%.2f\n",
+							       kernels[k].name,
+							       kernels[k].isa,
+							       swizzle_names[kernels[k].swizzle],
+							       b, t.width, t.height, t.align,
+							       bench(&t));
+						}
+		}
+	}
+
+	return failed != 0;
+}
@@ -0,0 +1,554 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Drive kgem against the mock device to measure the CPU overhead of
+ * buffer management and batch submission without any hardware (or X
+ * server) present.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "sna.h"
+#include "sna_reg.h"
+
+#include "kgem-mock.h"
+
+static void noop_reset(struct sna *sna)
+{
+	(void)sna;
+}
+
+static void noop_flush(struct sna *sna)
+{
+	(void)sna;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000 +
+		now.tv_nsec - start->tv_nsec;
+}
+
+enum workload {
+	COPY,
+	UPLOAD,
+	CHURN,
+	DESTROY,
+};
+
+static const char *workload_names[] = {
+	[COPY] = "copy",
+	[UPLOAD] = "upload",
+	[CHURN] = "churn",
+	[DESTROY] = "destroy",
+};
+
+#define POOL_SIZE 256
+#define OPS_PER_FRAME 64
+
+struct bench {
+	struct sna *sna;
+	struct kgem_bo *pool[POOL_SIZE];
+	int width[POOL_SIZE], height[POOL_SIZE];
+	unsigned seed;
+	uint64_t dwords;
+};
+
+/* A crude model of a desktop: mostly glyphs and icons, some windows,
+ * and the occasional fullscreen buffer.
+ */
+static void random_size(struct bench *b, int *width, int *height)
+{
+	int r = rand_r(&b->seed) % 10;
+
+	if (r < 6) {
+		*width = 16 + rand_r(&b->seed) % 112;
+		*height = 16 + rand_r(&b->seed) % 112;
+	} else if (r < 9) {
+		*width = 128 + rand_r(&b->seed) % 896;
+		*height = 128 + rand_r(&b->seed) % 640;
+	} else {
+		*width = 1920;
+		*height = 1080;
+	}
+}
+
+static struct kgem_bo *create_pixmap(struct bench *b, int idx)
+{
+	struct kgem *kgem = &b->sna->kgem;
+
+	random_size(b, &b->width[idx], &b->height[idx]);
+	return kgem_create_2d(kgem, b->width[idx], b->height[idx], 32,
+			      I915_TILING_X, 0);
+}
+
+static void emit_copy(struct bench *b,
+		      struct kgem_bo *src, struct kgem_bo *dst,
+		      int width, int height)
+{
+	struct kgem *kgem = &b->sna->kgem;
+	uint32_t cmd, br13, pitch;
+	uint32_t *batch;
+
+	cmd = XY_SRC_COPY_BLT_CMD | BLT_WRITE_ALPHA | BLT_WRITE_RGB;
+	cmd |= kgem->gen >= 0100 ? 8 : 6;
+	pitch = src->pitch;
+	if (kgem->gen >= 040 && src->tiling) {
+		cmd |= BLT_SRC_TILED;
+		pitch >>= 2;
+	}
+	br13 = dst->pitch;
+	if (kgem->gen >= 040 && dst->tiling) {
+		cmd |= BLT_DST_TILED;
+		br13 >>= 2;
+	}
+	br13 |= 0xcc << 16 | sna_br13_color_depth(32);
+
+	kgem_set_mode(kgem, KGEM_BLT, dst);
+	if (!kgem_check_many_bo_fenced(kgem, src, dst, NULL) ||
+	    !kgem_check_batch(kgem, 10) ||
+	    !kgem_check_reloc(kgem, 2)) {
+		_kgem_submit(kgem);
+		_kgem_set_mode(kgem, KGEM_BLT);
+	}
+	kgem_bcs_set_tiling(kgem, src, dst);
+
+	batch = kgem->batch + kgem->nbatch;
+	batch[0] = cmd;
+	batch[1] = br13;
+	batch[2] = 0;
+	batch[3] = height << 16 | width;
+	if (kgem->gen >= 0100) {
+		*(uint64_t *)(batch+4) =
+			kgem_add_reloc64(kgem, kgem->nbatch + 4, dst,
+					 I915_GEM_DOMAIN_RENDER << 16 |
+					 I915_GEM_DOMAIN_RENDER |
+					 KGEM_RELOC_FENCED,
+					 0);
+		batch[6] = 0;
+		batch[7] = pitch;
+		*(uint64_t *)(batch+8) =
+			kgem_add_reloc64(kgem, kgem->nbatch + 8, src,
+					 I915_GEM_DOMAIN_RENDER << 16 |
+					 KGEM_RELOC_FENCED,
+					 0);
+		kgem->nbatch += 10;
+		b->dwords += 10;
+	} else {
+		batch[4] = kgem_add_reloc(kgem, kgem->nbatch + 4, dst,
+					  I915_GEM_DOMAIN_RENDER << 16 |
+					  I915_GEM_DOMAIN_RENDER |
+					  KGEM_RELOC_FENCED,
+					  0);
+		batch[5] = 0;
+		batch[6] = pitch;
+		batch[7] = kgem_add_reloc(kgem, kgem->nbatch + 7, src,
+					  I915_GEM_DOMAIN_RENDER << 16 |
+					  KGEM_RELOC_FENCED,
+					  0);
+		kgem->nbatch += 8;
+		b->dwords += 8;
+	}
+	assert(kgem->nbatch < kgem->surface);
+}
+
+static void end_frame(struct bench *b, int frame)
+{
+	struct kgem *kgem = &b->sna->kgem;
+
+	kgem_submit(kgem);
+	kgem_retire(kgem);
+	if ((frame & 63) == 63)
+		kgem_expire_cache(kgem);
+}
+
+static bool copy_frame(struct bench *b, int frame)
+{
+	int n;
+
+	for (n = 0; n < OPS_PER_FRAME; n++) {
+		int src = rand_r(&b->seed) % POOL_SIZE;
+		int dst = rand_r(&b->seed) % POOL_SIZE;
+
+		/* Replace a few pixmaps each frame to exercise the caches */
+		if (rand_r(&b->seed) % 16 == 0) {
+			kgem_bo_destroy(&b->sna->kgem, b->pool[dst]);
+			b->pool[dst] = create_pixmap(b, dst);
+			if (b->pool[dst] == NULL)
+				return false;
+		}
+
+		if (src == dst)
+			continue;
+
+		emit_copy(b, b->pool[src], b->pool[dst],
+			  MIN(b->width[src], b->width[dst]),
+			  MIN(b->height[src], b->height[dst]));
+	}
+
+	end_frame(b, frame);
+	return true;
+}
+
+static bool upload_frame(struct bench *b, int frame)
+{
+	struct kgem *kgem = &b->sna->kgem;
+	int n;
+
+	for (n = 0; n < OPS_PER_FRAME; n++) {
+		int dst = rand_r(&b->seed) % POOL_SIZE;
+		int width = MIN(b->width[dst], 256);
+		int height = MIN(b->height[dst], 64);
+		struct kgem_bo *src;
+		void *ptr;
+
+		src = kgem_create_buffer_2d(kgem, width, height, 32,
+					    KGEM_BUFFER_WRITE_INPLACE, &ptr);
+		if (src == NULL)
+			return false;
+
+		memset(ptr, n, height * src->pitch);
+		emit_copy(b, src, b->pool[dst], width, height);
+		kgem_bo_destroy(kgem, src);
+	}
+
+	end_frame(b, frame);
+	return true;
+}
+
+static bool churn_frame(struct bench *b, int frame)
+{
+	struct kgem *kgem = &b->sna->kgem;
+	int n;
+
+	for (n = 0; n < OPS_PER_FRAME; n++) {
+		int size = 4096 << (rand_r(&b->seed) % 8);
+		struct kgem_bo *bo;
+		void *ptr;
+
+		bo = kgem_create_linear(kgem, size, CREATE_INACTIVE);
+		if (bo == NULL)
+			return false;
+
+		ptr = kgem_bo_map__cpu(kgem, bo);
+		if (ptr) {
+			kgem_bo_sync__cpu(kgem, bo);
+			memset(ptr, 0, 64);
+		}
+		kgem_bo_destroy(kgem, bo);
+	}
+
+	end_frame(b, frame);
+	return true;
+}
+
+/* Discard the targets whilst the batch still refers to them, half as if
+ * they had been exported and so are freed rather than cached upon submission.
+ */
+static bool destroy_frame(struct bench *b, int frame)
+{
+	struct kgem *kgem = &b->sna->kgem;
+	int n;
+
+	for (n = 0; n < OPS_PER_FRAME; n++) {
+		int src = rand_r(&b->seed) % POOL_SIZE;
+		int width = 16 + rand_r(&b->seed) % 240;
+		int height = 16 + rand_r(&b->seed) % 240;
+		struct kgem_bo *dst;
+
+		dst = kgem_create_2d(kgem, width, height, 32, I915_TILING_X, 0);
+		if (dst == NULL)
+			return false;
+
+		emit_copy(b, b->pool[src], dst,
+			  MIN(b->width[src], width),
+			  MIN(b->height[src], height));
+		if (n & 1)
+			dst->reusable = false;
+		kgem_bo_destroy(kgem, dst);
+	}
+
+	end_frame(b, frame);
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -g gen        device generation in octal (default 075)\n"
+		"  -n frames     number of frames to run (default 10000)\n"
+		"  -w workload   copy, upload, churn or destroy (default copy)\n"
+		"  -s seed       random seed\n"
+		"  -b ns         GPU time per batch\n"
+		"  -e ns         CPU time per execbuffer\n"
+		"  -o ns         CPU time per object within execbuffer\n"
+		"  -r ns         CPU time per relocation\n"
+		"  -c ns         CPU time per create\n"
+		"  -m ns         CPU time per mmap\n"
+		"  -N            disable NO_RELOC (and HANDLE_LUT)\n"
+		"  -L            pretend not to have a shared LLC\n"
+		"  -A            submit batches asynchronously\n"
+		"  -P            assign GPU addresses to buffers (softpin)\n"
+		"  -V MiB        size of the idle mapping cache\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	bool (*frame_fn[])(struct bench *, int) = {
+		[COPY] = copy_frame,
+		[UPLOAD] = upload_frame,
+		[CHURN] = churn_frame,
+		[DESTROY] = destroy_frame,
+	};
+	struct kgem_mock_params params;
+	struct kgem_mock_stats stats;
+	struct bench b;
+	struct timespec start;
+	ScrnInfoRec scrn;
+	enum workload workload = COPY;
+	unsigned gen = 075;
+	int frames = 10000;
+	bool async = false;
+	bool softpin = false;
+	int vma_cache = -1;
+	uint64_t elapsed;
+	int fd, n, c, ret = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.seed = 0x5eed;
+
+	kgem_mock_default_params(&params, gen);
+	while ((c = getopt(argc, argv, "g:n:w:s:b:e:o:r:c:m:V:NLAPh")) != -1) {
+		switch (c) {
+		case 'g':
+			gen = strtoul(optarg, NULL, 8);
+			params.gen = gen;
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'w':
+			for (n = 0; n < ARRAY_SIZE(workload_names); n++)
+				if (strcmp(optarg, workload_names[n]) == 0)
+					break;
+			if (n == ARRAY_SIZE(workload_names)) {
+				usage(argv[0]);
+				return 1;
+			}
+			workload = n;
+			break;
+		case 's':
+			b.seed = atoi(optarg);
+			break;
+		case 'b':
+			params.batch_ns = atoi(optarg);
+			break;
+		case 'e':
+			params.execbuf_ns = atoi(optarg);
+			break;
+		case 'o':
+			params.execbuf_object_ns = atoi(optarg);
+			break;
+		case 'r':
+			params.execbuf_reloc_ns = atoi(optarg);
+			break;
+		case 'c':
+			params.create_ns = atoi(optarg);
+			break;
+		case 'm':
+			params.mmap_ns = atoi(optarg);
+			break;
+		case 'N':
+			params.has_no_reloc = false;
+			params.has_handle_lut = false;
+			break;
+		case 'L':
+			params.has_llc = false;
+			break;
+		case 'A':
+			async = true;
+			break;
+		case 'P':
+			softpin = true;
+			params.has_softpin = true;
+			break;
+		case 'V':
+			vma_cache = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	fd = kgem_mock_open(&params);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create the mock device\n");
+		return 77;
+	}
+
+	b.sna = calloc(1, sizeof(*b.sna));
+	if (b.sna == NULL)
+		return 77;
+
+	memset(&scrn, 0, sizeof(scrn));
+	b.sna->scrn = &scrn;
+	b.sna->cpu_features = sna_cpu_detect();
+	b.sna->render.reset = noop_reset;
+	b.sna->render.flush = noop_flush;
+
+	kgem_init(&b.sna->kgem, fd, NULL, gen);
+	if (b.sna->kgem.wedged) {
+		fprintf(stderr, "kgem failed to initialise upon the mock device\n");
+		return 77;
+	}
+	kgem_reset(&b.sna->kgem);
+	if (vma_cache >= 0)
+		b.sna->kgem.vma_budget = (uint64_t)vma_cache << 20;
+
+	if (async && !kgem_async_init(&b.sna->kgem))
+		fprintf(stderr, "Unable to start the submission thread\n");
+	if (softpin && !kgem_vm_init(&b.sna->kgem))
+		fprintf(stderr, "Unable to assign GPU addresses, using relocations\n");
+
+	for (n = 0; n < POOL_SIZE; n++) {
+		b.pool[n] = create_pixmap(&b, n);
+		if (b.pool[n] == NULL) {
+			fprintf(stderr, "Unable to allocate the pixmap pool\n");
+			return 1;
+		}
+	}
+	kgem_submit(&b.sna->kgem);
+
+	kgem_mock_reset_stats(fd);
+	memset(&b.sna->kgem.cache_stats, 0, sizeof(b.sna->kgem.cache_stats));
+	for (n = 0; n < NUM_VMA_TYPES; n++) {
+		b.sna->kgem.vma_stats.type[n].hits = 0;
+		b.sna->kgem.vma_stats.type[n].misses = 0;
+	}
+	b.sna->kgem.vma_stats.evictions = 0;
+	b.sna->kgem.vma_stats.evicted = 0;
+	b.dwords = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < frames; n++) {
+		if (!frame_fn[workload](&b, n)) {
+			fprintf(stderr, "Frame %d failed\n", n);
+			break;
+		}
+	}
+	kgem_async_sync(&b.sna->kgem);
+	elapsed = elapsed_ns(&start);
+	frames = n;
+	if (b.sna->kgem.wedged) {
+		fprintf(stderr, "Batch submission failed\n");
+		ret = 1;
+	}
+
+	kgem_mock_get_stats(fd, &stats);
+
+	printf("%s: gen %03o, %d frames in %.3fs: %.1f frames/s, %.2fus/op\n",
+	       workload_names[workload], gen, frames, elapsed * 1e-9,
+	       frames / (elapsed * 1e-9),
+	       elapsed * 1e-3 / ((double)frames * OPS_PER_FRAME));
+	printf("batches: %llu, %.1f dwords, %.1f objects, %.1f relocs (%.1f skipped) per batch\n",
+	       (long long)stats.execbuf,
+	       stats.execbuf ? b.dwords / (double)stats.execbuf : 0.,
+	       stats.execbuf ? stats.exec_objects / (double)stats.execbuf : 0.,
+	       stats.execbuf ? (stats.relocs + stats.relocs_skipped) / (double)stats.execbuf : 0.,
+	       stats.execbuf ? stats.relocs_skipped / (double)stats.execbuf : 0.);
+	printf("bo cache: %llu lookups, %llu misses, %llu scanned\n",
+	       (long long)b.sna->kgem.cache_stats.lookups,
+	       (long long)b.sna->kgem.cache_stats.misses,
+	       (long long)b.sna->kgem.cache_stats.scanned);
+	printf("ioctls: create %llu, close %llu, mmap %llu, mmap_gtt %llu, set_domain %llu, set_tiling %llu, busy %llu, wait %llu, throttle %llu, madvise %llu, pwrite %llu, pread %llu\n",
+	       (long long)stats.create, (long long)stats.close,
+	       (long long)stats.mmap, (long long)stats.mmap_gtt,
+	       (long long)stats.set_domain, (long long)stats.set_tiling,
+	       (long long)stats.busy, (long long)stats.wait,
+	       (long long)stats.throttle, (long long)stats.madvise,
+	       (long long)stats.pwrite, (long long)stats.pread);
+	printf("stalls: %.3fms waiting, %.3fms throttled; peak %llu objects, %.1fMiB\n",
+	       stats.stall_ns * 1e-6, stats.throttle_ns * 1e-6,
+	       (long long)stats.max_live_objects,
+	       stats.max_live_bytes / (1024. * 1024.));
+	printf("vma: GTT %llu/%llu, WC %llu/%llu, CPU %llu/%llu hits/misses; %llu evictions, %.1fMiB; %.1fMiB idle\n",
+	       (long long)b.sna->kgem.vma_stats.type[VMA_GTT].hits,
+	       (long long)b.sna->kgem.vma_stats.type[VMA_GTT].misses,
+	       (long long)b.sna->kgem.vma_stats.type[VMA_WC].hits,
+	       (long long)b.sna->kgem.vma_stats.type[VMA_WC].misses,
+	       (long long)b.sna->kgem.vma_stats.type[VMA_CPU].hits,
+	       (long long)b.sna->kgem.vma_stats.type[VMA_CPU].misses,
+	       (long long)b.sna->kgem.vma_stats.evictions,
+	       b.sna->kgem.vma_stats.evicted / (1024. * 1024.),
+	       b.sna->kgem.vma_stats.cached / (1024. * 1024.));
+	printf("expiry: %llu windows, %llu allocations, %llu hits, %llu predicted; %llu kept, %llu expired\n",
+	       (long long)b.sna->kgem.demand.stats.windows,
+	       (long long)b.sna->kgem.demand.stats.requests,
+	       (long long)b.sna->kgem.demand.stats.hits,
+	       (long long)b.sna->kgem.demand.stats.predicted,
+	       (long long)b.sna->kgem.demand.stats.kept,
+	       (long long)b.sna->kgem.demand.stats.expired);
+	kgem_dump_slab_stats();
+
+	if (b.sna->kgem.vm) {
+		struct kgem_vm_stats vm;
+		uint64_t avail;
+
+		kgem_vm_get_stats(&b.sna->kgem, &vm);
+		avail = vm.size - vm.allocated;
+		printf("softpin: %llu allocs, %llu frees, %llu failures, %llu evictions (%.1fMiB); %d holes, %.1f%% fragmented; %llu/%llu objects pinned\n",
+		       (long long)vm.allocs, (long long)vm.frees,
+		       (long long)vm.failures,
+		       (long long)vm.evictions, vm.evicted / (1024. * 1024.),
+		       vm.holes,
+		       avail ? 100. * (1. - vm.largest_hole / (double)avail) : 0.,
+		       (long long)stats.exec_pinned,
+		       (long long)stats.exec_objects);
+	}
+
+	for (n = 0; n < POOL_SIZE; n++)
+		kgem_bo_destroy(&b.sna->kgem, b.pool[n]);
+	kgem_async_fini(&b.sna->kgem);
+	kgem_cleanup_cache(&b.sna->kgem);
+	kgem_vm_fini(&b.sna->kgem);
+
+	kgem_mock_close(fd);
+	free(b.sna);
+
+	return ret;
+}
@@ -0,0 +1,1064 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <xf86drm.h>
+#include <i915_drm.h>
+
+#include "kgem-mock.h"
+
+#define PAGE_SIZE 4096
+#define MAX_DEVICES 4
+#define MAX_FREE_PAGES 1024
+#define THROTTLE_NS (20*1000*1000)
+#define HISTORY 64
+
+/* Not every libdrm carries these, so keep our own copies as kgem does */
+#define LOCAL_I915_GEM_WAIT		0x2c
+#define LOCAL_I915_GEM_SET_CACHING	0x2f
+#define LOCAL_I915_GEM_GET_CACHING	0x30
+#define LOCAL_I915_GEM_USERPTR		0x33
+#define LOCAL_I915_GEM_CONTEXT_GETPARAM	0x34
+
+#define LOCAL_I915_PARAM_HAS_BLT		11
+#define LOCAL_I915_PARAM_HAS_RELAXED_FENCING	12
+#define LOCAL_I915_PARAM_HAS_RELAXED_DELTA	15
+#define LOCAL_I915_PARAM_HAS_LLC		17
+#define LOCAL_I915_PARAM_HAS_ALIASING_PPGTT	18
+#define LOCAL_I915_PARAM_HAS_NO_RELOC		25
+#define LOCAL_I915_PARAM_HAS_HANDLE_LUT		26
+#define LOCAL_I915_PARAM_MMAP_VERSION		30
+#define LOCAL_I915_PARAM_HAS_EXEC_SOFTPIN	37
+#define LOCAL_I915_PARAM_MMAP_GTT_COHERENT	52
+
+#define LOCAL_I915_EXEC_NO_RELOC	(1<<11)
+#define LOCAL_I915_EXEC_HANDLE_LUT	(1<<12)
+#define LOCAL_EXEC_OBJECT_WRITE		(1<<2)
+#define LOCAL_EXEC_OBJECT_PINNED	(1<<4)
+
+struct local_i915_gem_mmap2 {
+	uint32_t handle;
+	uint32_t pad;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t addr_ptr;
+	uint64_t flags;
+};
+#define LOCAL_I915_MMAP_WC 0x1
+
+struct local_i915_gem_get_tiling_v2 {
+	uint32_t handle;
+	uint32_t tiling_mode;
+	uint32_t swizzle_mode;
+	uint32_t phys_swizzle_mode;
+};
+
+struct local_i915_gem_wait {
+	uint32_t handle;
+	uint32_t flags;
+	int64_t timeout;
+};
+
+struct local_i915_gem_caching {
+	uint32_t handle;
+	uint32_t caching;
+};
+
+struct local_i915_gem_userptr {
+	uint64_t user_ptr;
+	uint64_t user_size;
+	uint32_t flags;
+	uint32_t handle;
+};
+
+struct local_i915_gem_context_param {
+	uint32_t context;
+	uint32_t size;
+	uint64_t param;
+	uint64_t value;
+};
+#define LOCAL_CONTEXT_PARAM_GTT_SIZE 0x3
+
+struct mock_bo {
+	uint64_t size;
+	uint64_t offset; /* into the backing file */
+	uint64_t gtt_offset;
+	uint64_t busy_until;
+	void *userptr;
+
+	uint32_t read_rings;
+	uint32_t write_ring;
+	uint32_t tiling, stride;
+	uint32_t caching;
+	uint32_t madv;
+	bool write;
+	bool used;
+};
+
+struct mock_range {
+	struct mock_range *next;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct mock_device {
+	int fd;
+	struct kgem_mock_params params;
+	pthread_mutex_t mutex;
+
+	struct mock_bo *bo;
+	uint32_t num_bo, max_bo;
+	uint32_t *free_handles;
+	uint32_t num_free_handles;
+
+	uint64_t file_size;
+	struct mock_range *free_pages[MAX_FREE_PAGES + 1];
+
+	uint64_t next_gtt;
+	uint64_t ring_idle[2];
+
+	struct {
+		uint64_t submit, complete;
+	} history[HISTORY];
+	unsigned num_history;
+
+	struct kgem_mock_stats stats;
+};
+
+static struct mock_device *devices[MAX_DEVICES];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void spin(uint64_t ns)
+{
+	uint64_t end;
+
+	if (ns == 0)
+		return;
+
+	end = now_ns() + ns;
+	while (now_ns() < end)
+		;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000;
+	ts.tv_nsec = deadline % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static struct mock_device *lookup_device(int fd)
+{
+	int n;
+
+	if (fd < 0)
+		return NULL;
+
+	for (n = 0; n < MAX_DEVICES; n++)
+		if (devices[n] && devices[n]->fd == fd)
+			return devices[n];
+
+	return NULL;
+}
+
+static struct mock_bo *lookup_bo(struct mock_device *dev, uint32_t handle)
+{
+	if (handle == 0 || handle > dev->num_bo)
+		return NULL;
+
+	if (!dev->bo[handle - 1].used)
+		return NULL;
+
+	return &dev->bo[handle - 1];
+}
+
+static uint32_t handle_of(struct mock_device *dev, struct mock_bo *bo)
+{
+	return bo - dev->bo + 1;
+}
+
+static int alloc_backing(struct mock_device *dev, struct mock_bo *bo)
+{
+	uint64_t pages = bo->size / PAGE_SIZE;
+	struct mock_range *r, **prev;
+
+	/* Reuse the backing of a closed object of the same size, like the
+	 * kernel reusing pages, so that churn does not grow the file.
+	 */
+	prev = &dev->free_pages[pages < MAX_FREE_PAGES ? pages : MAX_FREE_PAGES];
+	for (r = *prev; r; prev = &r->next, r = r->next) {
+		if (r->size == bo->size) {
+			*prev = r->next;
+			bo->offset = r->offset;
+			free(r);
+			return 0;
+		}
+	}
+
+	if (ftruncate(dev->fd, dev->file_size + bo->size))
+		return -ENOMEM;
+
+	bo->offset = dev->file_size;
+	dev->file_size += bo->size;
+	return 0;
+}
+
+static void free_backing(struct mock_device *dev, struct mock_bo *bo)
+{
+	uint64_t pages = bo->size / PAGE_SIZE;
+	struct mock_range *r;
+
+	if (bo->userptr)
+		return;
+
+	r = malloc(sizeof(*r));
+	if (r == NULL)
+		return;
+
+	r->offset = bo->offset;
+	r->size = bo->size;
+	pages = pages < MAX_FREE_PAGES ? pages : MAX_FREE_PAGES;
+	r->next = dev->free_pages[pages];
+	dev->free_pages[pages] = r;
+}
+
+static struct mock_bo *create_bo(struct mock_device *dev, uint64_t size)
+{
+	struct mock_bo *bo;
+	uint32_t handle;
+
+	if (size == 0)
+		return NULL;
+
+	if (dev->num_free_handles) {
+		handle = dev->free_handles[--dev->num_free_handles];
+	} else {
+		if (dev->num_bo == dev->max_bo) {
+			unsigned max = dev->max_bo ? 2 * dev->max_bo : 1024;
+			void *ptr;
+
+			ptr = realloc(dev->bo, max * sizeof(*dev->bo));
+			if (ptr == NULL)
+				return NULL;
+			dev->bo = ptr;
+
+			ptr = realloc(dev->free_handles,
+				      max * sizeof(*dev->free_handles));
+			if (ptr == NULL)
+				return NULL;
+			dev->free_handles = ptr;
+
+			dev->max_bo = max;
+		}
+		handle = ++dev->num_bo;
+	}
+
+	bo = &dev->bo[handle - 1];
+	memset(bo, 0, sizeof(*bo));
+	bo->size = (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+	bo->gtt_offset = -1;
+	bo->caching = dev->params.has_llc;
+	bo->used = true;
+
+	dev->stats.live_objects++;
+	if (dev->stats.live_objects > dev->stats.max_live_objects)
+		dev->stats.max_live_objects = dev->stats.live_objects;
+	dev->stats.live_bytes += bo->size;
+	if (dev->stats.live_bytes > dev->stats.max_live_bytes)
+		dev->stats.max_live_bytes = dev->stats.live_bytes;
+
+	return bo;
+}
+
+static void close_bo(struct mock_device *dev, struct mock_bo *bo)
+{
+	free_backing(dev, bo);
+
+	dev->stats.live_objects--;
+	dev->stats.live_bytes -= bo->size;
+
+	bo->used = false;
+	dev->free_handles[dev->num_free_handles++] = handle_of(dev, bo);
+}
+
+static uint32_t busy_flags(struct mock_bo *bo, uint64_t now)
+{
+	if (now >= bo->busy_until)
+		return 0;
+
+	return bo->read_rings << 16 | bo->write_ring;
+}
+
+static uint64_t gtt_offset(struct mock_device *dev, struct mock_bo *bo)
+{
+	if (bo->gtt_offset == (uint64_t)-1) {
+		if (dev->next_gtt + bo->size > dev->params.aperture_size)
+			dev->next_gtt = 0;
+		bo->gtt_offset = dev->next_gtt;
+		dev->next_gtt += bo->size;
+	}
+
+	return bo->gtt_offset;
+}
+
+static int bo_write(struct mock_device *dev, struct mock_bo *bo,
+		    uint64_t offset, const void *data, uint64_t len)
+{
+	if (offset + len > bo->size)
+		return -EINVAL;
+
+	if (bo->userptr) {
+		memcpy((char *)bo->userptr + offset, data, len);
+		return 0;
+	}
+
+	if (pwrite(dev->fd, data, len, bo->offset + offset) != (ssize_t)len)
+		return -EFAULT;
+
+	return 0;
+}
+
+static int bo_read(struct mock_device *dev, struct mock_bo *bo,
+		   uint64_t offset, void *data, uint64_t len)
+{
+	if (offset + len > bo->size)
+		return -EINVAL;
+
+	if (bo->userptr) {
+		memcpy(data, (char *)bo->userptr + offset, len);
+		return 0;
+	}
+
+	if (pread(dev->fd, data, len, bo->offset + offset) != (ssize_t)len)
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Called with the device lock held, returns with it released */
+static void wait_bo(struct mock_device *dev, struct mock_bo *bo)
+{
+	uint64_t until = bo->busy_until;
+	uint64_t now = now_ns();
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (now < until) {
+		sleep_until(until);
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.stall_ns += until - now;
+		pthread_mutex_unlock(&dev->mutex);
+	}
+}
+
+static int mock_getparam(struct mock_device *dev, drm_i915_getparam_t *gp)
+{
+	const struct kgem_mock_params *p = &dev->params;
+	int value;
+
+	switch (gp->param) {
+	case I915_PARAM_CHIPSET_ID: value = 0; break;
+	case I915_PARAM_HAS_EXECBUF2: value = 1; break;
+	case I915_PARAM_NUM_FENCES_AVAIL: value = 16; break;
+	case LOCAL_I915_PARAM_HAS_BLT: value = 1; break;
+	case LOCAL_I915_PARAM_HAS_RELAXED_FENCING: value = 1; break;
+	case LOCAL_I915_PARAM_HAS_RELAXED_DELTA: value = 1; break;
+	case LOCAL_I915_PARAM_HAS_LLC: value = p->has_llc; break;
+	case LOCAL_I915_PARAM_HAS_ALIASING_PPGTT: value = 2; break;
+	case LOCAL_I915_PARAM_HAS_NO_RELOC: value = p->has_no_reloc; break;
+	case LOCAL_I915_PARAM_HAS_HANDLE_LUT: value = p->has_handle_lut; break;
+	case LOCAL_I915_PARAM_MMAP_VERSION: value = p->has_wc_mmap; break;
+	case LOCAL_I915_PARAM_HAS_EXEC_SOFTPIN: value = p->has_softpin; break;
+	case LOCAL_I915_PARAM_MMAP_GTT_COHERENT: value = 1; break;
+	default: return -EINVAL;
+	}
+
+	*gp->value = value;
+	return 0;
+}
+
+static int mock_execbuf(struct mock_device *dev,
+			struct drm_i915_gem_execbuffer2 *execbuf)
+{
+	const struct kgem_mock_params *p = &dev->params;
+	struct drm_i915_gem_exec_object2 *exec;
+	struct mock_bo **bo;
+	uint64_t now, complete, cost;
+	unsigned nreloc = 0;
+	int ring, i, j, ret = 0;
+
+	if (execbuf->buffers_ptr == 0)
+		return -EFAULT;
+	if (execbuf->buffer_count == 0)
+		return -EINVAL;
+
+	exec = (struct drm_i915_gem_exec_object2 *)(uintptr_t)execbuf->buffers_ptr;
+	bo = malloc(execbuf->buffer_count * sizeof(*bo));
+	if (bo == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->stats.execbuf++;
+
+	for (i = 0; i < execbuf->buffer_count; i++) {
+		bo[i] = lookup_bo(dev, exec[i].handle);
+		if (bo[i] == NULL) {
+			ret = -ENOENT;
+			goto out;
+		}
+
+		if (exec[i].flags & LOCAL_EXEC_OBJECT_PINNED) {
+			if (!p->has_softpin ||
+			    exec[i].offset & (PAGE_SIZE - 1) ||
+			    exec[i].offset + bo[i]->size > p->aperture_size) {
+				ret = -EINVAL;
+				goto out;
+			}
+			bo[i]->gtt_offset = exec[i].offset;
+			dev->stats.exec_pinned++;
+		} else
+			(void)gtt_offset(dev, bo[i]);
+	}
+
+	for (i = 0; i < execbuf->buffer_count; i++) {
+		struct drm_i915_gem_relocation_entry *reloc =
+			(struct drm_i915_gem_relocation_entry *)(uintptr_t)exec[i].relocs_ptr;
+
+		for (j = 0; j < exec[i].relocation_count; j++) {
+			struct mock_bo *target;
+			uint64_t addr;
+
+			if (execbuf->flags & LOCAL_I915_EXEC_HANDLE_LUT) {
+				if (reloc[j].target_handle >= execbuf->buffer_count) {
+					ret = -EINVAL;
+					goto out;
+				}
+				target = bo[reloc[j].target_handle];
+			} else
+				target = lookup_bo(dev, reloc[j].target_handle);
+			if (target == NULL) {
+				ret = -ENOENT;
+				goto out;
+			}
+
+			if (reloc[j].write_domain)
+				target->write = true;
+
+			nreloc++;
+			if (execbuf->flags & LOCAL_I915_EXEC_NO_RELOC &&
+			    reloc[j].presumed_offset == target->gtt_offset) {
+				dev->stats.relocs_skipped++;
+				continue;
+			}
+
+			addr = target->gtt_offset + (int32_t)reloc[j].delta;
+			ret = bo_write(dev, bo[i], reloc[j].offset, &addr,
+				       p->gen >= 0100 ? 8 : 4);
+			if (ret)
+				goto out;
+
+			reloc[j].presumed_offset = target->gtt_offset;
+			dev->stats.relocs++;
+		}
+	}
+
+	ring = (execbuf->flags & I915_EXEC_RING_MASK) == I915_EXEC_BLT;
+	now = now_ns();
+	complete = dev->ring_idle[ring] > now ? dev->ring_idle[ring] : now;
+	complete += p->batch_ns;
+	dev->ring_idle[ring] = complete;
+
+	for (i = 0; i < execbuf->buffer_count; i++) {
+		if (now >= bo[i]->busy_until) {
+			bo[i]->read_rings = 0;
+			bo[i]->write_ring = 0;
+		}
+		if (bo[i]->write || exec[i].flags & LOCAL_EXEC_OBJECT_WRITE)
+			bo[i]->write_ring = ring + 1;
+		bo[i]->write = false;
+		bo[i]->read_rings |= 1 << ring;
+		bo[i]->busy_until = complete;
+
+		exec[i].offset = bo[i]->gtt_offset;
+	}
+	dev->stats.exec_objects += execbuf->buffer_count;
+
+	dev->history[dev->num_history % HISTORY].submit = now;
+	dev->history[dev->num_history % HISTORY].complete = complete;
+	dev->num_history++;
+
+out:
+	pthread_mutex_unlock(&dev->mutex);
+	free(bo);
+
+	cost = p->execbuf_ns;
+	cost += (uint64_t)execbuf->buffer_count * p->execbuf_object_ns;
+	cost += (uint64_t)nreloc * p->execbuf_reloc_ns;
+	spin(cost);
+
+	return ret;
+}
+
+static int mock_throttle(struct mock_device *dev)
+{
+	uint64_t now, until = 0;
+	unsigned n;
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->stats.throttle++;
+
+	/* Wait for the last request submitted more than 20ms ago */
+	now = now_ns();
+	for (n = 0; n < HISTORY && n < dev->num_history; n++) {
+		unsigned idx = (dev->num_history - 1 - n) % HISTORY;
+		if (now - dev->history[idx].submit >= THROTTLE_NS) {
+			until = dev->history[idx].complete;
+			break;
+		}
+	}
+	if (until > now)
+		dev->stats.throttle_ns += until - now;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (until > now)
+		sleep_until(until);
+
+	return 0;
+}
+
+static int mock_ioctl(struct mock_device *dev, unsigned long request, void *arg)
+{
+	const struct kgem_mock_params *p = &dev->params;
+	struct mock_bo *bo;
+	int ret = 0;
+
+	if (_IOC_TYPE(request) != DRM_IOCTL_BASE)
+		return -ENOTTY;
+
+	if (_IOC_NR(request) == _IOC_NR(DRM_IOCTL_GEM_CLOSE)) {
+		struct drm_gem_close *close = arg;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.close++;
+		bo = lookup_bo(dev, close->handle);
+		if (bo)
+			close_bo(dev, bo);
+		else
+			ret = -ENOENT;
+		pthread_mutex_unlock(&dev->mutex);
+
+		spin(p->close_ns);
+		return ret;
+	}
+
+	if (_IOC_NR(request) < DRM_COMMAND_BASE) {
+		/* modesetting, flink, prime: we are not a display device */
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.other++;
+		pthread_mutex_unlock(&dev->mutex);
+		return -EINVAL;
+	}
+
+	switch (_IOC_NR(request) - DRM_COMMAND_BASE) {
+	case DRM_I915_GETPARAM:
+		return mock_getparam(dev, arg);
+
+	case DRM_I915_GEM_CREATE: {
+		struct drm_i915_gem_create *create = arg;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.create++;
+		bo = create_bo(dev, create->size);
+		if (bo && alloc_backing(dev, bo)) {
+			close_bo(dev, bo);
+			bo = NULL;
+		}
+		if (bo) {
+			create->handle = handle_of(dev, bo);
+			create->size = bo->size;
+		} else
+			ret = -ENOMEM;
+		pthread_mutex_unlock(&dev->mutex);
+
+		spin(p->create_ns);
+		return ret;
+	}
+
+	case LOCAL_I915_GEM_USERPTR: {
+		struct local_i915_gem_userptr *userptr = arg;
+
+		if (!p->has_userptr)
+			return -ENODEV;
+
+		if (userptr->user_ptr & (PAGE_SIZE - 1) ||
+		    userptr->user_size & (PAGE_SIZE - 1))
+			return -EINVAL;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.create++;
+		bo = create_bo(dev, userptr->user_size);
+		if (bo) {
+			bo->userptr = (void *)(uintptr_t)userptr->user_ptr;
+			bo->caching = 1;
+			userptr->handle = handle_of(dev, bo);
+		} else
+			ret = -ENOMEM;
+		pthread_mutex_unlock(&dev->mutex);
+
+		spin(p->create_ns);
+		return ret;
+	}
+
+	case LOCAL_I915_GEM_CONTEXT_GETPARAM: {
+		struct local_i915_gem_context_param *param = arg;
+
+		/* shares its number with the never merged create2 */
+		if (_IOC_SIZE(request) != sizeof(*param) ||
+		    param->param != LOCAL_CONTEXT_PARAM_GTT_SIZE)
+			return -EINVAL;
+
+		param->value = p->aperture_size;
+		return 0;
+	}
+
+	case DRM_I915_GEM_GET_APERTURE: {
+		struct drm_i915_gem_get_aperture *aperture = arg;
+
+		aperture->aper_size = p->aperture_size;
+		aperture->aper_available_size = p->aperture_size;
+		return 0;
+	}
+
+	case DRM_I915_GEM_MMAP: {
+		struct local_i915_gem_mmap2 *mmap_arg = arg;
+		bool wc = false;
+		void *ptr;
+
+		if (_IOC_SIZE(request) >= sizeof(struct local_i915_gem_mmap2))
+			wc = mmap_arg->flags & LOCAL_I915_MMAP_WC;
+		if (wc && !p->has_wc_mmap)
+			return -EINVAL;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.mmap++;
+		bo = lookup_bo(dev, mmap_arg->handle);
+		if (bo == NULL || bo->userptr ||
+		    mmap_arg->offset + mmap_arg->size > bo->size) {
+			pthread_mutex_unlock(&dev->mutex);
+			return bo ? -EINVAL : -ENOENT;
+		}
+		ptr = mmap(NULL, mmap_arg->size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, dev->fd, bo->offset + mmap_arg->offset);
+		pthread_mutex_unlock(&dev->mutex);
+
+		spin(p->mmap_ns);
+		if (ptr == MAP_FAILED)
+			return -ENOMEM;
+
+		mmap_arg->addr_ptr = (uintptr_t)ptr;
+		return 0;
+	}
+
+	case DRM_I915_GEM_MMAP_GTT: {
+		struct drm_i915_gem_mmap_gtt *gtt = arg;
+
+		/* The fake offset is the object's location in our backing
+		 * file, so that mmap(fd, offset) just works.
+		 */
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.mmap_gtt++;
+		bo = lookup_bo(dev, gtt->handle);
+		if (bo && !bo->userptr)
+			gtt->offset = bo->offset;
+		else
+			ret = bo ? -EINVAL : -ENOENT;
+		pthread_mutex_unlock(&dev->mutex);
+
+		spin(p->mmap_ns);
+		return ret;
+	}
+
+	case DRM_I915_GEM_PWRITE:
+	case DRM_I915_GEM_PREAD: {
+		struct drm_i915_gem_pwrite *rw = arg; /* same layout as pread */
+		bool write = _IOC_NR(request) - DRM_COMMAND_BASE == DRM_I915_GEM_PWRITE;
+
+		pthread_mutex_lock(&dev->mutex);
+		if (write)
+			dev->stats.pwrite++;
+		else
+			dev->stats.pread++;
+		bo = lookup_bo(dev, rw->handle);
+		if (bo == NULL) {
+			pthread_mutex_unlock(&dev->mutex);
+			return -ENOENT;
+		}
+
+		wait_bo(dev, bo);
+
+		pthread_mutex_lock(&dev->mutex);
+		bo = lookup_bo(dev, rw->handle);
+		if (bo == NULL)
+			ret = -ENOENT;
+		else if (write)
+			ret = bo_write(dev, bo, rw->offset,
+				       (void *)(uintptr_t)rw->data_ptr, rw->size);
+		else
+			ret = bo_read(dev, bo, rw->offset,
+				      (void *)(uintptr_t)rw->data_ptr, rw->size);
+		pthread_mutex_unlock(&dev->mutex);
+		return ret;
+	}
+
+	case DRM_I915_GEM_SET_DOMAIN: {
+		struct drm_i915_gem_set_domain *domain = arg;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.set_domain++;
+		bo = lookup_bo(dev, domain->handle);
+		if (bo == NULL) {
+			pthread_mutex_unlock(&dev->mutex);
+			return -ENOENT;
+		}
+
+		wait_bo(dev, bo);
+		return 0;
+	}
+
+	case DRM_I915_GEM_BUSY: {
+		struct drm_i915_gem_busy *busy = arg;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.busy++;
+		bo = lookup_bo(dev, busy->handle);
+		if (bo)
+			busy->busy = busy_flags(bo, now_ns());
+		else
+			ret = -ENOENT;
+		pthread_mutex_unlock(&dev->mutex);
+
+		spin(p->busy_ns);
+		return ret;
+	}
+
+	case LOCAL_I915_GEM_WAIT: {
+		struct local_i915_gem_wait *wait = arg;
+		uint64_t now, until;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.wait++;
+		bo = lookup_bo(dev, wait->handle);
+		if (bo == NULL) {
+			pthread_mutex_unlock(&dev->mutex);
+			return -ENOENT;
+		}
+
+		now = now_ns();
+		until = bo->busy_until;
+		if (until > now && wait->timeout >= 0 &&
+		    until - now > (uint64_t)wait->timeout) {
+			pthread_mutex_unlock(&dev->mutex);
+			if (wait->timeout)
+				sleep_until(now + wait->timeout);
+			wait->timeout = 0;
+			return -ETIME;
+		}
+
+		wait_bo(dev, bo);
+		if (wait->timeout > 0)
+			wait->timeout -= until > now ? until - now : 0;
+		return 0;
+	}
+
+	case DRM_I915_GEM_THROTTLE:
+		return mock_throttle(dev);
+
+	case DRM_I915_GEM_EXECBUFFER2:
+		return mock_execbuf(dev, arg);
+
+	case DRM_I915_GEM_SET_TILING: {
+		struct drm_i915_gem_set_tiling *tiling = arg;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.set_tiling++;
+		bo = lookup_bo(dev, tiling->handle);
+		if (bo == NULL)
+			ret = -ENOENT;
+		else if (tiling->tiling_mode > I915_TILING_Y)
+			ret = -EINVAL;
+		else {
+			bo->tiling = tiling->tiling_mode;
+			bo->stride = tiling->tiling_mode ? tiling->stride : 0;
+			tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+		}
+		pthread_mutex_unlock(&dev->mutex);
+		return ret;
+	}
+
+	case DRM_I915_GEM_GET_TILING: {
+		struct local_i915_gem_get_tiling_v2 *tiling = arg;
+
+		pthread_mutex_lock(&dev->mutex);
+		bo = lookup_bo(dev, tiling->handle);
+		if (bo) {
+			tiling->tiling_mode = bo->tiling;
+			tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+			if (_IOC_SIZE(request) >= sizeof(*tiling))
+				tiling->phys_swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+		} else
+			ret = -ENOENT;
+		pthread_mutex_unlock(&dev->mutex);
+		return ret;
+	}
+
+	case DRM_I915_GEM_MADVISE: {
+		struct drm_i915_gem_madvise *madv = arg;
+
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.madvise++;
+		bo = lookup_bo(dev, madv->handle);
+		if (bo) {
+			bo->madv = madv->madv;
+			madv->retained = 1;
+		} else
+			ret = -ENOENT;
+		pthread_mutex_unlock(&dev->mutex);
+		return ret;
+	}
+
+	case LOCAL_I915_GEM_SET_CACHING:
+	case LOCAL_I915_GEM_GET_CACHING: {
+		struct local_i915_gem_caching *caching = arg;
+
+		if (!p->has_caching)
+			return -EINVAL;
+
+		pthread_mutex_lock(&dev->mutex);
+		bo = lookup_bo(dev, caching->handle);
+		if (bo == NULL)
+			ret = -ENOENT;
+		else if (_IOC_NR(request) - DRM_COMMAND_BASE == LOCAL_I915_GEM_SET_CACHING)
+			bo->caching = caching->caching;
+		else
+			caching->caching = bo->caching;
+		pthread_mutex_unlock(&dev->mutex);
+		return ret;
+	}
+
+	default:
+		/* pin, secure batches, etc are left unsupported */
+		pthread_mutex_lock(&dev->mutex);
+		dev->stats.other++;
+		pthread_mutex_unlock(&dev->mutex);
+		return -ENODEV;
+	}
+}
+
+int kgem_mock_ioctl(int fd, unsigned long request, void *arg)
+{
+	struct mock_device *dev = lookup_device(fd);
+	int ret;
+
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+
+	ret = mock_ioctl(dev, request, arg);
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Route every ioctl (including those from libdrm) on a mock device to the
+ * emulation, and pass everything else through to the kernel.
+ */
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list va;
+	void *arg;
+
+	va_start(va, request);
+	arg = va_arg(va, void *);
+	va_end(va);
+
+	if (lookup_device(fd))
+		return kgem_mock_ioctl(fd, request, arg);
+
+	return syscall(SYS_ioctl, fd, request, arg);
+}
+
+void kgem_mock_default_params(struct kgem_mock_params *params, unsigned gen)
+{
+	memset(params, 0, sizeof(*params));
+
+	params->gen = gen;
+	params->has_llc = gen >= 060 && gen != 071;
+	params->has_wc_mmap = gen >= 040;
+	params->has_userptr = gen >= 040;
+	params->has_caching = gen >= 040;
+	params->has_no_reloc = true;
+	params->has_handle_lut = true;
+	params->has_softpin = gen >= 0100;
+	params->aperture_size = (uint64_t)2 << 30;
+
+	/* Rough costs as measured on a desktop HSW */
+	params->create_ns = 2000;
+	params->close_ns = 1000;
+	params->mmap_ns = 3000;
+	params->busy_ns = 300;
+	params->execbuf_ns = 10000;
+	params->execbuf_object_ns = 200;
+	params->execbuf_reloc_ns = 50;
+	params->batch_ns = 100000;
+}
+
+int kgem_mock_open(const struct kgem_mock_params *params)
+{
+	struct mock_device *dev;
+	FILE *file;
+	int n;
+
+	for (n = 0; n < MAX_DEVICES; n++)
+		if (devices[n] == NULL)
+			break;
+	if (n == MAX_DEVICES)
+		return -1;
+
+	dev = calloc(1, sizeof(*dev));
+	if (dev == NULL)
+		return -1;
+
+	/* An unlinked temporary file provides our "physical" memory */
+	file = tmpfile();
+	if (file == NULL) {
+		free(dev);
+		return -1;
+	}
+	dev->fd = dup(fileno(file));
+	fclose(file);
+	if (dev->fd < 0) {
+		free(dev);
+		return -1;
+	}
+
+	dev->params = *params;
+	pthread_mutex_init(&dev->mutex, NULL);
+
+	devices[n] = dev;
+	return dev->fd;
+}
+
+void kgem_mock_close(int fd)
+{
+	struct mock_device *dev = lookup_device(fd);
+	struct mock_range *r;
+	int n;
+
+	if (dev == NULL)
+		return;
+
+	for (n = 0; n < MAX_DEVICES; n++)
+		if (devices[n] == dev)
+			devices[n] = NULL;
+
+	for (n = 0; n <= MAX_FREE_PAGES; n++) {
+		while ((r = dev->free_pages[n])) {
+			dev->free_pages[n] = r->next;
+			free(r);
+		}
+	}
+
+	close(dev->fd);
+	pthread_mutex_destroy(&dev->mutex);
+	free(dev->free_handles);
+	free(dev->bo);
+	free(dev);
+}
+
+bool kgem_mock_is_device(int fd)
+{
+	return lookup_device(fd) != NULL;
+}
+
+void kgem_mock_get_stats(int fd, struct kgem_mock_stats *stats)
+{
+	struct mock_device *dev = lookup_device(fd);
+
+	if (dev == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	*stats = dev->stats;
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+void kgem_mock_reset_stats(int fd)
+{
+	struct mock_device *dev = lookup_device(fd);
+	uint64_t objects, bytes;
+
+	if (dev == NULL)
+		return;
+
+	/* Keep the current population, and restart the high water marks */
+	pthread_mutex_lock(&dev->mutex);
+	objects = dev->stats.live_objects;
+	bytes = dev->stats.live_bytes;
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	dev->stats.live_objects = dev->stats.max_live_objects = objects;
+	dev->stats.live_bytes = dev->stats.max_live_bytes = bytes;
+	pthread_mutex_unlock(&dev->mutex);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef KGEM_MOCK_H
+#define KGEM_MOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A userspace stand-in for an i915 device node.
+ *
+ * kgem_mock_open() returns a file descriptor that can be passed to
+ * kgem_init(). Every ioctl() upon that descriptor is intercepted and
+ * emulated: objects are backed by ranges of an anonymous file (so that
+ * both the CPU and GTT mmap paths work unmodified), execbuffer applies
+ * the relocations and the "GPU" retires each batch after a configurable
+ * delay. The CPU cost of each ioctl is emulated by spinning on the
+ * calling thread.
+ */
+
+struct kgem_mock_params {
+	unsigned gen;
+
+	bool has_llc;
+	bool has_wc_mmap;
+	bool has_userptr;
+	bool has_caching;
+	bool has_no_reloc;
+	bool has_handle_lut;
+	bool has_softpin;
+
+	uint64_t aperture_size;
+
+	/* CPU time spent inside the "kernel", in nanoseconds */
+	unsigned create_ns;
+	unsigned close_ns;
+	unsigned mmap_ns;
+	unsigned busy_ns;
+	unsigned execbuf_ns;
+	unsigned execbuf_object_ns;
+	unsigned execbuf_reloc_ns;
+
+	/* GPU time to execute each batch, in nanoseconds */
+	unsigned batch_ns;
+};
+
+struct kgem_mock_stats {
+	uint64_t create, close;
+	uint64_t mmap, mmap_gtt;
+	uint64_t pread, pwrite;
+	uint64_t set_domain, set_tiling;
+	uint64_t busy, wait, throttle;
+	uint64_t madvise;
+	uint64_t execbuf;
+	uint64_t other;
+
+	uint64_t exec_objects, exec_pinned;
+	uint64_t relocs, relocs_skipped;
+
+	uint64_t stall_ns; /* time spent waiting for the "GPU" */
+	uint64_t throttle_ns;
+
+	uint64_t live_objects, max_live_objects;
+	uint64_t live_bytes, max_live_bytes;
+};
+
+void kgem_mock_default_params(struct kgem_mock_params *params, unsigned gen);
+int kgem_mock_open(const struct kgem_mock_params *params);
+void kgem_mock_close(int fd);
+
+bool kgem_mock_is_device(int fd);
+int kgem_mock_ioctl(int fd, unsigned long request, void *arg);
+
+void kgem_mock_get_stats(int fd, struct kgem_mock_stats *stats);
+void kgem_mock_reset_stats(int fd);
+
+#endif /* KGEM_MOCK_H */
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Feed synthetic memory pressure events to kgem, upon the mock device,
+ * and check that each successive event releases more of the caches.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sna.h"
+
+#include "kgem-mock.h"
+
+#define NUM_BO 64
+#define NUM_SNOOP 4
+
+#define check(x) do { \
+	if (!(x)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+			__FILE__, __LINE__, #x); \
+		exit(1); \
+	} \
+} while (0)
+
+static void noop_reset(struct sna *sna)
+{
+	(void)sna;
+}
+
+static void noop_flush(struct sna *sna)
+{
+	(void)sna;
+}
+
+static int count_inactive(struct kgem *kgem, int *purged)
+{
+	struct kgem_bo *bo;
+	int n, count = 0;
+
+	*purged = 0;
+	for (n = 0; n < ARRAY_SIZE(kgem->inactive); n++) {
+		list_for_each_entry(bo, &kgem->inactive[n], list) {
+			*purged += bo->purged;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static void fill_caches(struct kgem *kgem)
+{
+	struct kgem_bo *bo[NUM_BO + NUM_SNOOP];
+	int n;
+
+	for (n = 0; n < NUM_BO; n++) {
+		bo[n] = kgem_create_linear(kgem, PAGE_SIZE << (n % 8), 0);
+		check(bo[n]);
+
+		switch (n % 3) {
+		case 0: check(kgem_bo_map__cpu(kgem, bo[n])); break;
+		case 1: check(kgem_bo_map__gtt(kgem, bo[n])); break;
+		}
+	}
+
+	/* Created before the above are released, so as not to reuse them */
+	for (n = 0; n < NUM_SNOOP; n++) {
+		bo[NUM_BO + n] = kgem_create_cpu_2d(kgem, 256, 256 << n, 32, 0);
+		check(bo[NUM_BO + n]);
+		check(bo[NUM_BO + n]->snoop);
+	}
+
+	for (n = 0; n < NUM_BO + NUM_SNOOP; n++)
+		kgem_bo_destroy(kgem, bo[n]);
+}
+
+int main(int argc, char **argv)
+{
+	struct kgem_mock_params params;
+	struct kgem_mock_stats stats;
+	struct sna *sna;
+	struct kgem *kgem;
+	ScrnInfoRec scrn;
+	int fd, count, purged;
+
+	(void)argc;
+	(void)argv;
+
+	/* Without LLC, so that CPU buffers are kept in the snoop cache */
+	kgem_mock_default_params(&params, 075);
+	params.has_llc = false;
+	params.has_caching = true;
+
+	fd = kgem_mock_open(&params);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create the mock device\n");
+		return 77;
+	}
+
+	sna = calloc(1, sizeof(*sna));
+	if (sna == NULL)
+		return 77;
+
+	memset(&scrn, 0, sizeof(scrn));
+	sna->scrn = &scrn;
+	sna->cpu_features = sna_cpu_detect();
+	sna->render.reset = noop_reset;
+	sna->render.flush = noop_flush;
+
+	kgem = &sna->kgem;
+	kgem_init(kgem, fd, NULL, params.gen);
+	if (kgem->wedged) {
+		fprintf(stderr, "kgem failed to initialise upon the mock device\n");
+		return 77;
+	}
+	kgem_reset(kgem);
+
+	fill_caches(kgem);
+	check(count_inactive(kgem, &purged) == NUM_BO);
+	check(purged == 0);
+	check(!list_is_empty(&kgem->snoop));
+	check(!list_is_empty(&kgem->vma_lru));
+	check(kgem->vma_stats.cached > 0);
+
+	/* 1. Idle mappings are discarded, buffers marked purgeable */
+	kgem_mock_reset_stats(fd);
+	check(kgem_memory_pressure(kgem) == 1);
+	kgem_mock_get_stats(fd, &stats);
+	check(list_is_empty(&kgem->vma_lru));
+	check(kgem->vma_stats.cached == 0);
+	check(count_inactive(kgem, &purged) == NUM_BO);
+	check(purged == NUM_BO);
+	check(stats.madvise == NUM_BO);
+	check(!list_is_empty(&kgem->snoop));
+	check(kgem->pressure.stats.purgeable > 0);
+
+	/* 2. The snoop cache is released */
+	check(kgem_memory_pressure(kgem) == 2);
+	check(list_is_empty(&kgem->snoop));
+	check(count_inactive(kgem, &purged) == NUM_BO);
+
+	/* 3. Everything is released */
+	kgem_mock_reset_stats(fd);
+	check(kgem_memory_pressure(kgem) == KGEM_PRESSURE_MAX);
+	kgem_mock_get_stats(fd, &stats);
+	check(count_inactive(kgem, &purged) == 0);
+	check(stats.close == NUM_BO);
+	check(kgem_memory_pressure(kgem) == KGEM_PRESSURE_MAX);
+
+	/* Once the pressure subsides, we start again from the beginning */
+	fill_caches(kgem);
+	kgem->pressure.last -= 2*MAX_INACTIVE_TIME;
+	check(kgem_memory_pressure(kgem) == 1);
+	check(!list_is_empty(&kgem->snoop));
+	check(count_inactive(kgem, &purged) == NUM_BO);
+	check(purged == NUM_BO);
+
+	check(kgem->pressure.stats.events == 5);
+	check(kgem->pressure.stats.max_level == KGEM_PRESSURE_MAX);
+	check(kgem->pressure.stats.released > 0);
+
+	kgem_cleanup_cache(kgem);
+	kgem_mock_close(fd);
+	free(sna);
+
+	return 0;
+}
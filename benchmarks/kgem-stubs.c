@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* The few corners of the driver that kgem reaches into, shared by the
+ * programs that drive kgem without an X server.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sna.h"
+
+jmp_buf sigjmp[4];
+volatile sig_atomic_t sigtrap;
+
+void ErrorF(const char *f, ...)
+{
+	va_list va;
+
+	va_start(va, f);
+	vfprintf(stderr, f, va);
+	va_end(va);
+}
+
+void FatalError(const char *f, ...)
+{
+	va_list va;
+
+	va_start(va, f);
+	vfprintf(stderr, f, va);
+	va_end(va);
+
+	abort();
+}
+
+void xf86DrvMsg(int scrnIndex, MessageType type, const char *f, ...)
+{
+	va_list va;
+
+	(void)scrnIndex;
+	(void)type;
+
+	va_start(va, f);
+	vfprintf(stderr, f, va);
+	va_end(va);
+}
+
+bool sna_mode_disable(struct sna *sna)
+{
+	(void)sna;
+	return false;
+}
+
+void sna_mode_enable(struct sna *sna)
+{
+	(void)sna;
+}
+
+void sna_render_flush_solid(struct sna *sna)
+{
+	sna->render.solid_cache.dirty = 0;
+}
+
+void sna_render_mark_wedged(struct sna *sna)
+{
+	(void)sna;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Time the upload kernels with regular and with non-temporal stores over
+ * a range of upload sizes, to find where streaming starts to pay off on
+ * this machine. The destination is ordinary cacheable memory, as for an
+ * upload through a CPU mapping on LLC; for WC the crossover is lower.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "sna.h"
+
+#define WIDTH 1024 /* pixels, at 32bpp so a 4KiB pitch */
+#define PITCH (4 * WIDTH)
+#define MIN_SIZE (16 << 10)
+#define MAX_SIZE (128 << 20)
+
+enum kernel {
+	LINEAR,
+	LINEAR_NT,
+	TILED_X,
+	TILED_X_NT,
+	NUM_KERNELS
+};
+
+static const char *kernel_names[] = {
+	[LINEAR] = "linear",
+	[LINEAR_NT] = "linear-nt",
+	[TILED_X] = "tiled-x",
+	[TILED_X_NT] = "tiled-x-nt",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static memcpy_box_func kernel_func(struct kgem *kgem, enum kernel k)
+{
+	switch (k) {
+	case LINEAR: return memcpy_blt;
+	case LINEAR_NT: return kgem->memcpy_nt;
+	case TILED_X: return kgem->memcpy_to_tiled_x;
+	case TILED_X_NT: return kgem->memcpy_to_tiled_x__nt;
+	default: return NULL;
+	}
+}
+
+/* Returns the throughput in MiB/s of uploading height rows */
+static double measure(memcpy_box_func func,
+		      const void *src, void *dst, int height)
+{
+	uint64_t start, elapsed, bytes;
+	int loops, n;
+
+	/* Warm up, and so leave the destination in cache if it fits */
+	func(src, dst, 32, PITCH, PITCH, 0, 0, 0, 0, WIDTH, height);
+
+	loops = 1;
+	do {
+		start = now_ns();
+		for (n = 0; n < loops; n++)
+			func(src, dst, 32, PITCH, PITCH, 0, 0, 0, 0, WIDTH, height);
+		elapsed = now_ns() - start;
+		loops *= 2;
+	} while (elapsed < 50000000);
+
+	bytes = (uint64_t)(loops / 2) * height * PITCH;
+	return bytes / (elapsed * 1e-9) / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+	struct kgem kgem;
+	unsigned cpu = sna_cpu_detect();
+	uint32_t crossover[NUM_KERNELS] = { 0 };
+	void *src, *dst;
+	uint32_t size;
+	enum kernel k;
+
+	(void)argc;
+	(void)argv;
+
+	memset(&kgem, 0, sizeof(kgem));
+	kgem.gen = 0100;
+	choose_memcpy_tiled_x(&kgem, I915_BIT_6_SWIZZLE_NONE, cpu);
+	choose_memcpy_nt(&kgem, cpu);
+
+	if (kgem.memcpy_nt == memcpy_blt || kgem.memcpy_to_tiled_x__nt == NULL) {
+		fprintf(stderr, "No streaming store kernels for this cpu\n");
+		return 77;
+	}
+
+	if (posix_memalign(&src, 4096, MAX_SIZE) ||
+	    posix_memalign(&dst, 4096, MAX_SIZE))
+		return 1;
+
+	memset(src, 0x5a, MAX_SIZE);
+	memset(dst, 0, MAX_SIZE);
+
+	printf("%10s", "size");
+	for (k = 0; k < NUM_KERNELS; k++)
+		printf(" %12s", kernel_names[k]);
+	printf("  (MiB/s)\n");
+
+	for (size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+		double rate[NUM_KERNELS];
+
+		for (k = 0; k < NUM_KERNELS; k++)
+			rate[k] = measure(kernel_func(&kgem, k),
+					  src, dst, size / PITCH);
+
+		printf("%8dKiB", size >> 10);
+		for (k = 0; k < NUM_KERNELS; k++)
+			printf(" %12.0f", rate[k]);
+		printf("\n");
+
+		if (rate[LINEAR_NT] > rate[LINEAR]) {
+			if (!crossover[LINEAR_NT])
+				crossover[LINEAR_NT] = size;
+		} else
+			crossover[LINEAR_NT] = 0;
+
+		if (rate[TILED_X_NT] > rate[TILED_X]) {
+			if (!crossover[TILED_X_NT])
+				crossover[TILED_X_NT] = size;
+		} else
+			crossover[TILED_X_NT] = 0;
+	}
+
+	for (k = LINEAR_NT; k < NUM_KERNELS; k += 2) {
+		if (crossover[k])
+			printf("%s faster from %dKiB\n",
+			       kernel_names[k], crossover[k] >> 10);
+		else
+			printf("%s never faster\n", kernel_names[k]);
+	}
+
+	free(src);
+	free(dst);
+	return 0;
+}
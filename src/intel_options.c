@@ -35,6 +35,14 @@ const OptionInfoRec intel_options[] = {
 	{OPTION_VIRTUAL,	"VirtualHeads",	OPTV_INTEGER,	{0},	0},
 	{OPTION_TEAR_FREE,	"TearFree",	OPTV_BOOLEAN,	{0},	0},
 	{OPTION_CRTC_PIXMAPS,	"PerCrtcPixmaps", OPTV_BOOLEAN,	{0},	0},
+	{OPTION_ASYNC_SUBMIT,	"AsyncSubmit",	OPTV_BOOLEAN,	{0},	0},
+	{OPTION_BATCH_TRACE,	"BatchTrace",	OPTV_STRING,	{0},	0},
+	{OPTION_SOFTPIN,	"Softpin",	OPTV_BOOLEAN,	{0},	0},
+	{OPTION_VMA_CACHE,	"VMACacheSize",	OPTV_INTEGER,	{0},	0},
+	{OPTION_MEMORY_PRESSURE,	"MemoryPressure",	OPTV_BOOLEAN,	{0},	0},
+	{OPTION_THREADS,	"Threads",	OPTV_INTEGER,	{0},	0},
+	{OPTION_THREAD_AFFINITY,	"ThreadAffinity",	OPTV_STRING,	{0},	0},
+	{OPTION_THREAD_STATS,	"ThreadStats",	OPTV_BOOLEAN,	{0},	0},
 #endif
 #ifdef USE_UXA
 	{OPTION_FALLBACKDEBUG,	"FallbackDebug",OPTV_BOOLEAN,	{0},	0},
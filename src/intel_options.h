@@ -39,6 +39,14 @@ enum intel_options {
 	OPTION_VIRTUAL,
 	OPTION_TEAR_FREE,
 	OPTION_CRTC_PIXMAPS,
+	OPTION_ASYNC_SUBMIT,
+	OPTION_BATCH_TRACE,
+	OPTION_SOFTPIN,
+	OPTION_VMA_CACHE,
+	OPTION_MEMORY_PRESSURE,
+	OPTION_THREADS,
+	OPTION_THREAD_AFFINITY,
+	OPTION_THREAD_STATS,
 #endif
 #ifdef USE_UXA
 	OPTION_FALLBACKDEBUG,
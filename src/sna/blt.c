@@ -634,6 +634,842 @@ memcpy_between_tiled_x__swizzle_0__sse2(const void *src, void *dst, int bpp,
 #pragma GCC push_options
 #endif
 
+/* The X-tiling swizzles only ever flip bit 6 of the address, according
+ * to the parity of some of bits 9-11. As the pitch of an X-tiled surface
+ * is a multiple of the tile width, those bits are fixed by the row within
+ * the tile. So each 64 byte chunk moves as a whole, and along a row
+ * either every pair of chunks is swapped or none are. This lets us copy
+ * whole chunks using the widest vectors for every swizzling mode.
+ */
+#define SWIZZLE_0 0
+#define SWIZZLE_9 (1 << 9)
+#define SWIZZLE_9_10 (1 << 9 | 1 << 10)
+#define SWIZZLE_9_11 (1 << 9 | 1 << 11)
+#define SWIZZLE_9_10_11 (1 << 9 | 1 << 10 | 1 << 11)
+
+static force_inline unsigned
+swizzle_flip(uint32_t row, unsigned swizzle)
+{
+	return __builtin_parity(row & swizzle) << 6;
+}
+
+#if defined(avx2) && HAS_GCC(4, 9)
+#include <immintrin.h>
+
+avx2 static force_inline void
+to_avx2_64(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm0, ymm1;
+
+	ymm0 = _mm256_loadu_si256((const __m256i *)src + 0);
+	ymm1 = _mm256_loadu_si256((const __m256i *)src + 1);
+
+	_mm256_store_si256((__m256i *)dst + 0, ymm0);
+	_mm256_store_si256((__m256i *)dst + 1, ymm1);
+}
+
+avx2 static force_inline void
+from_avx2_64(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm0, ymm1;
+
+	ymm0 = _mm256_load_si256((const __m256i *)src + 0);
+	ymm1 = _mm256_load_si256((const __m256i *)src + 1);
+
+	_mm256_storeu_si256((__m256i *)dst + 0, ymm0);
+	_mm256_storeu_si256((__m256i *)dst + 1, ymm1);
+}
+
+avx2 static force_inline void
+between_avx2_64(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm0, ymm1;
+
+	ymm0 = _mm256_load_si256((const __m256i *)src + 0);
+	ymm1 = _mm256_load_si256((const __m256i *)src + 1);
+
+	_mm256_store_si256((__m256i *)dst + 0, ymm0);
+	_mm256_store_si256((__m256i *)dst + 1, ymm1);
+}
+
+#if defined(avx512)
+avx512 static force_inline void
+to_avx512_64(uint8_t *dst, const uint8_t *src)
+{
+	_mm512_store_si512((void *)dst,
+			   _mm512_loadu_si512((const void *)src));
+}
+
+avx512 static force_inline void
+from_avx512_64(uint8_t *dst, const uint8_t *src)
+{
+	_mm512_storeu_si512((void *)dst,
+			    _mm512_load_si512((const void *)src));
+}
+
+avx512 static force_inline void
+between_avx512_64(uint8_t *dst, const uint8_t *src)
+{
+	_mm512_store_si512((void *)dst,
+			   _mm512_load_si512((const void *)src));
+}
+#endif
+
+/* Copy len bytes between a linear row and a tile row, starting x bytes
+ * into the tile row, flipping bit 6 of the tile offset.
+ */
+#define tiled_x_span(isa) \
+isa static force_inline void \
+to_tiled_x_span__##isa(uint8_t *tile, unsigned x, \
+		       const uint8_t *src, unsigned len, \
+		       unsigned flip) \
+{ \
+	if (x & 63) { \
+		unsigned n = min(64 - (x & 63), len); \
+		memcpy(tile + (x ^ flip), src, n); \
+		x += n; src += n; len -= n; \
+	} \
+	while (len >= 64) { \
+		to_##isa##_64(assume_aligned(tile + (x ^ flip), 64), src); \
+		x += 64; src += 64; len -= 64; \
+	} \
+	if (len) \
+		memcpy(assume_aligned(tile + (x ^ flip), 64), src, len); \
+} \
+isa static force_inline void \
+from_tiled_x_span__##isa(uint8_t *dst, const uint8_t *tile, \
+			 unsigned x, unsigned len, \
+			 unsigned flip) \
+{ \
+	if (x & 63) { \
+		unsigned n = min(64 - (x & 63), len); \
+		memcpy(dst, tile + (x ^ flip), n); \
+		x += n; dst += n; len -= n; \
+	} \
+	while (len >= 64) { \
+		from_##isa##_64(dst, assume_aligned(tile + (x ^ flip), 64)); \
+		x += 64; dst += 64; len -= 64; \
+	} \
+	if (len) \
+		memcpy(dst, assume_aligned(tile + (x ^ flip), 64), len); \
+} \
+isa static force_inline void \
+between_tiled_x_span__##isa(uint8_t *dst, unsigned dst_flip, \
+			    const uint8_t *src, unsigned src_flip, \
+			    unsigned x, unsigned len) \
+{ \
+	if (x & 63) { \
+		unsigned n = min(64 - (x & 63), len); \
+		memcpy(dst + (x ^ dst_flip), src + (x ^ src_flip), n); \
+		x += n; len -= n; \
+	} \
+	while (len >= 64) { \
+		between_##isa##_64(assume_aligned(dst + (x ^ dst_flip), 64), \
+				   assume_aligned(src + (x ^ src_flip), 64)); \
+		x += 64; len -= 64; \
+	} \
+	if (len) \
+		memcpy(assume_aligned(dst + (x ^ dst_flip), 64), \
+		       assume_aligned(src + (x ^ src_flip), 64), \
+		       len); \
+}
+
+#define tiled_x_simd(isa, name, swizzle) \
+isa static void \
+memcpy_to_tiled_x__##name##__##isa(const void *src, void *dst, int bpp, \
+				      int32_t src_stride, int32_t dst_stride, \
+				      int16_t src_x, int16_t src_y, \
+				      int16_t dst_x, int16_t dst_y, \
+				      uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 512; \
+	const unsigned tile_height = 8; \
+	const unsigned tile_size = 4096; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned tile_pixels = tile_width / cpp; \
+	const unsigned tile_shift = ffs(tile_pixels) - 1; \
+	const unsigned tile_mask = tile_pixels - 1; \
+	const unsigned offset_x = (dst_x & tile_mask) * cpp; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	assert((dst_stride & (tile_width - 1)) == 0); \
+	src = (const uint8_t *)src + src_y * src_stride + src_x * cpp; \
+	dst = (uint8_t *)dst + (dst_x >> tile_shift) * tile_size; \
+	width *= cpp; \
+	assert(src_stride >= width); \
+	while (height--) { \
+		const uint8_t *src_row = src; \
+		const unsigned row = (dst_y & (tile_height-1)) * tile_width; \
+		const unsigned flip = swizzle_flip(row, swizzle); \
+		uint8_t *tile_row = dst; \
+		unsigned x = offset_x, w = width; \
+		tile_row += dst_y / tile_height * dst_stride * tile_height + row; \
+		do { \
+			unsigned len = min(tile_width - x, w); \
+			to_tiled_x_span__##isa(tile_row, x, src_row, len, flip); \
+			tile_row += tile_size; \
+			src_row += len; \
+			w -= len; \
+			x = 0; \
+		} while (w); \
+		src = (const uint8_t *)src + src_stride; \
+		dst_y++; \
+	} \
+} \
+isa static void \
+memcpy_from_tiled_x__##name##__##isa(const void *src, void *dst, int bpp, \
+					int32_t src_stride, int32_t dst_stride, \
+					int16_t src_x, int16_t src_y, \
+					int16_t dst_x, int16_t dst_y, \
+					uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 512; \
+	const unsigned tile_height = 8; \
+	const unsigned tile_size = 4096; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned tile_pixels = tile_width / cpp; \
+	const unsigned tile_shift = ffs(tile_pixels) - 1; \
+	const unsigned tile_mask = tile_pixels - 1; \
+	const unsigned offset_x = (src_x & tile_mask) * cpp; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	assert((src_stride & (tile_width - 1)) == 0); \
+	dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp; \
+	src = (const uint8_t *)src + (src_x >> tile_shift) * tile_size; \
+	width *= cpp; \
+	assert(dst_stride >= width); \
+	while (height--) { \
+		uint8_t *dst_row = dst; \
+		const unsigned row = (src_y & (tile_height-1)) * tile_width; \
+		const unsigned flip = swizzle_flip(row, swizzle); \
+		const uint8_t *tile_row = src; \
+		unsigned x = offset_x, w = width; \
+		tile_row += src_y / tile_height * src_stride * tile_height + row; \
+		do { \
+			unsigned len = min(tile_width - x, w); \
+			from_tiled_x_span__##isa(dst_row, tile_row, x, len, flip); \
+			tile_row += tile_size; \
+			dst_row += len; \
+			w -= len; \
+			x = 0; \
+		} while (w); \
+		dst = (uint8_t *)dst + dst_stride; \
+		src_y++; \
+	} \
+} \
+isa static void \
+memcpy_between_tiled_x__##name##__##isa(const void *src, void *dst, int bpp, \
+					   int32_t src_stride, int32_t dst_stride, \
+					   int16_t src_x, int16_t src_y, \
+					   int16_t dst_x, int16_t dst_y, \
+					   uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 512; \
+	const unsigned tile_height = 8; \
+	const unsigned tile_size = 4096; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned tile_pixels = tile_width / cpp; \
+	const unsigned tile_shift = ffs(tile_pixels) - 1; \
+	const unsigned tile_mask = tile_pixels - 1; \
+	const unsigned offset_x = (dst_x & tile_mask) * cpp; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	assert((dst_x & tile_mask) == (src_x & tile_mask)); \
+	assert((src_stride & (tile_width - 1)) == 0); \
+	assert((dst_stride & (tile_width - 1)) == 0); \
+	dst = (uint8_t *)dst + (dst_x >> tile_shift) * tile_size; \
+	src = (const uint8_t *)src + (src_x >> tile_shift) * tile_size; \
+	width *= cpp; \
+	while (height--) { \
+		const unsigned dst_row = (dst_y & (tile_height-1)) * tile_width; \
+		const unsigned src_row = (src_y & (tile_height-1)) * tile_width; \
+		const unsigned dst_flip = swizzle_flip(dst_row, swizzle); \
+		const unsigned src_flip = swizzle_flip(src_row, swizzle); \
+		uint8_t *dst_tile = dst; \
+		const uint8_t *src_tile = src; \
+		unsigned x = offset_x, w = width; \
+		dst_tile += dst_y / tile_height * dst_stride * tile_height + dst_row; \
+		src_tile += src_y / tile_height * src_stride * tile_height + src_row; \
+		do { \
+			unsigned len = min(tile_width - x, w); \
+			between_tiled_x_span__##isa(dst_tile, dst_flip, \
+						    src_tile, src_flip, \
+						    x, len); \
+			dst_tile += tile_size; \
+			src_tile += tile_size; \
+			w -= len; \
+			x = 0; \
+		} while (w); \
+		dst_y++; \
+		src_y++; \
+	} \
+}
+
+tiled_x_span(avx2)
+tiled_x_simd(avx2, swizzle_0, SWIZZLE_0)
+tiled_x_simd(avx2, swizzle_9, SWIZZLE_9)
+tiled_x_simd(avx2, swizzle_9_10, SWIZZLE_9_10)
+tiled_x_simd(avx2, swizzle_9_11, SWIZZLE_9_11)
+tiled_x_simd(avx2, swizzle_9_10_11, SWIZZLE_9_10_11)
+
+#if defined(avx512)
+tiled_x_span(avx512)
+tiled_x_simd(avx512, swizzle_0, SWIZZLE_0)
+tiled_x_simd(avx512, swizzle_9, SWIZZLE_9)
+tiled_x_simd(avx512, swizzle_9_10, SWIZZLE_9_10)
+tiled_x_simd(avx512, swizzle_9_11, SWIZZLE_9_11)
+tiled_x_simd(avx512, swizzle_9_10_11, SWIZZLE_9_10_11)
+#endif
+
+#define __choose_tiled_x_simd(kgem, isa, name) do { \
+	DBG(("%s: using %s\n", __FUNCTION__, #isa)); \
+	(kgem)->memcpy_to_tiled_x = memcpy_to_tiled_x__##name##__##isa; \
+	(kgem)->memcpy_from_tiled_x = memcpy_from_tiled_x__##name##__##isa; \
+	(kgem)->memcpy_between_tiled_x = memcpy_between_tiled_x__##name##__##isa; \
+} while (0)
+
+#if defined(avx512)
+#define choose_tiled_x_avx512(kgem, cpu, name) \
+	if ((cpu) & AVX512F) { \
+		__choose_tiled_x_simd(kgem, avx512, name); \
+		break; \
+	}
+#else
+#define choose_tiled_x_avx512(kgem, cpu, name)
+#endif
+
+/* Picks the widest kernel the cpu supports, and leaves the switch */
+#define choose_tiled_x_simd(kgem, cpu, name) \
+	choose_tiled_x_avx512(kgem, cpu, name) \
+	if ((cpu) & AVX2) { \
+		__choose_tiled_x_simd(kgem, avx2, name); \
+		break; \
+	}
+#else
+#define choose_tiled_x_simd(kgem, cpu, name)
+#endif
+
+#if defined(sse4_1) && HAS_GCC(4, 9)
+#include <smmintrin.h>
+
+/* Reads from WC (and GTT) mappings are uncached, and plain loads fetch
+ * them a few bytes at a time. MOVNTDQA instead pulls in a whole line
+ * through the streaming load buffers, but only if the line is consumed
+ * without interleaving other memory traffic. So we stream each span into
+ * a small cached bounce buffer first, and then copy it out from there.
+ */
+#define WC_BOUNCE 4096
+
+sse4_1 static force_inline void
+stream_load_64(uint8_t *dst, const uint8_t *src)
+{
+	__m128i xmm1, xmm2, xmm3, xmm4;
+
+	xmm1 = _mm_stream_load_si128((__m128i *)src + 0);
+	xmm2 = _mm_stream_load_si128((__m128i *)src + 1);
+	xmm3 = _mm_stream_load_si128((__m128i *)src + 2);
+	xmm4 = _mm_stream_load_si128((__m128i *)src + 3);
+
+	_mm_store_si128((__m128i *)dst + 0, xmm1);
+	_mm_store_si128((__m128i *)dst + 1, xmm2);
+	_mm_store_si128((__m128i *)dst + 2, xmm3);
+	_mm_store_si128((__m128i *)dst + 3, xmm4);
+}
+
+sse4_1 static force_inline void
+stream_load(uint8_t *dst, const uint8_t *src, unsigned len)
+{
+	assert(((uintptr_t)dst & 15) == 0);
+	assert(((uintptr_t)src & 15) == 0);
+	assert((len & 15) == 0);
+
+	while (len >= 64) {
+		stream_load_64(dst, src);
+		dst += 64;
+		src += 64;
+		len -= 64;
+	}
+
+	while (len) {
+		_mm_store_si128((__m128i *)dst,
+				_mm_stream_load_si128((__m128i *)src));
+		dst += 16;
+		src += 16;
+		len -= 16;
+	}
+}
+
+sse4_1 static void
+memcpy_from_wc__sse4_1(const void *src, void *dst, int bpp,
+		       int32_t src_stride, int32_t dst_stride,
+		       int16_t src_x, int16_t src_y,
+		       int16_t dst_x, int16_t dst_y,
+		       uint16_t width, uint16_t height)
+{
+	uint8_t bounce[WC_BOUNCE] __attribute__((aligned(64)));
+	const unsigned cpp = bpp / 8;
+
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+	assert(src != dst);
+
+	/* Rounding each span out to whole OWords must stay within the row */
+	if (((uintptr_t)src | src_stride) & 15) {
+		memcpy_blt(src, dst, bpp,
+			   src_stride, dst_stride,
+			   src_x, src_y,
+			   dst_x, dst_y,
+			   width, height);
+		return;
+	}
+
+	src = (const uint8_t *)src + src_y * src_stride + src_x * cpp;
+	dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp;
+	width *= cpp;
+
+	while (height--) {
+		const uint8_t *src_row = src;
+		uint8_t *dst_row = dst;
+		unsigned w = width;
+
+		do {
+			unsigned offset = (uintptr_t)src_row & 15;
+			unsigned len = min(w, WC_BOUNCE - offset);
+
+			stream_load(bounce, src_row - offset, ALIGN(offset + len, 16));
+			memcpy(dst_row, bounce + offset, len);
+
+			src_row += len;
+			dst_row += len;
+			w -= len;
+		} while (w);
+
+		src = (const uint8_t *)src + src_stride;
+		dst = (uint8_t *)dst + dst_stride;
+	}
+}
+
+/* Detile directly from a WC mapping of the X-tiled surface, rather than
+ * going through a fenced GTT mapping. Each span within a tile row is
+ * streamed into the bounce buffer rounded out to 128 bytes, so that both
+ * halves of any swizzled pair of chunks are present.
+ */
+sse4_1 static force_inline void
+from_tiled_x__wc(const void *src, void *dst, int bpp,
+		 int32_t src_stride, int32_t dst_stride,
+		 int16_t src_x, int16_t src_y,
+		 int16_t dst_x, int16_t dst_y,
+		 uint16_t width, uint16_t height,
+		 unsigned swizzle)
+{
+	const unsigned tile_width = 512;
+	const unsigned tile_height = 8;
+	const unsigned tile_size = 4096;
+	uint8_t bounce[512] __attribute__((aligned(64)));
+	const unsigned cpp = bpp / 8;
+	const uint32_t x1 = src_x * cpp, x2 = x1 + width * cpp;
+
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n",
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride));
+	assert(src != dst);
+	assert((src_stride & (tile_width - 1)) == 0);
+
+	dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp;
+	while (height--) {
+		const unsigned row = (src_y & (tile_height-1)) * tile_width;
+		const unsigned flip = swizzle_flip(row, swizzle);
+		const uint8_t *tile_row = src;
+		uint8_t *dst_row = dst;
+		uint32_t x = x1;
+
+		tile_row += src_y / tile_height * src_stride * tile_height + row;
+		do {
+			const uint8_t *tile = tile_row + x / tile_width * tile_size;
+			const uint32_t start = x & (tile_width - 1);
+			const uint32_t end = min(start + x2 - x, tile_width);
+			const uint32_t first = start & ~127;
+
+			stream_load(bounce + first, tile + first,
+				    ALIGN(end, 128) - first);
+			if (flip == 0) {
+				memcpy(dst_row, bounce + start, end - start);
+			} else {
+				uint32_t o = start;
+				do {
+					uint32_t len = min(ALIGN(o + 1, 64), end) - o;
+					memcpy(dst_row + o - start, bounce + (o ^ flip), len);
+					o += len;
+				} while (o < end);
+			}
+
+			dst_row += end - start;
+			x += end - start;
+		} while (x < x2);
+
+		dst = (uint8_t *)dst + dst_stride;
+		src_y++;
+	}
+}
+
+#define from_tiled_x_wc(name, swizzle) \
+sse4_1 static void \
+memcpy_from_tiled_x__##name##__wc(const void *src, void *dst, int bpp, \
+				  int32_t src_stride, int32_t dst_stride, \
+				  int16_t src_x, int16_t src_y, \
+				  int16_t dst_x, int16_t dst_y, \
+				  uint16_t width, uint16_t height) \
+{ \
+	from_tiled_x__wc(src, dst, bpp, src_stride, dst_stride, \
+			 src_x, src_y, dst_x, dst_y, width, height, \
+			 swizzle); \
+}
+
+from_tiled_x_wc(swizzle_0, SWIZZLE_0)
+from_tiled_x_wc(swizzle_9, SWIZZLE_9)
+from_tiled_x_wc(swizzle_9_10, SWIZZLE_9_10)
+from_tiled_x_wc(swizzle_9_11, SWIZZLE_9_11)
+from_tiled_x_wc(swizzle_9_10_11, SWIZZLE_9_10_11)
+
+#define choose_tiled_x_wc(kgem, cpu, name) \
+	if ((cpu) & SSE4_1) \
+		(kgem)->memcpy_from_tiled_x__wc = memcpy_from_tiled_x__##name##__wc
+#else
+#define choose_tiled_x_wc(kgem, cpu, name)
+#endif
+
+#if defined(avx2) && HAS_GCC(4, 9)
+/* Large uploads are written with non-temporal stores. Into a cacheable
+ * (LLC) mapping this avoids reading in every destination line only to
+ * evict the working set, and into a WC mapping it ensures that we only
+ * ever emit whole lines from the write-combining buffers. For small
+ * uploads the regular stores are better, as the destination is then
+ * likely to be found in the cache on the next access.
+ */
+sse2 static force_inline void
+stream_64__sse2(uint8_t *dst, const uint8_t *src)
+{
+	__m128i xmm1, xmm2, xmm3, xmm4;
+
+	xmm1 = _mm_loadu_si128((const __m128i *)src + 0);
+	xmm2 = _mm_loadu_si128((const __m128i *)src + 1);
+	xmm3 = _mm_loadu_si128((const __m128i *)src + 2);
+	xmm4 = _mm_loadu_si128((const __m128i *)src + 3);
+
+	_mm_stream_si128((__m128i *)dst + 0, xmm1);
+	_mm_stream_si128((__m128i *)dst + 1, xmm2);
+	_mm_stream_si128((__m128i *)dst + 2, xmm3);
+	_mm_stream_si128((__m128i *)dst + 3, xmm4);
+}
+
+avx2 static force_inline void
+stream_64__avx2(uint8_t *dst, const uint8_t *src)
+{
+	__m256i ymm0, ymm1;
+
+	ymm0 = _mm256_loadu_si256((const __m256i *)src + 0);
+	ymm1 = _mm256_loadu_si256((const __m256i *)src + 1);
+
+	_mm256_stream_si256((__m256i *)dst + 0, ymm0);
+	_mm256_stream_si256((__m256i *)dst + 1, ymm1);
+}
+
+#define memcpy_nt(isa) \
+isa static void \
+memcpy_nt__##isa(const void *src, void *dst, int bpp, \
+		 int32_t src_stride, int32_t dst_stride, \
+		 int16_t src_x, int16_t src_y, \
+		 int16_t dst_x, int16_t dst_y, \
+		 uint16_t width, uint16_t height) \
+{ \
+	const unsigned cpp = bpp / 8; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	src = (const uint8_t *)src + src_y * src_stride + src_x * cpp; \
+	dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp; \
+	width *= cpp; \
+	while (height--) { \
+		const uint8_t *src_row = src; \
+		uint8_t *dst_row = dst; \
+		unsigned w = width; \
+		if ((uintptr_t)dst_row & 63) { \
+			unsigned n = min(64 - ((uintptr_t)dst_row & 63), w); \
+			memcpy(dst_row, src_row, n); \
+			dst_row += n; src_row += n; w -= n; \
+		} \
+		while (w >= 64) { \
+			stream_64__##isa(assume_aligned(dst_row, 64), src_row); \
+			dst_row += 64; src_row += 64; w -= 64; \
+		} \
+		if (w) \
+			memcpy(dst_row, src_row, w); \
+		src = (const uint8_t *)src + src_stride; \
+		dst = (uint8_t *)dst + dst_stride; \
+	} \
+	_mm_sfence(); \
+}
+
+#define to_tiled_x_nt(isa, name, swizzle) \
+isa static void \
+memcpy_to_tiled_x__##name##__##isa##_nt(const void *src, void *dst, int bpp, \
+					  int32_t src_stride, int32_t dst_stride, \
+					  int16_t src_x, int16_t src_y, \
+					  int16_t dst_x, int16_t dst_y, \
+					  uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 512; \
+	const unsigned tile_height = 8; \
+	const unsigned tile_size = 4096; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned tile_pixels = tile_width / cpp; \
+	const unsigned tile_shift = ffs(tile_pixels) - 1; \
+	const unsigned tile_mask = tile_pixels - 1; \
+	const unsigned offset_x = (dst_x & tile_mask) * cpp; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	assert((dst_stride & (tile_width - 1)) == 0); \
+	src = (const uint8_t *)src + src_y * src_stride + src_x * cpp; \
+	dst = (uint8_t *)dst + (dst_x >> tile_shift) * tile_size; \
+	width *= cpp; \
+	while (height--) { \
+		const uint8_t *src_row = src; \
+		const unsigned row = (dst_y & (tile_height-1)) * tile_width; \
+		const unsigned flip = swizzle_flip(row, swizzle); \
+		uint8_t *tile_row = dst; \
+		unsigned x = offset_x, w = width; \
+		tile_row += dst_y / tile_height * dst_stride * tile_height + row; \
+		do { \
+			unsigned len = min(tile_width - x, w); \
+			w -= len; \
+			if (x & 63) { \
+				unsigned n = min(64 - (x & 63), len); \
+				memcpy(tile_row + (x ^ flip), src_row, n); \
+				x += n; src_row += n; len -= n; \
+			} \
+			while (len >= 64) { \
+				stream_64__##isa(assume_aligned(tile_row + (x ^ flip), 64), src_row); \
+				x += 64; src_row += 64; len -= 64; \
+			} \
+			if (len) { \
+				memcpy(assume_aligned(tile_row + (x ^ flip), 64), src_row, len); \
+				src_row += len; \
+			} \
+			tile_row += tile_size; \
+			x = 0; \
+		} while (w); \
+		src = (const uint8_t *)src + src_stride; \
+		dst_y++; \
+	} \
+	_mm_sfence(); \
+}
+
+memcpy_nt(sse2)
+memcpy_nt(avx2)
+
+to_tiled_x_nt(sse2, swizzle_0, SWIZZLE_0)
+to_tiled_x_nt(sse2, swizzle_9, SWIZZLE_9)
+to_tiled_x_nt(sse2, swizzle_9_10, SWIZZLE_9_10)
+to_tiled_x_nt(sse2, swizzle_9_11, SWIZZLE_9_11)
+to_tiled_x_nt(sse2, swizzle_9_10_11, SWIZZLE_9_10_11)
+
+to_tiled_x_nt(avx2, swizzle_0, SWIZZLE_0)
+to_tiled_x_nt(avx2, swizzle_9, SWIZZLE_9)
+to_tiled_x_nt(avx2, swizzle_9_10, SWIZZLE_9_10)
+to_tiled_x_nt(avx2, swizzle_9_11, SWIZZLE_9_11)
+to_tiled_x_nt(avx2, swizzle_9_10_11, SWIZZLE_9_10_11)
+
+#define choose_tiled_x_nt(kgem, cpu, name) \
+	if ((cpu) & AVX2) \
+		(kgem)->memcpy_to_tiled_x__nt = memcpy_to_tiled_x__##name##__avx2_nt; \
+	else if ((cpu) & SSE2) \
+		(kgem)->memcpy_to_tiled_x__nt = memcpy_to_tiled_x__##name##__sse2_nt
+#else
+#define choose_tiled_x_nt(kgem, cpu, name)
+#endif
+
+#if defined(avx2) && HAS_GCC(4, 9)
+/* Uploads of x8r8g8b8 data into a depth-32 pixmap have to fill in the
+ * alpha channel as they go, (src & and) | or, see memcpy_xor(). With the
+ * masks replicated to 32 bits, any run starting on a pixel boundary can be
+ * filtered 64 bytes at a time regardless of bpp.
+ */
+static force_inline void
+xor_pixels(uint8_t *dst, const uint8_t *src, unsigned len,
+	   unsigned cpp, uint32_t and, uint32_t or)
+{
+	unsigned i;
+
+	switch (cpp) {
+	case 1:
+		for (i = 0; i < len; i++)
+			dst[i] = (src[i] & and) | or;
+		break;
+	case 2:
+		for (i = 0; i < len / 2; i++)
+			((uint16_t *)dst)[i] = (((const uint16_t *)src)[i] & and) | or;
+		break;
+	default:
+		for (i = 0; i < len / 4; i++)
+			((uint32_t *)dst)[i] = (((const uint32_t *)src)[i] & and) | or;
+		break;
+	}
+}
+
+static force_inline void
+xor_replicate(unsigned cpp, uint32_t *and, uint32_t *or)
+{
+	switch (cpp) {
+	case 1:
+		*and = (*and & 0xff) * 0x01010101;
+		*or = (*or & 0xff) * 0x01010101;
+		break;
+	case 2:
+		*and = (*and & 0xffff) * 0x00010001;
+		*or = (*or & 0xffff) * 0x00010001;
+		break;
+	}
+}
+
+avx2 static force_inline void
+xor_64__avx2(uint8_t *dst, const uint8_t *src, uint32_t and, uint32_t or)
+{
+	const __m256i vand = _mm256_set1_epi32(and);
+	const __m256i vor = _mm256_set1_epi32(or);
+	__m256i ymm0, ymm1;
+
+	ymm0 = _mm256_loadu_si256((const __m256i *)src + 0);
+	ymm1 = _mm256_loadu_si256((const __m256i *)src + 1);
+
+	_mm256_store_si256((__m256i *)dst + 0,
+			   _mm256_or_si256(_mm256_and_si256(ymm0, vand), vor));
+	_mm256_store_si256((__m256i *)dst + 1,
+			   _mm256_or_si256(_mm256_and_si256(ymm1, vand), vor));
+}
+
+#if defined(avx512)
+avx512 static force_inline void
+xor_64__avx512(uint8_t *dst, const uint8_t *src, uint32_t and, uint32_t or)
+{
+	_mm512_store_si512((void *)dst,
+			   _mm512_or_si512(_mm512_and_si512(_mm512_loadu_si512((const void *)src),
+							    _mm512_set1_epi32(and)),
+					   _mm512_set1_epi32(or)));
+}
+#endif
+
+/* Filter a row of n 32 bit pixels, aligning the stores to the cacheline */
+#define xor_row_simd(isa) \
+isa static void \
+memcpy_xor_row__##isa(uint32_t *dst, const uint32_t *src, int n, \
+		      uint32_t and, uint32_t or) \
+{ \
+	while (n && (uintptr_t)dst & 63) { \
+		*dst++ = (*src++ & and) | or; \
+		n--; \
+	} \
+	while (n >= 16) { \
+		xor_64__##isa(assume_aligned(dst, 64), (const uint8_t *)src, and, or); \
+		dst += 16; src += 16; n -= 16; \
+	} \
+	while (n) { \
+		*dst++ = (*src++ & and) | or; \
+		n--; \
+	} \
+}
+
+#define to_tiled_x_xor(isa, name, swizzle) \
+isa static void \
+memcpy_to_tiled_x__##name##__##isa##_xor(const void *src, void *dst, int bpp, \
+					   int32_t src_stride, int32_t dst_stride, \
+					   int16_t src_x, int16_t src_y, \
+					   int16_t dst_x, int16_t dst_y, \
+					   uint16_t width, uint16_t height, \
+					   uint32_t and, uint32_t or) \
+{ \
+	const unsigned tile_width = 512; \
+	const unsigned tile_height = 8; \
+	const unsigned tile_size = 4096; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned tile_pixels = tile_width / cpp; \
+	const unsigned tile_shift = ffs(tile_pixels) - 1; \
+	const unsigned tile_mask = tile_pixels - 1; \
+	const unsigned offset_x = (dst_x & tile_mask) * cpp; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d, and=%x, or=%x\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride, and, or)); \
+	assert(src != dst); \
+	assert((dst_stride & (tile_width - 1)) == 0); \
+	xor_replicate(cpp, &and, &or); \
+	src = (const uint8_t *)src + src_y * src_stride + src_x * cpp; \
+	dst = (uint8_t *)dst + (dst_x >> tile_shift) * tile_size; \
+	width *= cpp; \
+	while (height--) { \
+		const uint8_t *src_row = src; \
+		const unsigned row = (dst_y & (tile_height-1)) * tile_width; \
+		const unsigned flip = swizzle_flip(row, swizzle); \
+		uint8_t *tile_row = dst; \
+		unsigned x = offset_x, w = width; \
+		tile_row += dst_y / tile_height * dst_stride * tile_height + row; \
+		do { \
+			unsigned len = min(tile_width - x, w); \
+			w -= len; \
+			if (x & 63) { \
+				unsigned n = min(64 - (x & 63), len); \
+				xor_pixels(tile_row + (x ^ flip), src_row, n, cpp, and, or); \
+				x += n; src_row += n; len -= n; \
+			} \
+			while (len >= 64) { \
+				xor_64__##isa(assume_aligned(tile_row + (x ^ flip), 64), src_row, and, or); \
+				x += 64; src_row += 64; len -= 64; \
+			} \
+			if (len) { \
+				xor_pixels(assume_aligned(tile_row + (x ^ flip), 64), src_row, len, cpp, and, or); \
+				src_row += len; \
+			} \
+			tile_row += tile_size; \
+			x = 0; \
+		} while (w); \
+		src = (const uint8_t *)src + src_stride; \
+		dst_y++; \
+	} \
+}
+
+xor_row_simd(avx2)
+
+to_tiled_x_xor(avx2, swizzle_0, SWIZZLE_0)
+to_tiled_x_xor(avx2, swizzle_9, SWIZZLE_9)
+to_tiled_x_xor(avx2, swizzle_9_10, SWIZZLE_9_10)
+to_tiled_x_xor(avx2, swizzle_9_11, SWIZZLE_9_11)
+to_tiled_x_xor(avx2, swizzle_9_10_11, SWIZZLE_9_10_11)
+
+#if defined(avx512)
+xor_row_simd(avx512)
+
+to_tiled_x_xor(avx512, swizzle_0, SWIZZLE_0)
+to_tiled_x_xor(avx512, swizzle_9, SWIZZLE_9)
+to_tiled_x_xor(avx512, swizzle_9_10, SWIZZLE_9_10)
+to_tiled_x_xor(avx512, swizzle_9_11, SWIZZLE_9_11)
+to_tiled_x_xor(avx512, swizzle_9_10_11, SWIZZLE_9_10_11)
+
+#define choose_tiled_x_xor_avx512(kgem, cpu, name) \
+	if ((cpu) & AVX512F) \
+		(kgem)->memcpy_to_tiled_x__xor = memcpy_to_tiled_x__##name##__avx512_xor; \
+	else
+#else
+#define choose_tiled_x_xor_avx512(kgem, cpu, name)
+#endif
+
+#define choose_tiled_x_xor(kgem, cpu, name) \
+	choose_tiled_x_xor_avx512(kgem, cpu, name) \
+	if ((cpu) & AVX2) \
+		(kgem)->memcpy_to_tiled_x__xor = memcpy_to_tiled_x__##name##__avx2_xor
+#else
+#define choose_tiled_x_xor(kgem, cpu, name)
+#endif
+
 fast void
 memcpy_blt(const void *src, void *dst, int bpp,
 	   int32_t src_stride, int32_t dst_stride,
@@ -1153,6 +1989,153 @@ memcpy_from_tiled_x__gen2(const void *src, void *dst, int bpp,
 	}
 }
 
+/* Y-tiles are 128 bytes wide and 32 rows high, but are laid out as 8
+ * columns of 16 byte OWords, with each column of 32 rows being contiguous.
+ * So we walk each band of tile rows a column at a time, so that the tiled
+ * side (typically a WC or uncached mapping) is accessed sequentially.
+ * The bit-6 swizzle only moves whole OWords, so we can apply it to each
+ * OWord address.
+ */
+#define memcpy_to_tiled_y(swizzle) \
+fast_memcpy static void \
+memcpy_to_tiled_y__##swizzle (const void *src, void *dst, int bpp, \
+			      int32_t src_stride, int32_t dst_stride, \
+			      int16_t src_x, int16_t src_y, \
+			      int16_t dst_x, int16_t dst_y, \
+			      uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 128; \
+	const unsigned tile_height = 32; \
+	const unsigned tile_size = 4096; \
+	const unsigned column_width = 16; \
+	const unsigned column_size = tile_height * column_width; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned stride_tiles = dst_stride / tile_width; \
+	const uint32_t x1 = dst_x * cpp, x2 = x1 + width * cpp; \
+	uint32_t y1 = dst_y, y2 = dst_y + height; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	src = (const uint8_t *)src + src_y * src_stride + src_x * cpp; \
+	while (y1 < y2) { \
+		const uint32_t band = min(ALIGN(y1 + 1, tile_height), y2); \
+		const uint32_t tile_row = \
+			y1 / tile_height * stride_tiles * tile_size + \
+			(y1 & (tile_height-1)) * column_width; \
+		uint32_t x = x1; \
+		while (x < x2) { \
+			const uint32_t len = min(ALIGN(x + 1, column_width), x2) - x; \
+			const uint8_t *src_row = (const uint8_t *)src + (x - x1); \
+			uint32_t offset = \
+				tile_row + \
+				x / tile_width * tile_size + \
+				(x & (tile_width-1)) / column_width * column_size + \
+				(x & (column_width-1)); \
+			uint32_t y; \
+			if (len == column_width) { \
+				for (y = y1; y < band; y++) { \
+					memcpy(assume_aligned((char *)dst + swizzle(offset), column_width), \
+					       src_row, column_width); \
+					src_row += src_stride; \
+					offset += column_width; \
+				} \
+			} else { \
+				for (y = y1; y < band; y++) { \
+					memcpy((char *)dst + swizzle(offset), src_row, len); \
+					src_row += src_stride; \
+					offset += column_width; \
+				} \
+			} \
+			x += len; \
+		} \
+		src = (const uint8_t *)src + (band - y1) * src_stride; \
+		y1 = band; \
+	} \
+}
+
+#define memcpy_from_tiled_y(swizzle) \
+fast_memcpy static void \
+memcpy_from_tiled_y__##swizzle (const void *src, void *dst, int bpp, \
+				int32_t src_stride, int32_t dst_stride, \
+				int16_t src_x, int16_t src_y, \
+				int16_t dst_x, int16_t dst_y, \
+				uint16_t width, uint16_t height) \
+{ \
+	const unsigned tile_width = 128; \
+	const unsigned tile_height = 32; \
+	const unsigned tile_size = 4096; \
+	const unsigned column_width = 16; \
+	const unsigned column_size = tile_height * column_width; \
+	const unsigned cpp = bpp / 8; \
+	const unsigned stride_tiles = src_stride / tile_width; \
+	const uint32_t x1 = src_x * cpp, x2 = x1 + width * cpp; \
+	uint32_t y1 = src_y, y2 = src_y + height; \
+	DBG(("%s(bpp=%d): src=(%d, %d), dst=(%d, %d), size=%dx%d, pitch=%d/%d\n", \
+	     __FUNCTION__, bpp, src_x, src_y, dst_x, dst_y, width, height, src_stride, dst_stride)); \
+	assert(src != dst); \
+	dst = (uint8_t *)dst + dst_y * dst_stride + dst_x * cpp; \
+	while (y1 < y2) { \
+		const uint32_t band = min(ALIGN(y1 + 1, tile_height), y2); \
+		const uint32_t tile_row = \
+			y1 / tile_height * stride_tiles * tile_size + \
+			(y1 & (tile_height-1)) * column_width; \
+		uint32_t x = x1; \
+		while (x < x2) { \
+			const uint32_t len = min(ALIGN(x + 1, column_width), x2) - x; \
+			uint8_t *dst_row = (uint8_t *)dst + (x - x1); \
+			uint32_t offset = \
+				tile_row + \
+				x / tile_width * tile_size + \
+				(x & (tile_width-1)) / column_width * column_size + \
+				(x & (column_width-1)); \
+			uint32_t y; \
+			if (len == column_width) { \
+				for (y = y1; y < band; y++) { \
+					memcpy(dst_row, \
+					       assume_aligned((const char *)src + swizzle(offset), column_width), \
+					       column_width); \
+					dst_row += dst_stride; \
+					offset += column_width; \
+				} \
+			} else { \
+				for (y = y1; y < band; y++) { \
+					memcpy(dst_row, (const char *)src + swizzle(offset), len); \
+					dst_row += dst_stride; \
+					offset += column_width; \
+				} \
+			} \
+			x += len; \
+		} \
+		dst = (uint8_t *)dst + (band - y1) * dst_stride; \
+		y1 = band; \
+	} \
+}
+
+#define swizzle_0(X) (X)
+memcpy_to_tiled_y(swizzle_0)
+memcpy_from_tiled_y(swizzle_0)
+#undef swizzle_0
+
+#define swizzle_9(X) ((X) ^ (((X) >> 3) & 64))
+memcpy_to_tiled_y(swizzle_9)
+memcpy_from_tiled_y(swizzle_9)
+#undef swizzle_9
+
+#define swizzle_9_10(X) ((X) ^ ((((X) ^ ((X) >> 1)) >> 3) & 64))
+memcpy_to_tiled_y(swizzle_9_10)
+memcpy_from_tiled_y(swizzle_9_10)
+#undef swizzle_9_10
+
+#define swizzle_9_11(X) ((X) ^ ((((X) ^ ((X) >> 2)) >> 3) & 64))
+memcpy_to_tiled_y(swizzle_9_11)
+memcpy_from_tiled_y(swizzle_9_11)
+#undef swizzle_9_11
+
+#define swizzle_9_10_11(X) ((X) ^ ((((X) ^ ((X) >> 1) ^ ((X) >> 2)) >> 3) & 64))
+memcpy_to_tiled_y(swizzle_9_10_11)
+memcpy_from_tiled_y(swizzle_9_10_11)
+#undef swizzle_9_10_11
+
 void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu)
 {
 	if (kgem->gen < 030) {
@@ -1171,6 +2154,10 @@ void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu)
 		break;
 	case I915_BIT_6_SWIZZLE_NONE:
 		DBG(("%s: no swizzling\n", __FUNCTION__));
+		choose_tiled_x_wc(kgem, cpu, swizzle_0);
+		choose_tiled_x_nt(kgem, cpu, swizzle_0);
+		choose_tiled_x_xor(kgem, cpu, swizzle_0);
+		choose_tiled_x_simd(kgem, cpu, swizzle_0);
 #if defined(sse2)
 		if (cpu & SSE2) {
 			kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_0__sse2;
@@ -1186,27 +2173,111 @@ void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu)
 		break;
 	case I915_BIT_6_SWIZZLE_9:
 		DBG(("%s: 6^9 swizzling\n", __FUNCTION__));
+		choose_tiled_x_wc(kgem, cpu, swizzle_9);
+		choose_tiled_x_nt(kgem, cpu, swizzle_9);
+		choose_tiled_x_xor(kgem, cpu, swizzle_9);
+		choose_tiled_x_simd(kgem, cpu, swizzle_9);
 		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9;
 		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9;
 		break;
 	case I915_BIT_6_SWIZZLE_9_10:
 		DBG(("%s: 6^9^10 swizzling\n", __FUNCTION__));
+		choose_tiled_x_wc(kgem, cpu, swizzle_9_10);
+		choose_tiled_x_nt(kgem, cpu, swizzle_9_10);
+		choose_tiled_x_xor(kgem, cpu, swizzle_9_10);
+		choose_tiled_x_simd(kgem, cpu, swizzle_9_10);
 		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10;
 		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10;
 		break;
 	case I915_BIT_6_SWIZZLE_9_11:
 		DBG(("%s: 6^9^11 swizzling\n", __FUNCTION__));
+		choose_tiled_x_wc(kgem, cpu, swizzle_9_11);
+		choose_tiled_x_nt(kgem, cpu, swizzle_9_11);
+		choose_tiled_x_xor(kgem, cpu, swizzle_9_11);
+		choose_tiled_x_simd(kgem, cpu, swizzle_9_11);
 		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_11;
 		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_11;
 		break;
 	case I915_BIT_6_SWIZZLE_9_10_11:
 		DBG(("%s: 6^9^10^11 swizzling\n", __FUNCTION__));
+		choose_tiled_x_wc(kgem, cpu, swizzle_9_10_11);
+		choose_tiled_x_nt(kgem, cpu, swizzle_9_10_11);
+		choose_tiled_x_xor(kgem, cpu, swizzle_9_10_11);
+		choose_tiled_x_simd(kgem, cpu, swizzle_9_10_11);
 		kgem->memcpy_to_tiled_x = memcpy_to_tiled_x__swizzle_9_10_11;
 		kgem->memcpy_from_tiled_x = memcpy_from_tiled_x__swizzle_9_10_11;
 		break;
 	}
 }
 
+void choose_memcpy_from_wc(struct kgem *kgem, unsigned cpu)
+{
+#if defined(sse4_1) && HAS_GCC(4, 9)
+	if (cpu & SSE4_1) {
+		DBG(("%s: using streaming loads\n", __FUNCTION__));
+		kgem->memcpy_from_wc = memcpy_from_wc__sse4_1;
+		return;
+	}
+#endif
+	kgem->memcpy_from_wc = memcpy_blt;
+}
+
+void choose_memcpy_nt(struct kgem *kgem, unsigned cpu)
+{
+#if defined(avx2) && HAS_GCC(4, 9)
+	if (cpu & AVX2) {
+		DBG(("%s: using avx2 streaming stores\n", __FUNCTION__));
+		kgem->memcpy_nt = memcpy_nt__avx2;
+		return;
+	}
+	if (cpu & SSE2) {
+		DBG(("%s: using sse2 streaming stores\n", __FUNCTION__));
+		kgem->memcpy_nt = memcpy_nt__sse2;
+		return;
+	}
+#endif
+	kgem->memcpy_nt = memcpy_blt;
+}
+
+void choose_memcpy_tiled_y(struct kgem *kgem, int swizzling, unsigned cpu)
+{
+	if (kgem->gen < 040) {
+		DBG(("%s: no detiling of Y-tiles before gen4\n", __FUNCTION__));
+		return;
+	}
+
+	switch (swizzling) {
+	default:
+		DBG(("%s: unknown swizzling, %d\n", __FUNCTION__, swizzling));
+		break;
+	case I915_BIT_6_SWIZZLE_NONE:
+		DBG(("%s: no swizzling\n", __FUNCTION__));
+		kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_0;
+		kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_0;
+		break;
+	case I915_BIT_6_SWIZZLE_9:
+		DBG(("%s: 6^9 swizzling\n", __FUNCTION__));
+		kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9;
+		kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10:
+		DBG(("%s: 6^9^10 swizzling\n", __FUNCTION__));
+		kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10;
+		kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10;
+		break;
+	case I915_BIT_6_SWIZZLE_9_11:
+		DBG(("%s: 6^9^11 swizzling\n", __FUNCTION__));
+		kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_11;
+		kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_11;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10_11:
+		DBG(("%s: 6^9^10^11 swizzling\n", __FUNCTION__));
+		kgem->memcpy_to_tiled_y = memcpy_to_tiled_y__swizzle_9_10_11;
+		kgem->memcpy_from_tiled_y = memcpy_from_tiled_y__swizzle_9_10_11;
+		break;
+	}
+}
+
 void
 memmove_box(const void *src, void *dst,
 	    int bpp, int32_t stride,
@@ -1360,6 +2431,115 @@ memmove_box(const void *src, void *dst,
 	}
 }
 
+typedef void (*memcpy_xor_row_func)(uint32_t *dst, const uint32_t *src, int n,
+				    uint32_t and, uint32_t or);
+
+static void
+memcpy_xor_row(uint32_t *dst, const uint32_t *src, int n,
+	       uint32_t and, uint32_t or)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = (src[i] & and) | or;
+}
+
+#if defined(sse2) && __x86_64__
+static void
+memcpy_xor_row__sse2(uint32_t *d, const uint32_t *s, int i,
+		     uint32_t and, uint32_t or)
+{
+	__m128i and_mask = xmm_create_mask_32(and);
+	__m128i or_mask = xmm_create_mask_32(or);
+
+	while (i && (uintptr_t)d & 15) {
+		*d++ = (*s++ & and) | or;
+		i--;
+	}
+
+	while (i >= 16) {
+		__m128i xmm1, xmm2, xmm3, xmm4;
+
+		xmm1 = xmm_load_128u((const __m128i*)s + 0);
+		xmm2 = xmm_load_128u((const __m128i*)s + 1);
+		xmm3 = xmm_load_128u((const __m128i*)s + 2);
+		xmm4 = xmm_load_128u((const __m128i*)s + 3);
+
+		xmm_save_128((__m128i*)d + 0,
+			     _mm_or_si128(_mm_and_si128(xmm1, and_mask), or_mask));
+		xmm_save_128((__m128i*)d + 1,
+			     _mm_or_si128(_mm_and_si128(xmm2, and_mask), or_mask));
+		xmm_save_128((__m128i*)d + 2,
+			     _mm_or_si128(_mm_and_si128(xmm3, and_mask), or_mask));
+		xmm_save_128((__m128i*)d + 3,
+			     _mm_or_si128(_mm_and_si128(xmm4, and_mask), or_mask));
+
+		d += 16;
+		s += 16;
+		i -= 16;
+	}
+
+	if (i & 8) {
+		__m128i xmm1, xmm2;
+
+		xmm1 = xmm_load_128u((const __m128i*)s + 0);
+		xmm2 = xmm_load_128u((const __m128i*)s + 1);
+
+		xmm_save_128((__m128i*)d + 0,
+			     _mm_or_si128(_mm_and_si128(xmm1, and_mask), or_mask));
+		xmm_save_128((__m128i*)d + 1,
+			     _mm_or_si128(_mm_and_si128(xmm2, and_mask), or_mask));
+		d += 8;
+		s += 8;
+		i -= 8;
+	}
+
+	if (i & 4) {
+		xmm_save_128((__m128i*)d,
+			     _mm_or_si128(_mm_and_si128(xmm_load_128u((const __m128i*)s),
+							and_mask),
+					  or_mask));
+
+		d += 4;
+		s += 4;
+		i -= 4;
+	}
+
+	while (i) {
+		*d++ = (*s++ & and) | or;
+		i--;
+	}
+}
+#endif
+
+static memcpy_xor_row_func choose_memcpy_xor_row(void)
+{
+	static memcpy_xor_row_func row;
+
+	if (row == NULL) {
+		unsigned cpu = sna_cpu_detect();
+
+		row = memcpy_xor_row;
+#if defined(avx2) && HAS_GCC(4, 9)
+#if defined(avx512)
+		if (cpu & AVX512F)
+			row = memcpy_xor_row__avx512;
+		else
+#endif
+		if (cpu & AVX2)
+			row = memcpy_xor_row__avx2;
+		else
+#endif
+#if defined(sse2) && __x86_64__
+		if (cpu & SSE2)
+			row = memcpy_xor_row__sse2;
+#endif
+		(void)cpu;
+	}
+
+	return row;
+}
+
 void
 memcpy_xor(const void *src, void *dst, int bpp,
 	   int32_t src_stride, int32_t dst_stride,
@@ -1368,6 +2548,7 @@ memcpy_xor(const void *src, void *dst, int bpp,
 	   uint16_t width, uint16_t height,
 	   uint32_t and, uint32_t or)
 {
+	const memcpy_xor_row_func row = choose_memcpy_xor_row();
 	const uint8_t *src_bytes;
 	uint8_t *dst_bytes;
 	int i, w;
@@ -1430,87 +2611,14 @@ memcpy_xor(const void *src, void *dst, int bpp,
 				height = 1;
 			}
 
-#if defined(sse2) && __x86_64__
-			if (have_sse2()) {
-				do {
-					uint32_t *d = (uint32_t *)dst_bytes;
-					const uint32_t *s = (const uint32_t *)src_bytes;
-					__m128i mask = xmm_create_mask_32(or);
-
-					i = w;
-					while (i && (uintptr_t)d & 15) {
-						*d++ = *s++ | or;
-						i--;
-					}
-
-					while (i >= 16) {
-						__m128i xmm1, xmm2, xmm3, xmm4;
-
-						xmm1 = xmm_load_128u((const __m128i*)s + 0);
-						xmm2 = xmm_load_128u((const __m128i*)s + 1);
-						xmm3 = xmm_load_128u((const __m128i*)s + 2);
-						xmm4 = xmm_load_128u((const __m128i*)s + 3);
-
-						xmm_save_128((__m128i*)d + 0,
-							     _mm_or_si128(xmm1, mask));
-						xmm_save_128((__m128i*)d + 1,
-							     _mm_or_si128(xmm2, mask));
-						xmm_save_128((__m128i*)d + 2,
-							     _mm_or_si128(xmm3, mask));
-						xmm_save_128((__m128i*)d + 3,
-							     _mm_or_si128(xmm4, mask));
-
-						d += 16;
-						s += 16;
-						i -= 16;
-					}
-
-					if (i & 8) {
-						__m128i xmm1, xmm2;
-
-						xmm1 = xmm_load_128u((const __m128i*)s + 0);
-						xmm2 = xmm_load_128u((const __m128i*)s + 1);
-
-						xmm_save_128((__m128i*)d + 0,
-							     _mm_or_si128(xmm1, mask));
-						xmm_save_128((__m128i*)d + 1,
-							     _mm_or_si128(xmm2, mask));
-						d += 8;
-						s += 8;
-						i -= 8;
-					}
-
-					if (i & 4) {
-						xmm_save_128((__m128i*)d,
-							     _mm_or_si128(xmm_load_128u((const __m128i*)s),
-									  mask));
-
-						d += 4;
-						s += 4;
-						i -= 4;
-					}
-
-					while (i) {
-						*d++ = *s++ | or;
-						i--;
-					}
-
-					src_bytes += src_stride;
-					dst_bytes += dst_stride;
-				} while (--height);
-			} else
-#else
-				do {
-					uint32_t *d = (uint32_t *)dst_bytes;
-					uint32_t *s = (uint32_t *)src_bytes;
-
-					for (i = 0; i < w; i++)
-						d[i] = s[i] | or;
+			do {
+				row((uint32_t *)dst_bytes,
+				    (const uint32_t *)src_bytes,
+				    w, and, or);
 
-					src_bytes += src_stride;
-					dst_bytes += dst_stride;
-				} while (--height);
-#endif
+				src_bytes += src_stride;
+				dst_bytes += dst_stride;
+			} while (--height);
 			break;
 		}
 	} else {
@@ -1539,12 +2647,16 @@ memcpy_xor(const void *src, void *dst, int bpp,
 			break;
 
 		case 4:
-			do {
-				uint32_t *d = (uint32_t *)dst_bytes;
-				const uint32_t *s = (const uint32_t *)src_bytes;
+			w = width;
+			if (w * 4 == dst_stride && dst_stride == src_stride) {
+				w *= height;
+				height = 1;
+			}
 
-				for (i = 0; i < width; i++)
-					d[i] = (s[i] & and) | or;
+			do {
+				row((uint32_t *)dst_bytes,
+				    (const uint32_t *)src_bytes,
+				    w, and, or);
 
 				src_bytes += src_stride;
 				dst_bytes += dst_stride;
@@ -1694,100 +2806,528 @@ static inline uint32_t convert_pixel(const uint8_t *p, int x)
 	return ((uint32_t *)p)[x];
 }
 
-fast void
-affine_blt(const void *src, void *dst, int bpp,
-	   int16_t src_x, int16_t src_y,
-	   int16_t src_width, int16_t src_height,
-	   int32_t src_stride,
-	   int16_t dst_x, int16_t dst_y,
-	   uint16_t dst_width, uint16_t dst_height,
-	   int32_t dst_stride,
-	   const struct pixman_f_transform *t)
+struct affine {
+	const uint8_t *src;
+	int32_t src_stride;
+	int src_width, src_height;
+	pixman_fixed_t ux, uy;
+	int width;
+};
+
+typedef void (*affine_row_func)(const struct affine *a,
+				pixman_fixed_t x, pixman_fixed_t y,
+				uint32_t *b);
+
+static inline uint32_t
+affine_pixel(const struct affine *a, pixman_fixed_t x, pixman_fixed_t y)
 {
 	static const uint8_t zero[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-	const pixman_fixed_t ux = pixman_double_to_fixed(t->m[0][0]);
-	const pixman_fixed_t uy = pixman_double_to_fixed(t->m[1][0]);
-	int i, j;
+	const uint8_t *row1;
+	const uint8_t *row2;
+	int x1, y1, x2, y2;
+	uint32_t tl, tr, bl, br;
+	int32_t fx, fy;
 
-	assert(bpp == 32);
+	x1 = x - pixman_fixed_1/2;
+	y1 = y - pixman_fixed_1/2;
 
-	for (j = 0; j < dst_height; j++) {
-		pixman_fixed_t x, y;
+	fx = bilinear_weight(x1);
+	fy = bilinear_weight(y1);
+
+	x1 = pixman_fixed_to_int(x1);
+	x2 = x1 + 1;
+	y1 = pixman_fixed_to_int(y1);
+	y2 = y1 + 1;
+
+	if (x1 >= a->src_width  || x2 < 0 ||
+	    y1 >= a->src_height || y2 < 0)
+		return 0;
+
+	if (y2 == 0) {
+		row1 = zero;
+	} else {
+		row1 = a->src + a->src_stride * y1;
+		row1 += 4 * x1;
+	}
+
+	if (y1 == a->src_height - 1) {
+		row2 = zero;
+	} else {
+		row2 = a->src + a->src_stride * y2;
+		row2 += 4 * x1;
+	}
+
+	if (x2 == 0) {
+		tl = 0;
+		bl = 0;
+	} else {
+		tl = convert_pixel(row1, 0);
+		bl = convert_pixel(row2, 0);
+	}
+
+	if (x1 == a->src_width - 1) {
+		tr = 0;
+		br = 0;
+	} else {
+		tr = convert_pixel(row1, 1);
+		br = convert_pixel(row2, 1);
+	}
+
+	return bilinear_interpolation(tl, tr, bl, br, fx, fy);
+}
+
+static void
+affine_row(const struct affine *a,
+	   pixman_fixed_t x, pixman_fixed_t y,
+	   uint32_t *b)
+{
+	int i;
+
+	for (i = 0; i < a->width; i++) {
+		b[i] = affine_pixel(a, x, y);
+		x += a->ux;
+		y += a->uy;
+	}
+}
+
+#if BILINEAR_INTERPOLATION_BITS <= 4
+/* The vector kernels compute exactly the same sums as the scalar
+ * bilinear_interpolation(): with 4 bits of weight, every channel of every
+ * pixel is sum(c * w) >> 8 with w summing to 256, so each channel fits in
+ * a 16 bit lane without overflow. Whenever a pixel of the group needs the
+ * edge handling of affine_pixel(), the whole group is done by the scalar
+ * path instead.
+ */
+#if defined(sse2)
+#include <emmintrin.h>
+
+static sse2 inline void
+affine_weights__sse2(__m128i w, __m128i *lo, __m128i *hi)
+{
+	/* [w0 w1 w2 w3] -> [w0 x4, w1 x4], [w2 x4, w3 x4] */
+	w = _mm_packs_epi32(w, w);
+	w = _mm_unpacklo_epi16(w, w);
+	*lo = _mm_unpacklo_epi32(w, w);
+	*hi = _mm_unpackhi_epi32(w, w);
+}
+
+static sse2 void
+affine_row__sse2(const struct affine *a,
+		 pixman_fixed_t x, pixman_fixed_t y,
+		 uint32_t *b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi32((1 << BILINEAR_INTERPOLATION_BITS) - 1);
+	const __m128i one = _mm_set1_epi32(256);
+	const __m128i max_x = _mm_set1_epi32(a->src_width - 2);
+	const __m128i max_y = _mm_set1_epi32(a->src_height - 2);
+	const __m128i dx = _mm_set1_epi32(4 * a->ux);
+	const __m128i dy = _mm_set1_epi32(4 * a->uy);
+	__m128i vx, vy;
+	int i;
+
+	vx = _mm_setr_epi32(x, x + a->ux, x + 2 * a->ux, x + 3 * a->ux);
+	vx = _mm_sub_epi32(vx, _mm_set1_epi32(pixman_fixed_1/2));
+	vy = _mm_setr_epi32(y, y + a->uy, y + 2 * a->uy, y + 3 * a->uy);
+	vy = _mm_sub_epi32(vy, _mm_set1_epi32(pixman_fixed_1/2));
+
+	for (i = 0; i + 4 <= a->width; i += 4) {
+		int32_t ix[4] __attribute__((aligned(16)));
+		int32_t iy[4] __attribute__((aligned(16)));
+		__m128i x1, y1, fx, fy, fxy, w;
+		__m128i wtl[2], wtr[2], wbl[2], wbr[2];
+		__m128i t01, t23, b01, b23;
+		__m128i tl, tr, bl, br, lo, hi;
+		const uint8_t *p[4];
+		int j;
+
+		x1 = _mm_srai_epi32(vx, 16);
+		y1 = _mm_srai_epi32(vy, 16);
+
+		w = _mm_or_si128(_mm_cmplt_epi32(x1, zero),
+				 _mm_cmpgt_epi32(x1, max_x));
+		w = _mm_or_si128(w, _mm_cmplt_epi32(y1, zero));
+		w = _mm_or_si128(w, _mm_cmpgt_epi32(y1, max_y));
+		if (_mm_movemask_epi8(w)) {
+			for (j = 0; j < 4; j++) {
+				b[i + j] = affine_pixel(a, x, y);
+				x += a->ux;
+				y += a->uy;
+			}
+			goto next;
+		}
+
+		_mm_store_si128((__m128i *)ix, x1);
+		_mm_store_si128((__m128i *)iy, y1);
+		for (j = 0; j < 4; j++)
+			p[j] = a->src + a->src_stride * iy[j] + 4 * ix[j];
+
+		fx = _mm_and_si128(_mm_srli_epi32(vx, 16 - BILINEAR_INTERPOLATION_BITS), mask);
+		fy = _mm_and_si128(_mm_srli_epi32(vy, 16 - BILINEAR_INTERPOLATION_BITS), mask);
+		fx = _mm_slli_epi32(fx, 4 - BILINEAR_INTERPOLATION_BITS);
+		fy = _mm_slli_epi32(fy, 4 - BILINEAR_INTERPOLATION_BITS);
+		fxy = _mm_mullo_epi16(fx, fy);
+
+		affine_weights__sse2(_mm_add_epi32(_mm_sub_epi32(one, _mm_slli_epi32(_mm_add_epi32(fx, fy), 4)), fxy),
+				     &wtl[0], &wtl[1]);
+		affine_weights__sse2(_mm_sub_epi32(_mm_slli_epi32(fx, 4), fxy),
+				     &wtr[0], &wtr[1]);
+		affine_weights__sse2(_mm_sub_epi32(_mm_slli_epi32(fy, 4), fxy),
+				     &wbl[0], &wbl[1]);
+		affine_weights__sse2(fxy, &wbr[0], &wbr[1]);
+
+		t01 = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p[0]),
+					 _mm_loadl_epi64((const __m128i *)p[1]));
+		t23 = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p[2]),
+					 _mm_loadl_epi64((const __m128i *)p[3]));
+		b01 = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(p[0] + a->src_stride)),
+					 _mm_loadl_epi64((const __m128i *)(p[1] + a->src_stride)));
+		b23 = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(p[2] + a->src_stride)),
+					 _mm_loadl_epi64((const __m128i *)(p[3] + a->src_stride)));
+
+		tl = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(t01), _mm_castsi128_ps(t23), _MM_SHUFFLE(2, 0, 2, 0)));
+		tr = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(t01), _mm_castsi128_ps(t23), _MM_SHUFFLE(3, 1, 3, 1)));
+		bl = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(b01), _mm_castsi128_ps(b23), _MM_SHUFFLE(2, 0, 2, 0)));
+		br = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(b01), _mm_castsi128_ps(b23), _MM_SHUFFLE(3, 1, 3, 1)));
+
+		lo = _mm_mullo_epi16(_mm_unpacklo_epi8(tl, zero), wtl[0]);
+		lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(tr, zero), wtr[0]));
+		lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(bl, zero), wbl[0]));
+		lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(br, zero), wbr[0]));
+
+		hi = _mm_mullo_epi16(_mm_unpackhi_epi8(tl, zero), wtl[1]);
+		hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(tr, zero), wtr[1]));
+		hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(bl, zero), wbl[1]));
+		hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(br, zero), wbr[1]));
+
+		_mm_storeu_si128((__m128i *)(b + i),
+				 _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+						  _mm_srli_epi16(hi, 8)));
+
+		x += 4 * a->ux;
+		y += 4 * a->uy;
+next:
+		vx = _mm_add_epi32(vx, dx);
+		vy = _mm_add_epi32(vy, dy);
+	}
+
+	for (; i < a->width; i++) {
+		b[i] = affine_pixel(a, x, y);
+		x += a->ux;
+		y += a->uy;
+	}
+}
+#endif
+
+#if defined(avx2) && HAS_GCC(4, 9)
+#include <immintrin.h>
+
+static avx2 inline void
+affine_weights__avx2(__m256i w, __m256i *lo, __m256i *hi)
+{
+	/* As for sse2, but independently within each 128 bit lane */
+	w = _mm256_packs_epi32(w, w);
+	w = _mm256_unpacklo_epi16(w, w);
+	*lo = _mm256_unpacklo_epi32(w, w);
+	*hi = _mm256_unpackhi_epi32(w, w);
+}
+
+static avx2 inline __m256i
+affine_load__avx2(const uint8_t * const *p, int a, int b)
+{
+	/* The pixel pairs for p[a], p[a+1] below those for p[b], p[b+1] */
+	__m128i lo, hi;
+
+	lo = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p[a]),
+				_mm_loadl_epi64((const __m128i *)p[a + 1]));
+	hi = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p[b]),
+				_mm_loadl_epi64((const __m128i *)p[b + 1]));
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+static avx2 void
+affine_row__avx2(const struct affine *a,
+		 pixman_fixed_t x, pixman_fixed_t y,
+		 uint32_t *b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i mask = _mm256_set1_epi32((1 << BILINEAR_INTERPOLATION_BITS) - 1);
+	const __m256i one = _mm256_set1_epi32(256);
+	const __m256i max_x = _mm256_set1_epi32(a->src_width - 2);
+	const __m256i max_y = _mm256_set1_epi32(a->src_height - 2);
+	const __m256i dx = _mm256_set1_epi32(8 * a->ux);
+	const __m256i dy = _mm256_set1_epi32(8 * a->uy);
+	const __m256i step = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i vx, vy;
+	int i;
+
+	vx = _mm256_mullo_epi32(step, _mm256_set1_epi32(a->ux));
+	vx = _mm256_add_epi32(vx, _mm256_set1_epi32(x - pixman_fixed_1/2));
+	vy = _mm256_mullo_epi32(step, _mm256_set1_epi32(a->uy));
+	vy = _mm256_add_epi32(vy, _mm256_set1_epi32(y - pixman_fixed_1/2));
+
+	for (i = 0; i + 8 <= a->width; i += 8) {
+		int32_t ix[8] __attribute__((aligned(32)));
+		int32_t iy[8] __attribute__((aligned(32)));
+		__m256i x1, y1, fx, fy, fxy, w;
+		__m256i wtl[2], wtr[2], wbl[2], wbr[2];
+		__m256i t0, t1, b0, b1;
+		__m256i tl, tr, bl, br, lo, hi;
+		const uint8_t *p[8], *q[8];
+		int j;
+
+		x1 = _mm256_srai_epi32(vx, 16);
+		y1 = _mm256_srai_epi32(vy, 16);
+
+		w = _mm256_or_si256(_mm256_cmpgt_epi32(zero, x1),
+				    _mm256_cmpgt_epi32(x1, max_x));
+		w = _mm256_or_si256(w, _mm256_cmpgt_epi32(zero, y1));
+		w = _mm256_or_si256(w, _mm256_cmpgt_epi32(y1, max_y));
+		if (_mm256_movemask_epi8(w)) {
+			for (j = 0; j < 8; j++) {
+				b[i + j] = affine_pixel(a, x, y);
+				x += a->ux;
+				y += a->uy;
+			}
+			goto next;
+		}
+
+		_mm256_store_si256((__m256i *)ix, x1);
+		_mm256_store_si256((__m256i *)iy, y1);
+		for (j = 0; j < 8; j++) {
+			p[j] = a->src + a->src_stride * iy[j] + 4 * ix[j];
+			q[j] = p[j] + a->src_stride;
+		}
+
+		fx = _mm256_and_si256(_mm256_srli_epi32(vx, 16 - BILINEAR_INTERPOLATION_BITS), mask);
+		fy = _mm256_and_si256(_mm256_srli_epi32(vy, 16 - BILINEAR_INTERPOLATION_BITS), mask);
+		fx = _mm256_slli_epi32(fx, 4 - BILINEAR_INTERPOLATION_BITS);
+		fy = _mm256_slli_epi32(fy, 4 - BILINEAR_INTERPOLATION_BITS);
+		fxy = _mm256_mullo_epi16(fx, fy);
+
+		affine_weights__avx2(_mm256_add_epi32(_mm256_sub_epi32(one, _mm256_slli_epi32(_mm256_add_epi32(fx, fy), 4)), fxy),
+				     &wtl[0], &wtl[1]);
+		affine_weights__avx2(_mm256_sub_epi32(_mm256_slli_epi32(fx, 4), fxy),
+				     &wtr[0], &wtr[1]);
+		affine_weights__avx2(_mm256_sub_epi32(_mm256_slli_epi32(fy, 4), fxy),
+				     &wbl[0], &wbl[1]);
+		affine_weights__avx2(fxy, &wbr[0], &wbr[1]);
+
+		/* lane 0 holds pixels 0-3, lane 1 pixels 4-7 */
+		t0 = affine_load__avx2(p, 0, 4);
+		t1 = affine_load__avx2(p, 2, 6);
+		b0 = affine_load__avx2(q, 0, 4);
+		b1 = affine_load__avx2(q, 2, 6);
+
+		tl = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(t0), _mm256_castsi256_ps(t1), _MM_SHUFFLE(2, 0, 2, 0)));
+		tr = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(t0), _mm256_castsi256_ps(t1), _MM_SHUFFLE(3, 1, 3, 1)));
+		bl = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(b0), _mm256_castsi256_ps(b1), _MM_SHUFFLE(2, 0, 2, 0)));
+		br = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(b0), _mm256_castsi256_ps(b1), _MM_SHUFFLE(3, 1, 3, 1)));
+
+		lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(tl, zero), wtl[0]);
+		lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(tr, zero), wtr[0]));
+		lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(bl, zero), wbl[0]));
+		lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_unpacklo_epi8(br, zero), wbr[0]));
+
+		hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(tl, zero), wtl[1]);
+		hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(tr, zero), wtr[1]));
+		hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(bl, zero), wbl[1]));
+		hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_unpackhi_epi8(br, zero), wbr[1]));
+
+		_mm256_storeu_si256((__m256i *)(b + i),
+				    _mm256_packus_epi16(_mm256_srli_epi16(lo, 8),
+							_mm256_srli_epi16(hi, 8)));
+
+		x += 8 * a->ux;
+		y += 8 * a->uy;
+next:
+		vx = _mm256_add_epi32(vx, dx);
+		vy = _mm256_add_epi32(vy, dy);
+	}
+
+	for (; i < a->width; i++) {
+		b[i] = affine_pixel(a, x, y);
+		x += a->ux;
+		y += a->uy;
+	}
+}
+#endif
+#endif
+
+static affine_row_func choose_affine_row(unsigned cpu)
+{
+	affine_row_func row = affine_row;
+
+#if BILINEAR_INTERPOLATION_BITS <= 4
+#if defined(avx2) && HAS_GCC(4, 9)
+	if (cpu & AVX2)
+		row = affine_row__avx2;
+	else
+#endif
+#if defined(sse2)
+	if (cpu & SSE2)
+		row = affine_row__sse2;
+#endif
+#endif
+	(void)cpu;
+
+	return row;
+}
+
+struct affine_thread {
+	const struct affine *a;
+	affine_row_func row;
+	const struct pixman_f_transform *t;
+	uint8_t *dst;
+	int32_t dst_stride;
+	int16_t dst_x, dst_y;
+	int dx, dy;
+	int y1, y2;
+};
+
+static void affine_thread(void *arg)
+{
+	const struct affine_thread *t = arg;
+	int j;
+
+	for (j = t->y1; j < t->y2; j++) {
 		struct pixman_f_vector v;
-		uint32_t *b;
+		pixman_fixed_t x, y;
 
 		/* reference point is the center of the pixel */
-		v.v[0] = dst_x + 0.5;
-		v.v[1] = dst_y + j + 0.5;
+		v.v[0] = t->dst_x + 0.5;
+		v.v[1] = t->dst_y + j + 0.5;
 		v.v[2] = 1.0;
 
-		pixman_f_transform_point_3d(t, &v);
+		pixman_f_transform_point_3d(t->t, &v);
 
 		x = pixman_double_to_fixed(v.v[0]);
-		x += pixman_int_to_fixed(src_x - dst_x);
+		x += pixman_int_to_fixed(t->dx);
 		y = pixman_double_to_fixed(v.v[1]);
-		y +=  pixman_int_to_fixed(src_y - dst_y);
-
-		b = (uint32_t*)((uint8_t *)dst + (dst_y + j) * dst_stride + dst_x * bpp / 8);
-		for (i = 0; i < dst_width; i++) {
-			const uint8_t *row1;
-			const uint8_t *row2;
-			int x1, y1, x2, y2;
-			uint32_t tl, tr, bl, br;
-			int32_t fx, fy;
-
-			x1 = x - pixman_fixed_1/2;
-			y1 = y - pixman_fixed_1/2;
-
-			fx = bilinear_weight(x1);
-			fy = bilinear_weight(y1);
-
-			x1 = pixman_fixed_to_int(x1);
-			x2 = x1 + 1;
-			y1 = pixman_fixed_to_int(y1);
-			y2 = y1 + 1;
-
-			if (x1 >= src_width  || x2 < 0 ||
-			    y1 >= src_height || y2 < 0) {
-				b[i] = 0;
-				goto next;
-			}
-
-			if (y2 == 0) {
-				row1 = zero;
-			} else {
-				row1 = (uint8_t *)src + src_stride * y1;
-				row1 += bpp / 8 * x1;
-			}
+		y += pixman_int_to_fixed(t->dy);
 
-			if (y1 == src_height - 1) {
-				row2 = zero;
-			} else {
-				row2 = (uint8_t *)src + src_stride * y2;
-				row2 += bpp / 8 * x1;
-			}
+		t->row(t->a, x, y,
+		       (uint32_t *)(t->dst + (t->dst_y + j) * t->dst_stride + t->dst_x * 4));
+	}
+}
 
-			if (x2 == 0) {
-				tl = 0;
-				bl = 0;
-			} else {
-				tl = convert_pixel(row1, 0);
-				bl = convert_pixel(row2, 0);
-			}
+/* Only transforms of at least this many pixels are spread across the
+ * threads; the cursors, our only callers today, are far smaller.
+ */
+#define AFFINE_THREAD_PIXELS (512*512)
+
+static fast void
+__affine_blt(affine_row_func row,
+	     const void *src, void *dst, int bpp,
+	     int16_t src_x, int16_t src_y,
+	     int16_t src_width, int16_t src_height,
+	     int32_t src_stride,
+	     int16_t dst_x, int16_t dst_y,
+	     uint16_t dst_width, uint16_t dst_height,
+	     int32_t dst_stride,
+	     const struct pixman_f_transform *t)
+{
+	struct affine a;
+	struct affine_thread data;
+	int num_threads;
 
-			if (x1 == src_width - 1) {
-				tr = 0;
-				br = 0;
-			} else {
-				tr = convert_pixel(row1, 1);
-				br = convert_pixel(row2, 1);
-			}
+	assert(bpp == 32);
 
-			b[i] = bilinear_interpolation(tl, tr, bl, br, fx, fy);
+	a.src = src;
+	a.src_stride = src_stride;
+	a.src_width = src_width;
+	a.src_height = src_height;
+	a.ux = pixman_double_to_fixed(t->m[0][0]);
+	a.uy = pixman_double_to_fixed(t->m[1][0]);
+	a.width = dst_width;
+
+	data.a = &a;
+	data.row = row;
+	data.t = t;
+	data.dst = dst;
+	data.dst_stride = dst_stride;
+	data.dst_x = dst_x;
+	data.dst_y = dst_y;
+	data.dx = src_x - dst_x;
+	data.dy = src_y - dst_y;
+	data.y1 = 0;
+	data.y2 = dst_height;
+
+	num_threads = 1;
+	if ((unsigned)dst_width * dst_height >= AFFINE_THREAD_PIXELS)
+		num_threads = sna_use_threads(dst_width, dst_height, 32);
+	if (num_threads > 1) {
+		struct affine_thread threads[num_threads];
+		int y, dy, n;
+
+		DBG(("%s: using %d threads for %dx%d\n",
+		     __FUNCTION__, num_threads, dst_width, dst_height));
+
+		dy = (dst_height + num_threads - 1) / num_threads;
+		num_threads = (dst_height + dy - 1) / dy;
+
+		y = 0;
+		for (n = 1; n < num_threads; n++) {
+			threads[n] = data;
+			threads[n].y1 = y;
+			threads[n].y2 = y += dy;
+			sna_threads_run(n, affine_thread, &threads[n]);
+		}
 
-next:
-			x += ux;
-			y += uy;
+		assert(y < dst_height);
+		data.y1 = y;
+		affine_thread(&data);
+
+		if (!sna_threads_wait()) {
+			/* A worker died, taking the pool with it, and
+			 * its band may be incomplete: redo the lot here.
+			 */
+			DBG(("%s: threads failed, transforming %dx%d inline\n",
+			     __FUNCTION__, dst_width, dst_height));
+			data.y1 = 0;
+			affine_thread(&data);
 		}
-	}
+	} else
+		affine_thread(&data);
+}
+
+fast void
+affine_blt(const void *src, void *dst, int bpp,
+	   int16_t src_x, int16_t src_y,
+	   int16_t src_width, int16_t src_height,
+	   int32_t src_stride,
+	   int16_t dst_x, int16_t dst_y,
+	   uint16_t dst_width, uint16_t dst_height,
+	   int32_t dst_stride,
+	   const struct pixman_f_transform *t)
+{
+	static affine_row_func row;
+
+	if (row == NULL)
+		row = choose_affine_row(sna_cpu_detect());
+
+	__affine_blt(row, src, dst, bpp,
+		     src_x, src_y, src_width, src_height, src_stride,
+		     dst_x, dst_y, dst_width, dst_height, dst_stride,
+		     t);
+}
+
+/* As affine_blt(), but using the row kernel chosen for the given cpu
+ * features, so that each variant can be checked against the others.
+ */
+void
+affine_blt__cpu(unsigned cpu,
+		const void *src, void *dst, int bpp,
+		int16_t src_x, int16_t src_y,
+		int16_t src_width, int16_t src_height,
+		int32_t src_stride,
+		int16_t dst_x, int16_t dst_y,
+		uint16_t dst_width, uint16_t dst_height,
+		int32_t dst_stride,
+		const struct pixman_f_transform *t)
+{
+	__affine_blt(choose_affine_row(cpu), src, dst, bpp,
+		     src_x, src_y, src_width, src_height, src_stride,
+		     dst_x, dst_y, dst_width, dst_height, dst_stride,
+		     t);
 }
@@ -60,6 +60,7 @@
 
 #if HAS_GCC(4, 5)
 #define sse2 fast __attribute__((target("sse2,fpmath=sse")))
+#define sse4_1 fast __attribute__((target("sse4.1,sse2,fpmath=sse")))
 #define sse4_2 fast __attribute__((target("sse4.2,sse2,fpmath=sse")))
 #endif
 
@@ -78,6 +79,10 @@
 #define assume_misaligned(ptr, align, offset) (ptr)
 #endif
 
+#if HAS_GCC(4, 9)
+#define avx512 fast __attribute__((target("avx512f,avx2,avx,sse4.2,sse2,fpmath=sse")))
+#endif
+
 #if HAS_GCC(4, 5) && defined(__OPTIMIZE__)
 #define fast_memcpy fast __attribute__((target("inline-all-stringops")))
 #else
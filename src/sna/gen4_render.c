@@ -549,7 +549,8 @@ gen4_bind_bo(struct sna *sna,
 	assert(sna->kgem.gen != 040 || !kgem_bo_is_snoop(bo));
 
 	/* After the first bind, we manage the cache domains within the batch */
-	offset = kgem_bo_get_binding(bo, format | is_dst << 31);
+	offset = kgem_bo_get_binding(&sna->kgem, bo, width, height,
+				     format | is_dst << 31);
 	if (offset) {
 		assert(offset >= sna->kgem.surface);
 		if (is_dst)
@@ -579,7 +580,8 @@ gen4_bind_bo(struct sna *sna,
 	ss[4] = 0;
 	ss[5] = 0;
 
-	kgem_bo_set_binding(bo, format | is_dst << 31, offset);
+	kgem_bo_set_binding(&sna->kgem, bo, width, height,
+			    format | is_dst << 31, offset);
 
 	DBG(("[%x] bind bo(handle=%d, addr=%d), format=%d, width=%d, height=%d, pitch=%d, tiling=%d -> %s\n",
 	     offset, bo->handle, ss[1],
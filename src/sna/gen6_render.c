@@ -1123,7 +1123,8 @@ gen6_bind_bo(struct sna *sna,
 	uint32_t is_scanout = is_dst && bo->scanout;
 
 	/* After the first bind, we manage the cache domains within the batch */
-	offset = kgem_bo_get_binding(bo, format | is_dst << 30 | is_scanout << 31);
+	offset = kgem_bo_get_binding(&sna->kgem, bo, width, height,
+				     format | is_dst << 30 | is_scanout << 31);
 	if (offset) {
 		DBG(("[%x]  bo(handle=%d), format=%d, reuse %s binding\n",
 		     offset, bo->handle, format,
@@ -1154,7 +1155,8 @@ gen6_bind_bo(struct sna *sna,
 	ss[4] = 0;
 	ss[5] = (is_scanout || bo->io) ? 0 : 3 << 16;
 
-	kgem_bo_set_binding(bo, format | is_dst << 30 | is_scanout << 31, offset);
+	kgem_bo_set_binding(&sna->kgem, bo, width, height,
+			    format | is_dst << 30 | is_scanout << 31, offset);
 
 	DBG(("[%x] bind bo(handle=%d, addr=%d), format=%d, width=%d, height=%d, pitch=%d, tiling=%d -> %s\n",
 	     offset, bo->handle, ss[1],
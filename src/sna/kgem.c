@@ -40,6 +40,8 @@
 #include <sched.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <xf86drm.h>
 
@@ -53,6 +55,7 @@
 #endif
 
 #include "sna_cpuid.h"
+#include "kgem_slab.h"
 
 static struct kgem_bo *
 search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
@@ -89,6 +92,7 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 #define DBG_NO_SCANOUT_Y 0
 #define DBG_NO_DIRTYFB 0
 #define DBG_NO_DETILING 0
+#define DBG_NO_SOFTPIN 0
 #define DBG_DUMP 0
 #define DBG_NO_MALLOC_CACHE 0
 
@@ -101,6 +105,8 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 #define SHOW_BATCH_BEFORE 0
 #define SHOW_BATCH_AFTER 0
 
+#define ASYNC_DEPTH 4 /* batches queued for the submission thread */
+
 #if 0
 #define ASSERT_IDLE(kgem__, handle__) assert(!__kgem_busy(kgem__, handle__))
 #define ASSERT_MAYBE_IDLE(kgem__, handle__, expect__) assert(!(expect__) || !__kgem_busy(kgem__, handle__))
@@ -125,7 +131,10 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 
 #define MAX_GTT_VMA_CACHE 512
 #define MAX_CPU_VMA_CACHE INT16_MAX
+#define DEFAULT_VMA_CACHE_SIZE ((sizeof(void *) == 4 ? 128ULL : 1024ULL) << 20)
 #define MAP_PRESERVE_TIME 10
+#define EXPIRE_SURPLUS_TIME (MAX_INACTIVE_TIME/2)
+#define EXPIRE_KEEP_TIME (EXPIRE_WINDOWS*MAX_INACTIVE_TIME)
 
 #define MAKE_USER_MAP(ptr) ((void*)((uintptr_t)(ptr) | 1))
 #define IS_USER_MAP(ptr) ((uintptr_t)(ptr) & 1)
@@ -141,12 +150,15 @@ search_snoop_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags);
 #define LOCAL_I915_PARAM_HAS_HANDLE_LUT		26
 #define LOCAL_I915_PARAM_HAS_WT			27
 #define LOCAL_I915_PARAM_MMAP_VERSION		30
+#define LOCAL_I915_PARAM_HAS_EXEC_SOFTPIN	37
 #define LOCAL_I915_PARAM_MMAP_GTT_COHERENT	52
 
 #define LOCAL_I915_EXEC_IS_PINNED		(1<<10)
 #define LOCAL_I915_EXEC_NO_RELOC		(1<<11)
 #define LOCAL_I915_EXEC_HANDLE_LUT		(1<<12)
 
+#define LOCAL_EXEC_OBJECT_PINNED		(1<<4)
+
 #define LOCAL_I915_GEM_CREATE2       0x34
 #define LOCAL_IOCTL_I915_GEM_CREATE2 DRM_IOWR (DRM_COMMAND_BASE + LOCAL_I915_GEM_CREATE2, struct local_i915_gem_create2)
 struct local_i915_gem_create2 {
@@ -222,8 +234,9 @@ enum {
 	MMAPPED_CPU
 };
 
-static struct kgem_bo *__kgem_freed_bo;
-static struct kgem_request *__kgem_freed_request;
+static struct kgem_slab_cache __kgem_bo_slab;
+static struct kgem_slab_cache __kgem_request_slab;
+static struct kgem_slab_cache __kgem_buffer_slab;
 static struct drm_i915_gem_exec_object2 _kgem_dummy_exec;
 
 static inline struct sna *__to_sna(struct kgem *kgem)
@@ -267,6 +280,87 @@ inline static int do_ioctl(int fd, unsigned long req, void *arg)
 	return __do_ioctl(fd, req, arg);
 }
 
+/* When enabled, finished batches are copied into a small ring and
+ * handed to a worker thread to perform the execbuffer, so that the
+ * relocation processing and validation by the kernel overlaps with
+ * constructing the next batch. Until the worker has called into the
+ * kernel for a batch, the kernel knows nothing about the work and so
+ * every query or synchronisation against one of its handles must first
+ * wait for the queue to drain.
+ */
+struct kgem_async_job {
+	struct drm_i915_gem_execbuffer2 execbuf;
+	struct drm_i915_gem_exec_object2 *exec;
+	struct drm_i915_gem_relocation_entry *reloc;
+	struct kgem_bo **bo;
+	uint32_t *close;
+	int nclose;
+	int ret;
+};
+
+struct kgem_async {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int fd;
+
+	/* reap <= head <= tail: [reap, head) are with the kernel awaiting
+	 * release of their references, [head, tail) are still queued.
+	 */
+	unsigned reap, head, tail;
+	bool error, recover, quit;
+
+	struct {
+		uint64_t queued;
+		uint64_t stalls;
+		uint64_t errors;
+	} stats;
+
+	struct kgem_async_job job[ASYNC_DEPTH];
+};
+
+static struct kgem_async_job *
+kgem_async_find(struct kgem_async *async, uint32_t handle)
+{
+	struct kgem_async_job *found = NULL;
+	unsigned n;
+	int i;
+
+	/* Only the main thread advances reap and tail */
+	if (async->reap == async->tail)
+		return NULL;
+
+	/* Newest first, the job that must outlive the handle */
+	pthread_mutex_lock(&async->mutex);
+	for (n = async->tail; found == NULL && n != async->head; n--) {
+		struct kgem_async_job *job = &async->job[(n - 1) % ASYNC_DEPTH];
+
+		for (i = 0; i < job->execbuf.buffer_count; i++) {
+			if (job->exec[i].handle == handle) {
+				found = job;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	return found;
+}
+
+static bool kgem_async_pending(struct kgem_async *async, uint32_t handle)
+{
+	return kgem_async_find(async, handle) != NULL;
+}
+
+static void kgem_bo_async_sync(struct kgem *kgem, struct kgem_bo *bo)
+{
+	if (kgem->async && bo->rq && kgem_async_pending(kgem->async, bo->handle)) {
+		DBG(("%s: handle=%d still queued for execbuffer\n",
+		     __FUNCTION__, bo->handle));
+		__kgem_async_sync(kgem);
+	}
+}
+
 #ifdef DEBUG_MEMORY
 static void debug_alloc(struct kgem *kgem, size_t size)
 {
@@ -476,6 +570,8 @@ static bool kgem_set_tiling(struct kgem *kgem, struct kgem_bo *bo,
 	if (DBG_NO_TILING)
 		return false;
 
+	kgem_bo_async_sync(kgem, bo);
+
 	VG_CLEAR(set_tiling);
 restart:
 	set_tiling.handle = bo->handle;
@@ -582,6 +678,46 @@ static bool __kgem_throttle_retire(struct kgem *kgem, unsigned flags)
 	return kgem_retire(kgem);
 }
 
+static void vma_mapped(struct kgem *kgem, int type, struct kgem_bo *bo)
+{
+	kgem->vma_stats.type[type].count++;
+	kgem->vma_stats.type[type].bytes += bytes(bo);
+}
+
+static void vma_unmapped(struct kgem *kgem, int type, struct kgem_bo *bo)
+{
+	assert(kgem->vma_stats.type[type].count);
+	assert(kgem->vma_stats.type[type].bytes >= bytes(bo));
+	kgem->vma_stats.type[type].count--;
+	kgem->vma_stats.type[type].bytes -= bytes(bo);
+}
+
+static void kgem_bo_unmap__gtt(struct kgem *kgem, struct kgem_bo *bo)
+{
+	assert(bo->map__gtt);
+	munmap(bo->map__gtt, bytes(bo));
+	bo->map__gtt = NULL;
+	vma_unmapped(kgem, VMA_GTT, bo);
+}
+
+static void kgem_bo_unmap__wc(struct kgem *kgem, struct kgem_bo *bo)
+{
+	assert(bo->map__wc);
+	VG(VALGRIND_MAKE_MEM_NOACCESS(bo->map__wc, bytes(bo)));
+	munmap(bo->map__wc, bytes(bo));
+	bo->map__wc = NULL;
+	vma_unmapped(kgem, VMA_WC, bo);
+}
+
+static void kgem_bo_unmap__cpu(struct kgem *kgem, struct kgem_bo *bo)
+{
+	assert(bo->map__cpu && !IS_USER_MAP(bo->map__cpu));
+	VG(VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map__cpu), bytes(bo)));
+	munmap(MAP(bo->map__cpu), bytes(bo));
+	bo->map__cpu = NULL;
+	vma_unmapped(kgem, VMA_CPU, bo);
+}
+
 static void *__kgem_bo_map__gtt(struct kgem *kgem, struct kgem_bo *bo)
 {
 	struct drm_i915_gem_mmap_gtt gtt;
@@ -632,7 +768,8 @@ retry_mmap:
 		ERR(("%s: failed to mmap handle=%d, %d bytes, into GTT domain: %d\n",
 		     __FUNCTION__, bo->handle, bytes(bo), err));
 		ptr = NULL;
-	}
+	} else
+		vma_mapped(kgem, VMA_GTT, bo);
 
 	/* Cache this mapping to avoid the overhead of an
 	 * excruciatingly slow GTT pagefault. This is more an
@@ -677,6 +814,7 @@ retry_wc:
 	VG(VALGRIND_MAKE_MEM_DEFINED(wc.addr_ptr, bytes(bo)));
 
 	DBG(("%s: caching CPU(wc) vma for %d\n", __FUNCTION__, bo->handle));
+	vma_mapped(kgem, VMA_WC, bo);
 	return bo->map__wc = (void *)(uintptr_t)wc.addr_ptr;
 }
 
@@ -711,6 +849,7 @@ retry:
 	VG(VALGRIND_MAKE_MEM_DEFINED(arg.addr_ptr, bytes(bo)));
 
 	DBG(("%s: caching CPU vma for %d\n", __FUNCTION__, bo->handle));
+	vma_mapped(kgem, VMA_CPU, bo);
 	return bo->map__cpu = (void *)(uintptr_t)arg.addr_ptr;
 }
 
@@ -783,6 +922,12 @@ bool __kgem_busy(struct kgem *kgem, int handle)
 {
 	struct drm_i915_gem_busy busy;
 
+	if (kgem->async && kgem_async_pending(kgem->async, handle)) {
+		DBG(("%s: handle=%d, queued for execbuffer\n",
+		     __FUNCTION__, handle));
+		return true;
+	}
+
 	VG_CLEAR(busy);
 	busy.handle = handle;
 	busy.busy = !kgem->wedged;
@@ -835,6 +980,7 @@ bool kgem_bo_write(struct kgem *kgem, struct kgem_bo *bo,
 	ASSERT_IDLE(kgem, bo->handle);
 
 	assert(length <= bytes(bo));
+	kgem_bo_async_sync(kgem, bo);
 retry:
 	ptr = NULL;
 	if (bo->domain == DOMAIN_CPU || (kgem->has_llc && !bo->scanout)) {
@@ -1000,22 +1146,57 @@ static struct kgem_bo *__kgem_bo_init(struct kgem_bo *bo,
 	list_init(&bo->request);
 	list_init(&bo->list);
 	list_init(&bo->vma);
+	list_init(&bo->vma_lru);
+	list_init(&bo->cache);
 
 	return bo;
 }
 
+static void *__kgem_struct_alloc(struct kgem_slab_cache *cache)
+{
+	if (DBG_NO_MALLOC_CACHE)
+		return malloc(cache->size);
+
+	return kgem_slab_alloc(cache);
+}
+
+/* Releases a bo, request or buffer struct back to its own slab */
+static void __kgem_struct_free(void *ptr)
+{
+	if (DBG_NO_MALLOC_CACHE)
+		free(ptr);
+	else
+		kgem_slab_free(ptr);
+}
+
+static void buffer_free(struct kgem_buffer *bo)
+{
+	if (bo->mmapped == MMAPPED_NONE)
+		free(bo->mem);
+	__kgem_struct_free(bo);
+}
+
+static void kgem_release_slabs(void)
+{
+	kgem_slab_cache_release(&__kgem_bo_slab);
+	kgem_slab_cache_release(&__kgem_request_slab);
+	kgem_slab_cache_release(&__kgem_buffer_slab);
+}
+
+void kgem_dump_slab_stats(void)
+{
+	kgem_slab_cache_dump(&__kgem_bo_slab);
+	kgem_slab_cache_dump(&__kgem_request_slab);
+	kgem_slab_cache_dump(&__kgem_buffer_slab);
+}
+
 static struct kgem_bo *__kgem_bo_alloc(int handle, int num_pages)
 {
 	struct kgem_bo *bo;
 
-	if (__kgem_freed_bo) {
-		bo = __kgem_freed_bo;
-		__kgem_freed_bo = *(struct kgem_bo **)bo;
-	} else {
-		bo = malloc(sizeof(*bo));
-		if (bo == NULL)
-			return NULL;
-	}
+	bo = __kgem_struct_alloc(&__kgem_bo_slab);
+	if (bo == NULL)
+		return NULL;
 
 	return __kgem_bo_init(bo, handle, num_pages);
 }
@@ -1027,14 +1208,9 @@ static struct kgem_request *__kgem_request_alloc(struct kgem *kgem)
 	if (unlikely(kgem->wedged)) {
 		rq = &kgem->static_request;
 	} else {
-		rq = __kgem_freed_request;
-		if (rq) {
-			__kgem_freed_request = *(struct kgem_request **)rq;
-		} else {
-			rq = malloc(sizeof(*rq));
-			if (rq == NULL)
-				rq = &kgem->static_request;
-		}
+		rq = __kgem_struct_alloc(&__kgem_request_slab);
+		if (rq == NULL)
+			rq = &kgem->static_request;
 	}
 
 	list_init(&rq->buffers);
@@ -1047,12 +1223,7 @@ static struct kgem_request *__kgem_request_alloc(struct kgem *kgem)
 static void __kgem_request_free(struct kgem_request *rq)
 {
 	_list_del(&rq->list);
-	if (DBG_NO_MALLOC_CACHE) {
-		free(rq);
-	} else {
-		*(struct kgem_request **)rq = __kgem_freed_request;
-		__kgem_freed_request = rq;
-	}
+	__kgem_struct_free(rq);
 }
 
 static struct list *inactive(struct kgem *kgem, int num_pages)
@@ -1069,6 +1240,93 @@ static struct list *active(struct kgem *kgem, int num_pages, int tiling)
 	return &kgem->active[cache_bucket(num_pages)][tiling];
 }
 
+inline static unsigned cache_class(int bucket, unsigned num_pages)
+{
+	if (cache_bucket(num_pages) < bucket)
+		return 0;
+
+	assert(cache_bucket(num_pages) == bucket);
+	if (bucket < CACHE_CLASS_SHIFT)
+		num_pages <<= CACHE_CLASS_SHIFT - bucket;
+	else
+		num_pages >>= bucket - CACHE_CLASS_SHIFT;
+	return num_pages & (NUM_CACHE_CLASSES - 1);
+}
+
+static void cache_index_init(struct kgem_cache_index *idx)
+{
+	int n;
+
+	for (n = 0; n < NUM_CACHE_CLASSES; n++)
+		list_init(&idx->size[n]);
+	idx->occupied = 0;
+}
+
+static void cache_index_add(struct kgem_cache_index *idx, struct kgem_bo *bo)
+{
+	unsigned class = cache_class(bucket(bo), num_pages(bo));
+
+	assert(bucket(bo) < NUM_CACHE_BUCKETS);
+	list_move(&bo->cache, &idx->size[class]);
+	idx->occupied |= 1 << class;
+}
+
+/* The occupied mask is only a hint; classes are emptied behind its back
+ * by kgem_bo_free() and friends, so stale bits are cleared as we find them.
+ */
+static struct kgem_bo *
+__cache_index_next(struct kgem *kgem, struct kgem_cache_index *idx,
+		   unsigned class)
+{
+	while (class < NUM_CACHE_CLASSES) {
+		uint32_t mask = idx->occupied >> class;
+		if (mask == 0)
+			break;
+
+		class += ffs(mask) - 1;
+		if (!list_is_empty(&idx->size[class])) {
+			kgem->cache_stats.scanned++;
+			return list_first_entry(&idx->size[class],
+						struct kgem_bo, cache);
+		}
+
+		idx->occupied &= ~(1 << class);
+		class++;
+	}
+
+	return NULL;
+}
+
+static struct kgem_bo *
+cache_index_first(struct kgem *kgem, struct kgem_cache_index *idx,
+		  int bucket, unsigned num_pages)
+{
+	return __cache_index_next(kgem, idx, cache_class(bucket, num_pages));
+}
+
+static struct kgem_bo *
+cache_index_next(struct kgem *kgem, struct kgem_cache_index *idx,
+		 struct kgem_bo *bo)
+{
+	unsigned class = cache_class(bucket(bo), num_pages(bo));
+
+	assert(bo->cache.next != &bo->cache);
+	if (bo->cache.next != &idx->size[class]) {
+		kgem->cache_stats.scanned++;
+		return list_entry(bo->cache.next, struct kgem_bo, cache);
+	}
+
+	return __cache_index_next(kgem, idx, class + 1);
+}
+
+/* Walk the candidates in a cache bucket that may hold at least num_pages,
+ * smallest size class first and most recently used first within each class.
+ */
+#define cache_index_for_each(bo, kgem, idx, bucket, num_pages) \
+	for (bo = cache_index_first(kgem, idx, bucket, num_pages); \
+	     bo; \
+	     bo = cache_index_next(kgem, idx, bo))
+
 static size_t
 agp_aperture_size(struct pci_device *dev, unsigned gen)
 {
@@ -1214,6 +1472,14 @@ static bool test_has_handle_lut(struct kgem *kgem)
 	return gem_param(kgem, LOCAL_I915_PARAM_HAS_HANDLE_LUT) > 0;
 }
 
+static bool test_has_softpin(struct kgem *kgem)
+{
+	if (DBG_NO_SOFTPIN)
+		return false;
+
+	return gem_param(kgem, LOCAL_I915_PARAM_HAS_EXEC_SOFTPIN) > 0;
+}
+
 static bool test_has_wt(struct kgem *kgem)
 {
 	if (DBG_NO_WT)
@@ -1617,7 +1883,7 @@ static bool kgem_init_pinned_batches(struct kgem *kgem)
 			ret = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_PIN, &pin);
 			if (ret) {
 				gem_close(kgem->fd, pin.handle);
-				free(bo);
+				__kgem_struct_free(bo);
 				goto err;
 			}
 			bo->presumed_offset = pin.offset;
@@ -1703,6 +1969,26 @@ static void kgem_init_swizzling(struct kgem *kgem)
 		choose_memcpy_tiled_x(kgem,
 				      tiling.swizzle_mode,
 				      __to_sna(kgem)->cpu_features);
+
+	/* The Y-tiling swizzle differs from X, so query it separately */
+	if (DBG_NO_DETILING || kgem->gen < 040)
+		goto out;
+
+	if (!gem_set_tiling(kgem->fd, tiling.handle, I915_TILING_Y, 512))
+		goto out;
+
+	if (do_ioctl(kgem->fd, LOCAL_IOCTL_I915_GEM_GET_TILING, &tiling))
+		goto out;
+
+	DBG(("%s: Y swizzle_mode=%d, phys_swizzle_mode=%d\n",
+	     __FUNCTION__, tiling.swizzle_mode, tiling.phys_swizzle_mode));
+
+	if (kgem->gen < 050 && tiling.phys_swizzle_mode != tiling.swizzle_mode)
+		goto out;
+
+	choose_memcpy_tiled_y(kgem,
+			      tiling.swizzle_mode,
+			      __to_sna(kgem)->cpu_features);
 out:
 	gem_close(kgem->fd, tiling.handle);
 	DBG(("%s: can fence?=%d\n", __FUNCTION__, kgem->can_fence));
@@ -1713,6 +1999,8 @@ static void kgem_fixup_relocs(struct kgem *kgem, struct kgem_bo *bo, int shrink)
 	int n;
 
 	bo->target_handle = kgem->has_handle_lut ? kgem->nexec : bo->handle;
+	if (kgem->vm)
+		kgem_vm_pin(kgem, bo);
 
 	assert(kgem->nreloc__self <= 256);
 	if (kgem->nreloc__self == 0)
@@ -1792,6 +2080,8 @@ static int kgem_bo_wait(struct kgem *kgem, struct kgem_bo *bo)
 	if (bo->rq == NULL)
 		return 0;
 
+	kgem_bo_async_sync(kgem, bo);
+
 	VG_CLEAR(wait);
 	wait.handle = bo->handle;
 	wait.flags = 0;
@@ -1973,6 +2263,13 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	kgem->expire = no_expire;
 	kgem->context_switch = no_context_switch;
 
+	kgem_slab_cache_init(&__kgem_bo_slab, "bo",
+			     sizeof(struct kgem_bo));
+	kgem_slab_cache_init(&__kgem_request_slab, "request",
+			     sizeof(struct kgem_request));
+	kgem_slab_cache_init(&__kgem_buffer_slab, "buffer",
+			     sizeof(struct kgem_buffer));
+
 	list_init(&kgem->requests[0]);
 	list_init(&kgem->requests[1]);
 	list_init(&kgem->batch_buffers);
@@ -1984,11 +2281,15 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	list_init(&kgem->scanout);
 	for (i = 0; i < ARRAY_SIZE(kgem->pinned_batches); i++)
 		list_init(&kgem->pinned_batches[i]);
-	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++)
+	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
 		list_init(&kgem->inactive[i]);
+		cache_index_init(&kgem->inactive_index[i]);
+	}
 	for (i = 0; i < ARRAY_SIZE(kgem->active); i++) {
-		for (j = 0; j < ARRAY_SIZE(kgem->active[i]); j++)
+		for (j = 0; j < ARRAY_SIZE(kgem->active[i]); j++) {
 			list_init(&kgem->active[i][j]);
+			cache_index_init(&kgem->active_index[i][j]);
+		}
 	}
 	for (i = 0; i < ARRAY_SIZE(kgem->vma); i++) {
 		for (j = 0; j < ARRAY_SIZE(kgem->vma[i].inactive); j++)
@@ -1996,6 +2297,10 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	}
 	kgem->vma[MAP_GTT].count = -MAX_GTT_VMA_CACHE;
 	kgem->vma[MAP_CPU].count = -MAX_CPU_VMA_CACHE;
+	list_init(&kgem->vma_lru);
+	kgem->vma_budget = DEFAULT_VMA_CACHE_SIZE;
+	kgem->demand.start = time(NULL);
+	kgem->binding.serial = 1;
 
 	kgem->has_blt = gem_param(kgem, LOCAL_I915_PARAM_HAS_BLT) > 0;
 	DBG(("%s: has BLT ring? %d\n", __FUNCTION__,
@@ -2046,6 +2351,10 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	DBG(("%s: has handle-lut? %d\n", __FUNCTION__,
 	     kgem->has_handle_lut));
 
+	kgem->has_softpin = test_has_softpin(kgem);
+	DBG(("%s: has softpin? %d\n", __FUNCTION__,
+	     kgem->has_softpin));
+
 	kgem->has_semaphores = false;
 	if (kgem->has_blt && test_has_semaphores_enabled(kgem))
 		kgem->has_semaphores = true;
@@ -2250,6 +2559,8 @@ void kgem_init(struct kgem *kgem, int fd, struct pci_device *dev, unsigned gen)
 	if (kgem->has_pinned_batches)
 		kgem->batch_flags_base |= LOCAL_I915_EXEC_IS_PINNED;
 
+	choose_memcpy_from_wc(kgem, __to_sna(kgem)->cpu_features);
+	choose_memcpy_nt(kgem, __to_sna(kgem)->cpu_features);
 	kgem_init_swizzling(kgem);
 }
 
@@ -2480,6 +2791,290 @@ static uint32_t kgem_aligned_height(struct kgem *kgem,
 	return ALIGN(height, tile_height);
 }
 
+/* With full-ppgtt we own the entire GPU address space of our context, and
+ * so we can choose where every object lives. Each object is assigned an
+ * address for its lifetime and the kernel is told to place it there
+ * (EXEC_OBJECT_PINNED). As the addresses written into the batch are then
+ * always correct, the relocation entries never need to be passed to the
+ * kernel. They are still recorded, as we use them to fixup the batch
+ * ourselves when it is compacted or its buffers replaced.
+ *
+ * The free space is kept as a list of holes in address order, and an
+ * object is placed in the smallest hole that fits. If we run out of
+ * space, we release the addresses of idle objects from the inactive cache,
+ * and failing that leave the object to be placed by the kernel.
+ */
+struct kgem_vm_hole {
+	struct list link;
+	uint64_t start, size;
+};
+
+struct kgem_vm {
+	uint64_t start, end;
+	struct list holes;
+	bool needs_relocs; /* for the current batch */
+	struct kgem_vm_stats stats;
+};
+
+/* Leave a guard page after each object for the CS prefetcher */
+#define VM_GUARD PAGE_SIZE
+
+static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo);
+
+static uint64_t vm_size(struct kgem_bo *bo)
+{
+	return (uint64_t)bytes(bo) + VM_GUARD;
+}
+
+static bool vm_alloc(struct kgem_vm *vm, uint64_t size, uint64_t *addr)
+{
+	struct kgem_vm_hole *hole, *best = NULL;
+
+	list_for_each_entry(hole, &vm->holes, link) {
+		if (hole->size < size)
+			continue;
+
+		if (best == NULL || hole->size < best->size) {
+			best = hole;
+			if (hole->size == size)
+				break;
+		}
+	}
+	if (best == NULL)
+		return false;
+
+	*addr = best->start;
+	best->start += size;
+	best->size -= size;
+	if (best->size == 0) {
+		list_del(&best->link);
+		free(best);
+		vm->stats.holes--;
+	}
+
+	vm->stats.allocated += size;
+	return true;
+}
+
+static void vm_free(struct kgem_vm *vm, uint64_t addr, uint64_t size)
+{
+	struct kgem_vm_hole *prev = NULL, *next = NULL, *hole;
+	struct list *pos = &vm->holes;
+
+	assert(vm->stats.allocated >= size);
+	vm->stats.allocated -= size;
+
+	list_for_each_entry(hole, &vm->holes, link) {
+		if (hole->start > addr) {
+			next = hole;
+			pos = &hole->link;
+			break;
+		}
+		prev = hole;
+	}
+	assert(prev == NULL || prev->start + prev->size <= addr);
+	assert(next == NULL || addr + size <= next->start);
+
+	if (prev && prev->start + prev->size == addr) {
+		prev->size += size;
+		if (next && prev->start + prev->size == next->start) {
+			prev->size += next->size;
+			list_del(&next->link);
+			free(next);
+			vm->stats.holes--;
+		}
+		return;
+	}
+
+	if (next && addr + size == next->start) {
+		next->start = addr;
+		next->size += size;
+		return;
+	}
+
+	hole = malloc(sizeof(*hole));
+	if (hole == NULL) {
+		/* Leak the range rather than risk reusing it */
+		vm->stats.leaked += size;
+		return;
+	}
+
+	hole->start = addr;
+	hole->size = size;
+	list_add_tail(&hole->link, pos);
+	vm->stats.holes++;
+}
+
+static void kgem_vm_release(struct kgem *kgem, struct kgem_bo *bo)
+{
+	if (!bo->softpin)
+		return;
+
+	DBG(("%s: handle=%d, offset=%llx\n",
+	     __FUNCTION__, bo->handle, (long long)bo->presumed_offset));
+
+	bo->softpin = false;
+	if (kgem->vm == NULL)
+		return;
+
+	vm_free(kgem->vm, bo->presumed_offset, vm_size(bo));
+	kgem->vm->stats.frees++;
+}
+
+static bool kgem_vm_evict(struct kgem *kgem, uint64_t size, uint64_t *addr)
+{
+	struct kgem_vm *vm = kgem->vm;
+	int i;
+
+	/* Release the oldest idle objects, largest first, until we fit */
+	for (i = ARRAY_SIZE(kgem->inactive); i--; ) {
+		while (!list_is_empty(&kgem->inactive[i])) {
+			struct kgem_bo *bo;
+
+			bo = list_last_entry(&kgem->inactive[i],
+					     struct kgem_bo, list);
+			if (!bo->softpin)
+				break;
+
+			DBG(("%s: evicting handle=%d, size=%d\n",
+			     __FUNCTION__, bo->handle, bytes(bo)));
+			vm->stats.evictions++;
+			vm->stats.evicted += vm_size(bo);
+			kgem_bo_free(kgem, bo);
+
+			if (vm_alloc(vm, size, addr))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static bool kgem_vm_pin(struct kgem *kgem, struct kgem_bo *bo)
+{
+	struct kgem_vm *vm = kgem->vm;
+	uint64_t addr, size;
+
+	assert(bo->proxy == NULL);
+	if (bo->softpin)
+		return true;
+
+	size = vm_size(bo);
+	if (!vm_alloc(vm, size, &addr) && !kgem_vm_evict(kgem, size, &addr)) {
+		DBG(("%s: no space for handle=%d, size=%d\n",
+		     __FUNCTION__, bo->handle, bytes(bo)));
+		vm->stats.failures++;
+		vm->needs_relocs = true;
+		return false;
+	}
+
+	DBG(("%s: handle=%d, offset=%llx\n",
+	     __FUNCTION__, bo->handle, (long long)addr));
+	vm->stats.allocs++;
+	bo->presumed_offset = addr;
+	bo->softpin = true;
+	return true;
+}
+
+static void kgem_exec_pin(struct kgem *kgem, struct kgem_bo *bo,
+			  struct drm_i915_gem_exec_object2 *exec)
+{
+	if (kgem->vm == NULL)
+		return;
+
+	if (kgem_vm_pin(kgem, bo))
+		exec->flags |= LOCAL_EXEC_OBJECT_PINNED;
+	else
+		exec->flags &= ~LOCAL_EXEC_OBJECT_PINNED;
+	exec->offset = bo->presumed_offset;
+}
+
+bool kgem_vm_init(struct kgem *kgem)
+{
+	struct kgem_vm_hole *hole;
+	struct kgem_vm *vm;
+
+	/* Objects keep their addresses across server generations */
+	if (kgem->vm)
+		return true;
+
+	if (!kgem->has_softpin || !kgem->has_full_ppgtt)
+		return false;
+
+	vm = calloc(1, sizeof(*vm));
+	if (vm == NULL)
+		return false;
+
+	hole = malloc(sizeof(*hole));
+	if (hole == NULL) {
+		free(vm);
+		return false;
+	}
+
+	/* Keep clear of the zero page, as we treat offset 0 as unknown */
+	vm->start = 1024 * 1024;
+	vm->end = kgem->aperture_total;
+	list_init(&vm->holes);
+
+	hole->start = vm->start;
+	hole->size = vm->end - vm->start;
+	list_add(&hole->link, &vm->holes);
+	vm->stats.holes = 1;
+
+	DBG(("%s: managing [%llx, %llx)\n", __FUNCTION__,
+	     (long long)vm->start, (long long)vm->end));
+
+	kgem->vm = vm;
+	return true;
+}
+
+void kgem_vm_fini(struct kgem *kgem)
+{
+	struct kgem_vm *vm = kgem->vm;
+
+	if (vm == NULL)
+		return;
+
+	DBG(("%s: allocs=%lld, frees=%lld, failures=%lld, evictions=%lld (%lld bytes), holes=%d\n",
+	     __FUNCTION__,
+	     (long long)vm->stats.allocs,
+	     (long long)vm->stats.frees,
+	     (long long)vm->stats.failures,
+	     (long long)vm->stats.evictions,
+	     (long long)vm->stats.evicted,
+	     vm->stats.holes));
+
+	/* Objects that outlive us simply forget their address */
+	kgem->vm = NULL;
+
+	while (!list_is_empty(&vm->holes)) {
+		struct kgem_vm_hole *hole;
+
+		hole = list_first_entry(&vm->holes, struct kgem_vm_hole, link);
+		list_del(&hole->link);
+		free(hole);
+	}
+	free(vm);
+}
+
+void kgem_vm_get_stats(struct kgem *kgem, struct kgem_vm_stats *stats)
+{
+	struct kgem_vm *vm = kgem->vm;
+	struct kgem_vm_hole *hole;
+
+	if (vm == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	*stats = vm->stats;
+	stats->size = vm->end - vm->start;
+	stats->largest_hole = 0;
+	list_for_each_entry(hole, &vm->holes, link)
+		if (hole->size > stats->largest_hole)
+			stats->largest_hole = hole->size;
+}
+
 static struct drm_i915_gem_exec_object2 *
 kgem_add_handle(struct kgem *kgem, struct kgem_bo *bo)
 {
@@ -2493,6 +3088,7 @@ kgem_add_handle(struct kgem *kgem, struct kgem_bo *bo)
 	exec = memset(&kgem->exec[kgem->nexec++], 0, sizeof(*exec));
 	exec->handle = bo->handle;
 	exec->offset = bo->presumed_offset;
+	kgem_exec_pin(kgem, bo, exec);
 
 	kgem->aperture += num_pages(bo);
 
@@ -2550,18 +3146,80 @@ static uint32_t kgem_end_batch(struct kgem *kgem)
 	return kgem->nbatch;
 }
 
-static void kgem_bo_binding_free(struct kgem *kgem, struct kgem_bo *bo)
+/* Idle mappings are kept both on the per-bucket vma lists, for reuse by
+ * the allocator, and on a single lru in the order they became idle,
+ * which is what we trim against the byte budget.
+ */
+static void kgem_vma_cache_add(struct kgem *kgem, struct kgem_bo *bo, int type)
+{
+	assert(list_is_empty(&bo->vma));
+	assert(list_is_empty(&bo->vma_lru));
+
+	list_add(&bo->vma, &kgem->vma[type].inactive[bucket(bo)]);
+	kgem->vma[type].count++;
+
+	list_add(&bo->vma_lru, &kgem->vma_lru);
+	kgem->vma_stats.cached += bytes(bo);
+}
+
+static void kgem_vma_cache_del(struct kgem *kgem, struct kgem_bo *bo)
 {
-	struct kgem_bo_binding *b;
+	assert(!list_is_empty(&bo->vma));
 
-	b = bo->binding.next;
-	while (b) {
-		struct kgem_bo_binding *next = b->next;
-		free(b);
-		b = next;
+	list_del(&bo->vma);
+	kgem->vma[bo->map__gtt == NULL && bo->map__wc == NULL].count--;
+
+	if (!list_is_empty(&bo->vma_lru)) {
+		assert(kgem->vma_stats.cached >= bytes(bo));
+		list_del(&bo->vma_lru);
+		kgem->vma_stats.cached -= bytes(bo);
+	}
+}
+
+static void kgem_vma_evict(struct kgem *kgem, struct kgem_bo *bo)
+{
+	int type = bo->map__gtt == NULL && bo->map__wc == NULL;
+
+	DBG(("%s: discarding inactive %s vma cache for %d\n",
+	     __FUNCTION__, type ? "CPU" : "GTT", bo->handle));
+
+	assert(bo->rq == NULL);
+	assert(bo->refcnt == 0);
+
+	kgem->vma_stats.evictions++;
+	kgem->vma_stats.evicted += bytes(bo);
+	kgem_vma_cache_del(kgem, bo);
+
+	if (type) {
+		kgem_bo_unmap__cpu(kgem, bo);
+	} else {
+		if (bo->map__wc)
+			kgem_bo_unmap__wc(kgem, bo);
+		if (bo->map__gtt)
+			kgem_bo_unmap__gtt(kgem, bo);
 	}
 }
 
+static void kgem_async_close(struct kgem *kgem, uint32_t handle)
+{
+	struct kgem_async_job *job;
+
+	/* The worker may yet pass the handle to the kernel, so the job
+	 * closes it once reaped. The job is only released by this thread,
+	 * so it is safe to use after the worker has moved on.
+	 */
+	job = kgem_async_find(kgem->async, handle);
+	if (job == NULL) {
+		gem_close(kgem->fd, handle);
+		return;
+	}
+
+	DBG(("%s: handle=%d still queued, deferring close\n",
+	     __FUNCTION__, handle));
+	assert(job->nclose < job->execbuf.buffer_count);
+	job->close[job->nclose++] = handle;
+}
+
 static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo)
 {
 	DBG(("%s: handle=%d, size=%d\n", __FUNCTION__, bo->handle, bytes(bo)));
@@ -2575,7 +3233,6 @@ static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo)
 	kgem->debug_memory.bo_bytes -= bytes(bo);
 #endif
 
-	kgem_bo_binding_free(kgem, bo);
 	kgem_bo_rmfb(kgem, bo);
 
 	if (IS_USER_MAP(bo->map__cpu)) {
@@ -2594,31 +3251,29 @@ static void kgem_bo_free(struct kgem *kgem, struct kgem_bo *bo)
 	     __FUNCTION__, bo->map__gtt, bo->map__cpu,
 	     bo->handle, list_is_empty(&bo->vma) ? 0 : kgem->vma[bo->map__gtt == NULL && bo->map__wc == NULL].count));
 
-	if (!list_is_empty(&bo->vma)) {
-		_list_del(&bo->vma);
-		kgem->vma[bo->map__gtt == NULL && bo->map__wc == NULL].count--;
-	}
+	if (!list_is_empty(&bo->vma))
+		kgem_vma_cache_del(kgem, bo);
 
 	if (bo->map__gtt)
-		munmap(bo->map__gtt, bytes(bo));
-	if (bo->map__wc) {
-		VG(VALGRIND_MAKE_MEM_NOACCESS(bo->map__wc, bytes(bo)));
-		munmap(bo->map__wc, bytes(bo));
-	}
-	if (bo->map__cpu) {
-		VG(VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map__cpu), bytes(bo)));
-		munmap(MAP(bo->map__cpu), bytes(bo));
-	}
+		kgem_bo_unmap__gtt(kgem, bo);
+	if (bo->map__wc)
+		kgem_bo_unmap__wc(kgem, bo);
+	if (bo->map__cpu)
+		kgem_bo_unmap__cpu(kgem, bo);
 
 	_list_del(&bo->list);
+	_list_del(&bo->cache);
 	_list_del(&bo->request);
-	gem_close(kgem->fd, bo->handle);
+	kgem_vm_release(kgem, bo);
+	if (kgem->async)
+		kgem_async_close(kgem, bo->handle);
+	else
+		gem_close(kgem->fd, bo->handle);
 
-	if (!bo->io && !DBG_NO_MALLOC_CACHE) {
-		*(struct kgem_bo **)bo = __kgem_freed_bo;
-		__kgem_freed_bo = bo;
-	} else
-		free(bo);
+	if (bo->io)
+		buffer_free((struct kgem_buffer *)bo);
+	else
+		__kgem_struct_free(bo);
 }
 
 inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
@@ -2647,8 +3302,7 @@ inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
 		if (bo->map__gtt) {
 			DBG(("%s: relinquishing large GTT mapping for handle=%d\n",
 			     __FUNCTION__, bo->handle));
-			munmap(bo->map__gtt, bytes(bo));
-			bo->map__gtt = NULL;
+			kgem_bo_unmap__gtt(kgem, bo);
 		}
 
 		list_move(&bo->list, &kgem->large_inactive);
@@ -2656,20 +3310,19 @@ inline static void kgem_bo_move_to_inactive(struct kgem *kgem,
 		assert(bo->flush == false);
 		assert(list_is_empty(&bo->vma));
 		list_move(&bo->list, &kgem->inactive[bucket(bo)]);
+		cache_index_add(&kgem->inactive_index[bucket(bo)], bo);
 		if (bo->map__gtt && !kgem_bo_can_map(kgem, bo)) {
 			DBG(("%s: relinquishing old GTT mapping for handle=%d\n",
 			     __FUNCTION__, bo->handle));
-			munmap(bo->map__gtt, bytes(bo));
-			bo->map__gtt = NULL;
-		}
-		if (bo->map__gtt || (bo->map__wc && !bo->tiling)) {
-			list_add(&bo->vma, &kgem->vma[0].inactive[bucket(bo)]);
-			kgem->vma[0].count++;
-		}
-		if (bo->map__cpu && list_is_empty(&bo->vma)) {
-			list_add(&bo->vma, &kgem->vma[1].inactive[bucket(bo)]);
-			kgem->vma[1].count++;
+			kgem_bo_unmap__gtt(kgem, bo);
 		}
+		if (bo->map__gtt || (bo->map__wc && !bo->tiling))
+			kgem_vma_cache_add(kgem, bo, MAP_GTT);
+		if (bo->map__cpu && list_is_empty(&bo->vma))
+			kgem_vma_cache_add(kgem, bo, MAP_CPU);
+
+		/* Remember when this bo became idle for kgem_expire_cache() */
+		bo->delta = time(NULL);
 	}
 
 	kgem->need_expire = true;
@@ -2687,11 +3340,7 @@ static struct kgem_bo *kgem_bo_replace_io(struct kgem_bo *bo)
 	assert(!bo->scanout);
 	assert(!bo->delta);
 
-	if (__kgem_freed_bo) {
-		base = __kgem_freed_bo;
-		__kgem_freed_bo = *(struct kgem_bo **)base;
-	} else
-		base = malloc(sizeof(*base));
+	base = __kgem_struct_alloc(&__kgem_bo_slab);
 	if (base) {
 		DBG(("%s: transferring io handle=%d to bo\n",
 		     __FUNCTION__, bo->handle));
@@ -2699,9 +3348,12 @@ static struct kgem_bo *kgem_bo_replace_io(struct kgem_bo *bo)
 		memcpy(base, bo, sizeof(*base));
 		base->io = false;
 		list_init(&base->list);
+		list_init(&base->cache);
 		list_replace(&bo->request, &base->request);
 		list_replace(&bo->vma, &base->vma);
-		free(bo);
+		assert(list_is_empty(&bo->vma_lru));
+		list_init(&base->vma_lru);
+		buffer_free((struct kgem_buffer *)bo);
 		bo = base;
 	} else
 		bo->reusable = false;
@@ -2715,13 +3367,13 @@ inline static void kgem_bo_remove_from_inactive(struct kgem *kgem,
 	DBG(("%s: removing handle=%d from inactive\n", __FUNCTION__, bo->handle));
 
 	list_del(&bo->list);
+	list_del(&bo->cache);
 	assert(bo->rq == NULL);
 	assert(bo->exec == NULL);
 	assert(!bo->purged);
 	if (!list_is_empty(&bo->vma)) {
 		assert(bo->map__gtt || bo->map__wc || bo->map__cpu);
-		list_del(&bo->vma);
-		kgem->vma[bo->map__gtt == NULL && bo->map__wc == NULL].count--;
+		kgem_vma_cache_del(kgem, bo);
 	}
 }
 
@@ -2731,6 +3383,7 @@ inline static void kgem_bo_remove_from_active(struct kgem *kgem,
 	DBG(("%s: removing handle=%d from active\n", __FUNCTION__, bo->handle));
 
 	list_del(&bo->list);
+	list_del(&bo->cache);
 	assert(bo->rq != NULL);
 	if (RQ(bo->rq) == (void *)kgem) {
 		assert(bo->exec == NULL);
@@ -2997,8 +3650,6 @@ static void __kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 	assert(bo->active_scanout == 0);
 	assert_tiling(kgem, bo);
 
-	bo->binding.offset = 0;
-
 	if (DBG_NO_CACHE)
 		goto destroy;
 
@@ -3049,9 +3700,10 @@ static void __kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 		struct list *cache;
 
 		DBG(("%s: handle=%d -> active\n", __FUNCTION__, bo->handle));
-		if (bucket(bo) < NUM_CACHE_BUCKETS)
+		if (bucket(bo) < NUM_CACHE_BUCKETS) {
 			cache = &kgem->active[bucket(bo)][bo->tiling];
-		else
+			cache_index_add(&kgem->active_index[bucket(bo)][bo->tiling], bo);
+		} else
 			cache = &kgem->large;
 		list_add(&bo->list, cache);
 		return;
@@ -3464,7 +4116,6 @@ static void kgem_commit(struct kgem *kgem)
 			continue;
 		}
 
-		bo->binding.offset = 0;
 		bo->domain = DOMAIN_GPU;
 		bo->gpu_dirty = false;
 		bo->gtt_dirty = false;
@@ -3514,6 +4165,7 @@ static void kgem_commit(struct kgem *kgem)
 		assert(rq->bo->map__gtt == NULL);
 		assert(rq->bo->map__wc == NULL);
 		assert(rq->bo->map__cpu == NULL);
+		kgem_vm_release(kgem, rq->bo);
 		gem_close(kgem->fd, rq->bo->handle);
 		kgem_cleanup_cache(kgem);
 	} else {
@@ -3631,6 +4283,7 @@ static void kgem_finish_buffers(struct kgem *kgem)
 				if (map) {
 					memcpy(map, bo->mem, bo->used);
 
+					kgem_exec_pin(kgem, shrink, bo->base.exec);
 					shrink->target_handle =
 						kgem->has_handle_lut ? bo->base.target_handle : shrink->handle;
 					for (n = 0; n < kgem->nreloc; n++) {
@@ -3679,6 +4332,7 @@ static void kgem_finish_buffers(struct kgem *kgem)
 				assert(bo->used <= bytes(shrink));
 				if (gem_write__cachealigned(kgem->fd, shrink->handle,
 							    0, bo->used, bo->mem) == 0) {
+					kgem_exec_pin(kgem, shrink, bo->base.exec);
 					shrink->target_handle =
 						kgem->has_handle_lut ? bo->base.target_handle : shrink->handle;
 					for (n = 0; n < kgem->nreloc; n++) {
@@ -3735,6 +4389,8 @@ static void kgem_cleanup(struct kgem *kgem)
 {
 	int n;
 
+	kgem_async_sync(kgem);
+
 	for (n = 0; n < ARRAY_SIZE(kgem->requests); n++) {
 		while (!list_is_empty(&kgem->requests[n])) {
 			struct kgem_request *rq;
@@ -3862,6 +4518,31 @@ expire:
 	return ret;
 }
 
+static void kgem_reset_bindings(struct kgem *kgem)
+{
+	if (kgem->binding.count) {
+		struct kgem_binding_stats *stats = &kgem->binding.stats;
+
+		DBG(("%s: %d surface states, %d binds shared\n",
+		     __FUNCTION__, kgem->binding.count, kgem->binding.shared));
+
+		stats->batches++;
+		stats->states += kgem->binding.count;
+		stats->shared += kgem->binding.shared;
+		if (kgem->binding.shared > stats->max_shared)
+			stats->max_shared = kgem->binding.shared;
+	}
+
+	kgem->binding.count = 0;
+	kgem->binding.shared = 0;
+
+	/* Serial 0 marks an unused slot of the table */
+	if (++kgem->binding.serial == 0) {
+		memset(kgem->binding.cache, 0, sizeof(kgem->binding.cache));
+		kgem->binding.serial = 1;
+	}
+}
+
 void kgem_reset(struct kgem *kgem)
 {
 	if (kgem->next_request) {
@@ -3876,7 +4557,6 @@ void kgem_reset(struct kgem *kgem)
 
 			assert(RQ(bo->rq) == rq);
 
-			bo->binding.offset = 0;
 			bo->exec = NULL;
 			bo->target_handle = -1;
 			bo->gpu_dirty = false;
@@ -3905,11 +4585,14 @@ void kgem_reset(struct kgem *kgem)
 	kgem->nexec = 0;
 	kgem->nreloc = 0;
 	kgem->nreloc__self = 0;
+	if (kgem->vm)
+		kgem->vm->needs_relocs = false;
 	kgem->aperture = 0;
 	kgem->aperture_fenced = 0;
 	kgem->aperture_max_fence = 0;
 	kgem->nbatch = 0;
 	kgem->surface = kgem->batch_size;
+	kgem_reset_bindings(kgem);
 	kgem->mode = KGEM_NONE;
 	kgem->needs_semaphore = false;
 	kgem->needs_reservation = false;
@@ -4077,57 +4760,382 @@ static void dump_debugfs(struct kgem *kgem, const char *name)
 		return;
 }
 
-static void dump_gtt_info(struct kgem *kgem)
-{
-	dump_debugfs(kgem, "i915_gem_gtt");
-}
+static void dump_gtt_info(struct kgem *kgem)
+{
+	dump_debugfs(kgem, "i915_gem_gtt");
+}
+
+static void dump_fence_regs(struct kgem *kgem)
+{
+	dump_debugfs(kgem, "i915_gem_fence_regs");
+}
+#endif
+
+static int do_execbuf(struct kgem *kgem, struct drm_i915_gem_execbuffer2 *execbuf)
+{
+	int ret;
+
+retry:
+	ret = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, execbuf);
+	if (ret == 0)
+		return 0;
+
+	DBG(("%s: failed ret=%d, throttling and discarding cache\n", __FUNCTION__, ret));
+	(void)__kgem_throttle_retire(kgem, 0);
+	if (kgem_expire_cache(kgem))
+		goto retry;
+
+	if (kgem_cleanup_cache(kgem))
+		goto retry;
+
+	/* last gasp */
+	ret = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, execbuf);
+	if (ret != -ENOSPC)
+		return ret;
+
+	/* One final trick up our sleeve for when we run out of space.
+	 * We turn everything off to free up our pinned framebuffers,
+	 * sprites and cursors, and try just one more time.
+	 */
+
+	xf86DrvMsg(kgem_get_screen_index(kgem), X_WARNING,
+		   "Failed to submit rendering commands, trying again with outputs disabled.\n");
+
+	if (sna_mode_disable(__to_sna(kgem))) {
+		kgem_cleanup_cache(kgem);
+		ret = do_ioctl(kgem->fd,
+			       DRM_IOCTL_I915_GEM_EXECBUFFER2,
+			       execbuf);
+		DBG(("%s: last_gasp ret=%d\n", __FUNCTION__, ret));
+		sna_mode_enable(__to_sna(kgem));
+	}
+
+	return ret;
+}
+
+static void *kgem_async_thread(void *arg)
+{
+	struct kgem_async *async = arg;
+	sigset_t signals;
+
+	/* Disable all signals in the worker as X uses them for IO */
+	sigfillset(&signals);
+	sigdelset(&signals, SIGBUS);
+	sigdelset(&signals, SIGSEGV);
+	pthread_sigmask(SIG_SETMASK, &signals, NULL);
+
+	pthread_mutex_lock(&async->mutex);
+	while (!async->quit) {
+		struct kgem_async_job *job;
+
+		if (async->error || async->head == async->tail) {
+			pthread_cond_wait(&async->cond, &async->mutex);
+			continue;
+		}
+
+		job = &async->job[async->head % ASYNC_DEPTH];
+		pthread_mutex_unlock(&async->mutex);
+
+		job->ret = do_ioctl(async->fd,
+				    DRM_IOCTL_I915_GEM_EXECBUFFER2,
+				    &job->execbuf);
+
+		pthread_mutex_lock(&async->mutex);
+		if (job->ret)
+			async->error = true; /* main thread takes over */
+		else
+			async->head++;
+		pthread_cond_broadcast(&async->cond);
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	return NULL;
+}
+
+static void kgem_async_reap(struct kgem *kgem)
+{
+	struct kgem_async *async = kgem->async;
+	unsigned head;
+	int i;
+
+	pthread_mutex_lock(&async->mutex);
+	head = async->head;
+	pthread_mutex_unlock(&async->mutex);
+
+	while (async->reap != head) {
+		struct kgem_async_job *job = &async->job[async->reap % ASYNC_DEPTH];
+
+		DBG(("%s: releasing job %d, %d buffers\n",
+		     __FUNCTION__, async->reap, job->execbuf.buffer_count));
+		async->reap++;
+
+		for (i = 0; i < job->execbuf.buffer_count; i++) {
+			struct kgem_bo *bo = job->bo[i];
+
+			if (bo == NULL)
+				continue;
+
+			assert(bo->handle == job->exec[i].handle);
+			if (bo->exec == NULL)
+				bo->presumed_offset = job->exec[i].offset;
+			kgem_bo_destroy(kgem, bo);
+		}
+
+		for (i = 0; i < job->nclose; i++)
+			gem_close(kgem->fd, job->close[i]);
+		job->nclose = 0;
+
+		job->execbuf.buffer_count = 0;
+	}
+}
+
+static void kgem_async_recover(struct kgem *kgem)
+{
+	struct kgem_async *async = kgem->async;
+	struct kgem_async_job *job = &async->job[async->head % ASYNC_DEPTH];
+	int ret = job->ret;
+
+	/* The worker has stopped after a failed execbuffer, so retry it
+	 * here where we can throttle and discard our caches in order
+	 * to make room, exactly as for synchronous submission.
+	 */
+	DBG(("%s: job %d failed ret=%d\n", __FUNCTION__, async->head, ret));
+	async->stats.errors++;
+
+	async->recover = true;
+	if (!kgem->wedged)
+		ret = do_execbuf(kgem, &job->execbuf);
+	async->recover = false;
+
+	if (ret < 0 && !kgem->wedged) {
+		kgem_throttle(kgem);
+		if (!kgem->wedged) {
+			xf86DrvMsg(kgem_get_screen_index(kgem), X_ERROR,
+				   "Failed to submit rendering commands (%s), disabling acceleration.\n",
+				   strerror(-ret));
+			__kgem_set_wedged(kgem);
+		}
+	}
+
+	pthread_mutex_lock(&async->mutex);
+	async->error = false;
+	async->head++;
+	pthread_cond_broadcast(&async->cond);
+	pthread_mutex_unlock(&async->mutex);
+}
+
+void __kgem_async_sync(struct kgem *kgem)
+{
+	struct kgem_async *async = kgem->async;
+	bool error;
+
+	/* do_execbuf() may wait upon our own requests whilst recovering */
+	if (async->recover)
+		return;
+
+	DBG(("%s: queued=%d\n", __FUNCTION__, async->tail - async->head));
+
+	do {
+		pthread_mutex_lock(&async->mutex);
+		while (async->head != async->tail && !async->error)
+			pthread_cond_wait(&async->cond, &async->mutex);
+		error = async->error;
+		pthread_mutex_unlock(&async->mutex);
+
+		if (error)
+			kgem_async_recover(kgem);
+	} while (error);
+
+	kgem_async_reap(kgem);
+	assert(async->reap == async->tail);
+}
+
+static bool kgem_async_allowed(struct kgem *kgem)
+{
+	struct kgem_request *rq = kgem->next_request;
+	struct kgem_bo *bo;
+
+	if (DEBUG_SYNC || SHOW_BATCH_AFTER)
+		return false;
+
+	/* kgem_commit() waits upon the batch after an allocation failure */
+	if (rq == &kgem->static_request)
+		return false;
+
+	/* Buffers shared outside of kgem (the scanout, DRI clients and
+	 * prime) may be inspected by others as soon as we return, so
+	 * they must be known to the kernel before then.
+	 */
+	list_for_each_entry(bo, &rq->buffers, request) {
+		if (bo->scanout || bo->flush || bo->prime) {
+			DBG(("%s: handle=%d is shared, submitting synchronously\n",
+			     __FUNCTION__, bo->handle));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int kgem_async_queue(struct kgem *kgem,
+			    struct drm_i915_gem_execbuffer2 *execbuf)
+{
+	struct kgem_async *async = kgem->async;
+	struct kgem_async_job *job;
+	struct kgem_bo *bo;
+	int n;
+
+	kgem_async_reap(kgem);
+	while (async->tail - async->reap == ASYNC_DEPTH) {
+		bool error;
+
+		DBG(("%s: queue full, waiting for the oldest batch\n",
+		     __FUNCTION__));
+		async->stats.stalls++;
+
+		pthread_mutex_lock(&async->mutex);
+		while (async->head == async->reap && !async->error)
+			pthread_cond_wait(&async->cond, &async->mutex);
+		error = async->error;
+		pthread_mutex_unlock(&async->mutex);
+
+		if (error)
+			kgem_async_recover(kgem);
+		kgem_async_reap(kgem);
+	}
+
+	/* The exec and reloc arrays are reused for the next batch as soon
+	 * as we return, so hand the worker its own copy.
+	 */
+	job = &async->job[async->tail % ASYNC_DEPTH];
+	assert(job->execbuf.buffer_count == 0);
+	assert(execbuf->buffer_count == kgem->nexec);
+
+	memcpy(job->exec, kgem->exec, kgem->nexec * sizeof(kgem->exec[0]));
+	memcpy(job->reloc, kgem->reloc, kgem->nreloc * sizeof(kgem->reloc[0]));
+	job->exec[kgem->nexec - 1].relocs_ptr = (uintptr_t)job->reloc;
+
+	job->execbuf = *execbuf;
+	job->execbuf.buffers_ptr = (uintptr_t)job->exec;
+	job->ret = 0;
+
+	/* Hold the buffers someone still owns so that we can report the
+	 * kernel's placement back to them. Unowned buffers (the caches and
+	 * those kgem_commit() is about to free) must not be resurrected;
+	 * should they be freed before the worker is done, kgem_bo_free()
+	 * leaves closing their handle to this job.
+	 */
+	assert(job->nclose == 0);
+	memset(job->bo, 0, kgem->nexec * sizeof(job->bo[0]));
+	n = 0;
+	list_for_each_entry(bo, &kgem->next_request->buffers, request) {
+		if (bo->proxy)
+			continue;
+
+		assert(bo->exec >= kgem->exec && bo->exec < kgem->exec + kgem->nexec);
+		if (bo->refcnt)
+			job->bo[bo->exec - kgem->exec] = kgem_bo_reference(bo);
+		n++;
+	}
+	assert(n == kgem->nexec);
+	(void)n;
+
+	DBG(("%s: job %d, nexec=%d, nreloc=%d\n",
+	     __FUNCTION__, async->tail, kgem->nexec, kgem->nreloc));
+
+	pthread_mutex_lock(&async->mutex);
+	async->tail++;
+	async->stats.queued++;
+	pthread_cond_broadcast(&async->cond);
+	pthread_mutex_unlock(&async->mutex);
+
+	return 0;
+}
+
+bool kgem_async_init(struct kgem *kgem)
+{
+	struct kgem_async *async;
+	int n;
+
+	if (kgem->async)
+		return true;
+
+	if (kgem->wedged)
+		return false;
+
+	async = calloc(1, sizeof(*async));
+	if (async == NULL)
+		return false;
+
+	for (n = 0; n < ASYNC_DEPTH; n++) {
+		struct kgem_async_job *job = &async->job[n];
+
+		job->exec = malloc(sizeof(kgem->exec));
+		job->reloc = malloc(sizeof(kgem->reloc));
+		job->bo = malloc(ARRAY_SIZE(kgem->exec) * sizeof(struct kgem_bo *));
+		job->close = malloc(ARRAY_SIZE(kgem->exec) * sizeof(uint32_t));
+		if (job->exec == NULL || job->reloc == NULL ||
+		    job->bo == NULL || job->close == NULL)
+			goto err;
+	}
+
+	async->fd = kgem->fd;
+	pthread_mutex_init(&async->mutex, NULL);
+	pthread_cond_init(&async->cond, NULL);
+	if (pthread_create(&async->thread, NULL, kgem_async_thread, async)) {
+		pthread_cond_destroy(&async->cond);
+		pthread_mutex_destroy(&async->mutex);
+		goto err;
+	}
+
+	DBG(("%s: enabled asynchronous submission, depth=%d\n",
+	     __FUNCTION__, ASYNC_DEPTH));
+	kgem->async = async;
+	return true;
 
-static void dump_fence_regs(struct kgem *kgem)
-{
-	dump_debugfs(kgem, "i915_gem_fence_regs");
+err:
+	for (n = 0; n < ASYNC_DEPTH; n++) {
+		free(async->job[n].exec);
+		free(async->job[n].reloc);
+		free(async->job[n].bo);
+		free(async->job[n].close);
+	}
+	free(async);
+	return false;
 }
-#endif
 
-static int do_execbuf(struct kgem *kgem, struct drm_i915_gem_execbuffer2 *execbuf)
+void kgem_async_fini(struct kgem *kgem)
 {
-	int ret;
-
-retry:
-	ret = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, execbuf);
-	if (ret == 0)
-		return 0;
-
-	DBG(("%s: failed ret=%d, throttling and discarding cache\n", __FUNCTION__, ret));
-	(void)__kgem_throttle_retire(kgem, 0);
-	if (kgem_expire_cache(kgem))
-		goto retry;
+	struct kgem_async *async = kgem->async;
+	int n;
 
-	if (kgem_cleanup_cache(kgem))
-		goto retry;
+	if (async == NULL)
+		return;
 
-	/* last gasp */
-	ret = do_ioctl(kgem->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, execbuf);
-	if (ret != -ENOSPC)
-		return ret;
+	__kgem_async_sync(kgem);
 
-	/* One final trick up our sleeve for when we run out of space.
-	 * We turn everything off to free up our pinned framebuffers,
-	 * sprites and cursors, and try just one more time.
-	 */
+	DBG(("%s: queued=%lld, stalls=%lld, errors=%lld\n", __FUNCTION__,
+	     (long long)async->stats.queued,
+	     (long long)async->stats.stalls,
+	     (long long)async->stats.errors));
 
-	xf86DrvMsg(kgem_get_screen_index(kgem), X_WARNING,
-		   "Failed to submit rendering commands, trying again with outputs disabled.\n");
+	pthread_mutex_lock(&async->mutex);
+	async->quit = true;
+	pthread_cond_broadcast(&async->cond);
+	pthread_mutex_unlock(&async->mutex);
+	pthread_join(async->thread, NULL);
 
-	if (sna_mode_disable(__to_sna(kgem))) {
-		kgem_cleanup_cache(kgem);
-		ret = do_ioctl(kgem->fd,
-			       DRM_IOCTL_I915_GEM_EXECBUFFER2,
-			       execbuf);
-		DBG(("%s: last_gasp ret=%d\n", __FUNCTION__, ret));
-		sna_mode_enable(__to_sna(kgem));
+	pthread_cond_destroy(&async->cond);
+	pthread_mutex_destroy(&async->mutex);
+	for (n = 0; n < ASYNC_DEPTH; n++) {
+		free(async->job[n].exec);
+		free(async->job[n].reloc);
+		free(async->job[n].bo);
+		free(async->job[n].close);
 	}
+	free(async);
 
-	return ret;
+	kgem->async = NULL;
 }
 
 void _kgem_submit(struct kgem *kgem)
@@ -4162,6 +5170,7 @@ void _kgem_submit(struct kgem *kgem)
 #if SHOW_BATCH_BEFORE
 	__kgem_batch_debug(kgem, batch_end);
 #endif
+	kgem_trace_batch(kgem, batch_end);
 
 	rq = kgem->next_request;
 	assert(rq->bo == NULL);
@@ -4182,6 +5191,9 @@ void _kgem_submit(struct kgem *kgem)
 		kgem->exec[i].flags = EXEC_OBJECT_NEEDS_FENCE;
 		kgem->exec[i].rsvd1 = 0;
 		kgem->exec[i].rsvd2 = 0;
+		kgem_exec_pin(kgem, rq->bo, &kgem->exec[i]);
+		if (kgem->vm && !kgem->vm->needs_relocs)
+			kgem->exec[i].relocation_count = 0;
 
 		rq->bo->exec = &kgem->exec[i];
 		rq->bo->rq = MAKE_REQUEST(rq, kgem->ring); /* useful sanity check */
@@ -4205,7 +5217,12 @@ void _kgem_submit(struct kgem *kgem)
 			}
 		}
 
-		ret = do_execbuf(kgem, &execbuf);
+		if (kgem->async && kgem_async_allowed(kgem)) {
+			ret = kgem_async_queue(kgem, &execbuf);
+		} else {
+			kgem_async_sync(kgem);
+			ret = do_execbuf(kgem, &execbuf);
+		}
 	} else
 		ret = -ENOMEM;
 
@@ -4375,6 +5392,71 @@ void kgem_clean_scanout_cache(struct kgem *kgem)
 	}
 }
 
+/* We model the demand upon each bucket of the inactive cache by counting
+ * the allocations made in that bucket over the last few expiry periods.
+ * The peak of those windows is the number of inactive bo we expect to be
+ * able to reuse before the next expiry, and so those are retained for
+ * longer; any surplus beyond that is released early.
+ */
+static inline void kgem_record_demand(struct kgem *kgem, int bucket, bool miss)
+{
+	if (bucket >= NUM_CACHE_BUCKETS)
+		return;
+
+	kgem->demand.requests[kgem->demand.window % EXPIRE_WINDOWS][bucket]++;
+	kgem->demand.misses[bucket] += miss;
+}
+
+/* For a lookup already recorded by kgem_record_demand() that later fails */
+static inline void kgem_record_miss(struct kgem *kgem, int bucket)
+{
+	if (bucket >= NUM_CACHE_BUCKETS)
+		return;
+
+	kgem->demand.misses[bucket]++;
+}
+
+static unsigned kgem_predict_demand(struct kgem *kgem, int bucket)
+{
+	unsigned max = 0;
+	int w;
+
+	for (w = 0; w < EXPIRE_WINDOWS; w++)
+		max = MAX(max, kgem->demand.requests[w][bucket]);
+
+	return max;
+}
+
+static void kgem_close_demand_window(struct kgem *kgem, uint32_t now)
+{
+	int w, i;
+
+	if (now - kgem->demand.start < MAX_INACTIVE_TIME)
+		return;
+
+	w = kgem->demand.window % EXPIRE_WINDOWS;
+	for (i = 0; i < NUM_CACHE_BUCKETS; i++) {
+		uint32_t requests = kgem->demand.requests[w][i];
+
+		assert(kgem->demand.misses[i] <= requests);
+		kgem->demand.stats.requests += requests;
+		kgem->demand.stats.hits += requests - kgem->demand.misses[i];
+		kgem->demand.stats.predicted += MIN(requests, kgem->demand.keep[i]);
+		kgem->demand.misses[i] = 0;
+	}
+	kgem->demand.stats.windows++;
+
+	w = ++kgem->demand.window % EXPIRE_WINDOWS;
+	memset(kgem->demand.requests[w], 0, sizeof(kgem->demand.requests[w]));
+	kgem->demand.start = now;
+
+	DBG(("%s: window=%d, requests=%lld, hits=%lld, predicted=%lld\n",
+	     __FUNCTION__, kgem->demand.window,
+	     (long long)kgem->demand.stats.requests,
+	     (long long)kgem->demand.stats.hits,
+	     (long long)kgem->demand.stats.predicted));
+}
+
 void kgem_clean_large_cache(struct kgem *kgem)
 {
 	while (!list_is_empty(&kgem->large_inactive)) {
@@ -4389,24 +5471,14 @@ bool kgem_expire_cache(struct kgem *kgem)
 {
 	time_t now, expire;
 	struct kgem_bo *bo;
-	unsigned int size = 0, count = 0;
+	unsigned int size = 0, count = 0, kept;
 	bool idle;
 	unsigned int i;
 
 	if (!time(&now))
 		return false;
 
-	while (__kgem_freed_bo) {
-		bo = __kgem_freed_bo;
-		__kgem_freed_bo = *(struct kgem_bo **)bo;
-		free(bo);
-	}
-
-	while (__kgem_freed_request) {
-		struct kgem_request *rq = __kgem_freed_request;
-		__kgem_freed_request = *(struct kgem_request **)rq;
-		free(rq);
-	}
+	kgem_release_slabs();
 
 	kgem_clean_large_cache(kgem);
 	if (__to_sna(kgem)->scrn->vtSema)
@@ -4455,43 +5527,46 @@ bool kgem_expire_cache(struct kgem *kgem)
 	if (kgem->need_retire)
 		kgem_retire(kgem);
 
-	expire = 0;
+	kgem_close_demand_window(kgem, now);
+
 	idle = true;
+	kept = 0;
 	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
-		idle &= list_is_empty(&kgem->inactive[i]);
-		list_for_each_entry(bo, &kgem->inactive[i], list) {
-			if (bo->delta) {
-				expire = now - MAX_INACTIVE_TIME;
-				break;
-			}
+		struct list preserve;
+		unsigned n, keep;
 
-			assert(now);
-			kgem_bo_set_purgeable(kgem, bo);
-			bo->delta = now;
+		n = 0;
+		list_for_each_entry(bo, &kgem->inactive[i], list) {
+			if (!bo->purged)
+				kgem_bo_set_purgeable(kgem, bo);
+			if (bo->delta == 0)
+				bo->delta = now;
+			n++;
 		}
-	}
-	if (expire == 0) {
-		DBG(("%s: idle? %d\n", __FUNCTION__, idle));
-		kgem->need_expire = !idle;
-		return false;
-	}
 
-	idle = true;
-	for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++) {
-		struct list preserve;
+		keep = MIN(kgem_predict_demand(kgem, i), n);
+		kgem->demand.keep[i] = keep;
+		kept += keep;
 
+		/* The oldest are the surplus, expire those after a short
+		 * grace period and keep the rest for as long as the demand
+		 * persists (within reason).
+		 */
 		list_init(&preserve);
-		while (!list_is_empty(&kgem->inactive[i])) {
+		while (n) {
+			bool surplus = n > keep;
+			unsigned age;
+
 			bo = list_last_entry(&kgem->inactive[i],
 					     struct kgem_bo, list);
-
-			if (bo->delta > expire) {
-				idle = false;
+			assert(bo->delta);
+			age = now - bo->delta;
+			if (age < (surplus ? EXPIRE_SURPLUS_TIME : EXPIRE_KEEP_TIME))
 				break;
-			}
 
-			if (bo->map__cpu && bo->delta + MAP_PRESERVE_TIME > expire) {
-				idle = false;
+			n--;
+			if (surplus && bo->map__cpu &&
+			    age < EXPIRE_SURPLUS_TIME + MAP_PRESERVE_TIME) {
 				list_move_tail(&bo->list, &preserve);
 			} else {
 				count++;
@@ -4502,8 +5577,13 @@ bool kgem_expire_cache(struct kgem *kgem)
 			}
 		}
 		list_splice_tail(&preserve, &kgem->inactive[i]);
+		idle &= list_is_empty(&kgem->inactive[i]);
 	}
 
+	kgem->demand.stats.kept = kept;
+	kgem->demand.stats.expired += count;
+	kgem->demand.stats.expired_bytes += size;
+
 #ifdef DEBUG_MEMORY
 	{
 		long inactive_size = 0;
@@ -4518,6 +5598,11 @@ bool kgem_expire_cache(struct kgem *kgem)
 
 	DBG(("%s: expired %d objects, %d bytes, idle? %d\n",
 	     __FUNCTION__, count, size, idle));
+	DBG(("%s: cache lookups=%lld, misses=%lld, scanned=%lld\n",
+	     __FUNCTION__,
+	     (long long)kgem->cache_stats.lookups,
+	     (long long)kgem->cache_stats.misses,
+	     (long long)kgem->cache_stats.scanned));
 
 	kgem->need_expire = !idle;
 	return count;
@@ -4572,11 +5657,7 @@ bool kgem_cleanup_cache(struct kgem *kgem)
 			     list_last_entry(&kgem->snoop,
 					     struct kgem_bo, list));
 
-	while (__kgem_freed_bo) {
-		struct kgem_bo *bo = __kgem_freed_bo;
-		__kgem_freed_bo = *(struct kgem_bo **)bo;
-		free(bo);
-	}
+	kgem_release_slabs();
 
 	kgem->need_purge = false;
 	kgem->need_expire = false;
@@ -4585,11 +5666,88 @@ bool kgem_cleanup_cache(struct kgem *kgem)
 	return true;
 }
 
+static void kgem_pressure_free(struct kgem *kgem, struct list *cache)
+{
+	while (!list_is_empty(cache)) {
+		struct kgem_bo *bo = list_last_entry(cache, struct kgem_bo, list);
+
+		kgem->pressure.stats.released += bytes(bo);
+		kgem_bo_free(kgem, bo);
+	}
+}
+
+/* Respond to memory pressure from the rest of the system before the
+ * kernel has to start reclaiming (or killing) on our behalf. Each
+ * successive event escalates how much of our caches we give up:
+ *
+ *   1. discard the idle mappings and mark every inactive bo purgeable,
+ *      so that the kernel may reclaim their pages without asking us;
+ *   2. release the snoop, large and scanout caches;
+ *   3. release the inactive cache entirely.
+ *
+ * Only idle bo are touched, we never wait upon the GPU here. Once there
+ * has been no pressure for MAX_INACTIVE_TIME, we start again from the
+ * first step.
+ */
+unsigned kgem_memory_pressure(struct kgem *kgem)
+{
+	uint32_t now = time(NULL);
+	struct kgem_bo *bo;
+	unsigned int i;
+
+	if (now - kgem->pressure.last > MAX_INACTIVE_TIME)
+		kgem->pressure.level = 0;
+	kgem->pressure.last = now;
+	if (kgem->pressure.level < KGEM_PRESSURE_MAX)
+		kgem->pressure.level++;
+
+	kgem->pressure.stats.events++;
+	if (kgem->pressure.level > kgem->pressure.stats.max_level)
+		kgem->pressure.stats.max_level = kgem->pressure.level;
+
+	DBG(("%s: level=%d\n", __FUNCTION__, kgem->pressure.level));
+
+	while (!list_is_empty(&kgem->vma_lru))
+		kgem_vma_evict(kgem,
+			       list_last_entry(&kgem->vma_lru,
+					       struct kgem_bo, vma_lru));
+
+	for (i = ARRAY_SIZE(kgem->inactive); i--; ) {
+		list_for_each_entry(bo, &kgem->inactive[i], list) {
+			if (bo->purged)
+				continue;
+
+			kgem_bo_set_purgeable(kgem, bo);
+			if (bo->purged)
+				kgem->pressure.stats.purgeable += bytes(bo);
+		}
+	}
+
+	if (kgem->pressure.level >= 2) {
+		kgem_pressure_free(kgem, &kgem->snoop);
+		kgem_pressure_free(kgem, &kgem->large_inactive);
+		if (__to_sna(kgem)->scrn->vtSema)
+			kgem_clean_scanout_cache(kgem);
+	}
+
+	if (kgem->pressure.level >= 3) {
+		for (i = 0; i < ARRAY_SIZE(kgem->inactive); i++)
+			kgem_pressure_free(kgem, &kgem->inactive[i]);
+		kgem_release_slabs();
+	}
+
+	if (kgem->need_purge)
+		kgem_purge_cache(kgem);
+
+	return kgem->pressure.level;
+}
+
 static struct kgem_bo *
-search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+__search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
 {
 	struct kgem_bo *bo, *first = NULL;
 	bool use_active = (flags & CREATE_INACTIVE) == 0;
+	struct kgem_cache_index *idx;
 	struct list *cache;
 
 	DBG(("%s: num_pages=%d, flags=%x, use_active? %d, use_large=%d [max=%d]\n",
@@ -4729,8 +5887,11 @@ discard:
 			return NULL;
 	}
 
-	cache = use_active ? active(kgem, num_pages, I915_TILING_NONE) : inactive(kgem, num_pages);
-	list_for_each_entry(bo, cache, list) {
+	if (use_active)
+		idx = &kgem->active_index[cache_bucket(num_pages)][I915_TILING_NONE];
+	else
+		idx = &kgem->inactive_index[cache_bucket(num_pages)];
+	cache_index_for_each(bo, kgem, idx, cache_bucket(num_pages), num_pages) {
 		assert(bo->refcnt == 0);
 		assert(bo->reusable);
 		assert(!!bo->rq == !!use_active);
@@ -4837,6 +5998,33 @@ discard:
 	return NULL;
 }
 
+/* As search_linear_cache(), but for allocations that may try several
+ * lookups and so record their demand just once themselves.
+ */
+static struct kgem_bo *
+lookup_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+{
+	struct kgem_bo *bo;
+
+	kgem->cache_stats.lookups++;
+	bo = __search_linear_cache(kgem, num_pages, flags);
+	if (bo == NULL)
+		kgem->cache_stats.misses++;
+
+	return bo;
+}
+
+static struct kgem_bo *
+search_linear_cache(struct kgem *kgem, unsigned int num_pages, unsigned flags)
+{
+	struct kgem_bo *bo;
+
+	bo = lookup_linear_cache(kgem, num_pages, flags);
+	kgem_record_demand(kgem, cache_bucket(num_pages), bo == NULL);
+
+	return bo;
+}
+
 struct kgem_bo *kgem_create_for_name(struct kgem *kgem, uint32_t name)
 {
 	struct drm_gem_open open_arg;
@@ -5358,12 +6546,9 @@ static void set_gpu_tiling(struct kgem *kgem,
 	     __FUNCTION__, bo->handle, tiling, pitch));
 
 	if (tiling_changed(bo, tiling, pitch) && bo->map__gtt) {
-		if (!list_is_empty(&bo->vma)) {
-			list_del(&bo->vma);
-			kgem->vma[0].count--;
-		}
-		munmap(bo->map__gtt, bytes(bo));
-		bo->map__gtt = NULL;
+		if (!list_is_empty(&bo->vma))
+			kgem_vma_cache_del(kgem, bo);
+		kgem_bo_unmap__gtt(kgem, bo);
 	}
 
 	bo->tiling = tiling;
@@ -5391,6 +6576,7 @@ struct kgem_bo *kgem_create_2d(struct kgem *kgem,
 			       int tiling,
 			       uint32_t flags)
 {
+	struct kgem_cache_index *idx;
 	struct list *cache;
 	struct kgem_bo *bo;
 	uint32_t pitch, tiled_height, size;
@@ -5419,6 +6605,8 @@ struct kgem_bo *kgem_create_2d(struct kgem *kgem,
 
 	size /= PAGE_SIZE;
 	bucket = cache_bucket(size);
+	kgem->cache_stats.lookups++;
+	kgem_record_demand(kgem, bucket, false);
 
 	if (flags & CREATE_SCANOUT) {
 		struct kgem_bo *last = NULL;
@@ -5720,10 +6908,12 @@ large_inactive:
 		retry = 3;
 search_active:
 	assert(bucket < NUM_CACHE_BUCKETS);
-	cache = &kgem->active[bucket][tiling];
+	idx = &kgem->active_index[bucket][tiling];
 	if (tiling) {
 		tiled_height = kgem_aligned_height(kgem, height, tiling);
-		list_for_each_entry(bo, cache, list) {
+		/* pre-965 only cares about pitch, so consider every size */
+		cache_index_for_each(bo, kgem, idx, bucket,
+				     kgem->gen < 040 ? 1 : size) {
 			assert(!bo->purged);
 			assert(bo->refcnt == 0);
 			assert(bucket(bo) == bucket);
@@ -5773,7 +6963,7 @@ search_active:
 			return bo;
 		}
 	} else {
-		list_for_each_entry(bo, cache, list) {
+		cache_index_for_each(bo, kgem, idx, bucket, size) {
 			assert(bucket(bo) == bucket);
 			assert(!bo->purged);
 			assert(bo->refcnt == 0);
@@ -5802,8 +6992,8 @@ search_active:
 
 	if (kgem->gen >= 040) {
 		for (i = I915_TILING_Y; i >= I915_TILING_NONE; i--) {
-			cache = &kgem->active[bucket][i];
-			list_for_each_entry(bo, cache, list) {
+			idx = &kgem->active_index[bucket][i];
+			cache_index_for_each(bo, kgem, idx, bucket, size) {
 				assert(!bo->purged);
 				assert(bo->refcnt == 0);
 				assert(bo->reusable);
@@ -5889,8 +7079,8 @@ skip_active_search:
 search_inactive:
 	/* Now just look for a close match and prefer any currently active */
 	assert(bucket < NUM_CACHE_BUCKETS);
-	cache = &kgem->inactive[bucket];
-	list_for_each_entry(bo, cache, list) {
+	idx = &kgem->inactive_index[bucket];
+	cache_index_for_each(bo, kgem, idx, bucket, size) {
 		assert(bucket(bo) == bucket);
 		assert(bo->reusable);
 		assert(!bo->scanout);
@@ -6001,6 +7191,8 @@ no_retire:
 	}
 
 create:
+	kgem->cache_stats.misses++;
+	kgem_record_miss(kgem, cache_bucket(size));
 	if (flags & CREATE_CACHED) {
 		DBG(("%s: no cached bo found, requested not to create a new bo\n", __FUNCTION__));
 		return NULL;
@@ -6034,7 +7226,7 @@ create:
 			if (flags & CREATE_EXACT) {
 				DBG(("%s: failed to set exact tiling (gem_set_tiling)\n", __FUNCTION__));
 				gem_close(kgem->fd, handle);
-				free(bo);
+				__kgem_struct_free(bo);
 				return NULL;
 			}
 		}
@@ -6156,7 +7348,6 @@ void _kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 
 	if (bo->proxy) {
 		assert(!bo->reusable);
-		kgem_bo_binding_free(kgem, bo);
 
 		assert(list_is_empty(&bo->list));
 		_list_del(&bo->vma);
@@ -6166,13 +7357,7 @@ void _kgem_bo_destroy(struct kgem *kgem, struct kgem_bo *bo)
 			_kgem_bo_delete_buffer(kgem, bo);
 
 		kgem_bo_unref(kgem, bo->proxy);
-
-		if (DBG_NO_MALLOC_CACHE) {
-			free(bo);
-		} else {
-			*(struct kgem_bo **)bo = __kgem_freed_bo;
-			__kgem_freed_bo = bo;
-		}
+		__kgem_struct_free(bo);
 	} else
 		__kgem_bo_destroy(kgem, bo);
 }
@@ -6622,6 +7807,20 @@ void __kgem_bcs_set_tiling(struct kgem *kgem,
 	kgem->bcs_state = state;
 }
 
+static void kgem_add_proxy(struct kgem *kgem, struct kgem_bo *bo)
+{
+	assert(bo->proxy);
+
+	/* need to release the cache upon batch submit */
+	if (bo->exec)
+		return;
+
+	list_move_tail(&bo->request, &kgem->next_request->buffers);
+	bo->rq = MAKE_REQUEST(kgem->next_request, kgem->ring);
+	bo->exec = &_kgem_dummy_exec;
+	bo->domain = DOMAIN_GPU;
+}
+
 uint32_t kgem_add_reloc(struct kgem *kgem,
 			uint32_t pos,
 			struct kgem_bo *bo,
@@ -6647,15 +7846,7 @@ uint32_t kgem_add_reloc(struct kgem *kgem,
 			     __FUNCTION__, bo->delta, bo->handle));
 			delta += bo->delta;
 			assert(bo->handle == bo->proxy->handle);
-			/* need to release the cache upon batch submit */
-			if (bo->exec == NULL) {
-				list_move_tail(&bo->request,
-					       &kgem->next_request->buffers);
-				bo->rq = MAKE_REQUEST(kgem->next_request,
-						      kgem->ring);
-				bo->exec = &_kgem_dummy_exec;
-				bo->domain = DOMAIN_GPU;
-			}
+			kgem_add_proxy(kgem, bo);
 
 			if (read_write_domain & 0x7fff && !bo->gpu_dirty)
 				__kgem_bo_mark_dirty(bo);
@@ -6730,15 +7921,7 @@ uint64_t kgem_add_reloc64(struct kgem *kgem,
 			     __FUNCTION__, (long)bo->delta, bo->handle));
 			delta += bo->delta;
 			assert(bo->handle == bo->proxy->handle);
-			/* need to release the cache upon batch submit */
-			if (bo->exec == NULL) {
-				list_move_tail(&bo->request,
-					       &kgem->next_request->buffers);
-				bo->rq = MAKE_REQUEST(kgem->next_request,
-						      kgem->ring);
-				bo->exec = &_kgem_dummy_exec;
-				bo->domain = DOMAIN_GPU;
-			}
+			kgem_add_proxy(kgem, bo);
 
 			if (read_write_domain & 0x7fff && !bo->gpu_dirty)
 				__kgem_bo_mark_dirty(bo);
@@ -6782,16 +7965,29 @@ uint64_t kgem_add_reloc64(struct kgem *kgem,
 
 static void kgem_trim_vma_cache(struct kgem *kgem, int type, int bucket)
 {
-	int i, j;
+	struct kgem_bo *bo, *prev;
 
-	DBG(("%s: type=%d, count=%d (bucket: %d)\n",
-	     __FUNCTION__, type, kgem->vma[type].count, bucket));
-	if (kgem->vma[type].count <= 0)
+	DBG(("%s: type=%d, count=%d (bucket: %d), cached=%lld (budget %lld)\n",
+	     __FUNCTION__, type, kgem->vma[type].count, bucket,
+	     (long long)kgem->vma_stats.cached, (long long)kgem->vma_budget));
+	if (kgem->vma[type].count <= 0 &&
+	    kgem->vma_stats.cached <= kgem->vma_budget)
 	       return;
 
 	if (kgem->need_purge)
 		kgem_purge_cache(kgem);
 
+	/* Keep the total size of the idle mappings within budget, oldest
+	 * first, regardless of their size or type. Only idle bo are ever
+	 * considered, the mappings of bo in use are never discarded.
+	 */
+	while (kgem->vma_stats.cached > kgem->vma_budget) {
+		assert(!list_is_empty(&kgem->vma_lru));
+		kgem_vma_evict(kgem,
+			       list_last_entry(&kgem->vma_lru,
+					       struct kgem_bo, vma_lru));
+	}
+
 	/* vma are limited on a per-process basis to around 64k.
 	 * This includes all malloc arenas as well as other file
 	 * mappings. In order to be fair and not hog the cache,
@@ -6799,42 +7995,12 @@ static void kgem_trim_vma_cache(struct kgem *kgem, int type, int bucket)
 	 * start failing mappings, we keep our own number of open
 	 * vma to within a conservative value.
 	 */
-	i = 0;
-	while (kgem->vma[type].count > 0) {
-		struct kgem_bo *bo = NULL;
-
-		for (j = 0;
-		     bo == NULL && j < ARRAY_SIZE(kgem->vma[type].inactive);
-		     j++) {
-			struct list *head = &kgem->vma[type].inactive[i++%ARRAY_SIZE(kgem->vma[type].inactive)];
-			if (!list_is_empty(head))
-				bo = list_last_entry(head, struct kgem_bo, vma);
-		}
-		if (bo == NULL)
-			break;
-
-		DBG(("%s: discarding inactive %s vma cache for %d\n",
-		     __FUNCTION__, type ? "CPU" : "GTT", bo->handle));
-
-		assert(bo->rq == NULL);
-		if (type) {
-			VG(VALGRIND_MAKE_MEM_NOACCESS(MAP(bo->map__cpu), bytes(bo)));
-			munmap(MAP(bo->map__cpu), bytes(bo));
-			bo->map__cpu = NULL;
-		} else {
-			if (bo->map__wc) {
-				VG(VALGRIND_MAKE_MEM_NOACCESS(bo->map__wc, bytes(bo)));
-				munmap(bo->map__wc, bytes(bo));
-				bo->map__wc = NULL;
-			}
-			if (bo->map__gtt) {
-				munmap(bo->map__gtt, bytes(bo));
-				bo->map__gtt = NULL;
-			}
-		}
-
-		list_del(&bo->vma);
-		kgem->vma[type].count--;
+	bo = list_last_entry(&kgem->vma_lru, struct kgem_bo, vma_lru);
+	while (kgem->vma[type].count > 0 && &bo->vma_lru != &kgem->vma_lru) {
+		prev = list_entry(bo->vma_lru.prev, struct kgem_bo, vma_lru);
+		if ((bo->map__gtt == NULL && bo->map__wc == NULL) == type)
+			kgem_vma_evict(kgem, bo);
+		bo = prev;
 	}
 }
 
@@ -6847,19 +8013,27 @@ static void *__kgem_bo_map__gtt_or_wc(struct kgem *kgem, struct kgem_bo *bo)
 	assert(bo->proxy == NULL);
 	assert(!bo->snoop);
 
-	kgem_trim_vma_cache(kgem, MAP_GTT, bucket(bo));
-
 	if (bo->tiling || !kgem->has_wc_mmap) {
 		assert(kgem->gen != 021 || bo->tiling != I915_TILING_Y);
 		warn_unless(num_pages(bo) <= kgem->aperture_mappable / 2);
 
 		ptr = bo->map__gtt;
-		if (ptr == NULL)
+		if (ptr) {
+			kgem->vma_stats.type[VMA_GTT].hits++;
+		} else {
+			kgem->vma_stats.type[VMA_GTT].misses++;
+			kgem_trim_vma_cache(kgem, MAP_GTT, bucket(bo));
 			ptr = __kgem_bo_map__gtt(kgem, bo);
+		}
 	} else {
 		ptr = bo->map__wc;
-		if (ptr == NULL)
+		if (ptr) {
+			kgem->vma_stats.type[VMA_WC].hits++;
+		} else {
+			kgem->vma_stats.type[VMA_WC].misses++;
+			kgem_trim_vma_cache(kgem, MAP_GTT, bucket(bo));
 			ptr = __kgem_bo_map__wc(kgem, bo);
+		}
 	}
 
 	return ptr;
@@ -6917,6 +8091,8 @@ void *kgem_bo_map(struct kgem *kgem, struct kgem_bo *bo)
 
 		/* XXX use PROT_READ to avoid the write flush? */
 
+		kgem_bo_async_sync(kgem, bo);
+
 		VG_CLEAR(set_domain);
 		set_domain.handle = bo->handle;
 		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
@@ -6958,11 +8134,14 @@ void *kgem_bo_map__wc(struct kgem *kgem, struct kgem_bo *bo)
 	assert_tiling(kgem, bo);
 	assert(!bo->purged || bo->reusable);
 
-	if (bo->map__wc)
+	if (bo->map__wc) {
+		kgem->vma_stats.type[VMA_WC].hits++;
 		return bo->map__wc;
+	}
 	if (!kgem->has_wc_mmap)
 		return NULL;
 
+	kgem->vma_stats.type[VMA_WC].misses++;
 	kgem_trim_vma_cache(kgem, MAP_GTT, bucket(bo));
 	return __kgem_bo_map__wc(kgem, bo);
 }
@@ -6976,9 +8155,12 @@ void *kgem_bo_map__cpu(struct kgem *kgem, struct kgem_bo *bo)
 	assert(bo->proxy == NULL);
 	assert_tiling(kgem, bo);
 
-	if (bo->map__cpu)
+	if (bo->map__cpu) {
+		kgem->vma_stats.type[VMA_CPU].hits++;
 		return MAP(bo->map__cpu);
+	}
 
+	kgem->vma_stats.type[VMA_CPU].misses++;
 	kgem_trim_vma_cache(kgem, MAP_CPU, bucket(bo));
 
 	return __kgem_bo_map__cpu(kgem, bo);
@@ -7130,6 +8312,8 @@ void kgem_bo_sync__cpu(struct kgem *kgem, struct kgem_bo *bo)
 		     bo->needs_flush, bo->domain,
 		     __kgem_busy(kgem, bo->handle)));
 
+		kgem_bo_async_sync(kgem, bo);
+
 		VG_CLEAR(set_domain);
 		set_domain.handle = bo->handle;
 		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
@@ -7174,6 +8358,8 @@ void kgem_bo_sync__cpu_full(struct kgem *kgem, struct kgem_bo *bo, bool write)
 		     bo->needs_flush, bo->domain,
 		     __kgem_busy(kgem, bo->handle)));
 
+		kgem_bo_async_sync(kgem, bo);
+
 		VG_CLEAR(set_domain);
 		set_domain.handle = bo->handle;
 		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
@@ -7216,6 +8402,8 @@ void kgem_bo_sync__gtt(struct kgem *kgem, struct kgem_bo *bo)
 		     bo->needs_flush, bo->domain,
 		     __kgem_busy(kgem, bo->handle)));
 
+		kgem_bo_async_sync(kgem, bo);
+
 		VG_CLEAR(set_domain);
 		set_domain.handle = bo->handle;
 		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
@@ -7290,7 +8478,7 @@ buffer_alloc(void)
 {
 	struct kgem_buffer *bo;
 
-	bo = malloc(sizeof(*bo));
+	bo = __kgem_struct_alloc(&__kgem_buffer_slab);
 	if (bo == NULL)
 		return NULL;
 
@@ -7306,11 +8494,15 @@ buffer_alloc_with_data(int num_pages)
 {
 	struct kgem_buffer *bo;
 
-	bo = malloc(sizeof(*bo) + 2*UPLOAD_ALIGNMENT + num_pages * PAGE_SIZE);
+	bo = __kgem_struct_alloc(&__kgem_buffer_slab);
 	if (bo == NULL)
 		return NULL;
 
-	bo->mem = (void *)ALIGN((uintptr_t)bo + sizeof(*bo), UPLOAD_ALIGNMENT);
+	if (posix_memalign(&bo->mem, UPLOAD_ALIGNMENT, num_pages * PAGE_SIZE)) {
+		__kgem_struct_free(bo);
+		return NULL;
+	}
+
 	bo->mmapped = false;
 	return bo;
 }
@@ -7339,14 +8531,30 @@ init_buffer_from_bo(struct kgem_buffer *bo, struct kgem_bo *old)
 	else
 		list_init(&bo->base.request);
 	list_replace(&old->vma, &bo->base.vma);
+	assert(list_is_empty(&old->vma_lru));
+	list_init(&bo->base.vma_lru);
 	list_init(&bo->base.list);
-	free(old);
+	list_init(&bo->base.cache);
+	__kgem_struct_free(old);
 
 	assert(bo->base.tiling == I915_TILING_NONE);
 
 	bo->base.refcnt = 1;
 }
 
+/* kgem_create_buffer() may fall through several caches, but each buffer
+ * is a single request upon the inactive cache.
+ */
+static void record_buffer_demand(struct kgem *kgem, bool *demand,
+				 unsigned alloc)
+{
+	if (*demand)
+		return;
+
+	kgem_record_demand(kgem, cache_bucket(alloc), false);
+	*demand = true;
+}
+
 static struct kgem_buffer *
 search_snoopable_buffer(struct kgem *kgem, unsigned alloc)
 {
@@ -7401,14 +8609,15 @@ create_snoopable_buffer(struct kgem *kgem, unsigned alloc)
 		if (bo == NULL)
 			return NULL;
 
-		old = search_linear_cache(kgem, alloc,
+		old = lookup_linear_cache(kgem, alloc,
 					 CREATE_INACTIVE | CREATE_CPU_MAP | CREATE_EXACT);
 		if (old) {
 			init_buffer_from_bo(bo, old);
 		} else {
+			kgem_record_miss(kgem, cache_bucket(alloc));
 			handle = gem_create(kgem->fd, alloc);
 			if (handle == 0) {
-				free(bo);
+				__kgem_struct_free(bo);
 				return NULL;
 			}
 
@@ -7437,14 +8646,15 @@ create_snoopable_buffer(struct kgem *kgem, unsigned alloc)
 		if (bo == NULL)
 			return NULL;
 
-		old = search_linear_cache(kgem, alloc,
+		old = lookup_linear_cache(kgem, alloc,
 					 CREATE_INACTIVE | CREATE_CPU_MAP | CREATE_EXACT);
 		if (old) {
 			init_buffer_from_bo(bo, old);
 		} else {
+			kgem_record_miss(kgem, cache_bucket(alloc));
 			handle = gem_create(kgem->fd, alloc);
 			if (handle == 0) {
-				free(bo);
+				__kgem_struct_free(bo);
 				return NULL;
 			}
 
@@ -7482,14 +8692,14 @@ free_caching:
 
 		//if (posix_memalign(&ptr, 64, ALIGN(size, 64)))
 		if (posix_memalign(&bo->mem, PAGE_SIZE, alloc * PAGE_SIZE)) {
-			free(bo);
+			__kgem_struct_free(bo);
 			return NULL;
 		}
 
 		handle = gem_userptr(kgem->fd, bo->mem, alloc * PAGE_SIZE, false);
 		if (handle == 0) {
 			free(bo->mem);
-			free(bo);
+			__kgem_struct_free(bo);
 			return NULL;
 		}
 
@@ -7518,6 +8728,7 @@ struct kgem_bo *kgem_create_buffer(struct kgem *kgem,
 	struct kgem_buffer *bo;
 	unsigned offset, alloc;
 	struct kgem_bo *old;
+	bool demand = false;
 
 	DBG(("%s: size=%d, flags=%x [write?=%d, inplace?=%d, last?=%d]\n",
 	     __FUNCTION__, size, flags,
@@ -7646,22 +8857,27 @@ struct kgem_bo *kgem_create_buffer(struct kgem *kgem,
 		if (bo == NULL)
 			goto skip_llc;
 
+		record_buffer_demand(kgem, &demand, alloc);
+
 		old = NULL;
 		if ((flags & KGEM_BUFFER_WRITE) == 0)
-			old = search_linear_cache(kgem, alloc, CREATE_CPU_MAP);
+			old = lookup_linear_cache(kgem, alloc, CREATE_CPU_MAP);
 		if (old == NULL)
-			old = search_linear_cache(kgem, alloc, CREATE_INACTIVE | CREATE_CPU_MAP);
+			old = lookup_linear_cache(kgem, alloc, CREATE_INACTIVE | CREATE_CPU_MAP);
 		if (old == NULL)
-			old = search_linear_cache(kgem, NUM_PAGES(size), CREATE_INACTIVE | CREATE_CPU_MAP);
+			old = lookup_linear_cache(kgem, NUM_PAGES(size), CREATE_INACTIVE | CREATE_CPU_MAP);
 		if (old) {
 			DBG(("%s: found LLC handle=%d for buffer\n",
 			     __FUNCTION__, old->handle));
 
 			init_buffer_from_bo(bo, old);
 		} else {
-			uint32_t handle = gem_create(kgem->fd, alloc);
+			uint32_t handle;
+
+			kgem_record_miss(kgem, cache_bucket(alloc));
+			handle = gem_create(kgem->fd, alloc);
 			if (handle == 0) {
-				free(bo);
+				__kgem_struct_free(bo);
 				goto skip_llc;
 			}
 			__kgem_bo_init(&bo->base, handle, alloc);
@@ -7697,7 +8913,8 @@ skip_llc:
 		 */
 		DBG(("%s: searching for an inactive GTT map for upload\n",
 		     __FUNCTION__));
-		old = search_linear_cache(kgem, alloc,
+		record_buffer_demand(kgem, &demand, alloc);
+		old = lookup_linear_cache(kgem, alloc,
 					  CREATE_EXACT | CREATE_INACTIVE | CREATE_GTT_MAP);
 #if HAVE_I915_GEM_BUFFER_INFO
 		if (old) {
@@ -7719,10 +8936,10 @@ skip_llc:
 		}
 #endif
 		if (old == NULL)
-			old = search_linear_cache(kgem, NUM_PAGES(size),
+			old = lookup_linear_cache(kgem, NUM_PAGES(size),
 						  CREATE_EXACT | CREATE_INACTIVE | CREATE_GTT_MAP);
 		if (old == NULL) {
-			old = search_linear_cache(kgem, alloc, CREATE_INACTIVE);
+			old = lookup_linear_cache(kgem, alloc, CREATE_INACTIVE);
 			if (old && !kgem_bo_can_map(kgem, old)) {
 				_kgem_bo_destroy(kgem, old);
 				old = NULL;
@@ -7765,6 +8982,7 @@ skip_llc:
 	if ((flags & KGEM_BUFFER_INPLACE) == 0)
 		alloc = NUM_PAGES(size);
 
+	record_buffer_demand(kgem, &demand, alloc);
 	if (use_snoopable_buffer(kgem, flags)) {
 		bo = search_snoopable_buffer(kgem, alloc);
 		if (bo) {
@@ -7785,9 +9003,9 @@ skip_llc:
 
 	old = NULL;
 	if ((flags & KGEM_BUFFER_WRITE) == 0)
-		old = search_linear_cache(kgem, alloc, 0);
+		old = lookup_linear_cache(kgem, alloc, 0);
 	if (old == NULL)
-		old = search_linear_cache(kgem, alloc, CREATE_INACTIVE);
+		old = lookup_linear_cache(kgem, alloc, CREATE_INACTIVE);
 	if (old) {
 		DBG(("%s: reusing ordinary handle %d for io\n",
 		     __FUNCTION__, old->handle));
@@ -7813,16 +9031,19 @@ skip_llc:
 		hint = CREATE_INACTIVE;
 		if (flags & KGEM_BUFFER_WRITE)
 			hint |= CREATE_CPU_MAP;
-		old = search_linear_cache(kgem, alloc, hint);
+		old = lookup_linear_cache(kgem, alloc, hint);
 		if (old) {
 			DBG(("%s: reusing handle=%d for buffer\n",
 			     __FUNCTION__, old->handle));
 
 			init_buffer_from_bo(bo, old);
 		} else {
-			uint32_t handle = gem_create(kgem->fd, alloc);
+			uint32_t handle;
+
+			kgem_record_miss(kgem, cache_bucket(alloc));
+			handle = gem_create(kgem->fd, alloc);
 			if (handle == 0) {
-				free(bo);
+				__kgem_struct_free(bo);
 				return NULL;
 			}
 
@@ -8021,6 +9242,8 @@ void kgem_buffer_read_sync(struct kgem *kgem, struct kgem_bo *_bo)
 	DBG(("%s(offset=%d, length=%d, snooped=%d)\n", __FUNCTION__,
 	     offset, length, bo->base.snoop));
 
+	kgem_bo_async_sync(kgem, &bo->base);
+
 	if (bo->mmapped) {
 		struct drm_i915_gem_set_domain set_domain;
 
@@ -8052,45 +9275,132 @@ void kgem_buffer_read_sync(struct kgem *kgem, struct kgem_bo *_bo)
 	bo->base.domain = DOMAIN_NONE;
 }
 
-uint32_t kgem_bo_get_binding(struct kgem_bo *bo, uint32_t format)
+static inline uint32_t binding_layout(struct kgem_bo *bo)
+{
+	return bo->pitch | bo->tiling << 18 | bo->io << 20;
+}
+
+/* The offset of a proxy from the start of the real bo */
+static inline uint32_t binding_delta(struct kgem_bo *bo)
 {
-	struct kgem_bo_binding *b;
+	uint32_t delta = 0;
 
-	assert(bo->refcnt);
+	while (bo->proxy) {
+		delta += bo->delta;
+		bo = bo->proxy;
+	}
 
-	for (b = &bo->binding; b && b->offset; b = b->next)
-		if (format == b->format)
-			return b->offset;
+	return delta;
+}
 
-	return 0;
+static inline unsigned binding_hash(uint32_t handle, uint32_t delta,
+				    uint32_t width, uint32_t height,
+				    uint32_t format)
+{
+	uint32_t hash;
+
+	hash = handle * 0x9e3779b1;
+	hash ^= delta;
+	hash ^= (width | height << 16) * 0xc2b2ae35;
+	hash ^= format * 0x85ebca6b;
+	return hash >> (32 - KGEM_BINDING_BITS);
+}
+
+static inline bool binding_match(const struct kgem_binding *b,
+				 uint32_t handle, uint32_t delta,
+				 uint32_t width, uint32_t height,
+				 uint32_t format, uint32_t layout)
+{
+	return (b->handle == handle &&
+		b->delta == delta &&
+		b->width == width &&
+		b->height == height &&
+		b->format == format &&
+		b->layout == layout);
 }
 
-void kgem_bo_set_binding(struct kgem_bo *bo, uint32_t format, uint16_t offset)
+#define BINDING_NEXT(i) (((i) + 1) & (KGEM_BINDING_SIZE - 1))
+
+/* The key covers everything that the gen*_bind_bo() write into the
+ * SURFACE_STATE, so that any bo matching it, including other proxies
+ * of the same handle, can use the same state.
+ */
+uint32_t kgem_bo_get_binding(struct kgem *kgem, struct kgem_bo *bo,
+			     uint32_t width, uint32_t height,
+			     uint32_t format)
 {
-	struct kgem_bo_binding *b;
+	uint32_t delta = binding_delta(bo);
+	uint32_t layout = binding_layout(bo);
+	unsigned i;
 
 	assert(bo->refcnt);
 
-	for (b = &bo->binding; b; b = b->next) {
-		if (b->offset)
+	for (i = binding_hash(bo->handle, delta, width, height, format);
+	     kgem->binding.cache[i].serial == kgem->binding.serial;
+	     i = BINDING_NEXT(i)) {
+		const struct kgem_binding *b = &kgem->binding.cache[i];
+		struct kgem_bo *p;
+
+		if (!binding_match(b, bo->handle, delta,
+				   width, height, format, layout))
 			continue;
 
-		b->offset = offset;
-		b->format = format;
+		/* The state was emitted, and so relocated, for a bo sharing
+		 * our handle. If we are a different proxy of it, we still
+		 * need to be tracked by this batch.
+		 */
+		for (p = bo; p->proxy; p = p->proxy)
+			;
+		if (p->exec == NULL)
+			return 0;
 
-		if (b->next)
-			b->next->offset = 0;
+		for (p = bo; p->proxy; p = p->proxy)
+			kgem_add_proxy(kgem, p);
 
-		return;
+		kgem->binding.shared++;
+		return b->offset;
 	}
 
-	b = malloc(sizeof(*b));
-	if (b) {
-		b->next = bo->binding.next;
-		b->format = format;
-		b->offset = offset;
-		bo->binding.next = b;
+	return 0;
+}
+
+void kgem_bo_set_binding(struct kgem *kgem, struct kgem_bo *bo,
+			 uint32_t width, uint32_t height,
+			 uint32_t format, uint16_t offset)
+{
+	uint32_t delta = binding_delta(bo);
+	uint32_t layout = binding_layout(bo);
+	struct kgem_binding *b;
+	unsigned i;
+
+	assert(bo->refcnt);
+	assert(offset);
+
+	/* Keep the table sparse so that probes stay short; once full, any
+	 * further surfaces are simply not shared.
+	 */
+	if (kgem->binding.count >= KGEM_BINDING_SIZE * 3 / 4)
+		return;
+
+	for (i = binding_hash(bo->handle, delta, width, height, format);
+	     kgem->binding.cache[i].serial == kgem->binding.serial;
+	     i = BINDING_NEXT(i)) {
+		/* An identical state is already in use; keep it */
+		if (binding_match(&kgem->binding.cache[i], bo->handle, delta,
+				  width, height, format, layout))
+			return;
 	}
+
+	b = &kgem->binding.cache[i];
+	b->serial = kgem->binding.serial;
+	b->handle = bo->handle;
+	b->delta = delta;
+	b->width = width;
+	b->height = height;
+	b->format = format;
+	b->layout = layout;
+	b->offset = offset;
+	kgem->binding.count++;
 }
 
 struct kgem_bo *
@@ -8119,10 +9429,12 @@ kgem_replace_bo(struct kgem *kgem,
 	size = height * pitch;
 	size = NUM_PAGES(size);
 
-	dst = search_linear_cache(kgem, size, 0);
+	kgem_record_demand(kgem, cache_bucket(size), false);
+	dst = lookup_linear_cache(kgem, size, 0);
 	if (dst == NULL)
-		dst = search_linear_cache(kgem, size, CREATE_INACTIVE);
+		dst = lookup_linear_cache(kgem, size, CREATE_INACTIVE);
 	if (dst == NULL) {
+		kgem_record_miss(kgem, cache_bucket(size));
 		handle = gem_create(kgem->fd, size);
 		if (handle == 0)
 			return NULL;
@@ -52,18 +52,14 @@ struct kgem_bo {
 	struct list list;
 	struct list request;
 	struct list vma;
+	struct list vma_lru;
+	struct list cache;
 
 	void *map__cpu;
 	void *map__gtt;
 	void *map__wc;
 #define MAP(ptr) ((void*)((uintptr_t)(ptr) & ~3))
 
-	struct kgem_bo_binding {
-		struct kgem_bo_binding *next;
-		uint32_t format;
-		uint16_t offset;
-	} binding;
-
 	uint64_t presumed_offset;
 	uint32_t unique_id;
 	uint32_t refcnt;
@@ -94,6 +90,7 @@ struct kgem_bo {
 	uint32_t scanout : 1;
 	uint32_t prime : 1;
 	uint32_t purged : 1;
+	uint32_t softpin : 1;
 };
 #define DOMAIN_NONE 0
 #define DOMAIN_CPU 1
@@ -113,12 +110,93 @@ enum {
 	NUM_MAP_TYPES,
 };
 
+enum {
+	VMA_GTT = 0,
+	VMA_WC,
+	VMA_CPU,
+	NUM_VMA_TYPES,
+};
+
+#define EXPIRE_WINDOWS 6
+
+struct kgem_expire_stats {
+	uint64_t windows;
+	uint64_t requests; /* allocations over the closed windows */
+	uint64_t hits; /* ...satisfied from the caches */
+	uint64_t predicted; /* ...that the bo we chose to keep could satisfy */
+	uint64_t kept; /* bo retained for predicted demand at the last expiry */
+	uint64_t expired;
+	uint64_t expired_bytes;
+};
+
+/* Surface state emitted into the current batch, shared by every op
+ * that binds the same surface of a bo with the same format.
+ */
+#define KGEM_BINDING_BITS 10
+#define KGEM_BINDING_SIZE (1 << KGEM_BINDING_BITS)
+
+struct kgem_binding {
+	uint32_t handle;
+	uint32_t delta;
+	uint32_t format;
+	uint32_t layout; /* pitch, tiling and io */
+	uint16_t width, height;
+	uint16_t offset;
+	uint16_t serial;
+};
+
+struct kgem_binding_stats {
+	uint64_t batches;
+	uint64_t states; /* surface states emitted */
+	uint64_t shared; /* ...and binds that reused one */
+	unsigned max_shared; /* in a single batch */
+};
+
+struct kgem_pressure_stats {
+	uint64_t events;
+	uint64_t purgeable; /* bytes marked purgeable */
+	uint64_t released; /* bytes freed */
+	unsigned max_level;
+};
+
+struct kgem_vma_stats {
+	struct {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t bytes; /* currently mapped */
+		uint32_t count;
+	} type[NUM_VMA_TYPES];
+	uint64_t cached; /* bytes held by idle bo on the lru */
+	uint64_t evictions;
+	uint64_t evicted;
+};
+
+/* Each power-of-two cache bucket is further split into size classes
+ * using the next most significant bits of the page count, so that a
+ * best-fit search only has to inspect the one class straddling the
+ * requested size before every candidate in the next occupied class
+ * is known to be large enough.
+ */
+#define CACHE_CLASS_SHIFT 3
+#define NUM_CACHE_CLASSES (1 << CACHE_CLASS_SHIFT)
+struct kgem_cache_index {
+	struct list size[NUM_CACHE_CLASSES];
+	uint32_t occupied;
+};
+
 typedef void (*memcpy_box_func)(const void *src, void *dst, int bpp,
 				int32_t src_stride, int32_t dst_stride,
 				int16_t src_x, int16_t src_y,
 				int16_t dst_x, int16_t dst_y,
 				uint16_t width, uint16_t height);
 
+typedef void (*memcpy_xor_func)(const void *src, void *dst, int bpp,
+				int32_t src_stride, int32_t dst_stride,
+				int16_t src_x, int16_t src_y,
+				int16_t dst_x, int16_t dst_y,
+				uint16_t width, uint16_t height,
+				uint32_t and, uint32_t or);
+
 struct kgem {
 	unsigned wedged;
 	int fd;
@@ -149,6 +227,8 @@ struct kgem {
 	struct list large_inactive;
 	struct list active[NUM_CACHE_BUCKETS][3];
 	struct list inactive[NUM_CACHE_BUCKETS];
+	struct kgem_cache_index active_index[NUM_CACHE_BUCKETS][3];
+	struct kgem_cache_index inactive_index[NUM_CACHE_BUCKETS];
 	struct list pinned_batches[2];
 	struct list snoop;
 	struct list scanout;
@@ -163,6 +243,30 @@ struct kgem {
 		struct list inactive[NUM_CACHE_BUCKETS];
 		int16_t count;
 	} vma[NUM_MAP_TYPES];
+	struct list vma_lru;
+	uint64_t vma_budget;
+	struct kgem_vma_stats vma_stats;
+
+	struct {
+		uint32_t requests[EXPIRE_WINDOWS][NUM_CACHE_BUCKETS];
+		uint32_t misses[NUM_CACHE_BUCKETS];
+		uint32_t keep[NUM_CACHE_BUCKETS];
+		uint32_t window;
+		uint32_t start;
+		struct kgem_expire_stats stats;
+	} demand;
+
+	struct {
+		unsigned level;
+		uint32_t last;
+		struct kgem_pressure_stats stats;
+	} pressure;
+
+	struct {
+		uint64_t lookups;
+		uint64_t misses;
+		uint64_t scanned;
+	} cache_stats;
 
 	uint32_t bcs_state;
 
@@ -196,6 +300,7 @@ struct kgem {
 	uint32_t has_wt :1;
 	uint32_t has_no_reloc :1;
 	uint32_t has_handle_lut :1;
+	uint32_t has_softpin :1;
 	uint32_t has_wc_mmap :1;
 	uint32_t has_dirtyfb :1;
 
@@ -223,8 +328,26 @@ struct kgem {
 	memcpy_box_func memcpy_to_tiled_x;
 	memcpy_box_func memcpy_from_tiled_x;
 	memcpy_box_func memcpy_between_tiled_x;
+	memcpy_box_func memcpy_to_tiled_y;
+	memcpy_box_func memcpy_from_tiled_y;
+	memcpy_box_func memcpy_from_tiled_x__wc;
+	memcpy_box_func memcpy_from_wc;
+	memcpy_box_func memcpy_to_tiled_x__nt;
+	memcpy_box_func memcpy_nt;
+	memcpy_xor_func memcpy_to_tiled_x__xor;
 
 	struct kgem_bo *batch_bo;
+	struct kgem_async *async;
+	struct kgem_trace *trace;
+	struct kgem_vm *vm;
+
+	struct {
+		uint16_t serial; /* entries from older batches are stale */
+		uint32_t count;
+		uint32_t shared;
+		struct kgem_binding_stats stats;
+		struct kgem_binding cache[KGEM_BINDING_SIZE];
+	} binding;
 
 	uint16_t reloc__self[256];
 	struct drm_i915_gem_exec_object2 exec[384] page_aligned;
@@ -328,8 +451,12 @@ bool kgem_bo_convert_to_gpu(struct kgem *kgem,
 			    unsigned flags);
 
 bool kgem_bo_is_fenced(struct kgem *kgem, struct kgem_bo *bo);
-uint32_t kgem_bo_get_binding(struct kgem_bo *bo, uint32_t format);
-void kgem_bo_set_binding(struct kgem_bo *bo, uint32_t format, uint16_t offset);
+uint32_t kgem_bo_get_binding(struct kgem *kgem, struct kgem_bo *bo,
+			     uint32_t width, uint32_t height,
+			     uint32_t format);
+void kgem_bo_set_binding(struct kgem *kgem, struct kgem_bo *bo,
+			 uint32_t width, uint32_t height,
+			 uint32_t format, uint16_t offset);
 
 bool kgem_retire(struct kgem *kgem);
 void kgem_retire__buffers(struct kgem *kgem);
@@ -395,6 +522,35 @@ static inline void kgem_bo_submit(struct kgem *kgem, struct kgem_bo *bo)
 
 void kgem_scanout_flush(struct kgem *kgem, struct kgem_bo *bo);
 
+bool kgem_async_init(struct kgem *kgem);
+void kgem_async_fini(struct kgem *kgem);
+void __kgem_async_sync(struct kgem *kgem);
+static inline void kgem_async_sync(struct kgem *kgem)
+{
+	if (kgem->async)
+		__kgem_async_sync(kgem);
+}
+
+struct kgem_vm_stats {
+	uint64_t size, allocated, leaked;
+	uint64_t largest_hole;
+	uint64_t allocs, frees, failures;
+	uint64_t evictions, evicted;
+	int holes;
+};
+bool kgem_vm_init(struct kgem *kgem);
+void kgem_vm_fini(struct kgem *kgem);
+void kgem_vm_get_stats(struct kgem *kgem, struct kgem_vm_stats *stats);
+
+bool kgem_trace_open(struct kgem *kgem, const char *path);
+void kgem_trace_close(struct kgem *kgem);
+void __kgem_trace_batch(struct kgem *kgem, uint32_t batch_end);
+static inline void kgem_trace_batch(struct kgem *kgem, uint32_t batch_end)
+{
+	if (kgem->trace)
+		__kgem_trace_batch(kgem, batch_end);
+}
+
 static inline struct kgem_bo *kgem_bo_reference(struct kgem_bo *bo)
 {
 	assert(bo->refcnt);
@@ -848,6 +1004,9 @@ void kgem_throttle(struct kgem *kgem);
 #define MAX_INACTIVE_TIME 10
 bool kgem_expire_cache(struct kgem *kgem);
 bool kgem_cleanup_cache(struct kgem *kgem);
+#define KGEM_PRESSURE_MAX 3
+unsigned kgem_memory_pressure(struct kgem *kgem);
+void kgem_dump_slab_stats(void);
 
 void kgem_clean_scanout_cache(struct kgem *kgem);
 void kgem_clean_large_cache(struct kgem *kgem);
@@ -902,6 +1061,153 @@ memcpy_from_tiled_x(struct kgem *kgem,
 					 width, height);
 }
 
+static inline void
+memcpy_to_tiled_y(struct kgem *kgem,
+		  const void *src, void *dst, int bpp,
+		  int32_t src_stride, int32_t dst_stride,
+		  int16_t src_x, int16_t src_y,
+		  int16_t dst_x, int16_t dst_y,
+		  uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_to_tiled_y);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_to_tiled_y(src, dst, bpp,
+				       src_stride, dst_stride,
+				       src_x, src_y,
+				       dst_x, dst_y,
+				       width, height);
+}
+
+static inline void
+memcpy_from_tiled_y(struct kgem *kgem,
+		    const void *src, void *dst, int bpp,
+		    int32_t src_stride, int32_t dst_stride,
+		    int16_t src_x, int16_t src_y,
+		    int16_t dst_x, int16_t dst_y,
+		    uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_from_tiled_y);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_from_tiled_y(src, dst, bpp,
+					 src_stride, dst_stride,
+					 src_x, src_y,
+					 dst_x, dst_y,
+					 width, height);
+}
+
+/* Copies out of uncached (WC or GTT) mappings */
+static inline void
+memcpy_from_wc(struct kgem *kgem,
+	       const void *src, void *dst, int bpp,
+	       int32_t src_stride, int32_t dst_stride,
+	       int16_t src_x, int16_t src_y,
+	       int16_t dst_x, int16_t dst_y,
+	       uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_from_wc);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_from_wc(src, dst, bpp,
+				    src_stride, dst_stride,
+				    src_x, src_y,
+				    dst_x, dst_y,
+				    width, height);
+}
+
+static inline void
+memcpy_from_tiled_x__wc(struct kgem *kgem,
+			const void *src, void *dst, int bpp,
+			int32_t src_stride, int32_t dst_stride,
+			int16_t src_x, int16_t src_y,
+			int16_t dst_x, int16_t dst_y,
+			uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_from_tiled_x__wc);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_from_tiled_x__wc(src, dst, bpp,
+					     src_stride, dst_stride,
+					     src_x, src_y,
+					     dst_x, dst_y,
+					     width, height);
+}
+
+/* Copies using non-temporal stores, bypassing the CPU cache */
+static inline void
+memcpy_nt(struct kgem *kgem,
+	  const void *src, void *dst, int bpp,
+	  int32_t src_stride, int32_t dst_stride,
+	  int16_t src_x, int16_t src_y,
+	  int16_t dst_x, int16_t dst_y,
+	  uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_nt);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_nt(src, dst, bpp,
+			       src_stride, dst_stride,
+			       src_x, src_y,
+			       dst_x, dst_y,
+			       width, height);
+}
+
+static inline void
+memcpy_to_tiled_x__nt(struct kgem *kgem,
+		      const void *src, void *dst, int bpp,
+		      int32_t src_stride, int32_t dst_stride,
+		      int16_t src_x, int16_t src_y,
+		      int16_t dst_x, int16_t dst_y,
+		      uint16_t width, uint16_t height)
+{
+	assert(kgem->memcpy_to_tiled_x__nt);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_to_tiled_x__nt(src, dst, bpp,
+					   src_stride, dst_stride,
+					   src_x, src_y,
+					   dst_x, dst_y,
+					   width, height);
+}
+
+static inline void
+memcpy_to_tiled_x__xor(struct kgem *kgem,
+		       const void *src, void *dst, int bpp,
+		       int32_t src_stride, int32_t dst_stride,
+		       int16_t src_x, int16_t src_y,
+		       int16_t dst_x, int16_t dst_y,
+		       uint16_t width, uint16_t height,
+		       uint32_t and, uint32_t or)
+{
+	assert(kgem->memcpy_to_tiled_x__xor);
+	assert(src_x >= 0 && src_y >= 0);
+	assert(dst_x >= 0 && dst_y >= 0);
+	assert(8*src_stride >= (src_x+width) * bpp);
+	assert(8*dst_stride >= (dst_x+width) * bpp);
+	return kgem->memcpy_to_tiled_x__xor(src, dst, bpp,
+					    src_stride, dst_stride,
+					    src_x, src_y,
+					    dst_x, dst_y,
+					    width, height,
+					    and, or);
+}
+
 void choose_memcpy_tiled_x(struct kgem *kgem, int swizzling, unsigned cpu);
+void choose_memcpy_tiled_y(struct kgem *kgem, int swizzling, unsigned cpu);
+void choose_memcpy_from_wc(struct kgem *kgem, unsigned cpu);
+void choose_memcpy_nt(struct kgem *kgem, unsigned cpu);
 
 #endif /* KGEM_H */
@@ -598,21 +598,27 @@ static void (*finish_state(int gen))(struct kgem*)
 	assert(0);
 }
 
+int kgem_debug_decode(struct kgem *kgem, uint32_t offset)
+{
+	switch ((kgem->batch[offset] & 0xe0000000) >> 29) {
+	case 0: return decode_mi(kgem, offset);
+	case 2: return decode_2d(kgem->gen)(kgem, offset);
+	case 3: return decode_3d(kgem->gen)(kgem, offset);
+	default: return decode_nop(kgem, offset);
+	}
+}
+
+void kgem_debug_finish_state(struct kgem *kgem)
+{
+	finish_state(kgem->gen)(kgem);
+}
+
 void __kgem_batch_debug(struct kgem *kgem, uint32_t nbatch)
 {
-	int (*const decode[])(struct kgem *, uint32_t) = {
-		decode_mi,
-		decode_nop,
-		decode_2d(kgem->gen),
-		decode_3d(kgem->gen),
-	};
 	uint32_t offset = 0;
 
-	while (offset < nbatch) {
-		int class = (kgem->batch[offset] & 0xe0000000) >> 29;
-		assert(class < ARRAY_SIZE(decode));
-		offset += decode[class](kgem, offset);
-	}
+	while (offset < nbatch)
+		offset += kgem_debug_decode(kgem, offset);
 
-	finish_state(kgem->gen)(kgem);
+	kgem_debug_finish_state(kgem);
 }
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "sna.h"
+#include "kgem_slab.h"
+
+#ifdef HAVE_VALGRIND
+#include <valgrind.h>
+#include <memcheck.h>
+#endif
+
+#if 0
+#undef DBG
+#define DBG(x) ErrorF x
+#endif
+
+#define CACHELINE 64
+#define SLAB_HEADER ALIGN(sizeof(struct kgem_slab), CACHELINE)
+
+static uint64_t slab_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void kgem_slab_cache_init(struct kgem_slab_cache *cache,
+			  const char *name, unsigned size)
+{
+	if (cache->size)
+		return;
+
+	cache->name = name;
+	cache->size = ALIGN(size, CACHELINE);
+	cache->count = (KGEM_SLAB_SIZE - SLAB_HEADER) / cache->size;
+	assert(cache->count > 1);
+
+	list_init(&cache->partial);
+	list_init(&cache->full);
+
+	cache->last.time = slab_time();
+
+	DBG(("%s: %s, size=%d (%d), %d per slab\n", __FUNCTION__,
+	     name, size, cache->size, cache->count));
+}
+
+static struct kgem_slab *slab_create(struct kgem_slab_cache *cache)
+{
+	struct kgem_slab *slab;
+	void *ptr;
+
+	if (posix_memalign(&ptr, KGEM_SLAB_SIZE, KGEM_SLAB_SIZE))
+		return NULL;
+
+	VG(VALGRIND_MAKE_MEM_NOACCESS((char *)ptr + SLAB_HEADER,
+				      KGEM_SLAB_SIZE - SLAB_HEADER));
+
+	slab = ptr;
+	slab->cache = cache;
+	slab->freelist = NULL;
+	slab->used = 0;
+	slab->unused = 0;
+	list_add(&slab->link, &cache->partial);
+
+	cache->stats.slab_allocs++;
+	if (++cache->stats.slabs > cache->stats.max_slabs)
+		cache->stats.max_slabs = cache->stats.slabs;
+
+	DBG(("%s: %s, slabs=%d\n", __FUNCTION__,
+	     cache->name, cache->stats.slabs));
+	return slab;
+}
+
+static void slab_destroy(struct kgem_slab_cache *cache, struct kgem_slab *slab)
+{
+	assert(slab->used == 0);
+	assert(cache->stats.slabs);
+
+	list_del(&slab->link);
+	free(slab);
+
+	cache->stats.slab_frees++;
+	cache->stats.slabs--;
+}
+
+static void slab_put(struct kgem_slab_cache *cache, void *ptr)
+{
+	struct kgem_slab *slab = kgem_slab(ptr);
+
+	assert(slab->cache == cache);
+	assert(slab->used);
+	assert(((char *)ptr - (char *)slab - SLAB_HEADER) % cache->size == 0);
+
+	if (slab->freelist == NULL && slab->unused == cache->count)
+		list_move(&slab->link, &cache->partial);
+
+	VG(VALGRIND_MAKE_MEM_NOACCESS(ptr, cache->size));
+	VG(VALGRIND_MAKE_MEM_UNDEFINED(ptr, sizeof(void *)));
+	*(void **)ptr = slab->freelist;
+	slab->freelist = ptr;
+	VG(VALGRIND_MAKE_MEM_NOACCESS(ptr, sizeof(void *)));
+
+	/* Keep the emptiest slabs at the back, where they may be released */
+	if (--slab->used == 0)
+		list_move_tail(&slab->link, &cache->partial);
+}
+
+void *__kgem_slab_alloc(struct kgem_slab_cache *cache)
+{
+	struct kgem_slab *slab;
+	void *ptr;
+
+	assert(cache->size);
+	assert(cache->nmagazine == 0);
+
+	if (list_is_empty(&cache->partial)) {
+		slab = slab_create(cache);
+		if (slab == NULL) {
+			cache->stats.allocs--;
+			return NULL;
+		}
+	} else
+		slab = list_first_entry(&cache->partial, struct kgem_slab, link);
+
+	if (slab->freelist) {
+		ptr = slab->freelist;
+		VG(VALGRIND_MAKE_MEM_DEFINED(ptr, sizeof(void *)));
+		slab->freelist = *(void **)ptr;
+	} else {
+		assert(slab->unused < cache->count);
+		ptr = (char *)slab + SLAB_HEADER + slab->unused++ * cache->size;
+	}
+	slab->used++;
+
+	if (slab->freelist == NULL && slab->unused == cache->count)
+		list_move(&slab->link, &cache->full);
+
+	VG(VALGRIND_MAKE_MEM_UNDEFINED(ptr, cache->size));
+	return ptr;
+}
+
+void __kgem_slab_free(struct kgem_slab_cache *cache, void *ptr)
+{
+	assert(cache->nmagazine == KGEM_SLAB_MAGAZINE);
+
+	/* Return the older half of the magazine to the slabs, keeping
+	 * the most recently used objects hot.
+	 */
+	while (cache->nmagazine > KGEM_SLAB_MAGAZINE / 2)
+		slab_put(cache, cache->magazine[--cache->nmagazine]);
+
+	cache->magazine[cache->nmagazine++] = ptr;
+}
+
+void kgem_slab_cache_release(struct kgem_slab_cache *cache)
+{
+	if (cache->size == 0)
+		return;
+
+	DBG(("%s: %s, magazine=%d, slabs=%d\n", __FUNCTION__,
+	     cache->name, cache->nmagazine, cache->stats.slabs));
+
+	while (cache->nmagazine)
+		slab_put(cache, cache->magazine[--cache->nmagazine]);
+
+	while (!list_is_empty(&cache->partial)) {
+		struct kgem_slab *slab;
+
+		slab = list_last_entry(&cache->partial, struct kgem_slab, link);
+		if (slab->used)
+			break;
+
+		slab_destroy(cache, slab);
+	}
+}
+
+void kgem_slab_cache_dump(struct kgem_slab_cache *cache)
+{
+	uint64_t now, allocs, frees;
+	double elapsed;
+
+	if (cache->size == 0)
+		return;
+
+	now = slab_time();
+	elapsed = (now - cache->last.time) * 1e-9;
+	allocs = cache->stats.allocs - cache->last.allocs;
+	frees = cache->stats.frees - cache->last.frees;
+
+	ErrorF("%s slab: %llu live (%d bytes each), %d slabs, %dKiB (peak %dKiB); %.0f allocs/s, %.0f frees/s; %llu slabs created, %llu released\n",
+	       cache->name,
+	       (unsigned long long)(cache->stats.allocs - cache->stats.frees),
+	       cache->size,
+	       cache->stats.slabs,
+	       cache->stats.slabs * (KGEM_SLAB_SIZE / 1024),
+	       cache->stats.max_slabs * (KGEM_SLAB_SIZE / 1024),
+	       elapsed > 0 ? allocs / elapsed : 0.,
+	       elapsed > 0 ? frees / elapsed : 0.,
+	       (unsigned long long)cache->stats.slab_allocs,
+	       (unsigned long long)cache->stats.slab_frees);
+
+	cache->last.allocs = cache->stats.allocs;
+	cache->last.frees = cache->stats.frees;
+	cache->last.time = now;
+}
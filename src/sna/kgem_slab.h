@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef KGEM_SLAB_H
+#define KGEM_SLAB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "compiler.h"
+#include "intel_list.h"
+
+/* A small slab allocator for the fixed-size structs kgem churns through
+ * on every batch (bo, request, upload buffers).
+ *
+ * Objects are carved out of naturally aligned KGEM_SLAB_SIZE chunks, so
+ * that the owning slab (and hence cache) can be found from the pointer
+ * alone, and each object is padded to a cacheline. In front of the slabs
+ * sits a per-cache magazine of recently freed objects, which serves the
+ * common alloc/free pairs without touching the slab bookkeeping at all.
+ *
+ * Everything is manipulated by the main thread only, there is no locking.
+ */
+
+#define KGEM_SLAB_SIZE (16*1024)
+#define KGEM_SLAB_MAGAZINE 32
+
+struct kgem_slab_cache {
+	const char *name;
+	unsigned size;
+	unsigned count; /* objects per slab */
+
+	struct list partial; /* slabs with free objects */
+	struct list full;
+
+	unsigned nmagazine;
+	void *magazine[KGEM_SLAB_MAGAZINE];
+
+	struct kgem_slab_stats {
+		uint64_t allocs;
+		uint64_t frees;
+		uint64_t slab_allocs;
+		uint64_t slab_frees;
+		unsigned slabs;
+		unsigned max_slabs;
+	} stats;
+
+	struct {
+		uint64_t allocs;
+		uint64_t frees;
+		uint64_t time;
+	} last;
+};
+
+struct kgem_slab {
+	struct list link;
+	struct kgem_slab_cache *cache;
+	void *freelist;
+	unsigned used; /* objects handed out, including the magazine */
+	unsigned unused; /* index of the first never-used object */
+};
+
+void kgem_slab_cache_init(struct kgem_slab_cache *cache,
+			  const char *name, unsigned size);
+void kgem_slab_cache_release(struct kgem_slab_cache *cache);
+void kgem_slab_cache_dump(struct kgem_slab_cache *cache);
+
+void *__kgem_slab_alloc(struct kgem_slab_cache *cache);
+void __kgem_slab_free(struct kgem_slab_cache *cache, void *ptr);
+
+static inline void *kgem_slab_alloc(struct kgem_slab_cache *cache)
+{
+	cache->stats.allocs++;
+	if (likely(cache->nmagazine))
+		return cache->magazine[--cache->nmagazine];
+
+	return __kgem_slab_alloc(cache);
+}
+
+static inline struct kgem_slab *kgem_slab(void *ptr)
+{
+	return (struct kgem_slab *)((uintptr_t)ptr & ~(uintptr_t)(KGEM_SLAB_SIZE - 1));
+}
+
+/* Objects are returned to whichever cache they were allocated from */
+static inline void kgem_slab_free(void *ptr)
+{
+	struct kgem_slab_cache *cache = kgem_slab(ptr)->cache;
+
+	cache->stats.frees++;
+	if (likely(cache->nmagazine < KGEM_SLAB_MAGAZINE)) {
+		cache->magazine[cache->nmagazine++] = ptr;
+		return;
+	}
+
+	__kgem_slab_free(cache, ptr);
+}
+
+#endif /* KGEM_SLAB_H */
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "sna.h"
+#include "kgem_trace.h"
+
+#if 0
+#undef DBG
+#define DBG(x) ErrorF x
+#endif
+
+struct kgem_trace {
+	FILE *file;
+	uint64_t batches;
+	uint64_t bytes;
+};
+
+static bool trace_write(struct kgem_trace *trace, const void *data, size_t len)
+{
+	if (len == 0)
+		return true;
+
+	if (fwrite(data, len, 1, trace->file) != 1)
+		return false;
+
+	trace->bytes += len;
+	return true;
+}
+
+bool kgem_trace_open(struct kgem *kgem, const char *path)
+{
+	struct kgem_trace_header header;
+	struct kgem_trace *trace;
+
+	assert(kgem->trace == NULL);
+
+	trace = calloc(1, sizeof(*trace));
+	if (trace == NULL)
+		return false;
+
+	trace->file = fopen(path, "we");
+	if (trace->file == NULL) {
+		DBG(("%s: unable to open '%s': %d\n", __FUNCTION__, path, errno));
+		free(trace);
+		return false;
+	}
+
+	header.magic = KGEM_TRACE_MAGIC;
+	header.version = KGEM_TRACE_VERSION;
+	header.gen = kgem->gen;
+	header.flags = 0;
+	if (kgem->has_handle_lut)
+		header.flags |= KGEM_TRACE_HAS_HANDLE_LUT;
+	if (kgem->has_llc)
+		header.flags |= KGEM_TRACE_HAS_LLC;
+
+	if (!trace_write(trace, &header, sizeof(header))) {
+		fclose(trace->file);
+		free(trace);
+		return false;
+	}
+
+	kgem->trace = trace;
+	return true;
+}
+
+void kgem_trace_close(struct kgem *kgem)
+{
+	struct kgem_trace *trace = kgem->trace;
+
+	if (trace == NULL)
+		return;
+
+	DBG(("%s: %lld batches, %lld bytes\n", __FUNCTION__,
+	     (long long)trace->batches, (long long)trace->bytes));
+
+	fclose(trace->file);
+	free(trace);
+	kgem->trace = NULL;
+}
+
+void __kgem_trace_batch(struct kgem *kgem, uint32_t batch_end)
+{
+	struct kgem_trace *trace = kgem->trace;
+	struct kgem_trace_object exec[ARRAY_SIZE(kgem->exec)];
+	struct kgem_trace_batch batch;
+	struct kgem_bo *bo;
+	int n;
+
+	assert(trace);
+	assert(kgem->nexec <= ARRAY_SIZE(kgem->exec));
+
+	batch.magic = KGEM_TRACE_BATCH_MAGIC;
+	batch.ring = kgem->ring;
+	batch.flags = kgem->batch_flags;
+	batch.batch_end = batch_end;
+	batch.nbatch = kgem->nbatch;
+	batch.surface = kgem->surface;
+	batch.batch_size = kgem->batch_size;
+	batch.nreloc = kgem->nreloc;
+	batch.nexec = kgem->nexec;
+	batch.pad = 0;
+
+	for (n = 0; n < kgem->nexec; n++) {
+		exec[n].handle = kgem->exec[n].handle;
+		exec[n].flags = kgem->exec[n].flags;
+		exec[n].size = 0;
+		exec[n].pitch = 0;
+		exec[n].tiling = 0;
+		exec[n].pad = 0;
+	}
+
+	list_for_each_entry(bo, &kgem->next_request->buffers, request) {
+		if (bo->proxy || bo->exec == NULL)
+			continue;
+
+		n = bo->exec - kgem->exec;
+		assert(n >= 0 && n < kgem->nexec);
+		exec[n].size = kgem_bo_size(bo);
+		exec[n].pitch = bo->pitch;
+		exec[n].tiling = bo->tiling;
+	}
+
+	if (!trace_write(trace, &batch, sizeof(batch)) ||
+	    !trace_write(trace, kgem->batch, sizeof(uint32_t)*kgem->nbatch) ||
+	    !trace_write(trace, kgem->batch + kgem->surface,
+			 sizeof(uint32_t)*(kgem->batch_size - kgem->surface)) ||
+	    !trace_write(trace, kgem->reloc, sizeof(kgem->reloc[0])*kgem->nreloc) ||
+	    !trace_write(trace, exec, sizeof(exec[0])*kgem->nexec)) {
+		xf86DrvMsg(to_sna_from_kgem(kgem)->scrn->scrnIndex, X_WARNING,
+			   "Failed to write batch trace, capture disabled.\n");
+		kgem_trace_close(kgem);
+		return;
+	}
+
+	trace->batches++;
+}
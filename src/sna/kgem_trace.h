@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef KGEM_TRACE_H
+#define KGEM_TRACE_H
+
+#include <stdint.h>
+
+/* On-disk layout of a batch trace, in host byte order.
+ *
+ * The file begins with a struct kgem_trace_header, followed by one record
+ * per submitted batch:
+ *
+ *   struct kgem_trace_batch
+ *   uint32_t batch[nbatch]                  commands, then inline vertices
+ *   uint32_t surface[batch_size - surface]  surface state from the tail
+ *   struct drm_i915_gem_relocation_entry reloc[nreloc]
+ *   struct kgem_trace_object exec[nexec]
+ *
+ * The batch is captured before it is compacted into its final buffer,
+ * so the relocation offsets are relative to a buffer of batch_size
+ * dwords with the surface state at the end; relocations targetting the
+ * batch itself have target_handle == ~0U.
+ */
+
+#define KGEM_TRACE_MAGIC 0x54414e53 /* "SNAT" */
+#define KGEM_TRACE_BATCH_MAGIC 0x48544142 /* "BATH" */
+#define KGEM_TRACE_VERSION 1
+
+struct kgem_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t gen;
+	uint32_t flags;
+#define KGEM_TRACE_HAS_HANDLE_LUT 0x1
+#define KGEM_TRACE_HAS_LLC 0x2
+};
+
+struct kgem_trace_batch {
+	uint32_t magic;
+	uint32_t ring;
+	uint32_t flags; /* execbuffer flags */
+	uint32_t batch_end; /* end of the commands, after MI_BATCH_BUFFER_END */
+	uint32_t nbatch;
+	uint32_t surface;
+	uint32_t batch_size;
+	uint32_t nreloc;
+	uint32_t nexec;
+	uint32_t pad;
+};
+
+struct kgem_trace_object {
+	uint32_t handle;
+	uint32_t flags;
+	uint32_t size;
+	uint32_t pitch;
+	uint32_t tiling;
+	uint32_t pad;
+};
+
+#endif /* KGEM_TRACE_H */
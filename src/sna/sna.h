@@ -280,6 +280,7 @@ struct sna {
 #define SSE4_2 0x40
 #define AVX 0x80
 #define AVX2 0x100
+#define AVX512F 0x200
 
 	bool ignore_copy_area : 1;
 
@@ -443,6 +444,8 @@ struct sna {
 		char event[256];
 	} acpi;
 
+	struct sna_pressure *pressure;
+
 	struct sna_render render;
 
 #if DEBUG_MEMORY
@@ -1248,6 +1251,17 @@ affine_blt(const void *src, void *dst, int bpp,
 	   int32_t dst_stride,
 	   const struct pixman_f_transform *t);
 
+void
+affine_blt__cpu(unsigned cpu,
+		const void *src, void *dst, int bpp,
+		int16_t src_x, int16_t src_y,
+		int16_t src_width, int16_t src_height,
+		int32_t src_stride,
+		int16_t dst_x, int16_t dst_y,
+		uint16_t dst_width, uint16_t dst_height,
+		int32_t dst_stride,
+		const struct pixman_f_transform *t);
+
 void
 memmove_box(const void *src, void *dst,
 	    int bpp, int32_t stride,
@@ -1343,12 +1357,32 @@ static inline void sna_acpi_wakeup(struct sna *sna, void *read_mask)
 }
 void sna_acpi_fini(struct sna *sna);
 
-void sna_threads_init(void);
+/* sna_pressure.c */
+bool sna_pressure_init(struct sna *sna);
+void _sna_pressure_wakeup(struct sna *sna);
+int __sna_pressure_fd(struct sna *sna);
+static inline void sna_pressure_wakeup(struct sna *sna, void *read_mask)
+{
+	if (sna->pressure &&
+	    FD_ISSET(__sna_pressure_fd(sna), (fd_set*)read_mask))
+		_sna_pressure_wakeup(sna);
+}
+void sna_pressure_fini(struct sna *sna);
+
+int sna_threads_init(int count, const char *affinity);
 int sna_use_threads (int width, int height, int threshold);
-void sna_threads_run(int id, void (*func)(void *arg), void *arg);
+void __sna_threads_submit(void (*func)(void *arg), void *arg, const char *site);
+#define sna_threads_submit(func, arg) __sna_threads_submit(func, arg, __func__)
+bool sna_threads_join(void);
+void __sna_threads_run(int id, void (*func)(void *arg), void *arg, const char *site);
+#define sna_threads_run(id, func, arg) __sna_threads_run(id, func, arg, __func__)
 void sna_threads_trap(int sig);
-void sna_threads_wait(void);
+bool sna_threads_wait(void);
 void sna_threads_kill(void);
+void sna_threads_stats_enable(void);
+void sna_threads_stats_dump(void);
+void *sna_scratch_alloc(size_t size);
+void sna_scratch_free(void *ptr);
 
 void sna_image_composite(pixman_op_t        op,
 			 pixman_image_t    *src,
@@ -17445,6 +17445,9 @@ void sna_accel_flush(struct sna *sna)
 
 	if (sna->kgem.flush)
 		kgem_submit(&sna->kgem);
+
+	/* Do not let the reply overtake any batch still queued */
+	kgem_async_sync(&sna->kgem);
 }
 
 static void
@@ -17889,6 +17892,46 @@ static void sna_accel_debug_memory(struct sna *sna)
 	       (unsigned long)sna->kgem.debug_memory.bo_bytes,
 	       sna->debug_memory.cpu_bo_allocs,
 	       (unsigned long)sna->debug_memory.cpu_bo_bytes);
+	ErrorF("BO cache: %llu lookups, %llu misses, %llu candidates scanned\n",
+	       (unsigned long long)sna->kgem.cache_stats.lookups,
+	       (unsigned long long)sna->kgem.cache_stats.misses,
+	       (unsigned long long)sna->kgem.cache_stats.scanned);
+	ErrorF("VMA cache: %lluKiB idle (budget %lluKiB), %llu evictions (%lluKiB); GTT: %u maps, %lluKiB, %llu hits, %llu misses; WC: %u maps, %lluKiB, %llu hits, %llu misses; CPU: %u maps, %lluKiB, %llu hits, %llu misses\n",
+	       (unsigned long long)sna->kgem.vma_stats.cached >> 10,
+	       (unsigned long long)sna->kgem.vma_budget >> 10,
+	       (unsigned long long)sna->kgem.vma_stats.evictions,
+	       (unsigned long long)sna->kgem.vma_stats.evicted >> 10,
+	       sna->kgem.vma_stats.type[VMA_GTT].count,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_GTT].bytes >> 10,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_GTT].hits,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_GTT].misses,
+	       sna->kgem.vma_stats.type[VMA_WC].count,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_WC].bytes >> 10,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_WC].hits,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_WC].misses,
+	       sna->kgem.vma_stats.type[VMA_CPU].count,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_CPU].bytes >> 10,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_CPU].hits,
+	       (unsigned long long)sna->kgem.vma_stats.type[VMA_CPU].misses);
+	ErrorF("Expiry: %llu windows, %llu allocations, %.1f%% cache hits, %.1f%% predicted; %llu bo kept, %llu expired (%lluKiB)\n",
+	       (unsigned long long)sna->kgem.demand.stats.windows,
+	       (unsigned long long)sna->kgem.demand.stats.requests,
+	       sna->kgem.demand.stats.requests ? 100. * sna->kgem.demand.stats.hits / sna->kgem.demand.stats.requests : 0.,
+	       sna->kgem.demand.stats.requests ? 100. * sna->kgem.demand.stats.predicted / sna->kgem.demand.stats.requests : 0.,
+	       (unsigned long long)sna->kgem.demand.stats.kept,
+	       (unsigned long long)sna->kgem.demand.stats.expired,
+	       (unsigned long long)sna->kgem.demand.stats.expired_bytes >> 10);
+	ErrorF("Memory pressure: %llu events, peak level %d; %lluKiB marked purgeable, %lluKiB released\n",
+	       (unsigned long long)sna->kgem.pressure.stats.events,
+	       sna->kgem.pressure.stats.max_level,
+	       (unsigned long long)sna->kgem.pressure.stats.purgeable >> 10,
+	       (unsigned long long)sna->kgem.pressure.stats.released >> 10);
+	ErrorF("Surface state: %llu batches, %.1f emitted and %.1f shared per batch (peak %d shared)\n",
+	       (unsigned long long)sna->kgem.binding.stats.batches,
+	       sna->kgem.binding.stats.batches ? sna->kgem.binding.stats.states / (double)sna->kgem.binding.stats.batches : 0.,
+	       sna->kgem.binding.stats.batches ? sna->kgem.binding.stats.shared / (double)sna->kgem.binding.stats.batches : 0.,
+	       sna->kgem.binding.stats.max_shared);
+	kgem_dump_slab_stats();
 
 #ifdef VALGRIND_DO_ADDED_LEAK_CHECK
 	VG(VALGRIND_DO_ADDED_LEAK_CHECK);
@@ -18161,7 +18204,8 @@ static void sna_accel_notify(int fd, int ready, void *data)
 
 bool sna_accel_init(ScreenPtr screen, struct sna *sna)
 {
-	const char *backend;
+	const char *backend, *s;
+	int n;
 
 	DBG(("%s\n", __FUNCTION__));
 
@@ -18264,6 +18308,45 @@ bool sna_accel_init(ScreenPtr screen, struct sna *sna)
 	DBG(("%s(backend=%s, prefer_gpu=%x)\n",
 	     __FUNCTION__, backend, sna->render.prefer_gpu));
 
+	if (xf86ReturnOptValBool(sna->Options, OPTION_ASYNC_SUBMIT, FALSE)) {
+		if (kgem_async_init(&sna->kgem))
+			xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+				   "Submitting batches from a separate thread\n");
+		else
+			xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+				   "Failed to start the submission thread, submitting synchronously\n");
+	}
+
+	if (xf86ReturnOptValBool(sna->Options, OPTION_SOFTPIN, FALSE)) {
+		if (kgem_vm_init(&sna->kgem))
+			xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+				   "Assigning GPU addresses to buffers, without relocations\n");
+		else
+			xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+				   "Softpin is not supported by this kernel or GPU, using relocations\n");
+	}
+
+	if (xf86GetOptValInteger(sna->Options, OPTION_VMA_CACHE, &n) && n >= 0) {
+		sna->kgem.vma_budget = (uint64_t)n << 20;
+		xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+			   "Caching up to %dMiB of idle buffer mappings\n", n);
+	}
+
+	if (xf86ReturnOptValBool(sna->Options, OPTION_MEMORY_PRESSURE, TRUE) &&
+	    sna_pressure_init(sna))
+		xf86DrvMsg(sna->scrn->scrnIndex, X_INFO,
+			   "Releasing cached buffers under memory pressure\n");
+
+	s = xf86GetOptValString(sna->Options, OPTION_BATCH_TRACE);
+	if (s) {
+		if (kgem_trace_open(&sna->kgem, s))
+			xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+				   "Recording batches to \"%s\"\n", s);
+		else
+			xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+				   "Unable to record batches to \"%s\"\n", s);
+	}
+
 	kgem_reset(&sna->kgem);
 	sigtrap_init();
 
@@ -18354,6 +18437,7 @@ void sna_accel_leave(struct sna *sna)
 {
 	DBG(("%s\n", __FUNCTION__));
 	sna_scanout_flush(sna);
+	kgem_async_sync(&sna->kgem);
 
 	/* as root we always have permission to render */
 	if (geteuid() == 0)
@@ -18367,6 +18451,7 @@ void sna_accel_leave(struct sna *sna)
 	DBG(("%s: dropping render privileges\n", __FUNCTION__));
 
 	kgem_submit(&sna->kgem);
+	kgem_async_sync(&sna->kgem);
 	sna->kgem.wedged |= 2;
 }
 
@@ -18392,6 +18477,9 @@ void sna_accel_close(struct sna *sna)
 	DeleteCallback(&EventCallback, sna_event_callback, sna);
 	RemoveNotifyFd(sna->kgem.fd);
 
+	sna_pressure_fini(sna);
+	kgem_async_fini(&sna->kgem);
+	kgem_trace_close(&sna->kgem);
 	kgem_cleanup_cache(&sna->kgem);
 }
 
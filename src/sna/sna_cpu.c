@@ -36,6 +36,7 @@
 	__asm__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c" (index))
 
 #define has_YMM 0x1
+#define has_ZMM 0x2
 
 unsigned sna_cpu_detect(void)
 {
@@ -64,6 +65,9 @@ unsigned sna_cpu_detect(void)
 			xgetbv(0, bv_eax, bv_ecx);
 			if ((bv_eax & 6) == 6)
 				extra |= has_YMM;
+			/* opmask and the upper zmm state as well */
+			if ((bv_eax & 0xe6) == 0xe6)
+				extra |= has_ZMM;
 		}
 
 		if ((extra & has_YMM) && (ecx & bit_AVX))
@@ -84,6 +88,9 @@ unsigned sna_cpu_detect(void)
 
 		if ((extra & has_YMM) && (ebx & bit_AVX2))
 			features |= AVX2;
+
+		if ((extra & has_ZMM) && (ebx & bit_AVX512F))
+			features |= AVX512F;
 	}
 
 	return features;
@@ -113,6 +120,8 @@ char *sna_cpu_features_to_string(unsigned features, char *line)
 		line += sprintf (line, ", avx");
 	if (features & AVX2)
 		line += sprintf (line, ", avx2");
+	if (features & AVX512F)
+		line += sprintf (line, ", avx512f");
 
 	return ret;
 }
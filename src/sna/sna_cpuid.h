@@ -81,4 +81,8 @@
 #define bit_AVX2	(1<<5)
 #endif
 
+#ifndef bit_AVX512F
+#define bit_AVX512F	(1<<16)
+#endif
+
 #endif /* SNA_CPUID_H */
@@ -508,6 +508,42 @@ done:
 	return sna->flags & SNA_TEAR_FREE;
 }
 
+static void setup_threads(struct sna *sna)
+{
+	const char *affinity;
+	int count, n;
+
+	/* The pool is shared by every screen, the first to start sets it up */
+	if (!xf86GetOptValInteger(sna->Options, OPTION_THREADS, &count)) {
+		count = -1;
+	} else if (count < 0) {
+		xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+			   "Ignoring invalid Threads value %d\n", count);
+		count = -1;
+	} else {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n > 0 && count > n) {
+			xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+				   "Limiting Threads from %d to the %d online cpus\n",
+				   count, n);
+			count = n;
+		}
+	}
+	affinity = xf86GetOptValString(sna->Options, OPTION_THREAD_AFFINITY);
+
+	n = sna_threads_init(count, affinity);
+	xf86DrvMsg(sna->scrn->scrnIndex,
+		   count >= 0 || affinity ? X_CONFIG : X_PROBED,
+		   "Using %d threads for CPU rendering, affinity: %s\n",
+		   n, affinity ? affinity : "big");
+
+	if (xf86ReturnOptValBool(sna->Options, OPTION_THREAD_STATS, FALSE)) {
+		xf86DrvMsg(sna->scrn->scrnIndex, X_CONFIG,
+			   "Collecting thread statistics, send SIGUSR2 to report\n");
+		sna_threads_stats_enable();
+	}
+}
+
 /**
  * This is called before ScreenInit to do any require probing of screen
  * configuration.
@@ -667,6 +703,8 @@ static Bool sna_pre_init(ScrnInfoPtr scrn, int probe)
 		sna->flags |= SNA_FORCE_SHADOW;
 	}
 
+	setup_threads(sna);
+
 	if (!sna_mode_pre_init(scrn, sna)) {
 		xf86DrvMsg(scrn->scrnIndex, X_ERROR,
 			   "No outputs and no modes.\n");
@@ -750,6 +788,7 @@ sna_wakeup_handler(WAKEUPHANDLER_ARGS_DECL)
 		return;
 
 	sna_acpi_wakeup(sna, read_mask);
+	sna_pressure_wakeup(sna, read_mask);
 
 	sna->WakeupHandler(WAKEUPHANDLER_ARGS);
 
@@ -998,6 +1037,7 @@ static Bool sna_early_close_screen(CLOSE_SCREEN_ARGS_DECL)
 
 	sna_uevent_fini(sna);
 	sna_mode_close(sna);
+	sna_threads_stats_dump();
 
 	if (sna->present.open) {
 		sna_present_close(sna, screen);
@@ -1294,6 +1334,7 @@ static void sna_free_screen(FREE_SCREEN_ARGS_DECL)
 
 	sna_mode_fini(sna);
 	sna_acpi_fini(sna);
+	kgem_vm_fini(&sna->kgem);
 
 	intel_put_device(sna->dev);
 	free(sna);
@@ -1492,8 +1533,6 @@ Bool sna_init_scrn(ScrnInfoPtr scrn, int entity_num)
 	xf86SetEntityInstanceForScreen(scrn, entity_num,
 				       xf86GetNumEntityInstances(entity_num)-1);
 
-	sna_threads_init();
-
 	return TRUE;
 }
 
@@ -38,6 +38,7 @@
 #define PITCH(x, y) ALIGN((x)*(y), 4)
 
 #define FORCE_INPLACE 0 /* 1 upload directly, -1 force indirect */
+#define FORCE_STREAM 0 /* 1 always use streaming stores, -1 never */
 
 /* XXX Need to avoid using GTT fenced access for I915_TILING_Y on 855GM */
 
@@ -53,6 +54,106 @@ static inline bool must_tile(struct sna *sna, int width, int height)
 		upload_too_large(sna, width, height));
 }
 
+/* Copies smaller than this are not worth waking the thread pool for */
+#define THREAD_COPY_SIZE (4 << 20)
+
+struct thread_copy {
+	memcpy_box_func func;
+	const void *src;
+	void *dst;
+	int bpp;
+	int32_t src_stride, dst_stride;
+	int16_t src_x, src_y;
+	int16_t dst_x, dst_y;
+	uint16_t width, height;
+};
+
+static void thread_copy(void *arg)
+{
+	struct thread_copy *t = arg;
+
+	t->func(t->src, t->dst, t->bpp,
+		t->src_stride, t->dst_stride,
+		t->src_x, t->src_y,
+		t->dst_x, t->dst_y,
+		t->width, t->height);
+}
+
+/* Copy a box, splitting a large one into bands across the threads. The
+ * bands are cut along the tile rows of the tiled side, beginning at
+ * tile_y, so that no tile row is shared between threads. Returns false
+ * if any thread faulted, leaving the copy incomplete.
+ */
+static bool copy_box(memcpy_box_func func,
+		     int tile_y, int tile_height,
+		     const void *src, void *dst, int bpp,
+		     int32_t src_stride, int32_t dst_stride,
+		     int16_t src_x, int16_t src_y,
+		     int16_t dst_x, int16_t dst_y,
+		     uint16_t width, uint16_t height)
+{
+	int num_threads = 1;
+
+	/* sna_use_threads() scales the threshold by the number of threads,
+	 * and so would begin splitting at a fraction of THREAD_COPY_SIZE.
+	 */
+	if ((size_t)width * height * bpp >> 3 >= THREAD_COPY_SIZE)
+		num_threads = sna_use_threads(width, height,
+					      THREAD_COPY_SIZE / (width * bpp >> 3) + 1);
+	if (num_threads <= 1) {
+		func(src, dst, bpp,
+		     src_stride, dst_stride,
+		     src_x, src_y,
+		     dst_x, dst_y,
+		     width, height);
+		return true;
+	} else {
+		struct thread_copy data[num_threads];
+		int y, dy, n;
+		bool ok;
+
+		dy = ALIGN((height + num_threads - 1) / num_threads, tile_height);
+		for (n = y = 0; y < height; n++) {
+			int end = ALIGN(tile_y + y + dy, tile_height) - tile_y;
+			if (end > height)
+				end = height;
+
+			assert(n < num_threads);
+			data[n].func = func;
+			data[n].src = src;
+			data[n].dst = dst;
+			data[n].bpp = bpp;
+			data[n].src_stride = src_stride;
+			data[n].dst_stride = dst_stride;
+			data[n].src_x = src_x;
+			data[n].src_y = src_y + y;
+			data[n].dst_x = dst_x;
+			data[n].dst_y = dst_y + y;
+			data[n].width = width;
+			data[n].height = end - y;
+
+			y = end;
+		}
+		num_threads = n;
+
+		DBG(("%s: using %d threads for copying %dx%d\n",
+		     __FUNCTION__, num_threads, width, height));
+
+		if (sigtrap_get()) {
+			sna_threads_kill();
+			return false;
+		}
+
+		for (n = 1; n < num_threads; n++)
+			sna_threads_run(n, thread_copy, &data[n]);
+		thread_copy(&data[0]);
+
+		ok = sna_threads_wait();
+		sigtrap_put();
+		return ok;
+	}
+}
+
 static bool download_inplace__cpu(struct kgem *kgem,
 				  PixmapPtr p, struct kgem_bo *bo,
 				  const BoxRec *box, int nbox)
@@ -60,6 +161,10 @@ static bool download_inplace__cpu(struct kgem *kgem,
 	BoxRec extents;
 
 	switch (bo->tiling) {
+	case I915_TILING_Y:
+		if (!kgem->memcpy_from_tiled_y)
+			return false;
+		break;
 	case I915_TILING_X:
 		if (!kgem->memcpy_from_tiled_x)
 			return false;
@@ -101,13 +206,12 @@ read_boxes_inplace__cpu(struct kgem *kgem,
 	void *src, *dst = pixmap->devPrivate.ptr;
 	int src_pitch = bo->pitch;
 	int dst_pitch = pixmap->devKind;
+	int tile_width, tile_height, tile_size;
+	memcpy_box_func copy;
 
 	if (!download_inplace__cpu(kgem, dst, bo, box, n))
 		return false;
 
-	if (bo->tiling == I915_TILING_Y)
-		return false;
-
 	assert(kgem_bo_can_map__cpu(kgem, bo, false));
 
 	src = kgem_bo_map__cpu(kgem, bo);
@@ -121,23 +225,77 @@ read_boxes_inplace__cpu(struct kgem *kgem,
 
 	DBG(("%s x %d\n", __FUNCTION__, n));
 
-	if (bo->tiling == I915_TILING_X) {
-		do {
-			memcpy_from_tiled_x(kgem, src, dst, bpp, src_pitch, dst_pitch,
-					    box->x1, box->y1,
-					    box->x1, box->y1,
-					    box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
-	} else {
-		do {
-			memcpy_blt(src, dst, bpp, src_pitch, dst_pitch,
-				   box->x1, box->y1,
-				   box->x1, box->y1,
-				   box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
-	}
+	if (bo->tiling == I915_TILING_X)
+		copy = kgem->memcpy_from_tiled_x;
+	else if (bo->tiling == I915_TILING_Y)
+		copy = kgem->memcpy_from_tiled_y;
+	else
+		copy = memcpy_blt;
+	assert(copy);
+
+	kgem_get_tile_size(kgem, bo->tiling, bo->pitch,
+			   &tile_width, &tile_height, &tile_size);
+
+	do {
+		if (!copy_box(copy, box->y1, tile_height,
+			      src, dst, bpp, src_pitch, dst_pitch,
+			      box->x1, box->y1,
+			      box->x1, box->y1,
+			      box->x2 - box->x1, box->y2 - box->y1)) {
+			sigtrap_put();
+			return false;
+		}
+		box++;
+	} while (--n);
+
+	sigtrap_put();
+	return true;
+}
+
+static bool
+read_boxes_inplace__wc(struct kgem *kgem,
+		       PixmapPtr pixmap, struct kgem_bo *bo,
+		       const BoxRec *box, int n)
+{
+	int bpp = pixmap->drawable.bitsPerPixel;
+	void *src, *dst = pixmap->devPrivate.ptr;
+	int src_pitch = bo->pitch;
+	int dst_pitch = pixmap->devKind;
+	int tile_width, tile_height, tile_size;
+
+	/* Detile ourselves rather than occupy a fence and the aperture */
+	if (bo->tiling != I915_TILING_X ||
+	    !kgem->has_wc_mmap || !kgem->memcpy_from_tiled_x__wc)
+		return false;
+
+	kgem_bo_submit(kgem, bo);
+
+	src = kgem_bo_map__wc(kgem, bo);
+	if (src == NULL)
+		return false;
+
+	kgem_bo_sync__gtt(kgem, bo);
+
+	if (sigtrap_get())
+		return false;
+
+	DBG(("%s x %d\n", __FUNCTION__, n));
+
+	kgem_get_tile_size(kgem, bo->tiling, bo->pitch,
+			   &tile_width, &tile_height, &tile_size);
+
+	do {
+		if (!copy_box(kgem->memcpy_from_tiled_x__wc,
+			      box->y1, tile_height,
+			      src, dst, bpp, src_pitch, dst_pitch,
+			      box->x1, box->y1,
+			      box->x1, box->y1,
+			      box->x2 - box->x1, box->y2 - box->y1)) {
+			sigtrap_put();
+			return false;
+		}
+		box++;
+	} while (--n);
 
 	sigtrap_put();
 	return true;
@@ -151,10 +309,14 @@ static void read_boxes_inplace(struct kgem *kgem,
 	void *src, *dst = pixmap->devPrivate.ptr;
 	int src_pitch = bo->pitch;
 	int dst_pitch = pixmap->devKind;
+	bool uncached;
 
 	if (read_boxes_inplace__cpu(kgem, pixmap, bo, box, n))
 		return;
 
+	if (read_boxes_inplace__wc(kgem, pixmap, bo, box, n))
+		return;
+
 	DBG(("%s x %d, tiling=%d\n", __FUNCTION__, n, bo->tiling));
 
 	if (!kgem_bo_can_map(kgem, bo))
@@ -166,6 +328,9 @@ static void read_boxes_inplace(struct kgem *kgem,
 	if (src == NULL)
 		return;
 
+	/* Only a CPU map is cached, the others need streaming reads */
+	uncached = src == bo->map__gtt || src == bo->map__wc;
+
 	if (sigtrap_get())
 		return;
 
@@ -187,11 +352,14 @@ static void read_boxes_inplace(struct kgem *kgem,
 		assert(box->x2 <= pixmap->drawable.width);
 		assert(box->y2 <= pixmap->drawable.height);
 
-		memcpy_blt(src, dst, bpp,
-			   src_pitch, dst_pitch,
-			   box->x1, box->y1,
-			   box->x1, box->y1,
-			   box->x2 - box->x1, box->y2 - box->y1);
+		if (!copy_box(uncached ? kgem->memcpy_from_wc : memcpy_blt,
+			      box->y1, 1,
+			      src, dst, bpp,
+			      src_pitch, dst_pitch,
+			      box->x1, box->y1,
+			      box->x1, box->y1,
+			      box->x2 - box->x1, box->y2 - box->y1))
+			break;
 		box++;
 	} while (--n);
 
@@ -643,12 +811,34 @@ fallback:
 	sna->blt_state.fill_bo = 0;
 }
 
+/* Once an upload exceeds half the CPU cache, the regular stores would
+ * only evict the working set for data the CPU will not read again.
+ */
+static bool upload_stream(struct kgem *kgem,
+			  const BoxRec *box, int n, int bpp)
+{
+	uint64_t bytes;
+
+	if (FORCE_STREAM)
+		return FORCE_STREAM > 0;
+
+	bytes = 0;
+	do {
+		bytes += (box->x2 - box->x1) * (box->y2 - box->y1);
+		box++;
+	} while (--n);
+
+	return bytes * bpp >> 15 >= kgem->half_cpu_cache_pages;
+}
+
 static bool upload_inplace__tiled(struct kgem *kgem, struct kgem_bo *bo)
 {
 	DBG(("%s: tiling=%d\n", __FUNCTION__, bo->tiling));
 	switch (bo->tiling) {
 	case I915_TILING_Y:
-		return false;
+		if (!kgem->memcpy_to_tiled_y)
+			return false;
+		break;
 	case I915_TILING_X:
 		if (!kgem->memcpy_to_tiled_x)
 			return false;
@@ -668,11 +858,10 @@ write_boxes_inplace__tiled(struct kgem *kgem,
                            struct kgem_bo *bo, int16_t dst_dx, int16_t dst_dy,
                            const BoxRec *box, int n)
 {
+	int tile_width, tile_height, tile_size;
+	memcpy_box_func copy;
 	uint8_t *dst;
 
-	if (bo->tiling == I915_TILING_Y)
-		return false;
-
 	assert(kgem->has_wc_mmap || kgem_bo_can_map__cpu(kgem, bo, true));
 
 	if (kgem_bo_can_map__cpu(kgem, bo, true)) {
@@ -692,23 +881,31 @@ write_boxes_inplace__tiled(struct kgem *kgem,
 	if (sigtrap_get())
 		return false;
 
-	if (bo->tiling) {
-		do {
-			memcpy_to_tiled_x(kgem, src, dst, bpp, stride, bo->pitch,
-					  box->x1 + src_dx, box->y1 + src_dy,
-					  box->x1 + dst_dx, box->y1 + dst_dy,
-					  box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
-	} else {
-		do {
-			memcpy_blt(src, dst, bpp, stride, bo->pitch,
-				   box->x1 + src_dx, box->y1 + src_dy,
-				   box->x1 + dst_dx, box->y1 + dst_dy,
-				   box->x2 - box->x1, box->y2 - box->y1);
-			box++;
-		} while (--n);
-	}
+	if (bo->tiling == I915_TILING_X) {
+		copy = kgem->memcpy_to_tiled_x;
+		if (kgem->memcpy_to_tiled_x__nt &&
+		    upload_stream(kgem, box, n, bpp))
+			copy = kgem->memcpy_to_tiled_x__nt;
+	} else if (bo->tiling == I915_TILING_Y)
+		copy = kgem->memcpy_to_tiled_y;
+	else
+		copy = memcpy_blt;
+	assert(copy);
+
+	kgem_get_tile_size(kgem, bo->tiling, bo->pitch,
+			   &tile_width, &tile_height, &tile_size);
+
+	do {
+		if (!copy_box(copy, box->y1 + dst_dy, tile_height,
+			      src, dst, bpp, stride, bo->pitch,
+			      box->x1 + src_dx, box->y1 + src_dy,
+			      box->x1 + dst_dx, box->y1 + dst_dy,
+			      box->x2 - box->x1, box->y2 - box->y1)) {
+			sigtrap_put();
+			return false;
+		}
+		box++;
+	} while (--n);
 
 	sigtrap_put();
 	return true;
@@ -720,6 +917,7 @@ static bool write_boxes_inplace(struct kgem *kgem,
 				const BoxRec *box, int n)
 {
 	void *dst;
+	bool stream;
 
 	DBG(("%s x %d, handle=%d, tiling=%d\n",
 	     __FUNCTION__, n, bo->handle, bo->tiling));
@@ -740,6 +938,8 @@ static bool write_boxes_inplace(struct kgem *kgem,
 
 	assert(dst != src);
 
+	stream = upload_stream(kgem, box, n, bpp);
+
 	if (sigtrap_get())
 		return false;
 
@@ -762,11 +962,16 @@ static bool write_boxes_inplace(struct kgem *kgem,
 		assert((box->x2 + src_dx)*bpp <= 8*stride);
 		assert(box->y1 + src_dy >= 0);
 
-		memcpy_blt(src, dst, bpp,
-			   stride, bo->pitch,
-			   box->x1 + src_dx, box->y1 + src_dy,
-			   box->x1 + dst_dx, box->y1 + dst_dy,
-			   box->x2 - box->x1, box->y2 - box->y1);
+		if (!copy_box(stream ? kgem->memcpy_nt : memcpy_blt,
+			      box->y1 + dst_dy, 1,
+			      src, dst, bpp,
+			      stride, bo->pitch,
+			      box->x1 + src_dx, box->y1 + src_dy,
+			      box->x1 + dst_dx, box->y1 + dst_dy,
+			      box->x2 - box->x1, box->y2 - box->y1)) {
+			sigtrap_put();
+			return false;
+		}
 		box++;
 	} while (--n);
 
@@ -1256,6 +1461,59 @@ fallback:
 				   box, nbox);
 }
 
+static bool upload_inplace__tiled_xor(struct kgem *kgem, struct kgem_bo *bo)
+{
+	DBG(("%s: tiling=%d\n", __FUNCTION__, bo->tiling));
+	if (bo->tiling != I915_TILING_X || !kgem->memcpy_to_tiled_x__xor)
+		return false;
+
+	if (kgem->has_wc_mmap)
+		return true;
+
+	return kgem_bo_can_map__cpu(kgem, bo, true);
+}
+
+static bool
+write_boxes_inplace__tiled_xor(struct kgem *kgem,
+			       const void *src, int stride, int bpp, int16_t src_dx, int16_t src_dy,
+			       struct kgem_bo *bo, int16_t dst_dx, int16_t dst_dy,
+			       const BoxRec *box, int n,
+			       uint32_t and, uint32_t or)
+{
+	uint8_t *dst;
+
+	assert(kgem->has_wc_mmap || kgem_bo_can_map__cpu(kgem, bo, true));
+
+	if (kgem_bo_can_map__cpu(kgem, bo, true)) {
+		dst = kgem_bo_map__cpu(kgem, bo);
+		if (dst == NULL)
+			return false;
+
+		kgem_bo_sync__cpu(kgem, bo);
+	} else {
+		dst = kgem_bo_map__wc(kgem, bo);
+		if (dst == NULL)
+			return false;
+
+		kgem_bo_sync__gtt(kgem, bo);
+	}
+
+	if (sigtrap_get())
+		return false;
+
+	do {
+		memcpy_to_tiled_x__xor(kgem, src, dst, bpp, stride, bo->pitch,
+				       box->x1 + src_dx, box->y1 + src_dy,
+				       box->x1 + dst_dx, box->y1 + dst_dy,
+				       box->x2 - box->x1, box->y2 - box->y1,
+				       and, or);
+		box++;
+	} while (--n);
+
+	sigtrap_put();
+	return true;
+}
+
 static bool
 write_boxes_inplace__xor(struct kgem *kgem,
 			 const void *src, int stride, int bpp, int16_t src_dx, int16_t src_dy,
@@ -1267,6 +1525,12 @@ write_boxes_inplace__xor(struct kgem *kgem,
 
 	DBG(("%s x %d, tiling=%d\n", __FUNCTION__, n, bo->tiling));
 
+	if (upload_inplace__tiled_xor(kgem, bo) &&
+	    write_boxes_inplace__tiled_xor(kgem, src, stride, bpp, src_dx, src_dy,
+					   bo, dst_dx, dst_dy, box, n,
+					   and, or))
+		return true;
+
 	if (!kgem_bo_can_map(kgem, bo))
 		return false;
 
@@ -1922,6 +2186,7 @@ sna_replace__xor(struct sna *sna, PixmapPtr pixmap,
 {
 	struct sna_pixmap *priv = sna_pixmap(pixmap);
 	struct kgem_bo *bo = priv->gpu_bo;
+	BoxRec box;
 	void *dst;
 
 	DBG(("%s(handle=%d, %dx%d, bpp=%d, tiling=%d)\n",
@@ -1949,6 +2214,17 @@ sna_replace__xor(struct sna *sna, PixmapPtr pixmap,
 			bo = new_bo;
 	}
 
+	box.x1 = box.y1 = 0;
+	box.x2 = pixmap->drawable.width;
+	box.y2 = pixmap->drawable.height;
+
+	if (upload_inplace__tiled_xor(&sna->kgem, bo) &&
+	    write_boxes_inplace__tiled_xor(&sna->kgem,
+					   src, stride, pixmap->drawable.bitsPerPixel, 0, 0,
+					   bo, 0, 0, &box, 1,
+					   and, or))
+		goto done;
+
 	if (kgem_bo_can_map(&sna->kgem, bo) &&
 	    (dst = kgem_bo_map(&sna->kgem, bo)) != NULL &&
 	    sigtrap_get() == 0) {
@@ -1961,17 +2237,11 @@ sna_replace__xor(struct sna *sna, PixmapPtr pixmap,
 			   and, or);
 		sigtrap_put();
 	} else {
-		BoxRec box;
-
 		if (bo != priv->gpu_bo) {
 			kgem_bo_destroy(&sna->kgem, bo);
 			bo = priv->gpu_bo;
 		}
 
-		box.x1 = box.y1 = 0;
-		box.x2 = pixmap->drawable.width;
-		box.y2 = pixmap->drawable.height;
-
 		if (!sna_write_boxes__xor(sna, pixmap,
 					  bo, 0, 0,
 					  src, stride, 0, 0,
@@ -1980,6 +2250,7 @@ sna_replace__xor(struct sna *sna, PixmapPtr pixmap,
 			return false;
 	}
 
+done:
 	if (bo != priv->gpu_bo) {
 		sna_pixmap_unmap(pixmap, priv);
 		kgem_bo_destroy(&sna->kgem, priv->gpu_bo);
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "sna.h"
+
+/* Listen for memory pressure stall information (PSI) from the kernel,
+ * and respond by giving up our caches before the system is forced to
+ * reclaim (or kill) on our behalf. We prefer the trigger for our own
+ * cgroup, so that we respond to the limits we are actually confined by,
+ * and fallback to the system-wide trigger.
+ *
+ * A PSI trigger is signalled by POLLPRI, which the server's own select
+ * loop does not listen for, so a small thread waits on the trigger and
+ * forwards each event down a pipe to be handled from the main thread.
+ */
+
+#define PSI_SYSTEM "/proc/pressure/memory"
+/* Some task stalled on memory for 100ms within a 2s window; the window
+ * must be at least 2s for unprivileged processes.
+ */
+#define PSI_TRIGGER "some 100000 2000000"
+
+struct sna_pressure {
+	int psi;
+	int pipe[2];
+	pthread_t thread;
+};
+
+static int psi_open(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) < 0) {
+		DBG(("%s: failed to register trigger on '%s', errno=%d\n",
+		     __FUNCTION__, path, errno));
+		close(fd);
+		return -1;
+	}
+
+	DBG(("%s: registered '%s' on '%s', fd=%d\n",
+	     __FUNCTION__, PSI_TRIGGER, path, fd));
+	return fd;
+}
+
+static int psi_open_cgroup(void)
+{
+	char buf[1024], path[1024 + 64];
+	char *cgroup, *eol;
+	int fd, n;
+
+	/* With the unified hierarchy, our entry is "0::/path" */
+	fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+
+	cgroup = strstr(buf, "0::/");
+	if (cgroup == NULL || (cgroup != buf && cgroup[-1] != '\n'))
+		return -1;
+
+	cgroup += 3;
+	eol = strchr(cgroup, '\n');
+	if (eol)
+		*eol = '\0';
+
+	snprintf(path, sizeof(path),
+		 "/sys/fs/cgroup%s/memory.pressure",
+		 strcmp(cgroup, "/") ? cgroup : "");
+	return psi_open(path);
+}
+
+static void *sna_pressure_thread(void *arg)
+{
+	struct sna_pressure *pressure = arg;
+	struct pollfd pfd;
+	sigset_t signals;
+
+	/* Disable all signals in the worker as X uses them for IO */
+	sigfillset(&signals);
+	sigdelset(&signals, SIGBUS);
+	sigdelset(&signals, SIGSEGV);
+	pthread_sigmask(SIG_SETMASK, &signals, NULL);
+
+	pfd.fd = pressure->psi;
+	pfd.events = POLLPRI;
+
+	for (;;) {
+		char c = 0;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd.revents & (POLLERR | POLLNVAL))
+			break;
+
+		/* A full pipe already has an event pending */
+		if (pfd.revents & POLLPRI &&
+		    write(pressure->pipe[1], &c, 1) < 0 &&
+		    errno != EAGAIN)
+			break;
+	}
+
+	DBG(("%s: trigger closed, errno=%d\n", __FUNCTION__, errno));
+	return NULL;
+}
+
+void _sna_pressure_wakeup(struct sna *sna)
+{
+	char buf[64];
+	int n;
+
+	/* Coalesce all the pending events into one */
+	n = read(sna->pressure->pipe[0], buf, sizeof(buf));
+	if (n <= 0)
+		return;
+
+	n = kgem_memory_pressure(&sna->kgem);
+	DBG(("%s: memory pressure, level=%d\n", __FUNCTION__, n));
+	if (n == KGEM_PRESSURE_MAX)
+		xf86DrvMsg(sna->scrn->scrnIndex, X_INFO,
+			   "Sustained memory pressure, released all cached buffers\n");
+}
+
+int __sna_pressure_fd(struct sna *sna)
+{
+	return sna->pressure->pipe[0];
+}
+
+#if HAVE_NOTIFY_FD
+static void sna_pressure_notify(int fd, int read, void *data)
+{
+	_sna_pressure_wakeup(data);
+}
+#endif
+
+bool sna_pressure_init(struct sna *sna)
+{
+	struct sna_pressure *pressure;
+	int n;
+
+	if (sna->pressure)
+		return true;
+
+	pressure = malloc(sizeof(*pressure));
+	if (pressure == NULL)
+		return false;
+
+	pressure->psi = psi_open_cgroup();
+	if (pressure->psi < 0)
+		pressure->psi = psi_open(PSI_SYSTEM);
+	if (pressure->psi < 0)
+		goto err;
+
+	if (pipe(pressure->pipe))
+		goto err_psi;
+
+	for (n = 0; n < 2; n++) {
+		fcntl(pressure->pipe[n], F_SETFL, O_NONBLOCK);
+		fcntl(pressure->pipe[n], F_SETFD, FD_CLOEXEC);
+	}
+
+	if (pthread_create(&pressure->thread, NULL,
+			   sna_pressure_thread, pressure))
+		goto err_pipe;
+
+	DBG(("%s: listening for memory pressure, fd=%d\n",
+	     __FUNCTION__, pressure->pipe[0]));
+
+	sna->pressure = pressure;
+	SetNotifyFd(pressure->pipe[0], sna_pressure_notify, X_NOTIFY_READ, sna);
+	return true;
+
+err_pipe:
+	close(pressure->pipe[0]);
+	close(pressure->pipe[1]);
+err_psi:
+	close(pressure->psi);
+err:
+	free(pressure);
+	return false;
+}
+
+void sna_pressure_fini(struct sna *sna)
+{
+	struct sna_pressure *pressure = sna->pressure;
+
+	if (pressure == NULL)
+		return;
+
+	DBG(("%s\n", __FUNCTION__));
+
+	RemoveNotifyFd(pressure->pipe[0]);
+	sna->pressure = NULL;
+
+	pthread_cancel(pressure->thread);
+	pthread_join(pressure->thread, NULL);
+
+	close(pressure->pipe[0]);
+	close(pressure->pipe[1]);
+	close(pressure->psi);
+	free(pressure);
+}
@@ -29,11 +29,18 @@
 #include "config.h"
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for sched_getcpu() and the cpu_set_t macros */
+#endif
+
 #include "sna.h"
 
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#if HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
 
 #ifdef HAVE_VALGRIND
 #include <valgrind.h>
@@ -44,61 +51,474 @@ static inline bool valgrind_active(void) { return false; }
 
 static int max_threads = -1;
 
-static struct thread {
-    pthread_t thread;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+/* Each thread owns a small deque of tasks. The owner pushes and pops at
+ * the tail, so that it works through its most recent (and cache hot)
+ * submissions first, whilst idle threads steal the oldest task from the
+ * head of somebody else's deque. A task is expected to be a tile or a
+ * band of a larger operation, so a mutex per deque is cheap enough and
+ * keeps the stealing simple.
+ */
+#define MAX_TASKS 256
 
-    void (*func)(void *arg);
-    void *arg;
+struct task {
+	void (*func)(void *arg);
+	void *arg;
+	uint64_t queued; /* only with ThreadStats */
+};
+
+/* Each thread also keeps a scratch arena for the temporary buffers of
+ * its jobs (the edge, bucket and cell arrays of the rasterisers). It is
+ * a simple stack: freeing a pointer releases it and everything allocated
+ * after it. Once empty, any overflow chunks are coalesced into one of the
+ * high water size, so that in the steady state a job performs no heap
+ * allocations. The arenas belong to the pool, so a job abandoned after a
+ * fault leaks nothing once sna_threads_kill() has run.
+ */
+#define SCRATCH_ALIGN 16
+#define SCRATCH_MIN (64 << 10)
+
+struct scratch_chunk {
+	struct scratch_chunk *next; /* older, retired chunks */
+	uint32_t size, used;
+	char data[] __attribute__((aligned(SCRATCH_ALIGN)));
+};
+
+struct scratch {
+	struct scratch_chunk *chunk;
+	size_t high;
+};
+
+static struct thread {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	unsigned head, tail;
+	struct task tasks[MAX_TASKS];
+	struct scratch scratch;
 } *threads;
 
+static pthread_key_t thread_key;
+static struct scratch scratch; /* for the main thread, without a pool */
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t work; /* signalled when a task is queued */
+	pthread_cond_t done; /* signalled when the last task completes */
+	unsigned epoch; /* bumped on every submission */
+	unsigned next; /* round robin deque for the next submission */
+	atomic_t pending; /* tasks queued or running */
+	int sig; /* set if a worker died whilst running a task */
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+};
+
+/* Optional instrumentation, so that sna_use_threads() can be tuned for
+ * a machine. A job is everything submitted between one join and the
+ * next, and is accounted to the function that submitted it. For each
+ * such call site we keep the number of jobs and tasks, the wall time of
+ * the job, the time spent running tasks (for utilisation), the spread
+ * between the quickest and slowest band of each job (imbalance), the
+ * time main spends asleep in join, and the latency from a task being
+ * queued to it starting (the wakeup cost of handing it to a worker).
+ */
+#define MAX_SITES 32
+
+static struct stats {
+	bool enabled;
+	volatile sig_atomic_t dump;
+	pthread_mutex_t mutex;
+
+	struct job {
+		struct site *site;
+		uint64_t start, submitted;
+		uint64_t band_min, band_max;
+		int tasks;
+	} job;
+
+	struct site {
+		const char *name;
+		uint64_t jobs, tasks;
+		uint64_t wall, busy, sleep;
+		uint64_t imbalance, band_max;
+		uint64_t wakeup, wakeup_max;
+	} sites[MAX_SITES];
+	int num_sites;
+} stats = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct site *stats_site(const char *name)
+{
+	int n;
+
+	/* name is the caller's __func__, so compare by address */
+	for (n = 0; n < stats.num_sites; n++)
+		if (stats.sites[n].name == name)
+			return &stats.sites[n];
+
+	if (stats.num_sites == MAX_SITES)
+		n--; /* lump the overflow into the last site */
+	else
+		stats.num_sites++;
+
+	stats.sites[n].name = name;
+	return &stats.sites[n];
+}
+
+static uint64_t stats_submit(const char *site)
+{
+	struct job *job = &stats.job;
+	uint64_t now = now_ns();
+
+	pthread_mutex_lock(&stats.mutex);
+	if (job->site == NULL) {
+		job->site = stats_site(site);
+		job->start = now;
+		job->band_min = UINT64_MAX;
+		job->band_max = 0;
+		job->tasks = 0;
+	}
+	job->submitted = now;
+	job->tasks++;
+	pthread_mutex_unlock(&stats.mutex);
+
+	return now;
+}
+
+static void stats_band(struct job *job, uint64_t elapsed)
+{
+	if (elapsed < job->band_min)
+		job->band_min = elapsed;
+	if (elapsed > job->band_max)
+		job->band_max = elapsed;
+}
+
+static void stats_task(const struct task *task, uint64_t start, uint64_t end)
+{
+	struct job *job = &stats.job;
+	struct site *site;
+
+	pthread_mutex_lock(&stats.mutex);
+	site = job->site;
+	if (site) {
+		stats_band(job, end - start);
+		site->busy += end - start;
+		site->wakeup += start - task->queued;
+		if (start - task->queued > site->wakeup_max)
+			site->wakeup_max = start - task->queued;
+	}
+	pthread_mutex_unlock(&stats.mutex);
+}
+
+static void stats_join(uint64_t sleep)
+{
+	struct job *job = &stats.job;
+	struct site *site;
+
+	pthread_mutex_lock(&stats.mutex);
+	site = job->site;
+	if (site) {
+		site->jobs++;
+		site->tasks += job->tasks;
+		site->wall += now_ns() - job->start;
+		site->sleep += sleep;
+		if (job->band_max) {
+			site->band_max += job->band_max;
+			site->imbalance += job->band_max - job->band_min;
+		}
+		job->site = NULL;
+	}
+	pthread_mutex_unlock(&stats.mutex);
+
+	if (stats.dump) {
+		stats.dump = 0;
+		sna_threads_stats_dump();
+	}
+}
+
+static void stats_signal(int sig)
+{
+	(void)sig;
+	stats.dump = 1; /* reported by the next join, outside of the handler */
+}
+
+void sna_threads_stats_enable(void)
+{
+	struct sigaction sa;
+
+	if (stats.enabled)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	stats.enabled = true;
+}
+
+void sna_threads_stats_dump(void)
+{
+	int n;
+
+	if (!stats.enabled)
+		return;
+
+	pthread_mutex_lock(&stats.mutex);
+	ErrorF("sna: thread pool statistics, %d threads\n", max_threads);
+	ErrorF("sna: %-40s %8s %8s %10s %6s %10s %10s %10s %10s\n",
+	       "site", "jobs", "tasks", "wall(ms)", "util%",
+	       "imbal%", "sleep(ms)", "wake(us)", "wakemax(us)");
+	for (n = 0; n < stats.num_sites; n++) {
+		const struct site *site = &stats.sites[n];
+		int threads = max_threads > 1 ? max_threads : 1;
+
+		if (site->jobs == 0)
+			continue;
+
+		ErrorF("sna: %-40s %8llu %8llu %10.1f %6.1f %10.1f %10.1f %10.1f %10.1f\n",
+		       site->name,
+		       (unsigned long long)site->jobs,
+		       (unsigned long long)site->tasks,
+		       site->wall * 1e-6,
+		       site->wall ? 100. * site->busy / (site->wall * threads) : 0.,
+		       site->band_max ? 100. * site->imbalance / site->band_max : 0.,
+		       site->sleep * 1e-6,
+		       site->tasks ? site->wakeup * 1e-3 / site->tasks : 0.,
+		       site->wakeup_max * 1e-3);
+	}
+	pthread_mutex_unlock(&stats.mutex);
+}
+
+static bool task_push(struct thread *t, const struct task *src)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->tail - t->head < MAX_TASKS) {
+		t->tasks[t->tail++ % MAX_TASKS] = *src;
+		ret = true;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return ret;
+}
+
+static bool task_pop(struct thread *t, struct task *task)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->head != t->tail) {
+		*task = t->tasks[--t->tail % MAX_TASKS];
+		ret = true;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return ret;
+}
+
+static bool task_steal(struct thread *t, struct task *task)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->head != t->tail) {
+		*task = t->tasks[t->head++ % MAX_TASKS];
+		ret = true;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return ret;
+}
+
+static bool task_find(int id, struct task *task)
+{
+	int n;
+
+	if (task_pop(&threads[id], task))
+		return true;
+
+	for (n = 1; n < max_threads; n++) {
+		if (task_steal(&threads[(id + n) % max_threads], task)) {
+			DBG(("%s: thread[%d] stole from thread[%d]\n",
+			     __func__, id, (id + n) % max_threads));
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void task_run(const struct task *task)
+{
+	if (task->queued) {
+		uint64_t start = now_ns();
+		task->func(task->arg);
+		stats_task(task, start, now_ns());
+	} else
+		task->func(task->arg);
+
+	if (atomic_dec_and_test(&pool.pending)) {
+		pthread_mutex_lock(&pool.mutex);
+		pthread_cond_broadcast(&pool.done);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+}
+
+static struct scratch *scratch_get(void)
+{
+	struct thread *t;
+
+	if (max_threads <= 0)
+		return &scratch;
+
+	t = pthread_getspecific(thread_key);
+	if (t == NULL) /* main */
+		t = &threads[0];
+
+	return &t->scratch;
+}
+
+static void scratch_fini(struct scratch *s)
+{
+	while (s->chunk) {
+		struct scratch_chunk *c = s->chunk;
+		s->chunk = c->next;
+		free(c);
+	}
+	s->high = 0;
+}
+
+void *sna_scratch_alloc(size_t size)
+{
+	struct scratch *s = scratch_get();
+	struct scratch_chunk *c = s->chunk;
+	size_t total;
+	void *ptr;
+
+	size = ALIGN(size, SCRATCH_ALIGN);
+	if (size > UINT32_MAX / 2)
+		return NULL;
+
+	if (c == NULL || c->size - c->used < size) {
+		size_t chunk_size = c ? 2 * c->size : SCRATCH_MIN;
+
+		if (chunk_size < s->high)
+			chunk_size = s->high;
+		if (chunk_size < size)
+			chunk_size = size;
+		if (chunk_size > UINT32_MAX)
+			chunk_size = size;
+
+		DBG(("%s: growing scratch arena by %zu bytes\n",
+		     __func__, chunk_size));
+		c = malloc(sizeof(*c) + chunk_size);
+		if (c == NULL)
+			return NULL;
+
+		c->size = chunk_size;
+		c->used = 0;
+		c->next = s->chunk;
+		s->chunk = c;
+	}
+
+	ptr = c->data + c->used;
+	c->used += size;
+
+	for (total = 0; c; c = c->next)
+		total += c->used;
+	if (total > s->high)
+		s->high = total;
+
+	return ptr;
+}
+
+void sna_scratch_free(void *ptr)
+{
+	struct scratch *s = scratch_get();
+	struct scratch_chunk *c;
+	uint32_t offset;
+
+	for (c = s->chunk; c; c = c->next) {
+		if ((char *)ptr >= c->data && (char *)ptr < c->data + c->used)
+			break;
+	}
+	if (c == NULL) /* already released along with an earlier block */
+		return;
+
+	/* Release everything allocated after ptr, including newer chunks */
+	while (s->chunk != c) {
+		struct scratch_chunk *next = s->chunk->next;
+		free(s->chunk);
+		s->chunk = next;
+	}
+
+	offset = (char *)ptr - c->data;
+	c->used = offset;
+
+	/* Once empty, replace a fragmented arena with a single chunk */
+	if (offset == 0 && c->next == NULL && c->size < s->high) {
+		free(c);
+		s->chunk = NULL;
+	}
+}
+
+static void __unlock__(void *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
 static void *__run__(void *arg)
 {
-	struct thread *t = arg;
+	int id = (struct thread *)arg - threads;
 	sigset_t signals;
 
+	pthread_setspecific(thread_key, arg);
+
 	/* Disable all signals in the slave threads as X uses them for IO */
 	sigfillset(&signals);
 	sigdelset(&signals, SIGBUS);
 	sigdelset(&signals, SIGSEGV);
 	pthread_sigmask(SIG_SETMASK, &signals, NULL);
 
-	pthread_mutex_lock(&t->mutex);
+	pthread_mutex_lock(&pool.mutex);
 	while (1) {
-		while (t->func == NULL)
-			pthread_cond_wait(&t->cond, &t->mutex);
-		pthread_mutex_unlock(&t->mutex);
-
-		assert(t->func);
-		t->func(t->arg);
-
-		pthread_mutex_lock(&t->mutex);
-		t->arg = NULL;
-		t->func = NULL;
-		pthread_cond_signal(&t->cond);
-	}
-	pthread_mutex_unlock(&t->mutex);
+		unsigned epoch = pool.epoch;
+		struct task task;
 
-	return NULL;
-}
+		pthread_mutex_unlock(&pool.mutex);
 
-#if defined(__GNUC__)
-#define popcount(x) __builtin_popcount(x)
-#else
-static int popcount(unsigned int x)
-{
-	int count = 0;
+		while (task_find(id, &task)) {
+			task_run(&task);
+			pthread_testcancel();
+		}
 
-	while (x) {
-		count += x&1;
-		x >>= 1;
+		/* Only sleep if nothing was submitted since we last looked */
+		pthread_mutex_lock(&pool.mutex);
+		pthread_cleanup_push(__unlock__, &pool.mutex);
+		while (pool.epoch == epoch)
+			pthread_cond_wait(&pool.work, &pool.mutex);
+		pthread_cleanup_pop(0);
 	}
+	pthread_mutex_unlock(&pool.mutex);
 
-	return count;
+	return NULL;
 }
-#endif
 
+/* Fallback for when sysfs is unavailable: count the distinct
+ * (physical id, core id) pairs, ignoring the SMT siblings.
+ */
 static int
 num_cores(void)
 {
@@ -107,84 +527,475 @@ num_cores(void)
 	if (file) {
 		size_t len = 0;
 		char *line = NULL;
-		uint32_t processors = 0, cores = 0;
+		struct { int package, core; } *seen = NULL;
+		int package = 0, size = 0;
 		while (getline(&line, &len, file) != -1) {
-			int id;
+			int id, n;
 			if (sscanf(line, "physical id : %d", &id) == 1) {
-				if (id >= 32)
-					continue;
-				processors |= 1 << id;
+				package = id;
 			} else if (sscanf(line, "core id : %d", &id) == 1) {
-				if (id >= 32)
+				for (n = 0; n < count; n++)
+					if (seen[n].package == package &&
+					    seen[n].core == id)
+						break;
+				if (n < count)
 					continue;
-				cores |= 1 << id;
+
+				if (count == size) {
+					void *ptr;
+
+					size = size ? 2 * size : 64;
+					ptr = realloc(seen, size * sizeof(*seen));
+					if (ptr == NULL)
+						break;
+					seen = ptr;
+				}
+				seen[count].package = package;
+				seen[count].core = id;
+				count++;
 			}
 		}
+		free(seen);
 		free(line);
 		fclose(file);
 
-		DBG(("%s: processors=0x%08x, cores=0x%08x\n",
-		     __FUNCTION__, processors, cores));
-
-		count = popcount(processors) * popcount(cores);
+		DBG(("%s: cores=%d\n", __FUNCTION__, count));
 	}
 	return count;
 }
 
-void sna_threads_init(void)
+enum affinity {
+	AFFINITY_NONE, /* leave the workers to the kernel */
+	AFFINITY_BIG, /* keep the workers on the performance cores */
+	AFFINITY_PIN, /* bind each worker to its own performance core */
+};
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+#ifndef SYSFS_CPU
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#endif
+
+static struct topology {
+	cpu_set_t allowed; /* performance cores sharing our LLC */
+	bool restricted; /* allowed excludes some of our cpus */
+	int *cores; /* first hw thread of each physical core */
+	int num_cores;
+} topology;
+
+static int read_int(const char *path, int def)
 {
-	int n;
+	FILE *file;
+	int val;
 
-	if (max_threads != -1)
+	file = fopen(path, "r");
+	if (file == NULL)
+		return def;
+
+	if (fscanf(file, "%d", &val) != 1)
+		val = def;
+	fclose(file);
+
+	return val;
+}
+
+static int cpu_read_int(int cpu, const char *attr, int def)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/%s", cpu, attr);
+	return read_int(path, def);
+}
+
+/* Parse a cpulist, e.g. "0-3,8,10-11", as found throughout sysfs */
+static bool read_cpulist(const char *path, cpu_set_t *set)
+{
+	FILE *file;
+	int first, last;
+	char sep;
+
+	CPU_ZERO(set);
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		return false;
+
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		sep = fgetc(file);
+		if (sep == '-') {
+			if (fscanf(file, "%d", &last) != 1)
+				break;
+			sep = fgetc(file);
+		}
+
+		while (first <= last && first < CPU_SETSIZE)
+			CPU_SET(first++, set);
+
+		if (sep != ',')
+			break;
+	}
+	fclose(file);
+
+	return CPU_COUNT(set) > 0;
+}
+
+/* The set of cpus sharing the last level cache with cpu */
+static bool cpu_read_llc(int cpu, cpu_set_t *set)
+{
+	char path[256];
+	int index, level, max_level = 0;
+
+	for (index = 0; index < 8; index++) {
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, index);
+		level = read_int(path, -1);
+		if (level < 0)
+			break;
+
+		if (level > max_level)
+			max_level = level;
+	}
+
+	while (index--) {
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, index);
+		if (read_int(path, -1) != max_level)
+			continue;
+
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+		return read_cpulist(path, set);
+	}
+
+	return false;
+}
+
+/* Relative performance of the cpu, with the fastest being 1024. On x86
+ * hybrid parts older kernels do not report cpu_capacity, but do list the
+ * P-cores and E-cores as separate PMUs.
+ */
+static int cpu_capacity(int cpu, const cpu_set_t *atom)
+{
+	int capacity;
+
+	capacity = cpu_read_int(cpu, "cpu_capacity", -1);
+	if (capacity < 0)
+		capacity = CPU_ISSET(cpu, atom) ? 512 : 1024;
+
+	return capacity;
+}
+
+static int topology_detect(void)
+{
+	struct topology *topo = &topology;
+	struct { int package, core; } *keys;
+	cpu_set_t available, big, llc, atom;
+	int max_capacity = 0;
+	int cpu, self, n;
+
+	if (sched_getaffinity(0, sizeof(available), &available))
+		return 0;
+
+	if (!read_cpulist("/sys/devices/cpu_atom/cpus", &atom))
+		CPU_ZERO(&atom);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		int capacity;
+
+		if (!CPU_ISSET(cpu, &available))
+			continue;
+
+		capacity = cpu_capacity(cpu, &atom);
+		if (capacity > max_capacity)
+			max_capacity = capacity;
+	}
+
+	/* Allow for small variations between the big clusters */
+	CPU_ZERO(&big);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &available))
+			continue;
+
+		if (5 * cpu_capacity(cpu, &atom) >= 4 * max_capacity)
+			CPU_SET(cpu, &big);
+	}
+	if (CPU_COUNT(&big) == 0)
+		return 0;
+
+	/* Prefer to keep the workers alongside the main thread so that they
+	 * share its cache, unless that leaves us with too few cores.
+	 */
+	self = sched_getcpu();
+	if (self >= 0 && self < CPU_SETSIZE && cpu_read_llc(self, &llc)) {
+		CPU_AND(&llc, &llc, &big);
+		if (CPU_COUNT(&llc) > 2)
+			big = llc;
+	}
+
+	topo->cores = malloc(CPU_COUNT(&big) * sizeof(int));
+	keys = malloc(CPU_COUNT(&big) * sizeof(*keys));
+	if (topo->cores == NULL || keys == NULL) {
+		free(topo->cores);
+		free(keys);
+		return 0;
+	}
+
+	/* One entry per physical core, with our own core first */
+	topo->num_cores = 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		int package, core;
+
+		if (!CPU_ISSET(cpu, &big))
+			continue;
+
+		package = cpu_read_int(cpu, "topology/physical_package_id", 0);
+		core = cpu_read_int(cpu, "topology/core_id", cpu);
+		for (n = 0; n < topo->num_cores; n++)
+			if (keys[n].package == package && keys[n].core == core)
+				break;
+
+		if (n == topo->num_cores) {
+			keys[n].package = package;
+			keys[n].core = core;
+			topo->cores[n] = cpu;
+			topo->num_cores++;
+		}
+
+		if (cpu == self) {
+			topo->cores[n] = topo->cores[0];
+			keys[n] = keys[0];
+			topo->cores[0] = cpu;
+			keys[0].package = package;
+			keys[0].core = core;
+		}
+	}
+	free(keys);
+
+	topo->allowed = big;
+	topo->restricted = !CPU_EQUAL(&big, &available);
+
+	DBG(("%s: %d of %d cpus usable, %d physical cores, restricted? %d\n",
+	     __func__, CPU_COUNT(&big), CPU_COUNT(&available),
+	     topo->num_cores, topo->restricted));
+
+	return topo->num_cores;
+}
+
+static void thread_set_affinity(int n, enum affinity affinity)
+{
+	cpu_set_t set;
+
+	switch (affinity) {
+	case AFFINITY_NONE:
 		return;
 
+	case AFFINITY_BIG:
+		if (!topology.restricted)
+			return;
+		set = topology.allowed;
+		break;
+
+	case AFFINITY_PIN:
+		/* cores[0] is left to the main thread */
+		assert(n > 0 && n < topology.num_cores);
+		CPU_ZERO(&set);
+		CPU_SET(topology.cores[n], &set);
+		break;
+	}
+
+	if (pthread_setaffinity_np(threads[n].thread, sizeof(set), &set))
+		DBG(("%s: failed to set affinity for thread[%d]\n",
+		     __func__, n));
+}
+#else
+static int topology_detect(void)
+{
+	return 0;
+}
+
+static void thread_set_affinity(int n, enum affinity affinity)
+{
+	(void)n;
+	(void)affinity;
+}
+#endif
+
+static enum affinity parse_affinity(const char *str)
+{
+	if (str == NULL)
+		return AFFINITY_BIG;
+
+	if (strcasecmp(str, "none") == 0 || strcasecmp(str, "off") == 0)
+		return AFFINITY_NONE;
+	if (strcasecmp(str, "pin") == 0)
+		return AFFINITY_PIN;
+
+	return AFFINITY_BIG;
+}
+
+/* Size the pool by the number of physical performance cores available to
+ * us (SMT siblings and efficiency cores add little to our memory bound
+ * workloads), or by the explicit count from xorg.conf. Returns the size
+ * of the pool, including the main thread.
+ */
+int sna_threads_init(int count, const char *affinity_str)
+{
+	enum affinity affinity = parse_affinity(affinity_str);
+	int cores, n;
+
+	if (max_threads != -1)
+		return max_threads;
+
 	if (valgrind_active())
 		goto bail;
 
-	max_threads = num_cores();
+	max_threads = cores = topology_detect();
+	if (max_threads == 0) {
+		affinity = AFFINITY_NONE;
+		max_threads = num_cores();
+	}
 	if (max_threads == 0)
 		max_threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+	if (count >= 0)
+		max_threads = count;
+	if (affinity == AFFINITY_PIN && max_threads > cores) {
+		/* Every worker needs a core of its own */
+		DBG(("%s: only %d cores to pin %d threads to\n",
+		     __func__, cores, max_threads));
+		max_threads = cores;
+	}
 	if (max_threads <= 1)
 		goto bail;
 
-	DBG(("%s: creating a thread pool of %d threads\n",
-	     __func__, max_threads));
+	DBG(("%s: creating a thread pool of %d threads, affinity=%d\n",
+	     __func__, max_threads, affinity));
 
 	threads = malloc (sizeof(threads[0])*max_threads);
 	if (threads == NULL)
 		goto bail;
 
-	for (n = 1; n < max_threads; n++) {
+	if (pthread_key_create(&thread_key, NULL)) {
+		free(threads);
+		goto bail;
+	}
+
+	for (n = 0; n < max_threads; n++) {
 		pthread_mutex_init(&threads[n].mutex, NULL);
-		pthread_cond_init(&threads[n].cond, NULL);
+		threads[n].head = threads[n].tail = 0;
+		threads[n].scratch.chunk = NULL;
+		threads[n].scratch.high = 0;
+	}
 
-		threads[n].func = NULL;
-		threads[n].arg = NULL;
+	atomic_set(&pool.pending, 0);
+	pool.epoch = 0;
+	pool.next = 0;
+	pool.sig = 0;
+
+	threads[0].thread = pthread_self();
+	for (n = 1; n < max_threads; n++) {
 		if (pthread_create(&threads[n].thread, NULL,
-				   __run__, &threads[n]))
-			goto bail;
+				   __run__, &threads[n])) {
+			/* Make do with the workers we have */
+			max_threads = n;
+			if (n == 1)
+				goto bail;
+			break;
+		}
+
+		thread_set_affinity(n, affinity);
 	}
 
-	threads[0].thread = pthread_self();
-	return;
+	return max_threads;
 
 bail:
 	max_threads = 0;
+	return 1;
+}
+
+static void submit(struct thread *t,
+		   void (*func)(void *arg), void *arg,
+		   const char *site)
+{
+	struct task task = { func, arg, 0 };
+
+	if (stats.enabled)
+		task.queued = stats_submit(site);
+
+	pthread_mutex_lock(&pool.mutex);
+	atomic_inc(&pool.pending);
+	if (!task_push(t, &task)) {
+		pthread_mutex_unlock(&pool.mutex);
+
+		/* Every deque is full, so there is no shortage of work */
+		DBG(("%s: deque full, running task inline\n", __func__));
+		task_run(&task);
+		return;
+	}
+	pool.epoch++;
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+void __sna_threads_submit(void (*func)(void *arg), void *arg,
+			  const char *site)
+{
+	if (max_threads <= 0) {
+		func(arg);
+		return;
+	}
+
+	assert(pthread_self() == threads[0].thread);
+	submit(&threads[pool.next++ % max_threads], func, arg, site);
+}
+
+bool sna_threads_join(void)
+{
+	uint64_t sleep = 0;
+	struct task task;
+	int sig;
+
+	if (max_threads <= 0)
+		return true;
+
+	assert(pthread_self() == threads[0].thread);
+
+	/* Rather than sleep, help drain the queues */
+	while (task_find(0, &task))
+		task_run(&task);
+
+	pthread_mutex_lock(&pool.mutex);
+	if (atomic_read(&pool.pending) && pool.sig == 0) {
+		uint64_t start = stats.enabled ? now_ns() : 0;
+		do
+			pthread_cond_wait(&pool.done, &pool.mutex);
+		while (atomic_read(&pool.pending) && pool.sig == 0);
+		if (start)
+			sleep = now_ns() - start;
+	}
+	sig = pool.sig;
+	pthread_mutex_unlock(&pool.mutex);
+
+	if (stats.enabled)
+		stats_join(sleep);
+
+	if (sig) {
+		DBG(("%s: worker died from signal %d\n", __func__, sig));
+		sna_threads_kill();
+		return false;
+	}
+
+	return true;
 }
 
-void sna_threads_run(int id, void (*func)(void *arg), void *arg)
+void __sna_threads_run(int id, void (*func)(void *arg), void *arg,
+		       const char *site)
 {
 	assert(max_threads > 0);
 	assert(pthread_self() == threads[0].thread);
 	assert(id > 0 && id < max_threads);
 
-	assert(threads[id].func == NULL);
-
-	pthread_mutex_lock(&threads[id].mutex);
-	threads[id].func = func;
-	threads[id].arg = arg;
-	pthread_cond_signal(&threads[id].cond);
-	pthread_mutex_unlock(&threads[id].mutex);
+	/* Seed the slot's own deque; an idle neighbour may still steal it */
+	submit(&threads[id], func, arg, site);
 }
 
 void sna_threads_trap(int sig)
@@ -203,36 +1014,36 @@ void sna_threads_trap(int sig)
 
 	ERR(("%s: thread[%d] caught signal %d\n", __func__, n, sig));
 
-	pthread_mutex_lock(&threads[n].mutex);
-	threads[n].arg = (void *)(intptr_t)sig;
-	threads[n].func = NULL;
-	pthread_cond_signal(&threads[n].cond);
-	pthread_mutex_unlock(&threads[n].mutex);
+	/* The task we were running will never complete */
+	atomic_dec(&pool.pending, 1);
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.sig = sig;
+	pthread_cond_broadcast(&pool.done);
+	pthread_mutex_unlock(&pool.mutex);
 
 	pthread_exit(&sig);
 }
 
-void sna_threads_wait(void)
+bool sna_threads_wait(void)
 {
-	int n;
-
 	assert(max_threads > 0);
-	assert(pthread_self() == threads[0].thread);
 
-	for (n = 1; n < max_threads; n++) {
-		if (threads[n].func != NULL) {
-			pthread_mutex_lock(&threads[n].mutex);
-			while (threads[n].func)
-				pthread_cond_wait(&threads[n].cond, &threads[n].mutex);
-			pthread_mutex_unlock(&threads[n].mutex);
-		}
+	/* The caller ran the first band itself, between the last run()
+	 * and now, so account for it alongside the workers' bands.
+	 */
+	if (stats.enabled) {
+		uint64_t now = now_ns();
 
-		if (threads[n].arg != NULL) {
-			DBG(("%s: thread[%d] died from signal %d\n", __func__, n, (int)(intptr_t)threads[n].arg));
-			sna_threads_kill();
-			return;
+		pthread_mutex_lock(&stats.mutex);
+		if (stats.job.site) {
+			stats_band(&stats.job, now - stats.job.submitted);
+			stats.job.site->busy += now - stats.job.submitted;
 		}
+		pthread_mutex_unlock(&stats.mutex);
 	}
+
+	return sna_threads_join();
 }
 
 void sna_threads_kill(void)
@@ -243,12 +1054,27 @@ void sna_threads_kill(void)
 	assert(max_threads > 0);
 	assert(pthread_self() == threads[0].thread);
 
+	/* Discard anything not yet started before cancelling the workers */
+	for (n = 0; n < max_threads; n++) {
+		pthread_mutex_lock(&threads[n].mutex);
+		threads[n].head = threads[n].tail;
+		pthread_mutex_unlock(&threads[n].mutex);
+	}
+
 	for (n = 1; n < max_threads; n++)
 		pthread_cancel(threads[n].thread);
 
+	pthread_mutex_lock(&pool.mutex);
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.mutex);
+
 	for (n = 1; n < max_threads; n++)
 		pthread_join(threads[n].thread, NULL);
 
+	/* Reclaim the scratch of any jobs abandoned mid-flight */
+	for (n = 0; n < max_threads; n++)
+		scratch_fini(&threads[n].scratch);
+
 	max_threads = 0;
 }
 
@@ -322,52 +1148,40 @@ void sna_image_composite(pixman_op_t        op,
 			sigtrap_put();
 		}
 	} else {
-		struct thread_composite data[num_threads];
+		/* Oversplit into bands so that threads finishing early can
+		 * steal the remainder, rather than idle whilst the slowest
+		 * (e.g. the one with the most complex clip) finishes.
+		 */
+		int num_tasks = 4 * num_threads;
+		struct thread_composite data[num_tasks];
 		int y, dy, n;
 
-		DBG(("%s: using %d threads for compositing %dx%d\n",
-		     __FUNCTION__, num_threads, width, height));
-
-		y = dst_y;
-		dy = (height + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * dy >= height;
-
-		data[0].op = op;
-		data[0].src = src;
-		data[0].mask = mask;
-		data[0].dst = dst;
-		data[0].src_x = src_x;
-		data[0].src_y = src_y;
-		data[0].mask_x = mask_x;
-		data[0].mask_y = mask_y;
-		data[0].dst_x = dst_x;
-		data[0].dst_y = y;
-		data[0].width = width;
-		data[0].height = dy;
+		dy = (height + num_tasks - 1) / num_tasks;
+		num_tasks = (height + dy - 1) / dy;
+
+		DBG(("%s: using %d threads for compositing %dx%d in %d bands\n",
+		     __FUNCTION__, num_threads, width, height, num_tasks));
 
 		if (sigtrap_get() == 0) {
-			for (n = 1; n < num_threads; n++) {
-				data[n] = data[0];
-				data[n].src_y += y - dst_y;
-				data[n].mask_y += y - dst_y;
-				data[n].dst_y = y;
-				y += dy;
-
-				sna_threads_run(n, thread_composite, &data[n]);
+			for (n = 0, y = 0; n < num_tasks; n++, y += dy) {
+				data[n].op = op;
+				data[n].src = src;
+				data[n].mask = mask;
+				data[n].dst = dst;
+				data[n].src_x = src_x;
+				data[n].src_y = src_y + y;
+				data[n].mask_x = mask_x;
+				data[n].mask_y = mask_y + y;
+				data[n].dst_x = dst_x;
+				data[n].dst_y = dst_y + y;
+				data[n].width = width;
+				data[n].height = MIN(dy, height - y);
+
+				sna_threads_submit(thread_composite, &data[n]);
 			}
+			assert(y >= height);
 
-			assert(y < dst_y + height);
-			if (y + dy > dst_y + height)
-				dy = dst_y + height - y;
-
-			data[0].src_y += y - dst_y;
-			data[0].mask_y += y - dst_y;
-			data[0].dst_y = y;
-			data[0].height = dy;
-
-			thread_composite(&data[0]);
-
-			sna_threads_wait();
+			sna_threads_join();
 			sigtrap_put();
 		} else
 			sna_threads_kill();
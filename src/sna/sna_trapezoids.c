@@ -140,6 +140,188 @@ bool trapezoids_bounds(int n, const xTrapezoid *t, BoxPtr box)
 	return box->x2 > box->x1 && box->y2 > box->y1;
 }
 
+#define TILE_MIN_WIDTH 64
+#define TILE_MIN_HEIGHT 8
+
+/* Choose a grid of about count tiles over the extents. Square tiles
+ * split the fewest trapezoids between neighbours, but those callers
+ * that need whole rows, i.e. tor_inplace(), only split into bands.
+ */
+void trapezoid_tiles_init(struct trapezoid_tiles *tiles,
+			  const BoxRec *extents,
+			  int count, bool split_x)
+{
+	int w = extents->x2 - extents->x1;
+	int h = extents->y2 - extents->y1;
+	int nx, ny;
+
+	assert(w > 0 && h > 0);
+	assert(count > 0);
+
+	nx = 1;
+	if (split_x) {
+		while (nx < count &&
+		       (int64_t)(nx + 1) * (nx + 1) * h <= (int64_t)count * w)
+			nx++;
+		if (nx > w / TILE_MIN_WIDTH)
+			nx = MAX(w / TILE_MIN_WIDTH, 1);
+	}
+
+	ny = (count + nx - 1) / nx;
+	if (ny > h / TILE_MIN_HEIGHT)
+		ny = MAX(h / TILE_MIN_HEIGHT, 1);
+
+	tiles->extents = *extents;
+	tiles->tile_width = (w + nx - 1) / nx;
+	tiles->tile_height = (h + ny - 1) / ny;
+	tiles->nx = (w + tiles->tile_width - 1) / tiles->tile_width;
+	tiles->ny = (h + tiles->tile_height - 1) / tiles->tile_height;
+	tiles->start = NULL;
+	tiles->index = NULL;
+
+	DBG(("%s: %dx%d split into %dx%d tiles of %dx%d\n",
+	     __FUNCTION__, w, h, tiles->nx, tiles->ny,
+	     tiles->tile_width, tiles->tile_height));
+}
+
+/* As line_x_for_y(), but without truncating to an xFixed: a nearly
+ * horizontal line extrapolated to the top or bottom of its trapezoid
+ * can land far outside of the 16.16 range.
+ */
+inline static int64_t
+line_x_for_y_64(const xLineFixed *l, xFixed y)
+{
+	xFixed_32_32 ex = (xFixed_32_32)(y - l->p1.y) * (l->p2.x - l->p1.x);
+	return l->p1.x + ex / (l->p2.y - l->p1.y);
+}
+
+/* Find the range of tiles a trapezoid may touch. Everything from its
+ * leftmost to its rightmost point is included, plus a pixel either
+ * side for the rounding of the edges onto the sample grid. As the scan
+ * converters treat a line whose end points round to the same sample as
+ * vertical through p1, the end points are included as well. A
+ * trapezoid entirely to the left of a tile can be left out, as its
+ * left and right edges cancel: it adds nothing to the winding within
+ * the tile.
+ */
+static bool
+trapezoid_tiles_range(const struct trapezoid_tiles *tiles,
+		      const xTrapezoid *t, int dx, int dy,
+		      BoxPtr range)
+{
+	int64_t x1, x2, v;
+	int w = tiles->extents.x2 - tiles->extents.x1;
+	int h = tiles->extents.y2 - tiles->extents.y1;
+	int i;
+
+	if (!xTrapezoidValid(t))
+		return false;
+
+	i = pixman_fixed_integer_floor(t->top) + dy - tiles->extents.y1;
+	range->y1 = MAX(i, 0) / tiles->tile_height;
+	i = pixman_fixed_integer_ceil(t->bottom) + dy - tiles->extents.y1;
+	if (i <= 0)
+		return false;
+	range->y2 = (MIN(i, h) + tiles->tile_height - 1) / tiles->tile_height;
+	if (range->y1 >= range->y2)
+		return false;
+
+	x1 = min(min(t->left.p1.x, t->left.p2.x),
+		 min(t->right.p1.x, t->right.p2.x));
+	x2 = max(max(t->left.p1.x, t->left.p2.x),
+		 max(t->right.p1.x, t->right.p2.x));
+
+	v = line_x_for_y_64(&t->left, t->top);
+	x1 = min(x1, v); x2 = max(x2, v);
+	v = line_x_for_y_64(&t->left, t->bottom);
+	x1 = min(x1, v); x2 = max(x2, v);
+	v = line_x_for_y_64(&t->right, t->top);
+	x1 = min(x1, v); x2 = max(x2, v);
+	v = line_x_for_y_64(&t->right, t->bottom);
+	x1 = min(x1, v); x2 = max(x2, v);
+
+	/* Clamp to the extents before converting back to whole pixels */
+	v = (int64_t)(tiles->extents.x1 - dx - 1) << 16;
+	x1 = max(x1, v);
+	x2 = max(x2, v);
+	v = (int64_t)(tiles->extents.x2 - dx + 1) << 16;
+	x1 = min(x1, v);
+	x2 = min(x2, v);
+
+	i = pixman_fixed_integer_floor(x1) - 1 + dx - tiles->extents.x1;
+	range->x1 = MAX(i, 0) / tiles->tile_width;
+	i = pixman_fixed_integer_ceil(x2) + 1 + dx - tiles->extents.x1;
+	if (i <= 0)
+		return false;
+	range->x2 = (MIN(i, w) + tiles->tile_width - 1) / tiles->tile_width;
+
+	return range->x1 < range->x2;
+}
+
+/* Sort the trapezoids into the tiles. (dx, dy) is the offset in pixels
+ * from the trapezoids to the extents passed to trapezoid_tiles_init().
+ */
+bool trapezoid_tiles_bin(struct trapezoid_tiles *tiles,
+			 int ntrap, const xTrapezoid *traps,
+			 int dx, int dy)
+{
+	int count = trapezoid_tiles_count(tiles);
+	BoxRec *range;
+	int n, x, y, sum;
+
+	range = malloc(sizeof(BoxRec) * ntrap);
+	tiles->start = calloc(count + 1, sizeof(int));
+	if (range == NULL || tiles->start == NULL)
+		goto err;
+
+	for (n = 0; n < ntrap; n++) {
+		if (!trapezoid_tiles_range(tiles, &traps[n], dx, dy, &range[n])) {
+			range[n].x1 = range[n].x2 = 0;
+			range[n].y1 = range[n].y2 = 0;
+			continue;
+		}
+
+		for (y = range[n].y1; y < range[n].y2; y++)
+			for (x = range[n].x1; x < range[n].x2; x++)
+				tiles->start[y * tiles->nx + x]++;
+	}
+
+	for (n = sum = 0; n <= count; n++) {
+		sum += tiles->start[n];
+		tiles->start[n] = sum;
+	}
+
+	DBG(("%s: %d trapezoids binned %d times into %d tiles\n",
+	     __FUNCTION__, ntrap, sum, count));
+
+	tiles->index = malloc(sizeof(int) * (sum + 1));
+	if (tiles->index == NULL)
+		goto err;
+
+	/* Fill backwards so that each tile keeps the original order */
+	for (n = ntrap; n--; ) {
+		for (y = range[n].y1; y < range[n].y2; y++)
+			for (x = range[n].x1; x < range[n].x2; x++)
+				tiles->index[--tiles->start[y * tiles->nx + x]] = n;
+	}
+
+	free(range);
+	return true;
+
+err:
+	free(range);
+	trapezoid_tiles_fini(tiles);
+	return false;
+}
+
+void trapezoid_tiles_fini(struct trapezoid_tiles *tiles)
+{
+	free(tiles->index);
+	free(tiles->start);
+	tiles->index = NULL;
+	tiles->start = NULL;
+}
+
 static bool
 trapezoids_inplace_fallback(struct sna *sna,
 			    CARD8 op,
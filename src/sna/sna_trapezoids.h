@@ -393,6 +393,50 @@ static inline int pixman_fixed_to_fast(pixman_fixed_t v)
 
 bool trapezoids_bounds(int n, const xTrapezoid *t, BoxPtr box);
 
+/* The extents divided into a grid of tiles, each with the list of
+ * trapezoids that may contribute to it. A tile is rasterised from its
+ * own list by a scan converter clipped to the tile, so that work is
+ * spread across threads by geometry rather than each thread walking
+ * every trapezoid.
+ */
+struct trapezoid_tiles {
+	BoxRec extents;
+	int tile_width, tile_height;
+	int nx, ny;
+
+	/* The trapezoids of tile n, in their original order, are
+	 * index[start[n]] ... index[start[n+1]-1] */
+	int *start;
+	int *index;
+};
+
+void trapezoid_tiles_init(struct trapezoid_tiles *tiles,
+			  const BoxRec *extents,
+			  int count, bool split_x);
+bool trapezoid_tiles_bin(struct trapezoid_tiles *tiles,
+			 int ntrap, const xTrapezoid *traps,
+			 int dx, int dy);
+void trapezoid_tiles_fini(struct trapezoid_tiles *tiles);
+
+static inline int
+trapezoid_tiles_count(const struct trapezoid_tiles *tiles)
+{
+	return tiles->nx * tiles->ny;
+}
+
+static inline void
+trapezoid_tiles_box(const struct trapezoid_tiles *tiles, int n, BoxPtr box)
+{
+	box->x1 = tiles->extents.x1 + n % tiles->nx * tiles->tile_width;
+	box->y1 = tiles->extents.y1 + n / tiles->nx * tiles->tile_height;
+	box->x2 = box->x1 + tiles->tile_width;
+	if (box->x2 > tiles->extents.x2)
+		box->x2 = tiles->extents.x2;
+	box->y2 = box->y1 + tiles->tile_height;
+	if (box->y2 > tiles->extents.y2)
+		box->y2 = tiles->extents.y2;
+}
+
 #define TOR_INPLACE_SIZE 128
 
 #endif /* SNA_TRAPEZOIDS_H */
@@ -39,6 +39,10 @@
 
 #include <mipict.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #undef SAMPLES_X
 #undef SAMPLES_Y
 
@@ -162,15 +166,17 @@ struct polygon {
 	/* The vertical clip extents. */
 	int ymin, ymax;
 
-	/* Array of edges all starting in the same bucket.	An edge is put
-	 * into bucket EDGE_BUCKET_INDEX(edge->ytop, polygon->ymin) when
-	 * it is added to the polygon. */
+	/* The first edge starting in each bucket, or NULL. Once all the
+	 * edges have been added, polygon_sort() orders them by ytop and
+	 * then by cell, so the edges of bucket
+	 * EDGE_Y_BUCKET_INDEX(edge->ytop, polygon->ymin) follow on
+	 * contiguously from here. */
 	struct edge **y_buckets;
 	struct edge *y_buckets_embedded[64];
 
 	struct edge edges_embedded[32];
 	struct edge *edges;
-	int num_edges;
+	int num_edges, max_edges;
 };
 
 /* A cell records the effect on pixel coverage of polygon edges
@@ -221,6 +227,16 @@ struct cell {
 	int16_t covered_height;
 };
 
+/* For rows crowded with edges, chasing the cursor along the sorted list
+ * dominates. Instead the cells for such a row are accumulated into a
+ * dense array, one per pixel across the clip, which needs no search and
+ * which tor_blt() can scan for occupied cells a vector at a time.
+ */
+struct dense_cell {
+	int16_t uncovered_area;
+	int16_t covered_height;
+};
+
 /* A cell list represents the scan line sparsely as cells ordered by
  * ascending x.  It is geared towards scanning the cells in order
  * using an internal cursor. */
@@ -234,6 +250,12 @@ struct cell_list {
 	int16_t count, size;
 	struct cell *cells;
 	struct cell embedded[256];
+
+	/* Dense accumulation, see cell_list_choose() */
+	struct dense_cell *dense;
+	int dense_lo, dense_hi; /* occupied range, relative to x1 */
+	bool use_dense;
+	bool no_dense;
 };
 
 /* The active list contains edges in the current scan line ordered by
@@ -276,15 +298,43 @@ cell_list_init(struct cell_list *cells, int x1, int x2)
 	cells->size = x2 - x1 + 1;
 	cells->cells = cells->embedded;
 	if (cells->size > ARRAY_SIZE(cells->embedded))
-		cells->cells = malloc(cells->size * sizeof(struct cell));
-	return cells->cells != NULL;
+		cells->cells = sna_scratch_alloc(cells->size * sizeof(struct cell));
+	if (cells->cells == NULL)
+		return false;
+
+	/* Allocated by the first row to go dense, see cell_list_choose() */
+	cells->use_dense = false;
+	cells->no_dense = x2 <= x1;
+	cells->dense_lo = x2 - x1;
+	cells->dense_hi = -1;
+	cells->dense = NULL;
+	return true;
+}
+
+/* Optional, without it every row is accumulated sparsely. */
+static bool
+cell_list_alloc_dense(struct cell_list *cells)
+{
+	int width = cells->x2 - cells->x1;
+
+	assert(cells->dense == NULL);
+	cells->dense = sna_scratch_alloc(width * sizeof(struct dense_cell));
+	if (cells->dense == NULL) {
+		cells->no_dense = true;
+		return false;
+	}
+
+	memset(cells->dense, 0, width * sizeof(struct dense_cell));
+	return true;
 }
 
 static void
 cell_list_fini(struct cell_list *cells)
 {
+	if (cells->dense)
+		sna_scratch_free(cells->dense);
 	if (cells->cells != cells->embedded)
-		free(cells->cells);
+		sna_scratch_free(cells->cells);
 }
 
 inline static void
@@ -294,6 +344,63 @@ cell_list_reset(struct cell_list *cells)
 	cells->head.next = &cells->tail;
 	cells->head.covered_height = 0;
 	cells->count = 0;
+
+	if (cells->dense_hi >= cells->dense_lo) {
+		memset(cells->dense + cells->dense_lo, 0,
+		       (cells->dense_hi - cells->dense_lo + 1) * sizeof(struct dense_cell));
+		cells->dense_lo = cells->x2 - cells->x1;
+		cells->dense_hi = -1;
+	}
+}
+
+/* Accumulate into the dense cell at x, treating the clip exactly as
+ * cell_list_find() does: anything to the left lands in the head (of
+ * which only the height is used), anything to the right is ignored.
+ */
+inline static void
+cell_list_add_dense(struct cell_list *cells, int x, int area, int height)
+{
+	struct dense_cell *cell;
+
+	if (x >= cells->x2)
+		return;
+
+	if (x < cells->x1) {
+		cells->head.covered_height += height;
+		return;
+	}
+
+	x -= cells->x1;
+	if (x < cells->dense_lo)
+		cells->dense_lo = x;
+	if (x > cells->dense_hi)
+		cells->dense_hi = x;
+
+	cell = &cells->dense[x];
+	cell->uncovered_area += area;
+	cell->covered_height += height;
+}
+
+/* Returns the first occupied dense cell in [x, end), or end */
+inline static int
+dense_next(const struct dense_cell *dense, int x, int end)
+{
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	while (x + 4 <= end) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(dense + x));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(v, zero));
+		if (mask != 0xffff)
+			return x + (__builtin_ctz(~mask) >> 2);
+		x += 4;
+	}
+#endif
+
+	while (x < end && (dense[x].covered_height | dense[x].uncovered_area) == 0)
+		x++;
+
+	return x;
 }
 
 inline static struct cell *
@@ -372,6 +479,15 @@ cell_list_add_subspan(struct cell_list *cells, int x1, int x2)
 	__DBG(("%s: x1=%d (%d+%d), x2=%d (%d+%d)\n", __FUNCTION__,
 	       x1, ix1, fx1, x2, ix2, fx2));
 
+	if (cells->use_dense) {
+		if (ix1 != ix2) {
+			cell_list_add_dense(cells, ix1, fx1, 1);
+			cell_list_add_dense(cells, ix2, -fx2, -1);
+		} else
+			cell_list_add_dense(cells, ix1, (fx1-fx2), 0);
+		return;
+	}
+
 	cell = cell_list_find(cells, ix1);
 	if (ix1 != ix2) {
 		cell->uncovered_area += fx1;
@@ -397,6 +513,15 @@ cell_list_add_span(struct cell_list *cells, int x1, int x2)
 	__DBG(("%s: x1=%d (%d+%d), x2=%d (%d+%d)\n", __FUNCTION__,
 	       x1, ix1, fx1, x2, ix2, fx2));
 
+	if (cells->use_dense) {
+		if (ix1 != ix2) {
+			cell_list_add_dense(cells, ix1, fx1*FAST_SAMPLES_Y, FAST_SAMPLES_Y);
+			cell_list_add_dense(cells, ix2, -fx2*FAST_SAMPLES_Y, -FAST_SAMPLES_Y);
+		} else
+			cell_list_add_dense(cells, ix1, (fx1-fx2)*FAST_SAMPLES_Y, 0);
+		return;
+	}
+
 	cell = cell_list_find(cells, ix1);
 	if (ix1 != ix2) {
 		cell->uncovered_area += fx1*FAST_SAMPLES_Y;
@@ -409,14 +534,17 @@ cell_list_add_span(struct cell_list *cells, int x1, int x2)
 		cell->uncovered_area += (fx1-fx2)*FAST_SAMPLES_Y;
 }
 
+/* Keys and indices for polygon_sort(), twice over to sort between */
+#define POLYGON_SORT_SPACE(n) (2*(n)*(sizeof(uint64_t) + sizeof(uint32_t)))
+
 static void
 polygon_fini(struct polygon *polygon)
 {
 	if (polygon->y_buckets != polygon->y_buckets_embedded)
-		free(polygon->y_buckets);
+		sna_scratch_free(polygon->y_buckets);
 
 	if (polygon->edges != polygon->edges_embedded)
-		free(polygon->edges);
+		sna_scratch_free(polygon->edges);
 }
 
 static bool
@@ -431,14 +559,17 @@ polygon_init(struct polygon *polygon, int num_edges, int ymin, int ymax)
 	polygon->y_buckets = polygon->y_buckets_embedded;
 
 	polygon->num_edges = 0;
-	if (num_edges > (int)ARRAY_SIZE(polygon->edges_embedded)) {
-		polygon->edges = malloc(sizeof(struct edge)*num_edges);
+	polygon->max_edges = ARRAY_SIZE(polygon->edges_embedded);
+	if (num_edges > polygon->max_edges) {
+		polygon->max_edges = num_edges;
+		polygon->edges = sna_scratch_alloc(sizeof(struct edge)*num_edges +
+						   POLYGON_SORT_SPACE(num_edges));
 		if (unlikely(NULL == polygon->edges))
 			goto bail_no_mem;
 	}
 
 	if (num_buckets >= ARRAY_SIZE(polygon->y_buckets_embedded)) {
-		polygon->y_buckets = malloc((1+num_buckets)*sizeof(struct edge *));
+		polygon->y_buckets = sna_scratch_alloc((1+num_buckets)*sizeof(struct edge *));
 		if (unlikely(NULL == polygon->y_buckets))
 			goto bail_no_mem;
 	}
@@ -454,16 +585,6 @@ bail_no_mem:
 	return false;
 }
 
-static void
-_polygon_insert_edge_into_its_y_bucket(struct polygon *polygon, struct edge *e)
-{
-	unsigned ix = EDGE_Y_BUCKET_INDEX(e->ytop, polygon->ymin);
-	struct edge **ptail = &polygon->y_buckets[ix];
-	assert(e->ytop < polygon->ymax);
-	e->next = *ptail;
-	*ptail = e;
-}
-
 inline static void
 polygon_add_edge(struct polygon *polygon,
 		 const xTrapezoid *t,
@@ -537,7 +658,6 @@ polygon_add_edge(struct polygon *polygon,
 		e->dy = Ey;
 	}
 
-	_polygon_insert_edge_into_its_y_bucket(polygon, e);
 	polygon->num_edges++;
 }
 
@@ -632,18 +752,141 @@ polygon_add_line(struct polygon *polygon,
 		    e->x.rem == prev->x.rem &&
 		    e->dxdy.quo == prev->dxdy.quo &&
 		    e->dxdy.rem == prev->dxdy.rem) {
-			unsigned ix = EDGE_Y_BUCKET_INDEX(e->ytop,
-							  polygon->ymin);
-			polygon->y_buckets[ix] = prev->next;
+			/* drop both, prev was the last edge added */
 			polygon->num_edges--;
 			return;
 		}
 	}
 
-	_polygon_insert_edge_into_its_y_bucket(polygon, e);
 	polygon->num_edges++;
 }
 
+/* Returns the permutation sorting the keys, stable for equal keys.
+ * A byte-wise LSD radix sort, passing only over the bytes that differ
+ * between the keys; key and idx are followed by as much again for
+ * the results of each pass.
+ */
+static uint32_t *
+radix_sort(uint64_t *key, uint32_t *idx, int n)
+{
+	uint64_t *tmp_key = key + n;
+	uint32_t *tmp_idx = idx + n;
+	unsigned count[8][256];
+	int pass, i;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		for (pass = 0; pass < 8; pass++)
+			count[pass][key[i] >> (8*pass) & 0xff]++;
+
+	for (pass = 0; pass < 8; pass++) {
+		unsigned *c = count[pass], sum = 0;
+		int shift = 8*pass;
+		uint64_t *k;
+		uint32_t *x;
+
+		if (c[key[0] >> shift & 0xff] == (unsigned)n)
+			continue;
+
+		for (i = 0; i < 256; i++) {
+			unsigned t = c[i];
+			c[i] = sum;
+			sum += t;
+		}
+
+		for (i = 0; i < n; i++) {
+			unsigned o = c[key[i] >> shift & 0xff]++;
+			tmp_key[o] = key[i];
+			tmp_idx[o] = idx[i];
+		}
+
+		k = key; key = tmp_key; tmp_key = k;
+		x = idx; idx = tmp_idx; tmp_idx = x;
+	}
+
+	return idx;
+}
+
+/* Once all the edges are added, sort them by ytop and then by cell.
+ * Edges with equal keys keep the order in which they were added, which
+ * filter() relies upon to pair up coincident edges. The keys are sorted
+ * separately from the edges, which are then only moved once. Afterwards
+ * the new edges for each subsample row are a contiguous run, already in
+ * order for merging into the active list.
+ */
+static void
+polygon_sort(struct polygon *polygon)
+{
+	uint64_t key_embedded[2*ARRAY_SIZE(polygon->edges_embedded)], *key;
+	uint32_t idx_embedded[2*ARRAY_SIZE(polygon->edges_embedded)], *idx;
+	struct edge *edges = polygon->edges;
+	int n = polygon->num_edges;
+	uint32_t min_cell;
+	int i, j;
+
+	if (n == 0)
+		return;
+
+	if (n <= (int)ARRAY_SIZE(polygon->edges_embedded)) {
+		key = key_embedded;
+		idx = idx_embedded;
+	} else {
+		key = (uint64_t *)(edges + polygon->max_edges);
+		idx = (uint32_t *)(key + 2*polygon->max_edges);
+	}
+
+	min_cell = edges[0].cell;
+	for (i = 1; i < n; i++)
+		if (edges[i].cell < (int)min_cell)
+			min_cell = edges[i].cell;
+
+	for (i = 0; i < n; i++) {
+		key[i] = (uint64_t)(edges[i].ytop - polygon->ymin) << 32;
+		key[i] |= (uint32_t)edges[i].cell - min_cell;
+		idx[i] = i;
+	}
+
+	if (n <= (int)ARRAY_SIZE(polygon->edges_embedded)) {
+		for (i = 1; i < n; i++) {
+			uint64_t k = key[i];
+			uint32_t x = idx[i];
+
+			for (j = i; j > 0 && key[j-1] > k; j--) {
+				key[j] = key[j-1];
+				idx[j] = idx[j-1];
+			}
+			key[j] = k;
+			idx[j] = x;
+		}
+	} else
+		idx = radix_sort(key, idx, n);
+
+	/* Permute the edges in place, a cycle at a time */
+	for (i = 0; i < n; i++) {
+		struct edge tmp;
+
+		if (idx[i] == (uint32_t)i)
+			continue;
+
+		tmp = edges[i];
+		j = i;
+		while (idx[j] != (uint32_t)i) {
+			int k = idx[j];
+			edges[j] = edges[k];
+			idx[j] = j;
+			j = k;
+		}
+		edges[j] = tmp;
+		idx[j] = j;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct edge **b = &polygon->y_buckets[EDGE_Y_BUCKET_INDEX(edges[i].ytop, polygon->ymin)];
+		if (*b == NULL)
+			*b = &edges[i];
+	}
+}
+
 static void
 active_list_reset(struct active_list *active)
 {
@@ -706,40 +949,6 @@ start_with_b:
 	} while (1);
 }
 
-static struct edge *
-sort_edges(struct edge  *list,
-	   unsigned int  level,
-	   struct edge **head_out)
-{
-	struct edge *head_other, *remaining;
-	unsigned int i;
-
-	head_other = list->next;
-	if (head_other == NULL) {
-		*head_out = list;
-		return NULL;
-	}
-
-	remaining = head_other->next;
-	if (list->cell <= head_other->cell) {
-		*head_out = list;
-		head_other->next = NULL;
-	} else {
-		*head_out = head_other;
-		head_other->prev = list->prev;
-		head_other->next = list;
-		list->prev = head_other;
-		list->next = NULL;
-	}
-
-	for (i = 0; i < level && remaining; i++) {
-		remaining = sort_edges(remaining, i, &head_other);
-		*head_out = merge_sorted_edges(*head_out, head_other);
-	}
-
-	return remaining;
-}
-
 static struct edge *filter(struct edge *edges)
 {
 	struct edge *e;
@@ -769,13 +978,6 @@ static struct edge *filter(struct edge *edges)
 	return edges;
 }
 
-static struct edge *
-merge_unsorted_edges(struct edge *head, struct edge *unsorted)
-{
-	sort_edges(unsorted, UINT_MAX, &unsorted);
-	return merge_sorted_edges(head, filter(unsorted));
-}
-
 /* Test if the edges on the active list can be safely advanced by a
  * full row without intersections or any edges ending. */
 inline static int
@@ -804,30 +1006,35 @@ can_full_step(struct active_list *active)
 inline static void
 merge_edges(struct active_list *active, struct edge *edges)
 {
-	active->head.next = merge_unsorted_edges(active->head.next, edges);
+	active->head.next = merge_sorted_edges(active->head.next, filter(edges));
 }
 
 inline static int
 fill_buckets(struct active_list *active,
 	     struct edge *edge,
+	     const struct edge *end,
 	     struct edge **buckets)
 {
-	int ymax = 0;
+	int ymax = 0, row;
+
+	if (edge == NULL)
+		return 0;
 
-	while (edge) {
+	row = edge->ytop & ~(FAST_SAMPLES_Y-1);
+	for (; edge != end && (edge->ytop & ~(FAST_SAMPLES_Y-1)) == row; edge++) {
 		int y = edge->ytop & (FAST_SAMPLES_Y-1);
-		struct edge *next = edge->next;
 		struct edge **b = &buckets[y];
 		__DBG(("%s: ytop %d -> bucket %d\n", __FUNCTION__,
 		       edge->ytop, y));
-		if (*b)
-			(*b)->prev = edge;
-		edge->next = *b;
-		edge->prev = NULL;
-		*b = edge;
-		edge = next;
-		if (y > ymax)
-			ymax = y;
+		if (*b) {
+			edge[-1].next = edge;
+			edge->prev = edge - 1;
+		} else {
+			edge->prev = NULL;
+			*b = edge;
+		}
+		edge->next = NULL;
+		ymax = y;
 	}
 
 	return ymax;
@@ -925,6 +1132,44 @@ nonzero_row(struct active_list *active, struct cell_list *coverages)
 	}
 }
 
+/* Pick the accumulator for the next row. The dense array costs a scan
+ * and clear of the occupied width, whereas each sparse lookup costs a
+ * walk along the cells, so go dense only when there are enough active
+ * edges to be worth it and they are also crowded together, at least one
+ * for every DENSE_PIXELS_PER_EDGE pixels of the width they span.
+ */
+#define DENSE_MIN_EDGES 8
+#define DENSE_PIXELS_PER_EDGE 32
+
+inline static void
+cell_list_choose(struct cell_list *cells, const struct active_list *active)
+{
+	const struct edge *e;
+	int n, width;
+
+	cells->use_dense = false;
+	if (cells->no_dense)
+		return;
+
+	n = 0;
+	for (e = active->head.next; e != &active->tail; e = e->next)
+		n++;
+	if (n < DENSE_MIN_EDGES)
+		return;
+
+	width = (active->tail.prev->cell - active->head.next->cell) / FAST_SAMPLES_X + 1;
+	if (n * DENSE_PIXELS_PER_EDGE < width)
+		return;
+
+	/* As this comes after polygon_init(), tor_fini() releases it
+	 * along with the polygon.
+	 */
+	if (cells->dense == NULL && !cell_list_alloc_dense(cells))
+		return;
+
+	cells->use_dense = true;
+}
+
 static void
 tor_fini(struct tor *converter)
 {
@@ -1090,6 +1335,47 @@ tor_blt_span_mono_unbounded_clipped(struct sna *sna,
 			     coverage < FAST_SAMPLES_XY/2 ? 0 : FAST_SAMPLES_XY);
 }
 
+inline static void
+tor_blt_cell(struct sna *sna,
+	     struct sna_composite_spans_op *op,
+	     pixman_region16_t *clip,
+	     span_func_t span,
+	     BoxRec *box, int *cover,
+	     int x, int covered_height, int uncovered_area,
+	     int unbounded)
+{
+	__DBG(("%s: cell=(%d, %d, %d), cover=%d\n", __FUNCTION__,
+	       x, covered_height, uncovered_area, *cover));
+
+	if (covered_height || uncovered_area) {
+		box->x2 = x;
+		if (box->x2 > box->x1 && (unbounded || *cover)) {
+			__DBG(("%s: end span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
+			       box->x1, box->y1,
+			       box->x2 - box->x1,
+			       box->y2 - box->y1,
+			       *cover));
+			span(sna, op, clip, box, *cover);
+		}
+		box->x1 = box->x2;
+		*cover += covered_height*FAST_SAMPLES_X;
+	}
+
+	if (uncovered_area) {
+		int area = *cover - uncovered_area;
+		box->x2 = x + 1;
+		if (unbounded || area) {
+			__DBG(("%s: new span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
+			       box->x1, box->y1,
+			       box->x2 - box->x1,
+			       box->y2 - box->y1,
+			       area));
+			span(sna, op, clip, box, area);
+		}
+		box->x1 = box->x2;
+	}
+}
+
 static void
 tor_blt(struct sna *sna,
 	struct tor *converter,
@@ -1116,41 +1402,27 @@ tor_blt(struct sna *sna,
 	/* Form the spans from the coverages and areas. */
 	cover = cells->head.covered_height*FAST_SAMPLES_X;
 	assert(cover >= 0);
-	for (cell = cells->head.next; cell != &cells->tail; cell = cell->next) {
-		int x = cell->x;
-
-		assert(x >= converter->extents.x1);
-		assert(x < converter->extents.x2);
-		__DBG(("%s: cell=(%d, %d, %d), cover=%d\n", __FUNCTION__,
-		       cell->x, cell->covered_height, cell->uncovered_area,
-		       cover));
-
-		if (cell->covered_height || cell->uncovered_area) {
-			box.x2 = x;
-			if (box.x2 > box.x1 && (unbounded || cover)) {
-				__DBG(("%s: span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
-				       box.x1, box.y1,
-				       box.x2 - box.x1,
-				       box.y2 - box.y1,
-				       cover));
-				span(sna, op, clip, &box, cover);
-			}
-			box.x1 = box.x2;
-			cover += cell->covered_height*FAST_SAMPLES_X;
+	if (cells->use_dense) {
+		const struct dense_cell *dense = cells->dense;
+		int x = cells->dense_lo, end = cells->dense_hi + 1;
+
+		while ((x = dense_next(dense, x, end)) < end) {
+			tor_blt_cell(sna, op, clip, span, &box, &cover,
+				     cells->x1 + x,
+				     dense[x].covered_height,
+				     dense[x].uncovered_area,
+				     unbounded);
+			x++;
 		}
-
-		if (cell->uncovered_area) {
-			int area = cover - cell->uncovered_area;
-			box.x2 = x + 1;
-			if (unbounded || area) {
-				__DBG(("%s: span (%d, %d)x(%d, %d) @ %d\n", __FUNCTION__,
-				       box.x1, box.y1,
-				       box.x2 - box.x1,
-				       box.y2 - box.y1,
-				       area));
-				span(sna, op, clip, &box, area);
-			}
-			box.x1 = box.x2;
+	} else {
+		for (cell = cells->head.next; cell != &cells->tail; cell = cell->next) {
+			assert(cell->x >= converter->extents.x1);
+			assert(cell->x < converter->extents.x2);
+			tor_blt_cell(sna, op, clip, span, &box, &cover,
+				     cell->x,
+				     cell->covered_height,
+				     cell->uncovered_area,
+				     unbounded);
 		}
 	}
 
@@ -1185,6 +1457,8 @@ tor_render(struct sna *sna,
 
 	__DBG(("%s: unbounded=%d\n", __FUNCTION__, unbounded));
 
+	polygon_sort(polygon);
+
 	/* Render each pixel row. */
 	for (i = 0; i < h; i = j) {
 		int do_full_step = 0;
@@ -1193,7 +1467,9 @@ tor_render(struct sna *sna,
 
 		/* Determine if we can ignore this row or use the full pixel
 		 * stepper. */
-		if (fill_buckets(active, polygon->y_buckets[i], buckets) == 0) {
+		if (fill_buckets(active, polygon->y_buckets[i],
+				 polygon->edges + polygon->num_edges,
+				 buckets) == 0) {
 			if (buckets[0]) {
 				merge_edges(active, buckets[0]);
 				buckets[0] = NULL;
@@ -1224,6 +1500,7 @@ tor_render(struct sna *sna,
 		       __FUNCTION__,
 		       i, j, do_full_step,
 		       polygon->y_buckets[i] != NULL));
+		cell_list_choose(coverages, active);
 		if (do_full_step) {
 			nonzero_row(active, coverages);
 
@@ -1559,6 +1836,8 @@ tor_inplace(struct tor *converter, PixmapPtr scratch, int mono, uint8_t *buf)
 	assert(converter->extents.x1 == 0);
 	assert(scratch->drawable.depth == 8);
 
+	polygon_sort(polygon);
+
 	/* Render each pixel row. */
 	for (i = 0; i < h; i = j) {
 		int do_full_step = 0;
@@ -1568,7 +1847,9 @@ tor_inplace(struct tor *converter, PixmapPtr scratch, int mono, uint8_t *buf)
 
 		/* Determine if we can ignore this row or use the full pixel
 		 * stepper. */
-		if (fill_buckets(active, polygon->y_buckets[i], buckets) == 0) {
+		if (fill_buckets(active, polygon->y_buckets[i],
+				 polygon->edges + polygon->num_edges,
+				 buckets) == 0) {
 			if (buckets[0]) {
 				merge_edges(active, buckets[0]);
 				buckets[0] = NULL;
@@ -1686,10 +1967,11 @@ struct span_thread {
 	struct sna *sna;
 	const struct sna_composite_spans_op *op;
 	const xTrapezoid *traps;
+	const int *index;
 	RegionPtr clip;
 	span_func_t span;
 	BoxRec extents;
-	int dx, dy, draw_y;
+	int dx, dy;
 	int ntrap;
 	bool unbounded;
 };
@@ -1821,23 +2103,16 @@ span_thread(void *arg)
 	struct span_thread *thread = arg;
 	struct span_thread_boxes boxes;
 	struct tor tor;
-	const xTrapezoid *t;
-	int n, y1, y2;
+	int n;
 
 	if (!tor_init(&tor, &thread->extents, 2*thread->ntrap))
 		return;
 
 	span_thread_boxes_init(&boxes, thread->op, thread->clip);
 
-	y1 = thread->extents.y1 - thread->draw_y;
-	y2 = thread->extents.y2 - thread->draw_y;
-	for (n = thread->ntrap, t = thread->traps; n--; t++) {
-		if (pixman_fixed_integer_floor(t->top) >= y2 ||
-		    pixman_fixed_integer_ceil(t->bottom) <= y1)
-			continue;
-
-		tor_add_trapezoid(&tor, t, thread->dx, thread->dy);
-	}
+	for (n = 0; n < thread->ntrap; n++)
+		tor_add_trapezoid(&tor, &thread->traps[thread->index[n]],
+				  thread->dx, thread->dy);
 
 	tor_render(thread->sna, &tor,
 		   (struct sna_composite_spans_op *)&boxes, thread->clip,
@@ -1985,44 +2260,58 @@ imprecise_trapezoid_span_converter(struct sna *sna,
 
 		tor_fini(&tor);
 	} else {
-		struct span_thread threads[num_threads];
-		int y, h;
+		struct trapezoid_tiles tiles;
+		struct span_thread *threads;
+		int count;
+
+		trapezoid_tiles_init(&tiles, &clip.extents, 4*num_threads, true);
+		count = trapezoid_tiles_count(&tiles);
 
-		DBG(("%s: using %d threads for span compositing %dx%d\n",
+		DBG(("%s: using %d threads for span compositing %dx%d in %d tiles\n",
 		     __FUNCTION__, num_threads,
 		     clip.extents.x2 - clip.extents.x1,
-		     clip.extents.y2 - clip.extents.y1));
+		     clip.extents.y2 - clip.extents.y1,
+		     count));
+
+		threads = malloc(sizeof(*threads) * count);
+		if (threads == NULL)
+			goto skip;
+
+		if (!trapezoid_tiles_bin(&tiles, ntrap, traps,
+					 dst->pDrawable->x, dst->pDrawable->y)) {
+			free(threads);
+			goto skip;
+		}
 
 		threads[0].sna = sna;
 		threads[0].op = &tmp;
 		threads[0].traps = traps;
-		threads[0].ntrap = ntrap;
-		threads[0].extents = clip.extents;
 		threads[0].clip = &clip;
 		threads[0].dx = dx;
 		threads[0].dy = dy;
-		threads[0].draw_y = dst->pDrawable->y;
 		threads[0].unbounded = !was_clear && maskFormat && !operator_is_bounded(op);
 		threads[0].span = thread_choose_span(&tmp, dst, maskFormat, &clip);
 
-		y = clip.extents.y1;
-		h = clip.extents.y2 - clip.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= clip.extents.y2 - clip.extents.y1;
-
-		for (n = 1; n < num_threads; n++) {
+		for (n = 0; n < count; n++) {
 			threads[n] = threads[0];
-			threads[n].extents.y1 = y;
-			threads[n].extents.y2 = y += h;
+			trapezoid_tiles_box(&tiles, n, &threads[n].extents);
+			threads[n].index = tiles.index + tiles.start[n];
+			threads[n].ntrap = tiles.start[n+1] - tiles.start[n];
+			if (threads[n].ntrap == 0 && !threads[n].unbounded)
+				continue;
 
-			sna_threads_run(n, span_thread, &threads[n]);
+			sna_threads_submit(span_thread, &threads[n]);
 		}
 
-		assert(y < threads[0].extents.y2);
-		threads[0].extents.y1 = y;
-		span_thread(&threads[0]);
+		/* A lost worker leaves its tile short, but replaying the
+		 * others would composite them twice; what was emitted stands.
+		 */
+		if (!sna_threads_join())
+			xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+				   "A rendering thread failed, trapezoids left incomplete\n");
 
-		sna_threads_wait();
+		trapezoid_tiles_fini(&tiles);
+		free(threads);
 	}
 skip:
 	tmp.done(sna, &tmp);
@@ -2802,7 +3091,7 @@ trapezoid_span_inplace__x8r8g8b8(CARD8 op,
 			sna_threads_wait();
 			sigtrap_put();
 		} else
-			sna_threads_kill(); /* leaks thread allocations */
+			sna_threads_kill();
 	}
 
 	return true;
@@ -2810,12 +3099,12 @@ trapezoid_span_inplace__x8r8g8b8(CARD8 op,
 
 struct inplace_thread {
 	xTrapezoid *traps;
+	const int *index;
 	span_func_t span;
 	struct inplace inplace;
 	struct clipped_span clipped;
 	BoxRec extents;
 	int dx, dy;
-	int draw_x, draw_y;
 	bool unbounded;
 	int ntrap;
 };
@@ -2829,13 +3118,9 @@ static void inplace_thread(void *arg)
 	if (!tor_init(&tor, &thread->extents, 2*thread->ntrap))
 		return;
 
-	for (n = 0; n < thread->ntrap; n++) {
-		if (pixman_fixed_to_int(thread->traps[n].top) >= thread->extents.y2 - thread->draw_y ||
-		    pixman_fixed_to_int(thread->traps[n].bottom) < thread->extents.y1 - thread->draw_y)
-			continue;
-
-		tor_add_trapezoid(&tor, &thread->traps[n], thread->dx, thread->dy);
-	}
+	for (n = 0; n < thread->ntrap; n++)
+		tor_add_trapezoid(&tor, &thread->traps[thread->index[n]],
+				  thread->dx, thread->dy);
 
 	tor_render(NULL, &tor,
 		   (void*)&thread->inplace, (void*)&thread->clipped,
@@ -3023,48 +3308,59 @@ imprecise_trapezoid_span_inplace(struct sna *sna,
 
 		tor_fini(&tor);
 	} else {
-		struct inplace_thread threads[num_threads];
-		int y, h;
+		struct trapezoid_tiles tiles;
+		struct inplace_thread *threads;
+		int count;
 
-		DBG(("%s: using %d threads for inplace compositing %dx%d\n",
+		trapezoid_tiles_init(&tiles, &region.extents, 4*num_threads, true);
+		count = trapezoid_tiles_count(&tiles);
+
+		DBG(("%s: using %d threads for inplace compositing %dx%d in %d tiles\n",
 		     __FUNCTION__, num_threads,
 		     region.extents.x2 - region.extents.x1,
-		     region.extents.y2 - region.extents.y1));
+		     region.extents.y2 - region.extents.y1,
+		     count));
+
+		threads = malloc(sizeof(*threads) * count);
+		if (threads == NULL)
+			return true;
+
+		if (!trapezoid_tiles_bin(&tiles, ntrap, traps,
+					 dst->pDrawable->x, dst->pDrawable->y)) {
+			free(threads);
+			return true;
+		}
 
 		threads[0].traps = traps;
-		threads[0].ntrap = ntrap;
 		threads[0].inplace = inplace;
 		threads[0].clipped = clipped;
-		threads[0].extents = region.extents;
 		threads[0].span = span;
 		threads[0].unbounded = unbounded;
 		threads[0].dx = dx;
 		threads[0].dy = dy;
-		threads[0].draw_x = dst->pDrawable->x;
-		threads[0].draw_y = dst->pDrawable->y;
-
-		y = region.extents.y1;
-		h = region.extents.y2 - region.extents.y1;
-		h = (h + num_threads - 1) / num_threads;
-		num_threads -= (num_threads-1) * h >= region.extents.y2 - region.extents.y1;
 
 		if (sigtrap_get() == 0) {
-			for (n = 1; n < num_threads; n++) {
+			for (n = 0; n < count; n++) {
 				threads[n] = threads[0];
-				threads[n].extents.y1 = y;
-				threads[n].extents.y2 = y += h;
+				trapezoid_tiles_box(&tiles, n, &threads[n].extents);
+				threads[n].index = tiles.index + tiles.start[n];
+				threads[n].ntrap = tiles.start[n+1] - tiles.start[n];
+				if (threads[n].ntrap == 0 && !unbounded)
+					continue;
 
-				sna_threads_run(n, inplace_thread, &threads[n]);
+				sna_threads_submit(inplace_thread, &threads[n]);
 			}
 
-			assert(y < threads[0].extents.y2);
-			threads[0].extents.y1 = y;
-			inplace_thread(&threads[0]);
-
-			sna_threads_wait();
+			/* As for a fault on this thread, the rest is lost */
+			if (!sna_threads_join())
+				xf86DrvMsg(sna->scrn->scrnIndex, X_WARNING,
+					   "A rendering thread failed, trapezoids left incomplete\n");
 			sigtrap_put();
 		} else
-			sna_threads_kill(); /* leaks thread allocations */
+			sna_threads_kill();
+
+		trapezoid_tiles_fini(&tiles);
+		free(threads);
 	}
 
 	return true;
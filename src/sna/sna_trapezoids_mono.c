@@ -155,7 +155,7 @@ mono_polygon_init(struct mono_polygon *polygon, BoxPtr box, int num_edges)
 
 	polygon->y_buckets = polygon->y_buckets_embedded;
 	if (h > ARRAY_SIZE (polygon->y_buckets_embedded)) {
-		polygon->y_buckets = malloc (h * sizeof (struct mono_edge *));
+		polygon->y_buckets = sna_scratch_alloc(h * sizeof (struct mono_edge *));
 		if (unlikely (NULL == polygon->y_buckets))
 			return false;
 	}
@@ -163,10 +163,10 @@ mono_polygon_init(struct mono_polygon *polygon, BoxPtr box, int num_edges)
 	polygon->num_edges = 0;
 	polygon->edges = polygon->edges_embedded;
 	if (num_edges > (int)ARRAY_SIZE (polygon->edges_embedded)) {
-		polygon->edges = malloc (num_edges * sizeof (struct mono_edge));
+		polygon->edges = sna_scratch_alloc(num_edges * sizeof (struct mono_edge));
 		if (unlikely (polygon->edges == NULL)) {
 			if (polygon->y_buckets != polygon->y_buckets_embedded)
-				free(polygon->y_buckets);
+				sna_scratch_free(polygon->y_buckets);
 			return false;
 		}
 	}
@@ -179,10 +179,10 @@ static void
 mono_polygon_fini(struct mono_polygon *polygon)
 {
 	if (polygon->y_buckets != polygon->y_buckets_embedded)
-		free(polygon->y_buckets);
+		sna_scratch_free(polygon->y_buckets);
 
 	if (polygon->edges != polygon->edges_embedded)
-		free(polygon->edges);
+		sna_scratch_free(polygon->edges);
 }
 
 static void
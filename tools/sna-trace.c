@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2015 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* Replay a trace recorded with Option "BatchTrace" through the kgem_debug
+ * decoders, and summarise what was sent to the GPU.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sna.h"
+#include "kgem_debug.h"
+#include "kgem_trace.h"
+
+struct trace_bo {
+	struct kgem_bo base;
+	void *data;
+};
+
+struct command {
+	char name[48];
+	uint64_t count;
+	uint64_t dwords;
+	uint64_t redundant;
+
+	uint32_t *last; /* the previous emission within this batch */
+	uint32_t last_len;
+	uint64_t last_batch;
+};
+
+#define MAX_COMMANDS 1024
+
+static struct {
+	bool verbose;
+	char *text;
+	size_t len, size;
+} output;
+
+static struct {
+	struct command command[MAX_COMMANDS];
+	int num_commands;
+
+	uint64_t batches, ring[4];
+	uint64_t command_bytes;
+	uint64_t vertex_bytes;
+	uint64_t surface_bytes;
+	uint64_t batch_bytes;
+	uint64_t relocs, objects;
+	double fill, min_fill, max_fill;
+} stats;
+
+/* The decoders report everything through ErrorF(), so collect each
+ * command's description to name it and, if asked, show it.
+ */
+void ErrorF(const char *f, ...)
+{
+	va_list va;
+	int len;
+
+	for (;;) {
+		va_start(va, f);
+		len = vsnprintf(output.text + output.len,
+				output.size - output.len, f, va);
+		va_end(va);
+		if (len < 0)
+			return;
+
+		if (output.len + len < output.size)
+			break;
+
+		output.size = 2*(output.len + len + 1);
+		output.text = realloc(output.text, output.size);
+		if (output.text == NULL)
+			abort();
+	}
+
+	output.len += len;
+}
+
+void *kgem_bo_map__debug(struct kgem *kgem, struct kgem_bo *bo)
+{
+	struct trace_bo *tbo = container_of(bo, struct trace_bo, base);
+
+	/* We do not have the contents of the buffers, only their size */
+	if (tbo->data == NULL)
+		tbo->data = calloc(1, kgem_bo_size(bo));
+
+	return tbo->data;
+}
+
+static struct command *lookup_command(const char *text, uint32_t header)
+{
+	char name[sizeof(stats.command[0].name)];
+	int n, len;
+
+	/* Skip over the "0x%08x: 0x%08x: " prefix of kgem_debug_print() */
+	len = 0;
+	if (strlen(text) > 24 && strncmp(text, "0x", 2) == 0) {
+		text += 24;
+		while (text[len] && !strchr(" (:,\n", text[len]) &&
+		       len < sizeof(name) - 1)
+			len++;
+	}
+	if (len) {
+		memcpy(name, text, len);
+		name[len] = '\0';
+	} else
+		snprintf(name, sizeof(name), "unknown [%08x]", header & 0xffff0000);
+
+	for (n = 0; n < stats.num_commands; n++)
+		if (strcmp(stats.command[n].name, name) == 0)
+			return &stats.command[n];
+
+	if (n == MAX_COMMANDS)
+		return NULL;
+
+	strcpy(stats.command[n].name, name);
+	stats.num_commands++;
+	return &stats.command[n];
+}
+
+static void count_command(const uint32_t *data, int len)
+{
+	struct command *cmd;
+
+	cmd = lookup_command(output.text ? output.text : "", data[0]);
+	if (cmd == NULL)
+		return;
+
+	cmd->count++;
+	cmd->dwords += len;
+
+	/* Identical state emitted twice within a batch is wasted effort */
+	if (cmd->last_batch == stats.batches &&
+	    cmd->last_len == len &&
+	    memcmp(cmd->last, data, len*sizeof(uint32_t)) == 0)
+		cmd->redundant++;
+
+	if (len > cmd->last_len) {
+		free(cmd->last);
+		cmd->last = malloc(len*sizeof(uint32_t));
+		if (cmd->last == NULL)
+			abort();
+	}
+	memcpy(cmd->last, data, len*sizeof(uint32_t));
+	cmd->last_len = len;
+	cmd->last_batch = stats.batches;
+}
+
+static void replay_batch(struct kgem *kgem, uint32_t batch_end)
+{
+	uint32_t offset = 0;
+
+	while (offset < batch_end) {
+		int len;
+
+		output.len = 0;
+		if (output.text)
+			output.text[0] = '\0';
+
+		len = kgem_debug_decode(kgem, offset);
+		if (len <= 0 || offset + len > batch_end) {
+			fprintf(stderr, "Bad command length %d at offset %x in batch %lld\n",
+				len, offset * 4, (long long)stats.batches);
+			break;
+		}
+
+		if (output.verbose)
+			fputs(output.text, stdout);
+
+		count_command(kgem->batch + offset, len);
+		offset += len;
+	}
+
+	output.len = 0;
+	kgem_debug_finish_state(kgem);
+	if (output.verbose && output.len)
+		fputs(output.text, stdout);
+}
+
+static bool read_exact(FILE *file, void *data, size_t len)
+{
+	return len == 0 || fread(data, len, 1, file) == 1;
+}
+
+static bool process_batch(FILE *file, struct kgem *kgem,
+			  const struct kgem_trace_batch *batch)
+{
+	struct kgem_trace_object exec[ARRAY_SIZE(kgem->exec)];
+	struct trace_bo *bo;
+	double fill;
+	int n;
+
+	if (batch->magic != KGEM_TRACE_BATCH_MAGIC ||
+	    batch->batch_size > UINT16_MAX ||
+	    batch->batch_end > batch->nbatch ||
+	    batch->nbatch > batch->surface ||
+	    batch->surface > batch->batch_size ||
+	    batch->nreloc > ARRAY_SIZE(kgem->reloc) ||
+	    batch->nexec > ARRAY_SIZE(kgem->exec)) {
+		fprintf(stderr, "Corrupt batch header in batch %lld\n",
+			(long long)stats.batches);
+		return false;
+	}
+
+	kgem->batch = realloc(kgem->batch, batch->batch_size * sizeof(uint32_t));
+	bo = calloc(batch->nexec, sizeof(*bo));
+	if (kgem->batch == NULL || (batch->nexec && bo == NULL))
+		abort();
+
+	if (!read_exact(file, kgem->batch, batch->nbatch * sizeof(uint32_t)) ||
+	    !read_exact(file, kgem->batch + batch->surface,
+			(batch->batch_size - batch->surface) * sizeof(uint32_t)) ||
+	    !read_exact(file, kgem->reloc, batch->nreloc * sizeof(kgem->reloc[0])) ||
+	    !read_exact(file, exec, batch->nexec * sizeof(exec[0]))) {
+		fprintf(stderr, "Truncated trace in batch %lld\n",
+			(long long)stats.batches);
+		free(bo);
+		return false;
+	}
+
+	kgem->mode = kgem->ring = batch->ring;
+	kgem->batch_flags = batch->flags;
+	kgem->nbatch = batch->nbatch;
+	kgem->surface = batch->surface;
+	kgem->batch_size = batch->batch_size;
+	kgem->nreloc = batch->nreloc;
+	kgem->nexec = batch->nexec;
+
+	list_init(&kgem->next_request->buffers);
+	for (n = 0; n < batch->nexec; n++) {
+		memset(&kgem->exec[n], 0, sizeof(kgem->exec[n]));
+		kgem->exec[n].handle = exec[n].handle;
+		kgem->exec[n].flags = exec[n].flags;
+
+		bo[n].base.handle = exec[n].handle;
+		bo[n].base.target_handle = kgem->has_handle_lut ? n : exec[n].handle;
+		bo[n].base.size.pages.count = exec[n].size / PAGE_SIZE;
+		bo[n].base.pitch = exec[n].pitch;
+		bo[n].base.tiling = exec[n].tiling;
+		bo[n].base.exec = &kgem->exec[n];
+		list_add_tail(&bo[n].base.request, &kgem->next_request->buffers);
+	}
+
+	if (output.verbose)
+		printf("batch %lld: ring=%d, %d dwords, %d relocations, %d objects\n",
+		       (long long)stats.batches, batch->ring, batch->batch_end,
+		       batch->nreloc, batch->nexec);
+
+	replay_batch(kgem, batch->batch_end);
+
+	for (n = 0; n < batch->nexec; n++)
+		free(bo[n].data);
+	free(bo);
+
+	fill = (batch->nbatch + batch->batch_size - batch->surface) /
+		(double)batch->batch_size;
+	if (stats.batches == 0 || fill < stats.min_fill)
+		stats.min_fill = fill;
+	if (stats.batches == 0 || fill > stats.max_fill)
+		stats.max_fill = fill;
+	stats.fill += fill;
+
+	stats.ring[batch->ring & 3]++;
+	stats.command_bytes += batch->batch_end * 4;
+	stats.vertex_bytes += (batch->nbatch - batch->batch_end) * 4;
+	stats.surface_bytes += (batch->batch_size - batch->surface) * 4;
+	stats.batch_bytes += batch->batch_size * 4;
+	stats.relocs += batch->nreloc;
+	stats.objects += batch->nexec;
+	stats.batches++;
+
+	return true;
+}
+
+static int cmp_dwords(const void *A, const void *B)
+{
+	const struct command *a = A, *b = B;
+
+	if (a->dwords != b->dwords)
+		return a->dwords < b->dwords ? 1 : -1;
+	return strcmp(a->name, b->name);
+}
+
+static void report(void)
+{
+	int n;
+
+	if (stats.batches == 0) {
+		printf("No batches recorded\n");
+		return;
+	}
+
+	printf("%lld batches (render %lld, blt %lld)\n",
+	       (long long)stats.batches,
+	       (long long)stats.ring[KGEM_RENDER],
+	       (long long)stats.ring[KGEM_BLT]);
+	printf("batch fill: %.1f%% average, %.1f%% min, %.1f%% max\n",
+	       100. * stats.fill / stats.batches,
+	       100. * stats.min_fill, 100. * stats.max_fill);
+	printf("commands: %lld bytes, inline vertices: %lld bytes, surface state: %lld bytes, of %lld bytes allocated\n",
+	       (long long)stats.command_bytes,
+	       (long long)stats.vertex_bytes,
+	       (long long)stats.surface_bytes,
+	       (long long)stats.batch_bytes);
+	printf("per batch: %.1f relocations, %.1f objects\n",
+	       stats.relocs / (double)stats.batches,
+	       stats.objects / (double)stats.batches);
+
+	qsort(stats.command, stats.num_commands, sizeof(stats.command[0]),
+	      cmp_dwords);
+
+	printf("\n%-40s %12s %12s %10s\n",
+	       "command", "count", "dwords", "redundant");
+	for (n = 0; n < stats.num_commands; n++) {
+		const struct command *cmd = &stats.command[n];
+		printf("%-40s %12lld %12lld %9.1f%%\n",
+		       cmd->name,
+		       (long long)cmd->count,
+		       (long long)cmd->dwords,
+		       100. * cmd->redundant / cmd->count);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-v] trace-file\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct kgem_trace_header header;
+	struct kgem_trace_batch batch;
+	struct kgem_request rq;
+	struct kgem *kgem;
+	FILE *file;
+	int c;
+
+	while ((c = getopt(argc, argv, "vh")) != -1) {
+		switch (c) {
+		case 'v':
+			output.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	file = fopen(argv[optind], "r");
+	if (file == NULL) {
+		fprintf(stderr, "Unable to open '%s'\n", argv[optind]);
+		return 1;
+	}
+
+	if (!read_exact(file, &header, sizeof(header)) ||
+	    header.magic != KGEM_TRACE_MAGIC) {
+		fprintf(stderr, "'%s' is not a batch trace\n", argv[optind]);
+		return 1;
+	}
+	if (header.version != KGEM_TRACE_VERSION) {
+		fprintf(stderr, "Unsupported trace version %d\n", header.version);
+		return 1;
+	}
+
+	kgem = calloc(1, sizeof(*kgem));
+	if (kgem == NULL)
+		return 1;
+
+	kgem->gen = header.gen;
+	kgem->has_handle_lut = !!(header.flags & KGEM_TRACE_HAS_HANDLE_LUT);
+	kgem->has_llc = !!(header.flags & KGEM_TRACE_HAS_LLC);
+
+	memset(&rq, 0, sizeof(rq));
+	kgem->next_request = &rq;
+
+	printf("gen %03o trace\n", kgem->gen);
+	while (read_exact(file, &batch, sizeof(batch))) {
+		if (!process_batch(file, kgem, &batch))
+			break;
+	}
+	fclose(file);
+
+	report();
+
+	free(kgem->batch);
+	free(kgem);
+	return 0;
+}